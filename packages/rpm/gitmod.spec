@@ -7,8 +7,8 @@ License:        GPLv2
 URL:            https://github.com/eantoranz/gitmod
 Source0:        https://github.com/eantoranz/gitmod
 
-BuildRequires:  fuse3-devel, libgit2-devel, glib2-devel
-Requires:       fuse3, libgit2, glib2
+BuildRequires:  fuse3-devel, libgit2-devel, glib2-devel, zlib-devel
+Requires:       fuse3, libgit2, glib2, zlib
 
 %description
 fuse-based linux kernel module to display a treeish from a git repo
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Threads take space from the current block by moving its used counter forward. When it is full,
+ * one of them adds a new block (holding the lock) and the others try again on it.
+ */
+
+#include <syslog.h>
+#include "gitmod.h"
+
+#define GITMOD_ARENA_ALIGNMENT 16
+
+static gitmod_arena_block *gitmod_arena_block_create(gitmod_arena *arena, size_t size)
+{
+	gitmod_arena_block *block = calloc(1, sizeof(gitmod_arena_block) + size);
+	if (!block) {
+		gitmod_log(LOG_ERR, "Could not allocate a block of %zu bytes for arena", size);
+		return NULL;
+	}
+	block->size = size;
+	__atomic_add_fetch(&arena->bytes, sizeof(gitmod_arena_block) + size, __ATOMIC_RELAXED);
+	return block;
+}
+
+gitmod_arena *gitmod_arena_create(size_t block_size)
+{
+	gitmod_arena *arena = calloc(1, sizeof(gitmod_arena));
+	if (!arena)
+		return NULL;
+	arena->block_size = block_size;
+	gitmod_locker_init(&arena->lock);
+	arena->block = gitmod_arena_block_create(arena, block_size);
+	if (!arena->block)
+		gitmod_arena_dispose(&arena);
+	return arena;
+}
+
+void *gitmod_arena_alloc(gitmod_arena *arena, size_t size)
+{
+	if (!arena)
+		return NULL;
+	size = (size + GITMOD_ARENA_ALIGNMENT - 1) & ~(size_t) (GITMOD_ARENA_ALIGNMENT - 1);
+	gitmod_arena_block *block;
+	if (size > arena->block_size / 4) {
+		// it would waste too much of a block, it gets one of its own
+		block = gitmod_arena_block_create(arena, size);
+		if (!block)
+			return NULL;
+		block->used = size;
+		gitmod_lock(&arena->lock);
+		block->next = arena->full;
+		arena->full = block;
+		gitmod_unlock(&arena->lock);
+		__atomic_add_fetch(&arena->used, size, __ATOMIC_RELAXED);
+		return block->data;
+	}
+	while (1) {
+		block = __atomic_load_n(&arena->block, __ATOMIC_ACQUIRE);
+		size_t offset = __atomic_fetch_add(&block->used, size, __ATOMIC_RELAXED);
+		if (offset + size <= block->size) {
+			__atomic_add_fetch(&arena->used, size, __ATOMIC_RELAXED);
+			return block->data + offset;
+		}
+		gitmod_lock(&arena->lock);
+		if (arena->block == block) {
+			// nobody replaced it in the meantime
+			gitmod_arena_block *new_block = gitmod_arena_block_create(arena, arena->block_size);
+			if (!new_block) {
+				gitmod_unlock(&arena->lock);
+				return NULL;
+			}
+			block->next = arena->full;
+			arena->full = block;
+			__atomic_store_n(&arena->block, new_block, __ATOMIC_RELEASE);
+		}
+		gitmod_unlock(&arena->lock);
+	}
+}
+
+char *gitmod_arena_strdup(gitmod_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = gitmod_arena_alloc(arena, len);
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+size_t gitmod_arena_bytes(gitmod_arena *arena)
+{
+	return arena ? __atomic_load_n(&arena->bytes, __ATOMIC_RELAXED) : 0;
+}
+
+size_t gitmod_arena_used(gitmod_arena *arena)
+{
+	return arena ? __atomic_load_n(&arena->used, __ATOMIC_RELAXED) : 0;
+}
+
+void gitmod_arena_dispose(gitmod_arena **arena)
+{
+	if (!(arena && *arena))
+		return;
+	gitmod_arena_block *block, *next;
+	free((*arena)->block);
+	for (block = (*arena)->full; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	gitmod_locker_destroy(&(*arena)->lock);
+	free(*arena);
+	*arena = NULL;
+}
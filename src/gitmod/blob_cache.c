@@ -0,0 +1,533 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Blobs are written into a temporary file that is renamed to the OID of the blob when it is complete, so a file
+ * named by an OID always holds the whole content of the blob. Files left by a previous run are hashed before they
+ * are used, in case they were written by something else. Writing and hashing is done by a writer thread so that
+ * opens don't wait for it: the blob is read from the repo meanwhile.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+#define GITMOD_BLOB_CACHE_TMP_PREFIX ".tmp-"
+#define GITMOD_BLOB_CACHE_CHUNK (1024 * 1024)
+
+static guint oid_hash(gconstpointer key)
+{
+	// OIDs are already well distributed
+	guint hash;
+	memcpy(&hash, ((const git_oid *)key)->id, sizeof(guint));
+	return hash;
+}
+
+static gboolean oid_equal(gconstpointer a, gconstpointer b)
+{
+	return !git_oid_cmp(a, b);
+}
+
+static void destroy_entry(void *value)
+{
+	gitmod_blob_cache_entry *entry = value;
+	if (entry->fd >= 0)
+		close(entry->fd);
+	free(entry);
+}
+
+static char *gitmod_blob_cache_path(gitmod_blob_cache *cache, const char *name)
+{
+	char *path = calloc(1, strlen(cache->dir) + 1 + strlen(name) + 1);
+	if (!path)
+		return NULL;
+	strcpy(path, cache->dir);
+	strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+static char *gitmod_blob_cache_oid_path(gitmod_blob_cache *cache, const git_oid *oid)
+{
+	char name[GIT_OID_HEXSZ + 1];
+	git_oid_tostr(name, sizeof(name), oid);
+	return gitmod_blob_cache_path(cache, name);
+}
+
+static gitmod_blob_cache_entry *gitmod_blob_cache_add_entry(gitmod_blob_cache *cache, const git_oid *oid)
+{
+	gitmod_blob_cache_entry *entry = calloc(1, sizeof(gitmod_blob_cache_entry));
+	if (!entry)
+		return NULL;
+	git_oid_cpy(&entry->oid, oid);
+	entry->fd = -1;
+	g_hash_table_insert(cache->entries, &entry->oid, entry);
+	return entry;
+}
+
+/**
+ * Files that are not in use are kept in a list, least recently used first.
+ * cache->lock has to be locked
+ */
+static void gitmod_blob_cache_lru_append(gitmod_blob_cache *cache, gitmod_blob_cache_entry *entry)
+{
+	entry->lru_next = NULL;
+	entry->lru_prev = cache->lru_last;
+	if (cache->lru_last)
+		cache->lru_last->lru_next = entry;
+	else
+		cache->lru_first = entry;
+	cache->lru_last = entry;
+}
+
+static void gitmod_blob_cache_lru_remove(gitmod_blob_cache *cache, gitmod_blob_cache_entry *entry)
+{
+	if (!(entry->lru_prev || cache->lru_first == entry))
+		// not in the list
+		return;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_first = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_last = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+/**
+ * Remove the file of an entry that is not in use, it has to be admitted again.
+ * cache->lock has to be locked
+ */
+static void gitmod_blob_cache_discard(gitmod_blob_cache *cache, gitmod_blob_cache_entry *entry)
+{
+	char *path = gitmod_blob_cache_oid_path(cache, &entry->oid);
+	if (path && (!unlink(path) || errno == ENOENT)) {
+		gitmod_blob_cache_lru_remove(cache, entry);
+		cache->bytes -= entry->size;
+		cache->removals++;
+		entry->state = GITMOD_BLOB_CACHE_NOT_ADMITTED;
+		entry->opens = 0;
+	}
+	free(path);
+}
+
+/**
+ * Remove files that are not in use, least recently used first, until we are within budget.
+ * cache->lock has to be locked
+ */
+static void gitmod_blob_cache_trim(gitmod_blob_cache *cache)
+{
+	gitmod_blob_cache_entry *entry, *next;
+	for (entry = cache->lru_first; entry && cache->bytes > cache->budget; entry = next) {
+		next = entry->lru_next;
+		gitmod_blob_cache_discard(cache, entry);
+	}
+}
+
+/**
+ * Pick up files left by a previous run and remove temporary files that were not completed.
+ * Their content is checked when they are opened for the first time
+ */
+static void gitmod_blob_cache_scan(gitmod_blob_cache *cache)
+{
+	DIR *dir = opendir(cache->dir);
+	if (!dir)
+		return;
+	struct dirent *dirent;
+	struct stat st;
+	git_oid oid;
+	while ((dirent = readdir(dir))) {
+		if (!strncmp(dirent->d_name, GITMOD_BLOB_CACHE_TMP_PREFIX, strlen(GITMOD_BLOB_CACHE_TMP_PREFIX))) {
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+			continue;
+		}
+		if (strlen(dirent->d_name) != GIT_OID_HEXSZ || git_oid_fromstr(&oid, dirent->d_name))
+			continue;
+		if (fstatat(dirfd(dir), dirent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+		gitmod_blob_cache_entry *entry = gitmod_blob_cache_add_entry(cache, &oid);
+		if (!entry)
+			break;
+		entry->state = GITMOD_BLOB_CACHE_UNVERIFIED;
+		entry->size = st.st_size;
+		cache->bytes += entry->size;
+		gitmod_blob_cache_lru_append(cache, entry);
+	}
+	closedir(dir);
+}
+
+gitmod_blob_cache *gitmod_blob_cache_create(const char *dir, int64_t min_size, int admit_opens, int64_t admit_size,
+					    size_t budget)
+{
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		gitmod_log(LOG_ERR, "Could not create blob cache directory %s", dir);
+		return NULL;
+	}
+	gitmod_blob_cache *cache = calloc(1, sizeof(gitmod_blob_cache));
+	if (!cache)
+		return NULL;
+	cache->dir = strdup(dir);
+	pthread_cond_init(&cache->work, NULL);
+	pthread_cond_init(&cache->idle, NULL);
+	cache->lock = gitmod_locker_create();
+	gitmod_locker_set_class(cache->lock, GITMOD_LOCK_BLOB_CACHE);
+	// keys are the OIDs inside of the values
+	cache->entries = g_hash_table_new_full(oid_hash, oid_equal, NULL, destroy_entry);
+	if (!(cache->dir && cache->lock && cache->entries)) {
+		gitmod_log(LOG_ERR, "Could not set up blob cache");
+		gitmod_blob_cache_dispose(&cache);
+		return NULL;
+	}
+	cache->min_size = min_size;
+	cache->admit_opens = admit_opens;
+	cache->admit_size = admit_size;
+	cache->budget = budget;
+	gitmod_blob_cache_scan(cache);
+	gitmod_blob_cache_trim(cache);
+	gitmod_log(LOG_INFO, "Blob cache in %s: %u files holding %zu bytes (budget: %zu)", cache->dir,
+		   g_hash_table_size(cache->entries), cache->bytes, cache->budget);
+	return cache;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+	while (len) {
+		written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/**
+ * Write the content of the blob into fd. Blobs that can be streamed are not inflated in memory
+ */
+static int gitmod_blob_cache_write(git_repository *repo, const git_oid *oid, int64_t size, int fd)
+{
+	int ret = 0;
+	gitmod_stream *stream = gitmod_stream_open(repo, oid, size, GITMOD_STREAM_DEFAULT_WINDOW);
+	if (stream) {
+		char *buf = malloc(GITMOD_BLOB_CACHE_CHUNK);
+		if (!buf) {
+			gitmod_stream_close(&stream);
+			return -ENOMEM;
+		}
+		int64_t offset = 0;
+		while (!ret && offset < size) {
+			ret = gitmod_stream_read(stream, buf, GITMOD_BLOB_CACHE_CHUNK, offset);
+			if (ret <= 0) {
+				ret = ret ? ret : -EIO;
+				break;
+			}
+			offset += ret;
+			ret = write_all(fd, buf, ret);
+		}
+		free(buf);
+		gitmod_stream_close(&stream);
+		return ret;
+	}
+	git_blob *blob;
+	if (git_blob_lookup(&blob, repo, oid)) {
+		gitmod_log(LOG_ERR, "Could not load blob %s", git_oid_tostr_s(oid));
+		return -EIO;
+	}
+	ret = write_all(fd, git_blob_rawcontent(blob), git_blob_rawsize(blob));
+	git_blob_free(blob);
+	return ret;
+}
+
+/**
+ * Write the blob into a temporary file and move it to its final name when it's complete.
+ * Will return 0 on success or a negative errno value
+ */
+static int gitmod_blob_cache_materialize(gitmod_blob_cache *cache, git_repository *repo, const git_oid *oid,
+					 int64_t size)
+{
+	char *tmp_path = gitmod_blob_cache_path(cache, GITMOD_BLOB_CACHE_TMP_PREFIX "XXXXXX");
+	char *path = gitmod_blob_cache_oid_path(cache, oid);
+	int ret = -ENOMEM;
+	if (!(tmp_path && path))
+		goto end;
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		ret = -errno;
+		gitmod_log(LOG_ERR, "Could not create a file in the blob cache: %s", strerror(errno));
+		goto end;
+	}
+	ret = gitmod_blob_cache_write(repo, oid, size, fd);
+	// the content has to be on disk before the file shows up with its final name
+	if (!ret && fsync(fd))
+		ret = -errno;
+	close(fd);
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+	if (ret) {
+		gitmod_log(LOG_ERR, "Could not write blob %s into the blob cache", git_oid_tostr_s(oid));
+		unlink(tmp_path);
+	}
+ end:
+	free(tmp_path);
+	free(path);
+	return ret;
+}
+
+/**
+ * Hash the file of a blob to make sure it holds it. A file that does not is removed
+ */
+static int gitmod_blob_cache_verify(gitmod_blob_cache *cache, const git_oid *oid)
+{
+	char *path = gitmod_blob_cache_oid_path(cache, oid);
+	if (!path)
+		return 0;
+	git_oid actual;
+	int ok = !git_odb_hashfile(&actual, path, GIT_OBJ_BLOB) && !git_oid_cmp(&actual, oid);
+	if (!ok) {
+		gitmod_log(LOG_WARNING, "File of blob %s in the blob cache does not hold it", git_oid_tostr_s(oid));
+		unlink(path);
+	}
+	free(path);
+	return ok;
+}
+
+/**
+ * Entries are taken from the queue one at a time. Files are written (or checked) without holding the lock
+ */
+static void *gitmod_blob_cache_run(void *params)
+{
+	gitmod_blob_cache *cache = params;
+	git_repository *repo = NULL;
+	gitmod_blob_cache_entry *entry;
+	gitmod_lock(cache->lock);
+	while (1) {
+		while (!(cache->queue_first || cache->stopping))
+			gitmod_locker_wait(cache->lock, &cache->work);
+		if (cache->stopping)
+			// what is left in the queue is not written
+			break;
+		entry = cache->queue_first;
+		cache->queue_first = entry->queue_next;
+		if (!cache->queue_first)
+			cache->queue_last = NULL;
+		entry->queue_next = NULL;
+		cache->busy = entry;
+		int verify = entry->state == GITMOD_BLOB_CACHE_VERIFYING;
+		gitmod_unlock(cache->lock);
+
+		int ok = verify && gitmod_blob_cache_verify(cache, &entry->oid);
+		int ret = 0;
+		if (!ok) {
+			if (!repo && git_repository_open(&repo, cache->repo_path)) {
+				gitmod_log(LOG_ERR, "Could not open %s to write into the blob cache", cache->repo_path);
+				repo = NULL;
+			}
+			ret = repo ? gitmod_blob_cache_materialize(cache, repo, &entry->oid, entry->size) : -EIO;
+		}
+
+		gitmod_lock(cache->lock);
+		if (verify && !ok) {
+			// the file is gone
+			cache->bytes -= entry->size;
+			cache->rejected++;
+			cache->removals++;
+		}
+		if (!ok && ret) {
+			entry->state = GITMOD_BLOB_CACHE_NOT_ADMITTED;
+			entry->opens = 0;
+		} else {
+			if (!ok) {
+				cache->bytes += entry->size;
+				cache->writes++;
+			}
+			entry->state = GITMOD_BLOB_CACHE_READY;
+			gitmod_blob_cache_lru_append(cache, entry);
+			gitmod_blob_cache_trim(cache);
+		}
+		cache->busy = NULL;
+		pthread_cond_broadcast(&cache->idle);
+	}
+	gitmod_unlock(cache->lock);
+	if (repo)
+		git_repository_free(repo);
+	return NULL;
+}
+
+/**
+ * Hand an entry over to the writer (it's started the first time).
+ * cache->lock has to be locked. Will return 0 on success
+ */
+static int gitmod_blob_cache_queue(gitmod_blob_cache *cache, git_repository *repo, gitmod_blob_cache_entry *entry)
+{
+	if (!cache->writer_started) {
+		if (!cache->repo_path)
+			cache->repo_path = strdup(git_repository_path(repo));
+		if (!cache->repo_path || pthread_create(&cache->writer, NULL, gitmod_blob_cache_run, cache)) {
+			gitmod_log(LOG_ERR, "Could not start the writer of the blob cache");
+			return -1;
+		}
+		cache->writer_started = 1;
+	}
+	entry->queue_next = NULL;
+	if (cache->queue_last)
+		cache->queue_last->queue_next = entry;
+	else
+		cache->queue_first = entry;
+	cache->queue_last = entry;
+	pthread_cond_signal(&cache->work);
+	return 0;
+}
+
+int gitmod_blob_cache_open(gitmod_blob_cache *cache, git_repository *repo, const git_oid *oid, int64_t size)
+{
+	if (!cache || size < cache->min_size)
+		return -1;
+	gitmod_lock(cache->lock);
+	gitmod_blob_cache_entry *entry = g_hash_table_lookup(cache->entries, oid);
+	if (!entry)
+		entry = gitmod_blob_cache_add_entry(cache, oid);
+	if (!entry) {
+		gitmod_unlock(cache->lock);
+		return -1;
+	}
+	int fd = -1;
+	switch (entry->state) {
+	case GITMOD_BLOB_CACHE_READY:
+		if (entry->fd < 0) {
+			char *path = gitmod_blob_cache_oid_path(cache, oid);
+			entry->fd = path ? open(path, O_RDONLY) : -1;
+			free(path);
+		}
+		if (entry->fd >= 0) {
+			if (!entry->refs++)
+				gitmod_blob_cache_lru_remove(cache, entry);
+			cache->hits++;
+			fd = entry->fd;
+		} else {
+			// the file was removed from the directory
+			gitmod_blob_cache_lru_remove(cache, entry);
+			cache->bytes -= entry->size;
+			entry->state = GITMOD_BLOB_CACHE_NOT_ADMITTED;
+			entry->opens = 0;
+		}
+		break;
+	case GITMOD_BLOB_CACHE_WRITING:
+	case GITMOD_BLOB_CACHE_VERIFYING:
+		// it will be there for a later open
+		break;
+	case GITMOD_BLOB_CACHE_UNVERIFIED:
+		if ((int64_t) entry->size == size) {
+			gitmod_blob_cache_lru_remove(cache, entry);
+			entry->state = GITMOD_BLOB_CACHE_VERIFYING;
+			if (gitmod_blob_cache_queue(cache, repo, entry)) {
+				entry->state = GITMOD_BLOB_CACHE_UNVERIFIED;
+				gitmod_blob_cache_lru_append(cache, entry);
+			}
+			break;
+		}
+		// a file left by a previous run that was not completed. It was admitted back then
+		gitmod_blob_cache_discard(cache, entry);
+		if (entry->state != GITMOD_BLOB_CACHE_NOT_ADMITTED)
+			// could not remove it
+			break;
+		entry->opens = cache->admit_opens;
+		/* fall through */
+	default:
+		entry->opens++;
+		if (entry->opens < cache->admit_opens && !(cache->admit_size && size >= cache->admit_size))
+			break;
+		entry->state = GITMOD_BLOB_CACHE_WRITING;
+		entry->size = size;
+		if (gitmod_blob_cache_queue(cache, repo, entry)) {
+			entry->state = GITMOD_BLOB_CACHE_NOT_ADMITTED;
+			entry->opens = 0;
+		}
+	}
+	gitmod_unlock(cache->lock);
+	return fd;
+}
+
+void gitmod_blob_cache_flush(gitmod_blob_cache *cache)
+{
+	if (!cache)
+		return;
+	gitmod_lock(cache->lock);
+	while (cache->writer_started && (cache->queue_first || cache->busy))
+		gitmod_locker_wait(cache->lock, &cache->idle);
+	gitmod_unlock(cache->lock);
+}
+
+void gitmod_blob_cache_release(gitmod_blob_cache *cache, const git_oid *oid)
+{
+	if (!cache)
+		return;
+	gitmod_lock(cache->lock);
+	gitmod_blob_cache_entry *entry = g_hash_table_lookup(cache->entries, oid);
+	if (entry && entry->refs > 0 && !--entry->refs) {
+		close(entry->fd);
+		entry->fd = -1;
+		// it could not be removed while it was in use
+		gitmod_blob_cache_lru_append(cache, entry);
+		gitmod_blob_cache_trim(cache);
+	}
+	gitmod_unlock(cache->lock);
+}
+
+int gitmod_blob_cache_size(gitmod_blob_cache *cache)
+{
+	if (!cache)
+		return 0;
+	int size = 0;
+	GHashTableIter iter;
+	gpointer value;
+	gitmod_lock(cache->lock);
+	g_hash_table_iter_init(&iter, cache->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		switch (((gitmod_blob_cache_entry *) value)->state) {
+		case GITMOD_BLOB_CACHE_READY:
+		case GITMOD_BLOB_CACHE_UNVERIFIED:
+		case GITMOD_BLOB_CACHE_VERIFYING:
+			size++;
+		}
+	gitmod_unlock(cache->lock);
+	return size;
+}
+
+void gitmod_blob_cache_dispose(gitmod_blob_cache **cache)
+{
+	if (!(cache && *cache))
+		return;
+	if ((*cache)->writer_started) {
+		gitmod_lock((*cache)->lock);
+		(*cache)->stopping = 1;
+		pthread_cond_signal(&(*cache)->work);
+		gitmod_unlock((*cache)->lock);
+		// the file being written is completed
+		pthread_join((*cache)->writer, NULL);
+	}
+	if ((*cache)->entries) {
+		gitmod_log(LOG_INFO,
+			   "Blob cache: %lu hits, %lu writes, %lu removals (%lu rejected), %zu bytes in files",
+			   (*cache)->hits, (*cache)->writes, (*cache)->removals, (*cache)->rejected, (*cache)->bytes);
+		g_hash_table_destroy((*cache)->entries);
+	}
+	if ((*cache)->lock)
+		gitmod_locker_dispose(&(*cache)->lock);
+	pthread_cond_destroy(&(*cache)->work);
+	pthread_cond_destroy(&(*cache)->idle);
+	free((*cache)->repo_path);
+	free((*cache)->dir);
+	free(*cache);
+	*cache = NULL;
+}
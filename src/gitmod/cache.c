@@ -1,122 +1,448 @@
 /*
  * Copyright 2020 Edmundo Carmona Antoranz
  * Released under the terms of GPLv2
+ *
+ * Items are spread over shards by the hash of their ids. Each shard is a chained hash table with its own lock
+ * so that threads adding items to different shards don't wait on each other. Lookups only take the lock
+ * of their shard for reading. Root trees look up most objects through their node tree instead.
  */
 
 #include <syslog.h>
 #include "gitmod.h"
 
+// used to wait for content being set up by other threads. That only happens the first time an item is used
+static gitmod_locker gitmod_cache_wait_lock = GITMOD_LOCKER_INITIALIZER(GITMOD_LOCK_CACHE_WAIT);
+static pthread_cond_t gitmod_cache_item_loaded = PTHREAD_COND_INITIALIZER;
+
 gitmod_cache *gitmod_cache_create(GDestroyNotify key_destroy_func, GDestroyNotify value_destroy_func)
 {
 	gitmod_locker *locker = NULL;
-	GHashTable *items = NULL;
+	GPtrArray *charged = NULL, *busy = NULL;
 	gitmod_cache *cache = NULL;
 	locker = gitmod_locker_create();
+	gitmod_locker_set_class(locker, GITMOD_LOCK_CACHE);
 	if (!locker) {
-		syslog(LOG_ERR, "Could not set up locker for cache");
+		gitmod_log(LOG_ERR, "Could not set up locker for cache");
 		goto end;
 	}
 
-	items = g_hash_table_new_full(g_str_hash, g_str_equal, key_destroy_func, value_destroy_func);
-	if (!items) {
-		syslog(LOG_ERR, "Could not setup hashtable for cache");
+	charged = g_ptr_array_new();
+	busy = g_ptr_array_new();
+	if (!(charged && busy)) {
+		gitmod_log(LOG_ERR, "Could not setup eviction list for cache");
 		goto end;
 	}
- end:
-	if (locker && items) {
-		cache = calloc(1, sizeof(gitmod_cache));
-		if (cache) {
-			cache->locker = locker;
-			cache->items = items;
+
+	if (posix_memalign((void **)&cache, 64, sizeof(gitmod_cache))) {
+		gitmod_log(LOG_ERR, "Could not setup shards for cache");
+		cache = NULL;
+		goto end;
+	}
+	memset(cache, 0, sizeof(gitmod_cache));
+	for (int i = 0; i < GITMOD_CACHE_SHARDS; i++) {
+		cache->shards[i].buckets = calloc(GITMOD_CACHE_SHARD_MIN_BUCKETS, sizeof(gitmod_cache_item *));
+		if (!cache->shards[i].buckets) {
+			gitmod_log(LOG_ERR, "Could not setup shards for cache");
+			for (int j = 0; j < i; j++) {
+				gitmod_rwlocker_destroy(&cache->shards[j].lock);
+				free(cache->shards[j].buckets);
+			}
+			free(cache);
+			cache = NULL;
+			goto end;
 		}
+		cache->shards[i].num_buckets = GITMOD_CACHE_SHARD_MIN_BUCKETS;
+		gitmod_rwlocker_init(&cache->shards[i].lock);
+		gitmod_rwlocker_set_class(&cache->shards[i].lock, GITMOD_LOCK_CACHE_SHARD);
 	}
-	if (!cache) {
+ end:
+	if (cache) {
+		cache->locker = locker;
+		cache->charged = charged;
+		cache->busy = busy;
+		cache->key_destroy_func = key_destroy_func;
+		cache->value_destroy_func = value_destroy_func;
+	} else {
 		// let's revert what we have done
 		if (locker)
 			gitmod_locker_dispose(&locker);
-		if (items)
-			g_hash_table_destroy(items);
+		if (charged)
+			g_ptr_array_free(charged, TRUE);
+		if (busy)
+			g_ptr_array_free(busy, TRUE);
 	}
 
 	return cache;
 }
 
-void gitmod_cache_set_fixed(gitmod_cache *cache, int fixed)
+void gitmod_cache_set_budget(gitmod_cache *cache, size_t budget)
 {
 	if (!cache)
 		return;
-	cache->fixed = fixed;
+	cache->budget = budget;
 }
 
-gitmod_cache_item *gitmod_cache_get(gitmod_cache *cache, const char *id)
+void gitmod_cache_set_evict_func(gitmod_cache *cache, gitmod_cache_evict_func evict)
 {
 	if (!cache)
-		return NULL;
-	gitmod_cache_item *item = g_hash_table_lookup(cache->items, id);
-	if (item || cache->fixed)
-		return item;
-	gitmod_lock(cache->locker);
-	// now I am the only one looking into the hash table. Let's tru again
-	item = g_hash_table_lookup(cache->items, id);
-	if (item) {
+		return;
+	cache->evict = evict;
+}
+
+void gitmod_cache_set_arena(gitmod_cache *cache, gitmod_arena *arena)
+{
+	if (!cache)
+		return;
+	cache->arena = arena;
+}
+
+void gitmod_cache_set_recorder(gitmod_cache *cache, gitmod_stats *recorder)
+{
+	if (!cache)
+		return;
+	// lookups are not counted by the cache, they are taken from the slots of the threads of the recorder
+	cache->ready_base = gitmod_stats_get_counter(recorder, GITMOD_STATS_ITEMS_READY);
+	cache->not_ready_base = gitmod_stats_get_counter(recorder, GITMOD_STATS_ITEMS_NOT_READY);
+	cache->recorder = recorder;
+}
+
+static gitmod_cache_item *gitmod_cache_shard_lookup(gitmod_cache_shard *shard, const char *id, guint hash)
+{
+	gitmod_cache_item *item = shard->buckets[(hash / GITMOD_CACHE_SHARDS) & (shard->num_buckets - 1)];
+	for (; item; item = item->next)
+		if (item->hash == hash && !strcmp(item->id, id))
+			return item;
+	return NULL;
+}
+
+/**
+ * Double the number of buckets of the shard. Its lock has to be held for writing
+ */
+static void gitmod_cache_shard_grow(gitmod_cache_shard *shard)
+{
+	guint num_buckets = shard->num_buckets * 2;
+	gitmod_cache_item **buckets = calloc(num_buckets, sizeof(gitmod_cache_item *));
+	if (!buckets)
+		// we can keep on working with longer chains
+		return;
+	gitmod_cache_item *item, *next;
+	for (guint i = 0; i < shard->num_buckets; i++) {
+		for (item = shard->buckets[i]; item; item = next) {
+			next = item->next;
+			guint bucket = (item->hash / GITMOD_CACHE_SHARDS) & (num_buckets - 1);
+			item->next = buckets[bucket];
+			buckets[bucket] = item;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->num_buckets = num_buckets;
+}
+
+/**
+ * Find the item of id in the shard or add an empty one. The lock of the shard has to be held for writing
+ */
+static gitmod_cache_item *gitmod_cache_shard_add(gitmod_cache *cache, gitmod_cache_shard *shard, const char *id,
+						 guint hash)
+{
+	gitmod_cache_item *item = gitmod_cache_shard_lookup(shard, id, hash);
+	if (item)
 		// another thread had set it up before us. Let's move on
-		gitmod_unlock(cache->locker);
 		return item;
-	}
 	// need to create a new instance of a container
-	item = calloc(1, sizeof(gitmod_cache_item));
+	if (cache->arena) {
+		item = gitmod_arena_alloc(cache->arena, sizeof(gitmod_cache_item));
+		if (item)
+			item->id = gitmod_arena_strdup(cache->arena, id);
+	} else {
+		item = calloc(1, sizeof(gitmod_cache_item));
+		if (item)
+			item->id = strdup(id);
+	}
 	if (item) {
-		item->locker = gitmod_locker_create();
-		if (!item->locker)
-			// can't work with container if it does not have a lock
-			free(item);
-		else {
-			gitmod_lock(item->locker);	// so that no other thread can get its content
-
-			// we associate the value in the hash table
-			g_hash_table_insert(cache->items, strdup(id), item);
-		}
+		item->hash = hash;
+		if (shard->size >= shard->num_buckets)
+			gitmod_cache_shard_grow(shard);
+		guint bucket = (hash / GITMOD_CACHE_SHARDS) & (shard->num_buckets - 1);
+		item->next = shard->buckets[bucket];
+		shard->buckets[bucket] = item;
+		shard->size++;
+		__atomic_add_fetch(&cache->size, 1, __ATOMIC_RELAXED);
 	}
-	gitmod_unlock(cache->locker);
 	return item;
 }
 
+gitmod_cache_item *gitmod_cache_get(gitmod_cache *cache, const char *id)
+{
+	if (!cache)
+		return NULL;
+	guint hash = g_str_hash(id);
+	gitmod_cache_shard *shard = &cache->shards[hash & (GITMOD_CACHE_SHARDS - 1)];
+	gitmod_read_lock(&shard->lock);
+	gitmod_cache_item *item = gitmod_cache_shard_lookup(shard, id, hash);
+	gitmod_read_unlock(&shard->lock);
+	if (item && __atomic_load_n(&item->state, __ATOMIC_ACQUIRE) == GITMOD_CACHE_ITEM_READY) {
+		__atomic_store_n(&item->referenced, 1, __ATOMIC_RELAXED);
+		gitmod_stats_add(cache->recorder, GITMOD_STATS_ITEMS_READY, 1);
+		gitmod_trace_instant(GITMOD_TRACE_ITEM_READY, 0, hash);
+	} else {
+		gitmod_stats_add(cache->recorder, GITMOD_STATS_ITEMS_NOT_READY, 1);
+		gitmod_trace_instant(GITMOD_TRACE_ITEM_NOT_READY, 0, hash);
+	}
+	if (item)
+		return item;
+	gitmod_write_lock(&shard->lock);
+	// now I am the only one looking into the shard. Let's try again
+	item = gitmod_cache_shard_add(cache, shard, id, hash);
+	gitmod_write_unlock(&shard->lock);
+	return item;
+}
+
+void gitmod_cache_get_batch(gitmod_cache *cache, const char **ids, guint count, gitmod_cache_item **items)
+{
+	if (!(cache && count))
+		return;
+	guint *hashes = malloc(count * sizeof(guint));
+	guint *order = malloc(count * sizeof(guint));
+	if (!(hashes && order)) {
+		free(hashes);
+		free(order);
+		for (guint i = 0; i < count; i++)
+			items[i] = gitmod_cache_get(cache, ids[i]);
+		return;
+	}
+	// ids are sorted by shard (counting them first) so that each shard is locked once
+	guint starts[GITMOD_CACHE_SHARDS + 1] = { 0 };
+	for (guint i = 0; i < count; i++) {
+		hashes[i] = g_str_hash(ids[i]);
+		starts[(hashes[i] & (GITMOD_CACHE_SHARDS - 1)) + 1]++;
+	}
+	for (int i = 0; i < GITMOD_CACHE_SHARDS; i++)
+		starts[i + 1] += starts[i];
+	guint next[GITMOD_CACHE_SHARDS];
+	memcpy(next, starts, sizeof(next));
+	for (guint i = 0; i < count; i++)
+		order[next[hashes[i] & (GITMOD_CACHE_SHARDS - 1)]++] = i;
+	for (int i = 0; i < GITMOD_CACHE_SHARDS; i++) {
+		if (starts[i] == starts[i + 1])
+			continue;
+		gitmod_cache_shard *shard = &cache->shards[i];
+		gitmod_write_lock(&shard->lock);
+		for (guint j = starts[i]; j < starts[i + 1]; j++)
+			items[order[j]] = gitmod_cache_shard_add(cache, shard, ids[order[j]], hashes[order[j]]);
+		gitmod_write_unlock(&shard->lock);
+	}
+	free(hashes);
+	free(order);
+}
+
 int gitmod_cache_size(gitmod_cache *cache)
 {
 	if (!cache)
 		return 0;
-	return g_hash_table_size(cache->items);
+	return __atomic_load_n(&cache->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add the item at the end of list. cache->locker has to be locked
+ */
+static void gitmod_cache_list_add(GPtrArray *list, gitmod_cache_item *item)
+{
+	item->slot = list->len;
+	g_ptr_array_add(list, item);
+}
+
+/**
+ * Take the item out of list, the last item is moved into its slot. cache->locker has to be locked
+ */
+static void gitmod_cache_list_remove(GPtrArray *list, gitmod_cache_item *item)
+{
+	g_ptr_array_remove_index_fast(list, item->slot);
+	if (item->slot < list->len)
+		((gitmod_cache_item *) g_ptr_array_index(list, item->slot))->slot = item->slot;
+}
+
+/**
+ * Move the CLOCK hand over the charged items releasing the ones that were not referenced
+ * since the last time until we are within budget. Items that are in use are moved to busy
+ * so the hand does not go over them again until gitmod_cache_item_idle is called on them.
+ * cache->locker has to be locked.
+ */
+static void gitmod_cache_evict(gitmod_cache *cache)
+{
+	guint steps = 2 * cache->charged->len;	// enough to clear all the reference bits
+	gitmod_cache_item *item;
+	while (cache->bytes > cache->budget && cache->charged->len && steps--) {
+		if (cache->hand >= cache->charged->len)
+			cache->hand = 0;
+		item = g_ptr_array_index(cache->charged, cache->hand);
+		if (__atomic_exchange_n(&item->referenced, 0, __ATOMIC_RELAXED)) {
+			// second chance
+			cache->hand++;
+			continue;
+		}
+		// set before evict looks at the item so that a holder letting it go right after sees it
+		__atomic_store_n(&item->busy, 1, __ATOMIC_SEQ_CST);
+		// the last item is moved into this position so the hand does not move
+		gitmod_cache_list_remove(cache->charged, item);
+		if (cache->evict(item->content)) {
+			// in use
+			gitmod_cache_list_add(cache->busy, item);
+			continue;
+		}
+		__atomic_store_n(&item->busy, 0, __ATOMIC_RELAXED);
+		cache->bytes -= item->charge;
+		item->charge = 0;
+		cache->evictions++;
+	}
+}
+
+void gitmod_cache_item_charge(gitmod_cache *cache, gitmod_cache_item *item, size_t bytes)
+{
+	if (!(cache && item && bytes))
+		return;
+	gitmod_lock(cache->locker);
+	if (!item->charge)
+		gitmod_cache_list_add(cache->charged, item);
+	item->charge += bytes;
+	item->referenced = 1;
+	cache->bytes += bytes;
+	if (cache->budget && cache->evict)
+		gitmod_cache_evict(cache);
+	gitmod_unlock(cache->locker);
+}
+
+void gitmod_cache_item_idle(gitmod_cache *cache, gitmod_cache_item *item)
+{
+	// only items that were found in use take the lock
+	if (!(cache && item && __atomic_load_n(&item->busy, __ATOMIC_SEQ_CST)))
+		return;
+	gitmod_lock(cache->locker);
+	if (item->busy) {
+		gitmod_cache_list_remove(cache->busy, item);
+		gitmod_cache_list_add(cache->charged, item);
+		item->referenced = 1;
+		item->busy = 0;
+		if (cache->budget && cache->evict)
+			gitmod_cache_evict(cache);
+	}
+	gitmod_unlock(cache->locker);
+}
+
+void gitmod_cache_get_stats(gitmod_cache *cache, gitmod_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(gitmod_cache_stats));
+	if (!cache)
+		return;
+	if (cache->recorder) {
+		stats->ready = gitmod_stats_get_counter(cache->recorder, GITMOD_STATS_ITEMS_READY) - cache->ready_base;
+		stats->not_ready =
+		    gitmod_stats_get_counter(cache->recorder, GITMOD_STATS_ITEMS_NOT_READY) - cache->not_ready_base;
+	}
+	gitmod_lock(cache->locker);
+	stats->evictions = cache->evictions;
+	stats->bytes = cache->bytes;
+	stats->budget = cache->budget;
+	gitmod_unlock(cache->locker);
+}
+
+int gitmod_cache_item_claim(gitmod_cache_item *item)
+{
+	if (!item)
+		return 0;
+	int expected = GITMOD_CACHE_ITEM_EMPTY;
+	return __atomic_compare_exchange_n(&item->state, &expected, GITMOD_CACHE_ITEM_LOADING, 0, __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
+}
+
+/**
+ * Move the item out of loading and wake up whoever is waiting for it
+ */
+static void gitmod_cache_item_finish_loading(gitmod_cache_item *item, int state)
+{
+	if (__atomic_exchange_n(&item->state, state, __ATOMIC_ACQ_REL) != GITMOD_CACHE_ITEM_WAITING)
+		return;
+	gitmod_lock(&gitmod_cache_wait_lock);
+	pthread_cond_broadcast(&gitmod_cache_item_loaded);
+	gitmod_unlock(&gitmod_cache_wait_lock);
 }
 
 void gitmod_cache_item_set(gitmod_cache_item *item, const void *content)
 {
 	if (!item)
 		return;
-	if (!item->content) {
-		// content hadn't been set up
-		item->content = content;
-		gitmod_unlock(item->locker);
-	}
+	if (__atomic_load_n(&item->state, __ATOMIC_ACQUIRE) == GITMOD_CACHE_ITEM_READY)
+		// content had been set up already
+		return;
+	item->content = content;
+	gitmod_cache_item_finish_loading(item, GITMOD_CACHE_ITEM_READY);
+}
+
+void gitmod_cache_item_abandon(gitmod_cache_item *item)
+{
+	if (item)
+		gitmod_cache_item_finish_loading(item, GITMOD_CACHE_ITEM_EMPTY);
 }
 
 const void *gitmod_cache_item_get(gitmod_cache_item *item)
 {
 	if (!item)
 		return NULL;
-	if (item->content)
+	int state = __atomic_load_n(&item->state, __ATOMIC_ACQUIRE);
+	if (state == GITMOD_CACHE_ITEM_READY)
 		return item->content;
-	gitmod_lock(item->locker);	// need to lock it so that we wait until content hs been set
-	// now we are sure that content has been set
-	gitmod_unlock(item->locker);
-	return item->content;
+	if (state == GITMOD_CACHE_ITEM_EMPTY)
+		return NULL;
+	// need to wait until content has been set
+	gitmod_lock(&gitmod_cache_wait_lock);
+	while (1) {
+		state = GITMOD_CACHE_ITEM_LOADING;
+		if (!__atomic_compare_exchange_n(&item->state, &state, GITMOD_CACHE_ITEM_WAITING, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+		    && state != GITMOD_CACHE_ITEM_WAITING)
+			break;
+		gitmod_locker_wait(&gitmod_cache_wait_lock, &gitmod_cache_item_loaded);
+	}
+	gitmod_unlock(&gitmod_cache_wait_lock);
+	// content could not be set up if it's empty again
+	return state == GITMOD_CACHE_ITEM_READY ? item->content : NULL;
+}
+
+const void *gitmod_cache_item_peek(gitmod_cache_item *item)
+{
+	if (!item)
+		return NULL;
+	return __atomic_load_n(&item->state, __ATOMIC_ACQUIRE) == GITMOD_CACHE_ITEM_READY ? item->content : NULL;
 }
 
 void gitmod_cache_dispose(gitmod_cache **cache)
 {
-	if (*cache) {
-		g_hash_table_destroy((*cache)->items);
-		gitmod_locker_dispose(&(*cache)->locker);
-		free(*cache);
-		*cache = NULL;
+	if (!*cache)
+		return;
+	gitmod_cache_item *item, *next;
+	for (int i = 0; i < GITMOD_CACHE_SHARDS; i++) {
+		gitmod_cache_shard *shard = &(*cache)->shards[i];
+		for (guint j = 0; j < shard->num_buckets; j++) {
+			for (item = shard->buckets[j]; item; item = next) {
+				next = item->next;
+				if (item->content && (*cache)->value_destroy_func)
+					(*cache)->value_destroy_func((void *)item->content);
+				if ((*cache)->arena)
+					// it goes away with the arena
+					continue;
+				if ((*cache)->key_destroy_func)
+					(*cache)->key_destroy_func(item->id);
+				else
+					free(item->id);
+				free(item);
+			}
+		}
+		free(shard->buckets);
+		gitmod_rwlocker_destroy(&shard->lock);
 	}
+	g_ptr_array_free((*cache)->charged, TRUE);
+	g_ptr_array_free((*cache)->busy, TRUE);
+	gitmod_locker_dispose(&(*cache)->locker);
+	free(*cache);
+	*cache = NULL;
 }
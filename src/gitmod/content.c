@@ -0,0 +1,316 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#include <syslog.h>
+#include <time.h>
+#include "gitmod.h"
+
+static guint oid_hash(gconstpointer key)
+{
+	// OIDs are already well distributed
+	guint hash;
+	memcpy(&hash, ((const git_oid *)key)->id, sizeof(guint));
+	return hash;
+}
+
+static gboolean oid_equal(gconstpointer a, gconstpointer b)
+{
+	return !git_oid_cmp(a, b);
+}
+
+static void destroy_content(void *value)
+{
+	gitmod_content *content = value;
+	git_object_free(content->object);
+	free(content);
+}
+
+/**
+ * The shard of an OID. The hash tables of the shards use the first bytes, shards are picked by the last one
+ */
+static gitmod_content_shard *gitmod_content_store_shard(gitmod_content_store *store, const git_oid *oid)
+{
+	return &store->shards[oid->id[GIT_OID_RAWSZ - 1] & (GITMOD_CONTENT_SHARDS - 1)];
+}
+
+gitmod_content_store *gitmod_content_store_create()
+{
+	gitmod_content_store *store = calloc(1, sizeof(gitmod_content_store));
+	if (!store)
+		return NULL;
+	int ok = 1;
+	for (int i = 0; i < GITMOD_CONTENT_SHARDS; i++) {
+		gitmod_content_shard *shard = &store->shards[i];
+		gitmod_locker_init(&shard->lock);
+		gitmod_locker_set_class(&shard->lock, GITMOD_LOCK_CONTENT);
+		pthread_cond_init(&shard->loaded, NULL);
+		// keys are the OIDs inside of the values
+		shard->items = g_hash_table_new_full(oid_hash, oid_equal, NULL, destroy_content);
+		ok = ok && shard->items;
+	}
+	store->retain_budget = GITMOD_CONTENT_RETAIN_BUDGET;
+	store->retain_age = GITMOD_CONTENT_RETAIN_AGE;
+	if (!ok) {
+		gitmod_log(LOG_ERR, "Could not set up content store");
+		gitmod_content_store_dispose(&store);
+	}
+	return store;
+}
+
+void gitmod_content_store_set_recorder(gitmod_content_store *store, gitmod_stats *recorder)
+{
+	if (store)
+		store->recorder = recorder;
+}
+
+void gitmod_content_store_set_retention(gitmod_content_store *store, size_t budget, time_t age)
+{
+	if (!store)
+		return;
+	__atomic_store_n(&store->retain_budget, budget, __ATOMIC_RELAXED);
+	__atomic_store_n(&store->retain_age, age, __ATOMIC_RELAXED);
+}
+
+static time_t gitmod_content_store_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/**
+ * The lock of the shard has to be held
+ */
+static void gitmod_content_store_unretain(gitmod_content_store *store, gitmod_content_shard *shard,
+					  gitmod_content *content)
+{
+	if (content->prev)
+		content->prev->next = content->next;
+	else
+		shard->retained = content->next;
+	if (content->next)
+		content->next->prev = content->prev;
+	else
+		shard->retained_last = content->prev;
+	content->prev = content->next = NULL;
+	content->retained = 0;
+	__atomic_sub_fetch(&store->retained_bytes, content->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Free retained content of the shard, oldest first, while the store is over the budget or it's too old.
+ * The lock of the shard has to be held
+ */
+static void gitmod_content_store_trim_shard(gitmod_content_store *store, gitmod_content_shard *shard, time_t now)
+{
+	size_t budget = __atomic_load_n(&store->retain_budget, __ATOMIC_RELAXED);
+	time_t age = __atomic_load_n(&store->retain_age, __ATOMIC_RELAXED);
+	gitmod_content *content;
+	while ((content = shard->retained)) {
+		if (!(budget && __atomic_load_n(&store->retained_bytes, __ATOMIC_RELAXED) > budget) &&
+		    !(age && now - content->released >= age))
+			break;
+		gitmod_content_store_unretain(store, shard, content);
+		__atomic_sub_fetch(&store->bytes, content->size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&store->expired, 1, __ATOMIC_RELAXED);
+		g_hash_table_remove(shard->items, &content->oid);
+	}
+}
+
+/**
+ * Retained content of other shards is only freed when the store is still over the budget
+ */
+static void gitmod_content_store_trim(gitmod_content_store *store, gitmod_content_shard *shard, time_t now)
+{
+	size_t budget = __atomic_load_n(&store->retain_budget, __ATOMIC_RELAXED);
+	for (int i = 1; i < GITMOD_CONTENT_SHARDS; i++) {
+		if (!(budget && __atomic_load_n(&store->retained_bytes, __ATOMIC_RELAXED) > budget))
+			return;
+		gitmod_content_shard *other = &store->shards[(shard - store->shards + i) & (GITMOD_CONTENT_SHARDS - 1)];
+		gitmod_lock(&other->lock);
+		gitmod_content_store_trim_shard(store, other, now);
+		gitmod_unlock(&other->lock);
+	}
+}
+
+gitmod_content *gitmod_content_store_get(gitmod_content_store *store, git_repository *repo, const git_oid *oid,
+					 git_otype type)
+{
+	if (!store)
+		return NULL;
+	gitmod_content_shard *shard = gitmod_content_store_shard(store, oid);
+	gitmod_lock(&shard->lock);
+	gitmod_content *content = g_hash_table_lookup(shard->items, oid);
+	if (content) {
+		if (content->retained)
+			gitmod_content_store_unretain(store, shard, content);
+		__atomic_add_fetch(&content->refcount, 1, __ATOMIC_ACQ_REL);
+		if (content->loading) {
+			// only one thread loads it, no matter how many ask for it at the same time
+			__atomic_add_fetch(&store->coalesced, 1, __ATOMIC_RELAXED);
+			while (content->loading)
+				gitmod_locker_wait(&shard->lock, &shard->loaded);
+		} else
+			__atomic_add_fetch(&store->hits, 1, __ATOMIC_RELAXED);
+		if (!content->object) {
+			// it could not be loaded. It's not in the store anymore
+			if (!__atomic_sub_fetch(&content->refcount, 1, __ATOMIC_ACQ_REL))
+				free(content);
+			content = NULL;
+		}
+		gitmod_unlock(&shard->lock);
+		return content;
+	}
+	content = calloc(1, sizeof(gitmod_content));
+	if (!content) {
+		gitmod_unlock(&shard->lock);
+		return NULL;
+	}
+	git_oid_cpy(&content->oid, oid);
+	content->refcount = 1;
+	content->loading = 1;
+	g_hash_table_insert(shard->items, &content->oid, content);
+	gitmod_unlock(&shard->lock);
+
+	// not holding the lock while loading so that other objects can be used in the meantime
+	git_object *object;
+	if (git_object_lookup(&object, repo, oid, type)) {
+		gitmod_log(LOG_ERR, "Could not load object %s", git_oid_tostr_s(oid));
+		object = NULL;
+	}
+
+	gitmod_lock(&shard->lock);
+	content->loading = 0;
+	if (object) {
+		content->object = object;
+		if (type == GIT_OBJ_BLOB) {
+			content->size = git_blob_rawsize((git_blob *) object);
+			gitmod_stats_add(store->recorder, GITMOD_STATS_BLOB_LOADS, 1);
+			gitmod_stats_add(store->recorder, GITMOD_STATS_BLOB_BYTES, content->size);
+		}
+		__atomic_add_fetch(&store->bytes, content->size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&store->loads, 1, __ATOMIC_RELAXED);
+	} else {
+		// threads that are waiting for it will let it go
+		g_hash_table_steal(shard->items, &content->oid);
+		if (!__atomic_sub_fetch(&content->refcount, 1, __ATOMIC_ACQ_REL))
+			free(content);
+		content = NULL;
+	}
+	pthread_cond_broadcast(&shard->loaded);
+	gitmod_unlock(&shard->lock);
+	return content;
+}
+
+void gitmod_content_store_ref(gitmod_content_store *store, gitmod_content *content)
+{
+	if (!(store && content))
+		return;
+	// the caller holds a reference already so it can't be freed in the meantime
+	__atomic_add_fetch(&content->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+void gitmod_content_store_release(gitmod_content_store *store, gitmod_content **content, int retain)
+{
+	if (!(store && content && *content))
+		return;
+	gitmod_content *released = *content;
+	*content = NULL;
+	// references that are not the last one are dropped without the lock
+	int refcount = __atomic_load_n(&released->refcount, __ATOMIC_RELAXED);
+	while (refcount > 1)
+		if (__atomic_compare_exchange_n(&released->refcount, &refcount, refcount - 1, 0, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			return;
+	// it can only get new references from the store (with the lock) from now on
+	gitmod_content_shard *shard = gitmod_content_store_shard(store, &released->oid);
+	gitmod_lock(&shard->lock);
+	if (__atomic_sub_fetch(&released->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+		// somebody got it in the meantime
+		gitmod_unlock(&shard->lock);
+		return;
+	}
+	if (!retain) {
+		__atomic_sub_fetch(&store->bytes, released->size, __ATOMIC_RELAXED);
+		g_hash_table_remove(shard->items, &released->oid);
+	} else if (!released->retained) {
+		released->retained = 1;
+		released->released = gitmod_content_store_now();
+		released->prev = shard->retained_last;
+		if (shard->retained_last)
+			shard->retained_last->next = released;
+		else
+			shard->retained = released;
+		shard->retained_last = released;
+		__atomic_add_fetch(&store->retained_bytes, released->size, __ATOMIC_RELAXED);
+	}
+	// retained content is not kept forever if the root tree does not change again
+	time_t now = gitmod_content_store_now();
+	gitmod_content_store_trim_shard(store, shard, now);
+	gitmod_unlock(&shard->lock);
+	if (retain)
+		gitmod_content_store_trim(store, shard, now);
+}
+
+static gboolean content_is_unused(gpointer key, gpointer value, gpointer user_data)
+{
+	gitmod_content *content = value;
+	gitmod_content_store *store = user_data;
+	if (__atomic_load_n(&content->refcount, __ATOMIC_ACQUIRE) > 0)
+		return FALSE;
+	__atomic_sub_fetch(&store->bytes, content->size, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+void gitmod_content_store_expire(gitmod_content_store *store)
+{
+	if (!store)
+		return;
+	guint expired = 0, size = 0;
+	for (int i = 0; i < GITMOD_CONTENT_SHARDS; i++) {
+		gitmod_content_shard *shard = &store->shards[i];
+		gitmod_lock(&shard->lock);
+		expired += g_hash_table_foreach_remove(shard->items, content_is_unused, store);
+		// all retained content of the shard is gone
+		shard->retained = shard->retained_last = NULL;
+		size += g_hash_table_size(shard->items);
+		gitmod_unlock(&shard->lock);
+	}
+	__atomic_store_n(&store->retained_bytes, 0, __ATOMIC_RELAXED);
+	gitmod_log(LOG_INFO, "Content store: %u entries expired (%lu before, by age or budget), %u entries in use "
+		   "holding %zu bytes (%lu hits, %lu loads, %lu coalesced)", expired,
+		   __atomic_load_n(&store->expired, __ATOMIC_RELAXED), size,
+		   __atomic_load_n(&store->bytes, __ATOMIC_RELAXED), __atomic_load_n(&store->hits, __ATOMIC_RELAXED),
+		   __atomic_load_n(&store->loads, __ATOMIC_RELAXED),
+		   __atomic_load_n(&store->coalesced, __ATOMIC_RELAXED));
+}
+
+int gitmod_content_store_size(gitmod_content_store *store)
+{
+	if (!store)
+		return 0;
+	int size = 0;
+	for (int i = 0; i < GITMOD_CONTENT_SHARDS; i++) {
+		gitmod_lock(&store->shards[i].lock);
+		size += g_hash_table_size(store->shards[i].items);
+		gitmod_unlock(&store->shards[i].lock);
+	}
+	return size;
+}
+
+void gitmod_content_store_dispose(gitmod_content_store **store)
+{
+	if (!(store && *store))
+		return;
+	for (int i = 0; i < GITMOD_CONTENT_SHARDS; i++) {
+		gitmod_content_shard *shard = &(*store)->shards[i];
+		if (shard->items)
+			g_hash_table_destroy(shard->items);
+		gitmod_locker_destroy(&shard->lock);
+		pthread_cond_destroy(&shard->loaded);
+	}
+	free(*store);
+	*store = NULL;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Readers register on one of two sets of counters (depending on the parity of the epoch).
+ * The writer flips the epoch and waits for the counters of the previous parity to drain. Doing it twice makes sure
+ * that readers that got the parity right before a flip are waited for too.
+ * Counters are spread over cache lines so that readers on different threads don't fight over the same one.
+ */
+
+#include <sched.h>
+#include "gitmod.h"
+
+static __thread int thread_stripe = -1;
+static int next_stripe = 0;
+
+static int gitmod_epoch_get_stripe()
+{
+	if (thread_stripe < 0)
+		thread_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % GITMOD_EPOCH_STRIPES;
+	return thread_stripe;
+}
+
+int gitmod_epoch_enter(gitmod_epoch *epoch)
+{
+	int stripe = gitmod_epoch_get_stripe();
+	int parity = __atomic_load_n(&epoch->current, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&epoch->readers[parity][stripe].count, 1, __ATOMIC_SEQ_CST);
+	return parity * GITMOD_EPOCH_STRIPES + stripe;
+}
+
+void gitmod_epoch_exit(gitmod_epoch *epoch, int token)
+{
+	__atomic_sub_fetch(&epoch->readers[token / GITMOD_EPOCH_STRIPES][token % GITMOD_EPOCH_STRIPES].count, 1,
+			   __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Returns 1 if it had to wait for readers
+ */
+static int gitmod_epoch_flip_and_wait(gitmod_epoch *epoch)
+{
+	int waited = 0;
+	int parity = __atomic_fetch_add(&epoch->current, 1, __ATOMIC_SEQ_CST) & 1;
+	for (int stripe = 0; stripe < GITMOD_EPOCH_STRIPES; stripe++)
+		while (__atomic_load_n(&epoch->readers[parity][stripe].count, __ATOMIC_SEQ_CST)) {
+			// reader sections are very short
+			sched_yield();
+			waited = 1;
+		}
+	return waited;
+}
+
+void gitmod_epoch_synchronize(gitmod_epoch *epoch)
+{
+	uint64_t start = gitmod_lock_wait_begin();
+	int waited = gitmod_epoch_flip_and_wait(epoch);
+	waited |= gitmod_epoch_flip_and_wait(epoch);
+	gitmod_lock_wait_end(GITMOD_LOCK_EPOCH, start, waited);
+}
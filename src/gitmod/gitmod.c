@@ -3,22 +3,24 @@
  * Released under the terms of GPLv2
  */
 
+#include <errno.h>
 #include <git2.h>
 #include <syslog.h>
+#include <unistd.h>
 #include "gitmod.h"
 
 static int gitmod_started = 0;
 
 int gitmod_init()
 {
+	// messages are written by a thread of their own
+	gitmod_log_start();
 	if (gitmod_started)
 		return 0;
-#ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "gitmod init (debug compilation)");
-#endif
+	gitmod_log_debug("gitmod init (debug compilation)");
 	git_libgit2_init();
 	gitmod_started = 1;
-	syslog(LOG_INFO, "gitmod init done");
+	gitmod_log(LOG_INFO, "gitmod init done");
 
 	return 0;
 }
@@ -29,7 +31,8 @@ void gitmod_shutdown()
 		return;
 	// going out, for the time being
 	git_libgit2_shutdown();
-	syslog(LOG_INFO, "gitmod shutdown complete");
+	gitmod_log(LOG_INFO, "gitmod shutdown complete");
+	gitmod_log_stop();
 }
 
 static git_tree *gitmod_get_tree_from_tag(git_tag *tag, time_t *time)
@@ -37,7 +40,7 @@ static git_tree *gitmod_get_tree_from_tag(git_tag *tag, time_t *time)
 	git_object *target;
 	int ret = git_tag_target(&target, tag);
 	if (ret) {
-		syslog(LOG_ERR, "There was an error trying to get target from signed tag");
+		gitmod_log(LOG_ERR, "There was an error trying to get target from signed tag");
 		return NULL;
 	}
 	*time = git_commit_time((git_commit *) target);
@@ -45,7 +48,7 @@ static git_tree *gitmod_get_tree_from_tag(git_tag *tag, time_t *time)
 	ret = git_commit_tree(&tree, (git_commit *) target);
 	if (ret) {
 		tree = NULL;
-		syslog(LOG_ERR, "There was an error getting tree from signed tag's target revision");
+		gitmod_log(LOG_ERR, "There was an error getting tree from signed tag's target revision");
 	}
 	git_object_free(target);
 	return tree;
@@ -63,7 +66,7 @@ static git_tree *gitmod_get_root_tree(gitmod_info *info, time_t *revision_time)
 	git_tree *root_tree = NULL;
 	ret = git_revparse_single(&treeish, info->repo, info->treeish);
 	if (ret) {
-		syslog(LOG_ERR, "There was error parsing the threeish %s", info->treeish);
+		gitmod_log(LOG_ERR, "There was error parsing the threeish %s", info->treeish);
 		return NULL;
 	}
 
@@ -71,7 +74,7 @@ static git_tree *gitmod_get_root_tree(gitmod_info *info, time_t *revision_time)
 	git_otype tag_target_type;
 	switch (object_type) {
 	case GIT_OBJ_TREE:
-		syslog(LOG_ERR, "Threeish is a tree object straight");
+		gitmod_log(LOG_ERR, "Threeish is a tree object straight");
 		root_tree = (git_tree *) treeish;
 		*revision_time = time(NULL);
 		info->treeish_type = GIT_OBJ_TREE;
@@ -84,12 +87,12 @@ static git_tree *gitmod_get_root_tree(gitmod_info *info, time_t *revision_time)
 		// type of object that it points to has to be a commit
 		tag_target_type = git_tag_target_type((git_tag *) treeish);
 		if (tag_target_type != GIT_OBJ_COMMIT) {
-			syslog(LOG_ERR, "Signed tag does not point to a revision");
+			gitmod_log(LOG_ERR, "Signed tag does not point to a revision");
 			goto end;
 		}
 		break;
 	default:
-		syslog(LOG_ERR, "Treeish provided does not refer to a revision");
+		gitmod_log(LOG_ERR, "Treeish provided does not refer to a revision");
 		goto end;
 	}
 	info->treeish_type = object_type;
@@ -104,7 +107,7 @@ static git_tree *gitmod_get_root_tree(gitmod_info *info, time_t *revision_time)
 	default:
 		ret = git_commit_tree(&root_tree, (git_commit *) treeish);
 		if (ret) {
-			syslog(LOG_ERR, "Could not find tree object for the revision");
+			gitmod_log(LOG_ERR, "Could not find tree object for the revision");
 			goto end;
 		}
 		*revision_time = git_commit_time((git_commit *) treeish);
@@ -128,61 +131,73 @@ gitmod_info *gitmod_start(const char *repo_path, const char *treeish, int option
 
 	// save the treeish
 	gitmod_info *info = calloc(1, sizeof(gitmod_info));
+	if (!info)
+		return NULL;
 	info->treeish = treeish;
+	gitmod_locker_init(&info->preload_lock);
+	gitmod_locker_set_class(&info->preload_lock, GITMOD_LOCK_INFO);
+	info->stream_threshold = GITMOD_STREAM_DEFAULT_THRESHOLD;
+	info->content_store = gitmod_content_store_create();
+	info->stats = gitmod_stats_create();
+	if (!(info->content_store && info->stats))
+		goto fail;
+	gitmod_content_store_set_recorder(info->content_store, info->stats);
 
 	ret = git_repository_open(&info->repo, repo_path);
 	if (ret) {
 		// there was an error opening the repository
 #if LIBGIT2_VER_MAJOR == 0 && LIBGIT2_VER_MINOR < 28
-		syslog(LOG_ERR, "There was an error opening the git repo at %s: %s", repo_path, giterr_last()->message);
+		gitmod_log(LOG_ERR, "There was an error opening the git repo at %s: %s", repo_path,
+			   giterr_last()->message);
 #else
-		syslog(LOG_ERR, "There was an error opening the git repo at %s: %s", repo_path,
-		       git_error_last()->message);
+		gitmod_log(LOG_ERR, "There was an error opening the git repo at %s: %s", repo_path,
+			   git_error_last()->message);
 #endif
-		goto end;
+		info->repo = NULL;
+		goto fail;
 	}
-#ifdef GITMOD_DEBUG
-	syslog(LOG_INFO, "Successfully opened repo at %s", git_repository_commondir(info->repo));
-#endif
+	gitmod_log_debug("Successfully opened repo at %s", git_repository_commondir(info->repo));
 	time_t revision_time;
 	git_tree *git_root_tree = gitmod_get_root_tree(info, &revision_time);
 	if (!git_root_tree) {
-		syslog(LOG_ERR, "Could not open root tree for treeish");
-		free(info);
-		return NULL;
+		gitmod_log(LOG_ERR, "Could not open root tree for treeish");
+		goto fail;
 	}
 	// need to  create a new root_tree instance
 	gitmod_root_tree *root_tree =
 	    gitmod_root_tree_create(git_root_tree, revision_time, options & GITMOD_OPTION_KEEP_IN_MEMORY);
 	if (!root_tree) {
-		syslog(LOG_ERR, "Could not set up root tree instance");
-		free(info);
-		return NULL;
+		gitmod_log(LOG_ERR, "Could not set up root tree instance");
+		git_tree_free(git_root_tree);
+		goto fail;
 	}
-	syslog(LOG_INFO, "gitmod is ready using git repo in %s", repo_path);
-#ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "Using tree %s as the root of the mount point",
-	       git_oid_tostr_s(git_tree_id(root_tree->tree)));
-#endif
+	gitmod_log(LOG_INFO, "gitmod is ready using git repo in %s", repo_path);
+	gitmod_log_debug("Using tree %s as the root of the mount point", git_oid_tostr_s(git_tree_id(root_tree->tree)));
 
+	gitmod_cache_set_recorder(root_tree->objects_cache, info->stats);
 	info->root_tree = root_tree;
+	info->inodes = gitmod_inode_table_create(info->content_store);
+	gitmod_inode_table_set_root(info->inodes, root_tree);
 	if (!(options & GITMOD_OPTION_FIX)) {
 		info->lock = gitmod_locker_create();
+		gitmod_locker_set_class(info->lock, GITMOD_LOCK_INFO);
 		if (!info->lock) {
-			syslog(LOG_ERR, "Could not create lock for root tree (ran out of memory?)");
-			free(info);
-			return NULL;
+			gitmod_log(LOG_ERR, "Could not create lock for root tree (ran out of memory?)");
+			goto fail;
 		}
-		info->root_tree_monitor = gitmod_thread_create(info, gitmod_root_tree_monitor_task, root_tree_delay);
+		info->root_tree_watch = gitmod_watch_create(info->repo, info->treeish);
+		info->root_tree_monitor =
+		    gitmod_thread_create(info, gitmod_root_tree_monitor_task, root_tree_delay, info->root_tree_watch);
 		if (!info->root_tree_monitor)
-			syslog(LOG_ERR, "Could not create root tree monitor. Will be fixed on the starting root tree");
-	} else {
-#ifdef GITMOD_DEBUG
-		syslog(LOG_DEBUG, "Root tree will be fixed");
-#endif
-	}
- end:
+			gitmod_log(LOG_ERR,
+				   "Could not create root tree monitor. Will be fixed on the starting root tree");
+	} else
+		gitmod_log_debug("Root tree will be fixed");
 	return info;
+ fail:
+	// no threads were started, whatever was set up is released like when stopping
+	gitmod_stop(&info);
+	return NULL;
 }
 
 gitmod_object *gitmod_get_object(gitmod_info *info, const char *path)
@@ -190,14 +205,19 @@ gitmod_object *gitmod_get_object(gitmod_info *info, const char *path)
 	if (!(info && info->root_tree))
 		return NULL;
 	gitmod_object *object = NULL;
-	// Will make sure to be the only one looking at the root_tree
-	object = gitmod_root_tree_get_object(info, info->root_tree, path);
+	// the root tree can't go away while we hold a reference, even if it is replaced
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	object = gitmod_root_tree_get_object(info, root_tree, path);
+	gitmod_root_tree_unref(&root_tree);
 	return object;
 }
 
 gitmod_object *gitmod_get_tree_entry(gitmod_info *info, gitmod_object *tree, int index)
 {
-	return gitmod_object_get_tree_entry(info, info->root_tree, tree, index);
+	if (!tree)
+		return NULL;
+	// entries come from the same root tree as the tree (which holds a reference to it)
+	return gitmod_object_get_tree_entry(info, tree->root_tree, tree, index);
 }
 
 int gitmod_dispose_object(gitmod_object **object)
@@ -205,36 +225,418 @@ int gitmod_dispose_object(gitmod_object **object)
 	return gitmod_root_tree_dispose_object(object);
 }
 
+void gitmod_set_stream_threshold(gitmod_info *info, int64_t threshold)
+{
+	if (info)
+		info->stream_threshold = threshold;
+}
+
+void gitmod_set_cache_budget(gitmod_info *info, size_t budget)
+{
+	if (!info)
+		return;
+	__atomic_store_n(&info->cache_budget, budget, __ATOMIC_RELEASE);
+	// the monitor reads the budget for a new root tree while holding the lock, so it is set on the root tree
+	// that is published either way
+	gitmod_lock(info->lock);
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	if (root_tree)
+		gitmod_cache_set_budget(root_tree->objects_cache, budget);
+	gitmod_unlock(info->lock);
+	gitmod_root_tree_unref(&root_tree);
+}
+
+int gitmod_set_blob_cache(gitmod_info *info, const char *dir, int64_t min_size, int admit_opens, size_t budget)
+{
+	if (!info)
+		return -EINVAL;
+	// blobs that would be streamed are written on the first open
+	info->blob_cache = gitmod_blob_cache_create(dir, min_size, admit_opens, info->stream_threshold, budget);
+	return info->blob_cache ? 0 : -EIO;
+}
+
+/**
+ * Call the ready function (only once)
+ */
+static void gitmod_notify_ready(gitmod_info *info)
+{
+	gitmod_ready_func ready = __atomic_exchange_n(&info->ready, NULL, __ATOMIC_ACQ_REL);
+	if (ready)
+		ready(info->ready_payload);
+}
+
+static void gitmod_warmup_done(gitmod_info *info)
+{
+	__atomic_store_n(&info->warming_up, 0, __ATOMIC_RELEASE);
+	gitmod_log(LOG_INFO, "gitmod is ready");
+	gitmod_notify_ready(info);
+}
+
+static void *gitmod_preload_task(void *params)
+{
+	gitmod_info *info = params;
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	gitmod_root_tree_preload(info, root_tree, __atomic_load_n(&info->preload_repos, __ATOMIC_ACQUIRE),
+				 info->preload_blobs, &info->preload_cancel, NULL);
+	gitmod_root_tree_unref(&root_tree);
+	// if the root tree moved in the meantime, the warm-up is over when the new one is preloaded
+	if (__atomic_load_n(&info->warming_up, __ATOMIC_ACQUIRE)
+	    && (!__atomic_load_n(&info->preload_cancel, __ATOMIC_ACQUIRE)
+		|| __atomic_load_n(&info->stopping, __ATOMIC_ACQUIRE)))
+		gitmod_warmup_done(info);
+	return NULL;
+}
+
+/**
+ * Preload the current root tree in the background. The preload of the previous one is stopped first
+ * if it is still going on. Will return 0 on success
+ */
+static int gitmod_preload_start(gitmod_info *info)
+{
+	int ret = 0;
+	gitmod_lock(&info->preload_lock);
+	if (info->preload_started) {
+		__atomic_store_n(&info->preload_cancel, 1, __ATOMIC_RELEASE);
+		pthread_join(info->preload_thread, NULL);
+		info->preload_started = 0;
+	}
+	if (!__atomic_load_n(&info->stopping, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&info->preload_cancel, 0, __ATOMIC_RELEASE);
+		ret = pthread_create(&info->preload_thread, NULL, gitmod_preload_task, info);
+		if (ret)
+			gitmod_log(LOG_ERR, "Could not start preloading the root tree");
+		else
+			info->preload_started = 1;
+	}
+	gitmod_unlock(&info->preload_lock);
+	return ret;
+}
+
+git_repository *gitmod_get_repo(gitmod_info *info)
+{
+	// the pool can be published while the monitor and preload threads are running
+	gitmod_repo_pool *repos = __atomic_load_n(&info->repos, __ATOMIC_ACQUIRE);
+	return repos ? gitmod_repo_pool_get(repos) : info->repo;
+}
+
+int gitmod_set_repo_pool(gitmod_info *info, int size)
+{
+	if (!info || size < 1)
+		return -EINVAL;
+	if (__atomic_load_n(&info->repos, __ATOMIC_ACQUIRE))
+		// objects could be using its handles
+		return -EBUSY;
+	gitmod_repo_pool *repos = gitmod_repo_pool_create(git_repository_path(info->repo), size);
+	if (!repos)
+		return -EIO;
+	gitmod_repo_pool *expected = NULL;
+	if (!__atomic_compare_exchange_n(&info->repos, &expected, repos, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// set up by another thread in the meantime
+		gitmod_repo_pool_dispose(&repos);
+		return -EBUSY;
+	}
+	gitmod_log(LOG_INFO, "Reading objects with %d repo handles", gitmod_repo_pool_size(repos));
+	return 0;
+}
+
+static void free_preload_repo(void *repo)
+{
+	git_repository_free(repo);
+}
+
+int gitmod_set_preload(gitmod_info *info, int threads, int blobs)
+{
+	if (!(info && info->root_tree && info->root_tree->objects_cache && threads > 0))
+		return -EINVAL;
+	if (!info->preload_repos) {
+		// workers don't share the repo handle of gitmod. Objects loaded with them live until gitmod stops
+		GPtrArray *repos = g_ptr_array_new_with_free_func(free_preload_repo);
+		git_repository *repo;
+		for (int i = 0; i < threads; i++) {
+			if (git_repository_open(&repo, git_repository_path(info->repo))) {
+				gitmod_log(LOG_ERR, "Could not open the repo for preload worker %d", i);
+				break;
+			}
+			g_ptr_array_add(repos, repo);
+		}
+		if (!repos->len) {
+			g_ptr_array_free(repos, TRUE);
+			return -EIO;
+		}
+		// the monitor preloads the root trees that replace this one once it's set
+		__atomic_store_n(&info->preload_repos, repos, __ATOMIC_RELEASE);
+	}
+	info->preload_blobs = blobs;
+	__atomic_store_n(&info->warming_up, 1, __ATOMIC_RELEASE);
+	// requests are served while the root tree is preloaded
+	int ret = gitmod_preload_start(info);
+	if (ret) {
+		gitmod_warmup_done(info);
+		return -ret;
+	}
+	return 0;
+}
+
+int gitmod_is_ready(gitmod_info *info)
+{
+	return info && !__atomic_load_n(&info->warming_up, __ATOMIC_ACQUIRE);
+}
+
+void gitmod_set_ready_func(gitmod_info *info, gitmod_ready_func ready, void *payload)
+{
+	if (!(info && ready))
+		return;
+	info->ready_payload = payload;
+	__atomic_store_n(&info->ready, ready, __ATOMIC_RELEASE);
+	if (gitmod_is_ready(info))
+		gitmod_notify_ready(info);
+	// otherwise it's called when the warm-up is over
+}
+
+int gitmod_get_status(gitmod_info *info, char *buf, size_t size)
+{
+	if (!info)
+		return -EINVAL;
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	int ret = snprintf(buf, size,
+			   "ready: %s\n"
+			   "warm-up: %s\n"
+			   "treeish: %s\n"
+			   "root tree: %s\n"
+			   "revision time: %ld\n"
+			   "root tree changes: %lu\n"
+			   "dirs set up: %d\n"
+			   "paths set up: %d\n"
+			   "metadata bytes: %zu\n",
+			   gitmod_is_ready(info) ? "yes" : "no",
+			   __atomic_load_n(&info->warming_up, __ATOMIC_ACQUIRE) ? "running" :
+			   info->preload_repos ? "done" : "off",
+			   info->treeish, git_oid_tostr_s(git_tree_id(root_tree->tree)), (long)root_tree->time,
+			   gitmod_get_root_tree_changes(info),
+			   __atomic_load_n(&root_tree->populated_dirs, __ATOMIC_RELAXED),
+			   gitmod_cache_size(root_tree->objects_cache), gitmod_arena_bytes(root_tree->arena));
+	gitmod_root_tree_unref(&root_tree);
+	return ret;
+}
+
+void gitmod_get_stats(gitmod_info *info, GString *out)
+{
+	if (!(info && out))
+		return;
+	gitmod_stats_write(info->stats, out);
+	gitmod_lock_stats_write(out);
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	gitmod_cache_stats cache_stats;
+	gitmod_cache_get_stats(root_tree->objects_cache, &cache_stats);
+	g_string_append_printf(out,
+			       "# TYPE gitmod_root_tree_changes_total counter\n"
+			       "gitmod_root_tree_changes_total %lu\n"
+			       "# TYPE gitmod_root_tree_usage gauge\n"
+			       "gitmod_root_tree_usage %d\n"
+			       "# TYPE gitmod_cache_bytes gauge\n"
+			       "gitmod_cache_bytes %zu\n"
+			       "# TYPE gitmod_cache_evictions_total counter\n"
+			       "gitmod_cache_evictions_total %lu\n"
+			       "# TYPE gitmod_content_store_entries gauge\n"
+			       "gitmod_content_store_entries %d\n",
+			       gitmod_get_root_tree_changes(info),
+			       __atomic_load_n(&root_tree->usage_counter, __ATOMIC_RELAXED), cache_stats.bytes,
+			       cache_stats.evictions, gitmod_content_store_size(info->content_store));
+	gitmod_root_tree_unref(&root_tree);
+}
+
+gitmod_inode *gitmod_lookup(gitmod_info *info, uint64_t parent, const char *name)
+{
+	if (!(info && info->root_tree))
+		return NULL;
+	return gitmod_inode_table_lookup(info, parent, name);
+}
+
+gitmod_inode *gitmod_get_inode(gitmod_info *info, uint64_t ino)
+{
+	return info ? gitmod_inode_table_get(info->inodes, ino) : NULL;
+}
+
+void gitmod_forget(gitmod_info *info, uint64_t ino, uint64_t nlookup)
+{
+	if (info)
+		gitmod_inode_table_forget(info->inodes, ino, nlookup);
+}
+
+gitmod_inode_dir *gitmod_opendir(gitmod_info *info, uint64_t ino)
+{
+	gitmod_inode *dir = gitmod_get_inode(info, ino);
+	if (!(dir && gitmod_inode_get_type(dir) == GITMOD_OBJECT_TREE))
+		return NULL;
+	return gitmod_inode_table_opendir(info, dir);
+}
+
+int gitmod_readdir(gitmod_inode_dir *dir, int64_t offset, gitmod_inode_dir_filler filler, void *payload)
+{
+	return gitmod_inode_table_readdir(dir, offset, filler, payload);
+}
+
+int gitmod_readdirplus(gitmod_info *info, gitmod_inode_dir *dir, int64_t offset, gitmod_inode_dir_plus_filler filler,
+		       void *payload)
+{
+	return gitmod_inode_table_readdirplus(info, dir, offset, filler, payload);
+}
+
+void gitmod_releasedir(gitmod_info *info, gitmod_inode_dir **dir)
+{
+	gitmod_inode_table_closedir(info, dir);
+}
+
+static gitmod_file *gitmod_open_object(gitmod_info *info, gitmod_object *object)
+{
+	if (!object)
+		return NULL;
+	if (gitmod_object_get_type(object) != GITMOD_OBJECT_BLOB) {
+		gitmod_dispose_object(&object);
+		return NULL;
+	}
+	gitmod_file *file = calloc(1, sizeof(gitmod_file));
+	if (!file) {
+		gitmod_dispose_object(&object);
+		return NULL;
+	}
+	file->object = object;
+	file->recorder = info->stats;
+	file->fd = gitmod_blob_cache_open(info->blob_cache, gitmod_get_repo(info), &object->oid,
+					  gitmod_object_get_size(object));
+	if (file->fd >= 0)
+		file->blob_cache = info->blob_cache;
+	else if (info->stream_threshold > 0 && gitmod_object_get_size(object) >= info->stream_threshold)
+		// if it can't be streamed, the blob will be loaded in memory as usual
+		file->stream =
+		    gitmod_stream_open(gitmod_get_repo(info), &object->oid, gitmod_object_get_size(object),
+				       GITMOD_STREAM_DEFAULT_WINDOW);
+	return file;
+}
+
+gitmod_file *gitmod_open_inode(gitmod_info *info, gitmod_inode *inode)
+{
+	return gitmod_open_object(info, gitmod_inode_get_object(info, inode));
+}
+
+void gitmod_set_invalidate_func(gitmod_info *info, gitmod_invalidate_func invalidate, void *payload)
+{
+	if (!info)
+		return;
+	info->invalidate_payload = payload;
+	__atomic_store_n(&info->invalidate, invalidate, __ATOMIC_RELEASE);
+}
+
+unsigned long gitmod_get_root_tree_changes(gitmod_info *info)
+{
+	return info ? __atomic_load_n(&info->root_tree_changes, __ATOMIC_ACQUIRE) : 0;
+}
+
+gitmod_file *gitmod_open_file(gitmod_info *info, const char *path)
+{
+	return gitmod_open_object(info, gitmod_get_object(info, path));
+}
+
+int gitmod_read_file(gitmod_file *file, char *buf, size_t size, int64_t offset)
+{
+	if (!file)
+		return -EINVAL;
+	if (file->fd >= 0) {
+		ssize_t ret = pread(file->fd, buf, size, offset);
+		return ret < 0 ? -errno : ret;
+	}
+	if (file->stream) {
+		int ret = gitmod_stream_read(file->stream, buf, size, offset);
+		if (ret > 0)
+			gitmod_stats_add(file->recorder, GITMOD_STATS_STREAMED_BYTES, ret);
+		return ret;
+	}
+
+	int64_t len = gitmod_object_get_size(file->object);
+	if (offset >= len)
+		return 0;
+	const char *contents = gitmod_object_get_content(file->object);
+	if (!contents)
+		return -EIO;
+	if (offset + (int64_t) size > len)
+		size = len - offset;
+	memcpy(buf, contents + offset, size);
+	return size;
+}
+
+void gitmod_release_file(gitmod_file **file)
+{
+	if (!(file && *file))
+		return;
+	if ((*file)->stream)
+		gitmod_stream_close(&(*file)->stream);
+	if ((*file)->blob_cache)
+		// the file descriptor belongs to the blob cache
+		gitmod_blob_cache_release((*file)->blob_cache, &(*file)->object->oid);
+	gitmod_dispose_object(&(*file)->object);
+	free(*file);
+	*file = NULL;
+}
+
 void gitmod_stop(gitmod_info **info)
 {
 	if (!(info && *info))
 		return;
+	__atomic_store_n(&(*info)->stopping, 1, __ATOMIC_RELEASE);
+	gitmod_lock(&(*info)->preload_lock);
+	if ((*info)->preload_started) {
+		__atomic_store_n(&(*info)->preload_cancel, 1, __ATOMIC_RELEASE);
+		pthread_join((*info)->preload_thread, NULL);
+		(*info)->preload_started = 0;
+	}
+	gitmod_unlock(&(*info)->preload_lock);
 	if ((*info)->root_tree_monitor)
 		gitmod_thread_release(&(*info)->root_tree_monitor);
 	(*info)->root_tree_monitor = NULL;
-	git_repository_free((*info)->repo);
+	gitmod_watch_dispose(&(*info)->root_tree_watch);
 	if ((*info)->root_tree)
 		gitmod_root_tree_dispose(&(*info)->root_tree);
+	gitmod_inode_table_dispose(&(*info)->inodes);
+	gitmod_blob_cache_dispose(&(*info)->blob_cache);
+	gitmod_content_store_dispose(&(*info)->content_store);
+	// git objects have to be released before the repo
+	gitmod_repo_pool_dispose(&(*info)->repos);
+	if ((*info)->preload_repos)
+		g_ptr_array_free((*info)->preload_repos, TRUE);
+	git_repository_free((*info)->repo);
 	if ((*info)->lock)
 		gitmod_locker_dispose(&(*info)->lock);
+	gitmod_stats_dispose(&(*info)->stats);
+	gitmod_locker_destroy(&(*info)->preload_lock);
 	free(*info);
 	*info = NULL;
 }
 
 int gitmod_root_tree_changed(gitmod_info *info, gitmod_root_tree *new_tree)
 {
-	syslog(LOG_INFO, "root tree changed");
+	uint64_t start = gitmod_trace_begin();
+	gitmod_log(LOG_INFO, "root tree changed");
+	// content retained when the previous root tree was released had its chance to be picked up
+	gitmod_content_store_expire(info->content_store);
+	if (!new_tree) {
+		gitmod_log(LOG_ERR, "Could not set up the new root tree. Will keep on using the previous one");
+		gitmod_unlock(info->lock);
+		return 0;
+	}
 	gitmod_root_tree *old_tree = info->root_tree;
-	info->root_tree = new_tree;
+	__atomic_store_n(&info->root_tree, new_tree, __ATOMIC_RELEASE);
+	gitmod_inode_table_set_root(info->inodes, new_tree);
+	__atomic_add_fetch(&info->root_tree_changes, 1, __ATOMIC_RELEASE);
+	// readers that could have seen the old tree have a reference to it by the time this returns
+	gitmod_epoch_synchronize(&info->root_tree_epoch);
 	gitmod_unlock(info->lock);
-	gitmod_lock(old_tree->lock);
-	// set it for deletion right away
-	old_tree->marked_for_deletion = 1;
-	int delete_root_tree = old_tree->usage_counter <= 0;	// not decreasing, just checking how many resources are out
-	gitmod_unlock(old_tree->lock);
-	if (delete_root_tree)
-		gitmod_root_tree_dispose(&old_tree);
-	return delete_root_tree;
+	// only what changed is dropped by the kernel
+	gitmod_inode_table_invalidate(old_tree, new_tree, __atomic_load_n(&info->invalidate, __ATOMIC_ACQUIRE),
+				      info->invalidate_payload);
+	gitmod_trace_end(GITMOD_TRACE_ROOT_TREE_SWAP, 0, start,
+			 __atomic_load_n(&info->root_tree_changes, __ATOMIC_RELAXED));
+	// it will be disposed of when the last object that uses it is released
+	return gitmod_root_tree_retire(old_tree);
 }
 
 static void gitmod_root_tree_monitor_task(gitmod_thread *thread)
@@ -244,6 +646,8 @@ static void gitmod_root_tree_monitor_task(gitmod_thread *thread)
 	gitmod_info *info = (gitmod_info *) thread->payload;
 	if (!info)
 		return;
+	// only the monitor replaces the root tree
+	gitmod_root_tree_expire_previous(info->root_tree, GITMOD_ROOT_TREE_PREVIOUS_AGE);
 	time_t revision_time;
 	git_tree *new_tree = gitmod_get_root_tree(info, &revision_time);
 	if (new_tree) {
@@ -254,15 +658,32 @@ static void gitmod_root_tree_monitor_task(gitmod_thread *thread)
 			gitmod_root_tree *old_tree = info->root_tree;
 
 			// now we are the only ones watching the old tree, let's check again
-			if (git_oid_cmp(git_tree_id(old_tree->tree), git_tree_id(new_tree)))
+			if (git_oid_cmp(git_tree_id(old_tree->tree), git_tree_id(new_tree))) {
 				// it did change, indeed
 				// we can replace the old tree with the new one and let it run normally
 				// this will take care of unlocking
-				gitmod_root_tree_changed(info,
-							 gitmod_root_tree_create(new_tree, revision_time,
-										 old_tree->objects_cache != NULL));
-			else
-				gitmod_unlock(info->lock);	// no need to make anybody wait, the new tree can be used from now on
+				gitmod_root_tree *root_tree =
+				    gitmod_root_tree_create_from_previous(info, old_tree, new_tree, revision_time);
+				if (!root_tree) {
+					// the old tree is kept. It will be tried again on the next run
+					gitmod_log(LOG_ERR, "Could not set up the new root tree");
+					gitmod_unlock(info->lock);
+					git_tree_free(new_tree);
+					return;
+				}
+				// new_tree belongs to the root tree from now on
+				gitmod_cache_set_budget(root_tree->objects_cache,
+							__atomic_load_n(&info->cache_budget, __ATOMIC_ACQUIRE));
+				gitmod_cache_set_recorder(root_tree->objects_cache, info->stats);
+				gitmod_root_tree_changed(info, root_tree);
+				// published right away, it's preloaded in the background
+				if (__atomic_load_n(&info->preload_repos, __ATOMIC_ACQUIRE))
+					gitmod_preload_start(info);
+			} else {
+				// no need to make anybody wait, the tree we have can be used from now on
+				gitmod_unlock(info->lock);
+				git_tree_free(new_tree);
+			}
 		} else
 			git_tree_free(new_tree);
 	}
@@ -0,0 +1,506 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Inodes hold the metadata of the objects the kernel looked up (and the tree of directories so that their entries
+ * can be looked up by name). They don't hold root trees so the kernel remembering an inode does not keep a root
+ * tree that was replaced alive.
+ */
+
+#include <errno.h>
+#include <syslog.h>
+#include "gitmod.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static guint64 gitmod_inode_identity(const char *path, const git_oid *oid, int mode)
+{
+	guint64 hash = FNV_OFFSET;
+	for (const unsigned char *c = (const unsigned char *)path; *c; c++)
+		hash = (hash ^ *c) * FNV_PRIME;
+	for (int i = 0; i < GIT_OID_RAWSZ; i++)
+		hash = (hash ^ oid->id[i]) * FNV_PRIME;
+	hash = (hash ^ (guint64) mode) * FNV_PRIME;
+	return hash;
+}
+
+static uint64_t gitmod_inode_number(guint64 identity)
+{
+	uint64_t ino = identity >> 1;	// some tools don't like inode numbers that look negative
+	return ino > GITMOD_RESERVED_INODES ? ino : ino + GITMOD_RESERVED_INODES + 1;
+}
+
+static guint identity_hash(gconstpointer key)
+{
+	return (guint) ((const gitmod_inode *)key)->identity;
+}
+
+static gboolean identity_equal(gconstpointer a, gconstpointer b)
+{
+	const gitmod_inode *inode_a = a, *inode_b = b;
+	return inode_a->identity == inode_b->identity && inode_a->mode == inode_b->mode
+	    && !git_oid_cmp(&inode_a->oid, &inode_b->oid) && !strcmp(inode_a->path, inode_b->path);
+}
+
+static void gitmod_inode_dispose(gitmod_inode_table *table, gitmod_inode **inode)
+{
+	if ((*inode)->content)
+		gitmod_content_store_release(table->store, &(*inode)->content, 0);
+	free((*inode)->path);
+	free((*inode)->name);
+	free(*inode);
+	*inode = NULL;
+}
+
+gitmod_inode_table *gitmod_inode_table_create(gitmod_content_store *store)
+{
+	gitmod_inode_table *table = calloc(1, sizeof(gitmod_inode_table));
+	if (!table)
+		return NULL;
+	table->store = store;
+	table->lock = gitmod_locker_create();
+	gitmod_locker_set_class(table->lock, GITMOD_LOCK_INODES);
+	// keys are inside of the inodes, which are released by the table
+	table->inodes = g_hash_table_new(g_int64_hash, g_int64_equal);
+	table->identities = g_hash_table_new(identity_hash, identity_equal);
+	table->root = calloc(1, sizeof(gitmod_inode));
+	if (!(table->lock && table->inodes && table->identities && table->root)) {
+		gitmod_log(LOG_ERR, "Could not set up inode table");
+		free(table->root);
+		table->root = NULL;
+		gitmod_inode_table_dispose(&table);
+		return NULL;
+	}
+	table->root->ino = GITMOD_ROOT_INODE;
+	table->root->path = strdup("/");
+	table->root->name = strdup("/");
+	table->root->type = GITMOD_OBJECT_TREE;
+	table->root->mode = 0555;
+	table->root->nlookup = 1;	// it's never forgotten
+	g_hash_table_insert(table->inodes, &table->root->ino, table->root);
+	return table;
+}
+
+void gitmod_inode_table_set_root(gitmod_inode_table *table, gitmod_root_tree *root_tree)
+{
+	if (!(table && root_tree))
+		return;
+	gitmod_lock(table->lock);
+	git_oid_cpy(&table->root->oid, git_tree_id(root_tree->tree));
+	gitmod_unlock(table->lock);
+	__atomic_store_n(&table->root->num_entries, (int)git_tree_entrycount(root_tree->tree), __ATOMIC_RELAXED);
+	__atomic_store_n(&table->time, root_tree->time, __ATOMIC_RELAXED);
+}
+
+/**
+ * Call invalidate for the entries of tree that are not in other (or that are different)
+ */
+static void gitmod_inode_invalidate_entries(git_tree *tree, git_tree *other, gitmod_invalidate_func invalidate,
+					    void *payload, int report_changes)
+{
+	size_t num_entries = git_tree_entrycount(tree);
+	const git_tree_entry *entry, *other_entry;
+	for (size_t i = 0; i < num_entries; i++) {
+		entry = git_tree_entry_byindex(tree, i);
+		other_entry = git_tree_entry_byname(other, git_tree_entry_name(entry));
+		if (!other_entry)
+			invalidate(payload, GITMOD_ROOT_INODE, git_tree_entry_name(entry));
+		else if (report_changes && (git_oid_cmp(git_tree_entry_id(entry), git_tree_entry_id(other_entry))
+					    || git_tree_entry_filemode(entry) != git_tree_entry_filemode(other_entry)))
+			invalidate(payload, GITMOD_ROOT_INODE, git_tree_entry_name(entry));
+	}
+}
+
+void gitmod_inode_table_invalidate(gitmod_root_tree *previous, gitmod_root_tree *root_tree,
+				   gitmod_invalidate_func invalidate, void *payload)
+{
+	if (!(previous && root_tree && invalidate))
+		return;
+	// removed and changed entries
+	gitmod_inode_invalidate_entries(previous->tree, root_tree->tree, invalidate, payload, 1);
+	// added entries
+	gitmod_inode_invalidate_entries(root_tree->tree, previous->tree, invalidate, payload, 0);
+	// its attributes (and its content) changed
+	invalidate(payload, GITMOD_ROOT_INODE, NULL);
+}
+
+gitmod_inode *gitmod_inode_table_get(gitmod_inode_table *table, uint64_t ino)
+{
+	if (!table)
+		return NULL;
+	gitmod_lock(table->lock);
+	gitmod_inode *inode = g_hash_table_lookup(table->inodes, &ino);
+	gitmod_unlock(table->lock);
+	return inode;
+}
+
+static char *gitmod_inode_child_path(gitmod_inode *dir, const char *name)
+{
+	int is_root = !strcmp(dir->path, "/");
+	char *path = calloc(1, strlen(dir->path) + (is_root ? 0 : 1) + strlen(name) + 1);
+	if (!path)
+		return NULL;
+	strcpy(path, dir->path);
+	if (!is_root)
+		strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+/**
+ * Get the tree of a directory. For the root inode, the current root tree is acquired
+ * and has to be dropped by the caller
+ */
+static git_tree *gitmod_inode_get_tree(gitmod_info *info, gitmod_inode *dir, gitmod_root_tree **root_tree)
+{
+	*root_tree = NULL;
+	if (dir->ino == GITMOD_ROOT_INODE) {
+		*root_tree = gitmod_root_tree_acquire(info);
+		return *root_tree ? (*root_tree)->tree : NULL;
+	}
+	return dir->content ? (git_tree *) dir->content->object : NULL;
+}
+
+static int gitmod_inode_read_size(git_odb *odb, gitmod_inode *inode)
+{
+	git_otype otype;
+	size_t size;
+	int ret = git_odb_read_header(&size, &otype, odb, &inode->oid);
+	if (ret)
+		gitmod_log(LOG_ERR, "Could not read header of object %s", git_oid_tostr_s(&inode->oid));
+	else
+		inode->size = size;
+	return ret;
+}
+
+/**
+ * Set up a new inode for a tree entry. It's not in the table yet
+ */
+static gitmod_inode *gitmod_inode_create(gitmod_info *info, git_odb *odb, gitmod_inode *probe,
+					 const git_tree_entry *entry)
+{
+	gitmod_inode *inode = calloc(1, sizeof(gitmod_inode));
+	if (!inode)
+		return NULL;
+	*inode = *probe;
+	inode->path = strdup(probe->path);
+	inode->name = strdup(git_tree_entry_name(entry));
+	int ret = 0;
+	if (inode->type == GITMOD_OBJECT_BLOB)
+		ret = gitmod_inode_read_size(odb, inode);
+	else {
+		inode->content =
+		    gitmod_content_store_get(info->content_store, gitmod_get_repo(info), &inode->oid, GIT_OBJ_TREE);
+		if (inode->content)
+			inode->num_entries = git_tree_entrycount((git_tree *) inode->content->object);
+		else
+			ret = -ENOENT;
+	}
+	if (ret || !(inode->path && inode->name)) {
+		if (inode->content)
+			gitmod_content_store_release(info->content_store, &inode->content, 0);
+		free(inode->path);
+		free(inode->name);
+		free(inode);
+		return NULL;
+	}
+	return inode;
+}
+
+/**
+ * Fill in the identity of the object of a tree entry. Will return non-zero if the entry is not a blob or a tree
+ */
+static int gitmod_inode_probe(gitmod_inode *probe, gitmod_inode *dir, const git_tree_entry *entry)
+{
+	memset(probe, 0, sizeof(gitmod_inode));
+	switch (git_tree_entry_type(entry)) {
+	case GIT_OBJ_BLOB:
+		probe->type = GITMOD_OBJECT_BLOB;
+		break;
+	case GIT_OBJ_TREE:
+		probe->type = GITMOD_OBJECT_TREE;
+		break;
+	default:
+		return -ENOENT;
+	}
+	probe->path = gitmod_inode_child_path(dir, git_tree_entry_name(entry));
+	if (!probe->path)
+		return -ENOMEM;
+	git_oid_cpy(&probe->oid, git_tree_entry_id(entry));
+	probe->mode = git_tree_entry_filemode(entry) & 0555;	// RO always
+	probe->identity = gitmod_inode_identity(probe->path, &probe->oid, probe->mode);
+	return 0;
+}
+
+/**
+ * Get the inode of an entry of dir (setting it up if the kernel does not know about it) and increase its
+ * lookup count
+ */
+static gitmod_inode *gitmod_inode_table_lookup_entry(gitmod_info *info, git_odb *odb, gitmod_inode *dir,
+						     const git_tree_entry *entry)
+{
+	gitmod_inode_table *table = info->inodes;
+	gitmod_inode *inode = NULL;
+	gitmod_inode probe;
+	probe.path = NULL;
+	if (gitmod_inode_probe(&probe, dir, entry))
+		goto end;
+
+	gitmod_lock(table->lock);
+	inode = g_hash_table_lookup(table->identities, &probe);
+	if (inode)
+		inode->nlookup++;
+	gitmod_unlock(table->lock);
+	if (inode)
+		goto end;
+
+	// not holding the lock while the metadata is read from the repo
+	gitmod_inode *new_inode = gitmod_inode_create(info, odb, &probe, entry);
+	if (!new_inode)
+		goto end;
+	gitmod_lock(table->lock);
+	inode = g_hash_table_lookup(table->identities, &probe);
+	if (!inode) {
+		inode = new_inode;
+		new_inode = NULL;
+		inode->ino = gitmod_inode_number(inode->identity);
+		// another object could have gotten the same number
+		while (g_hash_table_contains(table->inodes, &inode->ino) || inode->ino <= GITMOD_RESERVED_INODES)
+			inode->ino++;
+		g_hash_table_insert(table->inodes, &inode->ino, inode);
+		g_hash_table_add(table->identities, inode);
+	}
+	inode->nlookup++;
+	gitmod_unlock(table->lock);
+	if (new_inode)
+		// another thread set it up in the meantime
+		gitmod_inode_dispose(table, &new_inode);
+ end:
+	free(probe.path);
+	return inode;
+}
+
+gitmod_inode *gitmod_inode_table_lookup(gitmod_info *info, uint64_t parent, const char *name)
+{
+	gitmod_inode *dir = gitmod_inode_table_get(info ? info->inodes : NULL, parent);
+	if (!(dir && dir->type == GITMOD_OBJECT_TREE))
+		return NULL;
+	gitmod_root_tree *root_tree;
+	gitmod_inode *inode = NULL;
+	git_odb *odb = NULL;
+	git_tree *tree = gitmod_inode_get_tree(info, dir, &root_tree);
+	if (!tree)
+		goto end;
+	// names that are not there are remembered by the kernel as negative entries
+	const git_tree_entry *entry = git_tree_entry_byname(tree, name);
+	if (!entry)
+		goto end;
+	if (git_repository_odb(&odb, gitmod_get_repo(info))) {
+		gitmod_log(LOG_ERR, "Could not get the object database of the repo");
+		goto end;
+	}
+	inode = gitmod_inode_table_lookup_entry(info, odb, dir, entry);
+	git_odb_free(odb);
+ end:
+	gitmod_root_tree_unref(&root_tree);
+	return inode;
+}
+
+void gitmod_inode_table_forget(gitmod_inode_table *table, uint64_t ino, uint64_t nlookup)
+{
+	if (!table || ino == GITMOD_ROOT_INODE)
+		return;
+	gitmod_lock(table->lock);
+	gitmod_inode *inode = g_hash_table_lookup(table->inodes, &ino);
+	if (inode) {
+		inode->nlookup -= nlookup < inode->nlookup ? nlookup : inode->nlookup;
+		if (inode->nlookup) {
+			inode = NULL;
+		} else {
+			g_hash_table_remove(table->identities, inode);
+			g_hash_table_remove(table->inodes, &inode->ino);
+		}
+	}
+	gitmod_unlock(table->lock);
+	if (inode)
+		gitmod_inode_dispose(table, &inode);
+}
+
+gitmod_inode_dir *gitmod_inode_table_opendir(gitmod_info *info, gitmod_inode *dir)
+{
+	if (!(info && dir))
+		return NULL;
+	gitmod_inode_dir *handle = calloc(1, sizeof(gitmod_inode_dir));
+	if (!handle)
+		return NULL;
+	handle->dir = dir;
+	// read before the root tree is acquired so it can only be older than the tree
+	handle->root_tree_changes = gitmod_get_root_tree_changes(info);
+	if (dir->ino == GITMOD_ROOT_INODE) {
+		handle->root_tree = gitmod_root_tree_acquire(info);
+		if (handle->root_tree)
+			handle->tree = handle->root_tree->tree;
+	} else if (dir->content) {
+		gitmod_content_store_ref(info->content_store, dir->content);
+		handle->content = dir->content;
+		handle->tree = (git_tree *) handle->content->object;
+	}
+	if (!handle->tree || git_repository_odb(&handle->odb, gitmod_get_repo(info))) {
+		gitmod_log(LOG_ERR, "Could not open directory %s", dir->path);
+		gitmod_inode_table_closedir(info, &handle);
+		return NULL;
+	}
+	return handle;
+}
+
+int gitmod_inode_table_readdir(gitmod_inode_dir *handle, int64_t offset, gitmod_inode_dir_filler filler,
+			       void *payload)
+{
+	if (!handle)
+		return -EBADF;
+	size_t num_entries = git_tree_entrycount(handle->tree);
+	const git_tree_entry *entry;
+	gitmod_inode probe;
+	for (size_t i = offset > 0 ? offset : 0; i < num_entries; i++) {
+		entry = git_tree_entry_byindex(handle->tree, i);
+		if (gitmod_inode_probe(&probe, handle->dir, entry)) {
+			free(probe.path);
+			continue;
+		}
+		// the number the inode gets when it's looked up (unless there's a collision)
+		int ret = filler(payload, git_tree_entry_name(entry), gitmod_inode_number(probe.identity), probe.type,
+				 i + 1);
+		free(probe.path);
+		if (ret)
+			break;
+	}
+	return 0;
+}
+
+int gitmod_inode_table_readdirplus(gitmod_info *info, gitmod_inode_dir *handle, int64_t offset,
+				   gitmod_inode_dir_plus_filler filler, void *payload)
+{
+	if (!handle)
+		return -EBADF;
+	size_t num_entries = git_tree_entrycount(handle->tree);
+	gitmod_inode *inode;
+	for (size_t i = offset > 0 ? offset : 0; i < num_entries; i++) {
+		inode = gitmod_inode_table_lookup_entry(info, handle->odb, handle->dir,
+							git_tree_entry_byindex(handle->tree, i));
+		if (!inode)
+			continue;
+		if (filler(payload, inode->name, inode, i + 1)) {
+			// it did not make it to the kernel
+			gitmod_inode_table_forget(info->inodes, inode->ino, 1);
+			break;
+		}
+	}
+	return 0;
+}
+
+void gitmod_inode_table_closedir(gitmod_info *info, gitmod_inode_dir **handle)
+{
+	if (!(handle && *handle))
+		return;
+	if ((*handle)->odb)
+		git_odb_free((*handle)->odb);
+	gitmod_root_tree_unref(&(*handle)->root_tree);
+	if ((*handle)->content)
+		gitmod_content_store_release(info->content_store, &(*handle)->content, 0);
+	free(*handle);
+	*handle = NULL;
+}
+
+gitmod_object *gitmod_inode_get_object(gitmod_info *info, gitmod_inode *inode)
+{
+	if (!(info && inode && inode->type == GITMOD_OBJECT_BLOB))
+		return NULL;
+	gitmod_object *object = NULL;
+	gitmod_root_tree *root_tree = gitmod_root_tree_acquire(info);
+	if (root_tree && root_tree->objects_cache) {
+		object = gitmod_root_tree_get_object(info, root_tree, inode->path);
+		if (object && git_oid_cmp(&object->oid, &inode->oid))
+			// the root tree moved, this path has different content now
+			gitmod_dispose_object(&object);
+	}
+	gitmod_root_tree_unref(&root_tree);
+	if (object)
+		return object;
+
+	// an object of its own. The blob is shared through the content store
+	object = gitmod_object_create();
+	if (!object)
+		return NULL;
+	object->type = GITMOD_OBJECT_BLOB;
+	git_oid_cpy(&object->oid, &inode->oid);
+	object->size = inode->size;
+	object->mode = inode->mode;
+	object->repo = info->repo;
+	object->repos = __atomic_load_n(&info->repos, __ATOMIC_ACQUIRE);
+	object->store = info->content_store;
+	object->name = strdup(inode->name);
+	object->path = strdup(inode->path);
+	return object;
+}
+
+enum gitmod_object_type gitmod_inode_get_type(gitmod_inode *inode)
+{
+	return inode ? inode->type : GITMOD_OBJECT_UNKNOWN;
+}
+
+int gitmod_inode_get_mode(gitmod_inode *inode)
+{
+	return inode ? inode->mode : 0;
+}
+
+int64_t gitmod_inode_get_size(gitmod_inode *inode)
+{
+	if (!inode)
+		return -ENOENT;
+	return inode->type == GITMOD_OBJECT_BLOB ? inode->size : gitmod_inode_get_num_entries(inode);
+}
+
+int gitmod_inode_get_num_entries(gitmod_inode *inode)
+{
+	if (!inode)
+		return -ENOENT;
+	return inode->type == GITMOD_OBJECT_BLOB ? 1 : __atomic_load_n(&inode->num_entries, __ATOMIC_RELAXED);
+}
+
+time_t gitmod_inode_table_get_time(gitmod_inode_table *table)
+{
+	return table ? __atomic_load_n(&table->time, __ATOMIC_RELAXED) : 0;
+}
+
+int gitmod_inode_table_size(gitmod_inode_table *table)
+{
+	if (!table)
+		return 0;
+	gitmod_lock(table->lock);
+	int size = g_hash_table_size(table->inodes);
+	gitmod_unlock(table->lock);
+	return size;
+}
+
+void gitmod_inode_table_dispose(gitmod_inode_table **table)
+{
+	if (!(table && *table))
+		return;
+	if ((*table)->inodes) {
+		// the keys are inside of the inodes (the root inode included)
+		GList *inodes = g_hash_table_get_values((*table)->inodes);
+		g_hash_table_destroy((*table)->inodes);
+		for (GList *item = inodes; item; item = item->next) {
+			gitmod_inode *inode = item->data;
+			gitmod_inode_dispose(*table, &inode);
+		}
+		g_list_free(inodes);
+	}
+	if ((*table)->identities)
+		g_hash_table_destroy((*table)->identities);
+	if ((*table)->lock)
+		gitmod_locker_dispose(&(*table)->lock);
+	free(*table);
+	*table = NULL;
+}
@@ -1,10 +1,125 @@
 /**
  * Copyright 2020 Edmundo Carmona Antoranz
  * Released under the terms of GPLv3
+ *
+ * When building with GITMOD_LOCK_STATS, acquisitions, waits and hold times are recorded by class of locker
+ * into slots of the threads that take them (same as gitmod_stats). Otherwise lockers are plain mutexes (and rwlocks).
+ * Hold times of rwlockers are only recorded for writers: readers share it.
  */
 
+#include <errno.h>
 #include "gitmod.h"
 
+static const char *gitmod_lock_class_names[GITMOD_LOCK_CLASSES] = {
+	"other", "info", "root_tree", "cache", "object", "content", "inodes", "blob_cache", "stream", "cache_shard",
+	"cache_wait", "log", "epoch"
+};
+
+#ifdef GITMOD_LOCK_STATS
+static const double gitmod_lock_quantiles[] = { 0.5, 0.99, 0.999 };
+
+static gitmod_lock_stats_slot *gitmod_lock_slots;	// (atomic) slots are added at the head and never removed
+static pthread_key_t gitmod_lock_key;	// slot of each thread
+static pthread_once_t gitmod_lock_key_once = PTHREAD_ONCE_INIT;
+
+static void gitmod_lock_slot_release(void *slot)
+{
+	__atomic_store_n(&((gitmod_lock_stats_slot *) slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void gitmod_lock_create_key()
+{
+	pthread_key_create(&gitmod_lock_key, gitmod_lock_slot_release);
+}
+
+static gitmod_lock_stats_slot *gitmod_lock_get_slot()
+{
+	pthread_once(&gitmod_lock_key_once, gitmod_lock_create_key);
+	gitmod_lock_stats_slot *slot = pthread_getspecific(gitmod_lock_key);
+	if (slot)
+		return slot;
+	int expected;
+	for (slot = __atomic_load_n(&gitmod_lock_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&slot->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!slot) {
+		slot = calloc(1, sizeof(gitmod_lock_stats_slot));
+		if (!slot)
+			return NULL;
+		slot->in_use = 1;
+		slot->next = __atomic_load_n(&gitmod_lock_slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&gitmod_lock_slots, &slot->next, slot, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) ;
+	}
+	pthread_setspecific(gitmod_lock_key, slot);
+	return slot;
+}
+
+/**
+ * Only the owner of the slot writes into it
+ */
+static void gitmod_lock_slot_add(uint64_t *value, uint64_t delta)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static void gitmod_lock_record_acquisition(int lock_class, int contended, uint64_t wait)
+{
+	gitmod_lock_stats_slot *slot = gitmod_lock_get_slot();
+	if (!slot)
+		return;
+	gitmod_lock_slot_add(&slot->acquisitions[lock_class], 1);
+	if (!contended)
+		return;
+	gitmod_lock_slot_add(&slot->contended[lock_class], 1);
+	gitmod_lock_slot_add(&slot->waits[lock_class][gitmod_stats_bucket(wait)], 1);
+	gitmod_lock_slot_add(&slot->wait_sums[lock_class], wait);
+}
+
+/**
+ * Record an acquisition of a lock that was tried first. Returns the time it was acquired at
+ */
+static uint64_t gitmod_lock_acquired(int lock_class, const void *lock, uint64_t start, int contended)
+{
+	uint64_t now = contended ? gitmod_stats_now() : start;
+	gitmod_lock_record_acquisition(lock_class, contended, now - start);
+	if (contended && gitmod_trace_is_enabled())
+		gitmod_trace_write(GITMOD_TRACE_LOCK_WAIT, lock_class, start, (uintptr_t) lock);
+	return now;
+}
+
+static void gitmod_lock_record_hold(int lock_class, uint64_t hold)
+{
+	gitmod_lock_stats_slot *slot = gitmod_lock_get_slot();
+	if (slot && hold > __atomic_load_n(&slot->max_hold[lock_class], __ATOMIC_RELAXED))
+		__atomic_store_n(&slot->max_hold[lock_class], hold, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add up what all threads recorded for a class. waits gets the histogram of contended acquisitions
+ */
+static void gitmod_lock_merge(int lock_class, gitmod_lock_stats *stats, uint64_t *waits)
+{
+	memset(stats, 0, sizeof(gitmod_lock_stats));
+	memset(waits, 0, GITMOD_STATS_BUCKETS * sizeof(uint64_t));
+	uint64_t max_hold;
+	for (gitmod_lock_stats_slot *slot = __atomic_load_n(&gitmod_lock_slots, __ATOMIC_ACQUIRE); slot;
+	     slot = slot->next) {
+		stats->acquisitions += __atomic_load_n(&slot->acquisitions[lock_class], __ATOMIC_RELAXED);
+		stats->contended += __atomic_load_n(&slot->contended[lock_class], __ATOMIC_RELAXED);
+		stats->wait += __atomic_load_n(&slot->wait_sums[lock_class], __ATOMIC_RELAXED);
+		max_hold = __atomic_load_n(&slot->max_hold[lock_class], __ATOMIC_RELAXED);
+		if (max_hold > stats->max_hold)
+			stats->max_hold = max_hold;
+		for (int i = 0; i < GITMOD_STATS_BUCKETS; i++)
+			waits[i] += __atomic_load_n(&slot->waits[lock_class][i], __ATOMIC_RELAXED);
+	}
+	stats->wait_p99 = gitmod_stats_quantile(waits, stats->contended, 0.99);
+}
+#endif
+
 gitmod_locker *gitmod_locker_create()
 {
 	gitmod_locker *locker = calloc(1, sizeof(gitmod_locker));
@@ -13,16 +128,86 @@ gitmod_locker *gitmod_locker_create()
 	return locker;
 }
 
+void gitmod_locker_init(gitmod_locker *locker)
+{
+	pthread_mutex_init(&locker->lock, NULL);
+#ifdef GITMOD_LOCK_STATS
+	locker->lock_class = GITMOD_LOCK_OTHER;
+#endif
+}
+
+void gitmod_locker_set_class(gitmod_locker *locker, enum gitmod_lock_class lock_class)
+{
+#ifdef GITMOD_LOCK_STATS
+	if (locker && lock_class < GITMOD_LOCK_CLASSES)
+		locker->lock_class = lock_class;
+#else
+	(void)locker;
+	(void)lock_class;
+#endif
+}
+
+void gitmod_locker_destroy(gitmod_locker *locker)
+{
+	pthread_mutex_destroy(&locker->lock);
+}
+
 void gitmod_lock(gitmod_locker *locker)
 {
-	if (locker)
+	if (!locker)
+		return;
+#ifdef GITMOD_LOCK_STATS
+	uint64_t start = gitmod_stats_now();
+	int contended = pthread_mutex_trylock(&locker->lock) != 0;
+	if (contended)
 		pthread_mutex_lock(&locker->lock);
+	locker->acquired_at = gitmod_lock_acquired(locker->lock_class, locker, start, contended);
+#else
+	uint64_t start = gitmod_trace_begin();
+	if (!start) {
+		pthread_mutex_lock(&locker->lock);
+		return;
+	}
+	// only waits are traced
+	if (!pthread_mutex_trylock(&locker->lock))
+		return;
+	pthread_mutex_lock(&locker->lock);
+	gitmod_trace_end(GITMOD_TRACE_LOCK_WAIT, GITMOD_LOCK_OTHER, start, (uintptr_t) locker);
+#endif
 }
 
 void gitmod_unlock(gitmod_locker *locker)
 {
-	if (locker)
-		pthread_mutex_unlock(&locker->lock);
+	if (!locker)
+		return;
+#ifdef GITMOD_LOCK_STATS
+	gitmod_lock_record_hold(locker->lock_class, gitmod_stats_now() - locker->acquired_at);
+#endif
+	pthread_mutex_unlock(&locker->lock);
+}
+
+void gitmod_locker_wait(gitmod_locker *locker, pthread_cond_t *cond)
+{
+#ifdef GITMOD_LOCK_STATS
+	// time spent waiting is not counted as holding it
+	gitmod_lock_record_hold(locker->lock_class, gitmod_stats_now() - locker->acquired_at);
+	pthread_cond_wait(cond, &locker->lock);
+	locker->acquired_at = gitmod_stats_now();
+#else
+	pthread_cond_wait(cond, &locker->lock);
+#endif
+}
+
+int gitmod_locker_timedwait(gitmod_locker *locker, pthread_cond_t *cond, const struct timespec *until)
+{
+#ifdef GITMOD_LOCK_STATS
+	gitmod_lock_record_hold(locker->lock_class, gitmod_stats_now() - locker->acquired_at);
+	int ret = pthread_cond_timedwait(cond, &locker->lock, until);
+	locker->acquired_at = gitmod_stats_now();
+	return ret;
+#else
+	return pthread_cond_timedwait(cond, &locker->lock, until);
+#endif
 }
 
 void gitmod_locker_dispose(gitmod_locker **locker)
@@ -33,3 +218,158 @@ void gitmod_locker_dispose(gitmod_locker **locker)
 	free(*locker);
 	*locker = NULL;
 }
+
+void gitmod_rwlocker_init(gitmod_rwlocker *locker)
+{
+	pthread_rwlock_init(&locker->lock, NULL);
+#ifdef GITMOD_LOCK_STATS
+	locker->lock_class = GITMOD_LOCK_OTHER;
+#endif
+}
+
+void gitmod_rwlocker_set_class(gitmod_rwlocker *locker, enum gitmod_lock_class lock_class)
+{
+#ifdef GITMOD_LOCK_STATS
+	if (locker && lock_class < GITMOD_LOCK_CLASSES)
+		locker->lock_class = lock_class;
+#else
+	(void)locker;
+	(void)lock_class;
+#endif
+}
+
+void gitmod_rwlocker_destroy(gitmod_rwlocker *locker)
+{
+	pthread_rwlock_destroy(&locker->lock);
+}
+
+void gitmod_read_lock(gitmod_rwlocker *locker)
+{
+#ifdef GITMOD_LOCK_STATS
+	uint64_t start = gitmod_stats_now();
+	int contended = pthread_rwlock_tryrdlock(&locker->lock) != 0;
+	if (contended)
+		pthread_rwlock_rdlock(&locker->lock);
+	gitmod_lock_acquired(locker->lock_class, locker, start, contended);
+#else
+	uint64_t start = gitmod_trace_begin();
+	if (!start) {
+		pthread_rwlock_rdlock(&locker->lock);
+		return;
+	}
+	if (!pthread_rwlock_tryrdlock(&locker->lock))
+		return;
+	pthread_rwlock_rdlock(&locker->lock);
+	gitmod_trace_end(GITMOD_TRACE_LOCK_WAIT, GITMOD_LOCK_OTHER, start, (uintptr_t) locker);
+#endif
+}
+
+void gitmod_read_unlock(gitmod_rwlocker *locker)
+{
+	pthread_rwlock_unlock(&locker->lock);
+}
+
+void gitmod_write_lock(gitmod_rwlocker *locker)
+{
+#ifdef GITMOD_LOCK_STATS
+	uint64_t start = gitmod_stats_now();
+	int contended = pthread_rwlock_trywrlock(&locker->lock) != 0;
+	if (contended)
+		pthread_rwlock_wrlock(&locker->lock);
+	locker->acquired_at = gitmod_lock_acquired(locker->lock_class, locker, start, contended);
+#else
+	uint64_t start = gitmod_trace_begin();
+	if (!start) {
+		pthread_rwlock_wrlock(&locker->lock);
+		return;
+	}
+	if (!pthread_rwlock_trywrlock(&locker->lock))
+		return;
+	pthread_rwlock_wrlock(&locker->lock);
+	gitmod_trace_end(GITMOD_TRACE_LOCK_WAIT, GITMOD_LOCK_OTHER, start, (uintptr_t) locker);
+#endif
+}
+
+void gitmod_write_unlock(gitmod_rwlocker *locker)
+{
+#ifdef GITMOD_LOCK_STATS
+	gitmod_lock_record_hold(locker->lock_class, gitmod_stats_now() - locker->acquired_at);
+#endif
+	pthread_rwlock_unlock(&locker->lock);
+}
+
+uint64_t gitmod_lock_wait_begin()
+{
+#ifdef GITMOD_LOCK_STATS
+	return gitmod_stats_now();
+#else
+	return 0;
+#endif
+}
+
+void gitmod_lock_wait_end(enum gitmod_lock_class lock_class, uint64_t start, int waited)
+{
+#ifdef GITMOD_LOCK_STATS
+	if (lock_class < GITMOD_LOCK_CLASSES)
+		gitmod_lock_acquired(lock_class, NULL, start, waited);
+#else
+	(void)lock_class;
+	(void)start;
+	(void)waited;
+#endif
+}
+
+const char *gitmod_lock_class_name(enum gitmod_lock_class lock_class)
+{
+	return lock_class < GITMOD_LOCK_CLASSES ? gitmod_lock_class_names[lock_class] : "unknown";
+}
+
+int gitmod_lock_get_stats(enum gitmod_lock_class lock_class, gitmod_lock_stats *stats)
+{
+	memset(stats, 0, sizeof(gitmod_lock_stats));
+#ifdef GITMOD_LOCK_STATS
+	if (lock_class >= GITMOD_LOCK_CLASSES)
+		return -EINVAL;
+	uint64_t waits[GITMOD_STATS_BUCKETS];
+	gitmod_lock_merge(lock_class, stats, waits);
+	return 0;
+#else
+	(void)lock_class;
+	return -ENOTSUP;
+#endif
+}
+
+void gitmod_lock_stats_write(GString *out)
+{
+#ifdef GITMOD_LOCK_STATS
+	gitmod_lock_stats stats[GITMOD_LOCK_CLASSES];
+	uint64_t waits[GITMOD_LOCK_CLASSES][GITMOD_STATS_BUCKETS];
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		gitmod_lock_merge(i, &stats[i], waits[i]);
+	g_string_append(out, "# TYPE gitmod_lock_acquisitions_total counter\n");
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		g_string_append_printf(out, "gitmod_lock_acquisitions_total{lock=\"%s\"} %lu\n",
+				       gitmod_lock_class_names[i], (unsigned long)stats[i].acquisitions);
+	g_string_append(out, "# TYPE gitmod_lock_contended_total counter\n");
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		g_string_append_printf(out, "gitmod_lock_contended_total{lock=\"%s\"} %lu\n",
+				       gitmod_lock_class_names[i], (unsigned long)stats[i].contended);
+	g_string_append(out, "# TYPE gitmod_lock_wait_ns histogram\n");
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		gitmod_stats_write_histogram(out, "gitmod_lock_wait_ns", "lock", gitmod_lock_class_names[i], waits[i],
+					     stats[i].contended, stats[i].wait);
+	g_string_append(out, "# TYPE gitmod_lock_wait_quantile_ns gauge\n");
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		for (size_t q = 0; q < sizeof(gitmod_lock_quantiles) / sizeof(double); q++)
+			g_string_append_printf(out, "gitmod_lock_wait_quantile_ns{lock=\"%s\",quantile=\"%g\"} %lu\n",
+					       gitmod_lock_class_names[i], gitmod_lock_quantiles[q],
+					       (unsigned long)gitmod_stats_quantile(waits[i], stats[i].contended,
+										    gitmod_lock_quantiles[q]));
+	g_string_append(out, "# TYPE gitmod_lock_max_hold_ns gauge\n");
+	for (int i = 0; i < GITMOD_LOCK_CLASSES; i++)
+		g_string_append_printf(out, "gitmod_lock_max_hold_ns{lock=\"%s\"} %lu\n", gitmod_lock_class_names[i],
+				       (unsigned long)stats[i].max_hold);
+#else
+	(void)out;
+#endif
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Threads don't call syslog: each one formats its messages into a ring of its own and the logging thread
+ * writes them into syslog. When a ring is full, messages are dropped (and counted) instead of waiting.
+ * Sites that had messages suppressed by the rate limit are listed so that the logging thread can report
+ * how many were suppressed (once per second at most).
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include "gitmod.h"
+
+#define GITMOD_LOG_INTERVAL_MS 100	// the logging thread writes messages this often
+
+static gitmod_log_ring *gitmod_log_rings;	// (atomic) rings are added at the head and never removed
+static gitmod_log_site *gitmod_log_sites;	// (atomic) sites that had messages suppressed
+static pthread_key_t gitmod_log_key;	// ring of each thread
+static pthread_once_t gitmod_log_key_once = PTHREAD_ONCE_INIT;
+static unsigned int gitmod_log_rate_limit = GITMOD_LOG_DEFAULT_RATE_LIMIT;	// (atomic)
+static int gitmod_log_running;	// (atomic)
+static pthread_t gitmod_log_thread;
+// held while starting/stopping and to wait
+static gitmod_locker gitmod_log_lock = GITMOD_LOCKER_INITIALIZER(GITMOD_LOCK_LOG);
+static pthread_cond_t gitmod_log_wake = PTHREAD_COND_INITIALIZER;
+// rings are drained by one thread at a time
+static gitmod_locker gitmod_log_drain_lock = GITMOD_LOCKER_INITIALIZER(GITMOD_LOCK_LOG);
+
+static void gitmod_log_ring_release(void *ring)
+{
+	// the thread is gone, messages that are left will be written anyway
+	__atomic_store_n(&((gitmod_log_ring *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void gitmod_log_create_key()
+{
+	pthread_key_create(&gitmod_log_key, gitmod_log_ring_release);
+}
+
+static gitmod_log_ring *gitmod_log_get_ring()
+{
+	gitmod_log_ring *ring = pthread_getspecific(gitmod_log_key);
+	if (ring)
+		return ring;
+	int expected;
+	for (ring = __atomic_load_n(&gitmod_log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!ring) {
+		ring = calloc(1, sizeof(gitmod_log_ring));
+		if (!ring)
+			return NULL;
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&gitmod_log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&gitmod_log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) ;
+	}
+	pthread_setspecific(gitmod_log_key, ring);
+	return ring;
+}
+
+static long gitmod_log_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/**
+ * Will return 0 if the message goes over the rate limit of its site
+ */
+static int gitmod_log_admit(gitmod_log_site *site)
+{
+	unsigned int limit = __atomic_load_n(&gitmod_log_rate_limit, __ATOMIC_RELAXED);
+	if (!limit)
+		return 1;
+	long now = gitmod_log_now();
+	long window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if (window != now
+	    && __atomic_compare_exchange_n(&site->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < limit)
+		return 1;
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	int listed = 0;
+	if (__atomic_compare_exchange_n(&site->listed, &listed, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// the logging thread will report what was suppressed
+		site->next = __atomic_load_n(&gitmod_log_sites, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&gitmod_log_sites, &site->next, site, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) ;
+	}
+	return 0;
+}
+
+void gitmod_log_write(gitmod_log_site *site, int level, const char *format, ...)
+{
+	if (!gitmod_log_admit(site))
+		return;
+	va_list args;
+	va_start(args, format);
+	gitmod_log_ring *ring = NULL;
+	if (__atomic_load_n(&gitmod_log_running, __ATOMIC_ACQUIRE))
+		ring = gitmod_log_get_ring();
+	if (!ring) {
+		vsyslog(level, format, args);
+		va_end(args);
+		return;
+	}
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= GITMOD_LOG_RING_SIZE) {
+		// only this thread writes into it
+		__atomic_store_n(&ring->dropped, __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) + 1,
+				 __ATOMIC_RELAXED);
+		va_end(args);
+		return;
+	}
+	gitmod_log_entry *entry = &ring->entries[head & (GITMOD_LOG_RING_SIZE - 1)];
+	entry->level = level;
+	vsnprintf(entry->message, GITMOD_LOG_MESSAGE_SIZE, format, args);
+	va_end(args);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void gitmod_log_set_rate_limit(unsigned int per_second)
+{
+	__atomic_store_n(&gitmod_log_rate_limit, per_second, __ATOMIC_RELAXED);
+}
+
+static void gitmod_log_drain()
+{
+	gitmod_lock(&gitmod_log_drain_lock);
+	for (gitmod_log_ring *ring = __atomic_load_n(&gitmod_log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		unsigned int tail = ring->tail;
+		unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			gitmod_log_entry *entry = &ring->entries[tail & (GITMOD_LOG_RING_SIZE - 1)];
+			syslog(entry->level, "%s", entry->message);
+			// the entry can be written again
+			__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+		unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			syslog(LOG_WARNING, "%lu log messages were dropped (buffer full)", dropped - ring->reported);
+			ring->reported = dropped;
+		}
+	}
+	long now = gitmod_log_now();
+	for (gitmod_log_site *site = __atomic_load_n(&gitmod_log_sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		if (site->reported == now || !__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+			continue;
+		syslog(LOG_WARNING, "%s:%d: %lu similar log messages were suppressed", site->file, site->line,
+		       __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED));
+		site->reported = now;
+	}
+	gitmod_unlock(&gitmod_log_drain_lock);
+}
+
+static void *gitmod_log_run(void *params)
+{
+	(void)params;
+	struct timespec until;
+	gitmod_lock(&gitmod_log_lock);
+	while (__atomic_load_n(&gitmod_log_running, __ATOMIC_ACQUIRE)) {
+		gitmod_unlock(&gitmod_log_lock);
+		gitmod_log_drain();
+		gitmod_lock(&gitmod_log_lock);
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += GITMOD_LOG_INTERVAL_MS * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		if (__atomic_load_n(&gitmod_log_running, __ATOMIC_ACQUIRE))
+			gitmod_locker_timedwait(&gitmod_log_lock, &gitmod_log_wake, &until);
+	}
+	gitmod_unlock(&gitmod_log_lock);
+	return NULL;
+}
+
+int gitmod_log_start()
+{
+	pthread_once(&gitmod_log_key_once, gitmod_log_create_key);
+	int ret = 0;
+	gitmod_lock(&gitmod_log_lock);
+	if (!__atomic_load_n(&gitmod_log_running, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&gitmod_log_running, 1, __ATOMIC_RELEASE);
+		ret = pthread_create(&gitmod_log_thread, NULL, gitmod_log_run, NULL);
+		if (ret) {
+			__atomic_store_n(&gitmod_log_running, 0, __ATOMIC_RELEASE);
+			syslog(LOG_ERR, "Could not start the logging thread. Messages will be written right away");
+		}
+	}
+	gitmod_unlock(&gitmod_log_lock);
+	return ret;
+}
+
+void gitmod_log_flush()
+{
+	gitmod_log_drain();
+}
+
+void gitmod_log_stop()
+{
+	gitmod_lock(&gitmod_log_lock);
+	if (!__atomic_load_n(&gitmod_log_running, __ATOMIC_ACQUIRE)) {
+		gitmod_unlock(&gitmod_log_lock);
+		return;
+	}
+	// from now on, messages are written right away
+	__atomic_store_n(&gitmod_log_running, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&gitmod_log_wake);
+	gitmod_unlock(&gitmod_log_lock);
+	pthread_join(gitmod_log_thread, NULL);
+	gitmod_log_drain();
+}
@@ -5,9 +5,9 @@
 
 #define FUSE_USE_VERSION 35
 
-#include <assert.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <signal.h>
 #include <stdio.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -22,10 +22,50 @@ static struct options {
 	int show_help;
 	int debug;
 	int keep_in_memory;
+	long stream_threshold;	// in bytes (default: 64 MBs)
+	long kim_budget;	// in MBs (default: 0, no limit)
+	int kim_preload;	// workers that set up all paths right away (default: 0, paths are set up when accessed)
+	int kim_preload_blobs;
+	unsigned int uid;	// owner of the files (default: 0)
+	unsigned int gid;
+	const char *blob_cache;	// directory to write blobs into (default: none)
+	long blob_cache_min_size;	// in bytes (default: 64 KBs)
+	int blob_cache_opens;	// (default: 2)
+	long blob_cache_budget;	// in MBs (default: 1024)
+	int ready_fd;		// "ready" is written into it once gitmod is ready (default: -1, none)
+	int repo_handles;	// (default: number of processors)
+	int log_rate_limit;	// messages per second of each call site (default: 10)
+	const char *trace;	// file trace events are dumped into (default: none, events are not traced)
 } options;
 
+// the parent process waits on it for the mount to be ready when running in the background
+static int daemon_fd = -1;
+
+// the kernel reads straight from files of the blob cache
+static int passthrough;
+
 gitmod_info *gm_info;
 
+// seconds the kernel can keep entries. When the root tree moves, the entries that changed are invalidated
+#define GITMOD_LL_TIMEOUT 86400.0
+// seconds the kernel can keep attributes. Every inode reports the time of the root tree so they follow its moves
+#define GITMOD_LL_ATTR_TIMEOUT 1.0
+
+// readiness and progress of gitmod. It is not listed in the root directory and it's hidden by an entry of the
+// root tree with the same name
+#define GITMOD_LL_STATUS_NAME ".gitmod-status"
+#define GITMOD_LL_STATUS_SIZE 4096
+
+// latencies of the operations and counters, in Prometheus text format. Not listed either
+#define GITMOD_LL_STATS_NAME ".gitmod-stats"
+
+// trace events (same format as the file of --trace), taken when it's opened. Not listed either
+#define GITMOD_LL_TRACE_NAME ".gitmod-trace"
+
+// all three files are read from a report taken when they are opened
+#define GITMOD_LL_IS_REPORT(ino) \
+	((ino) == GITMOD_STATUS_INODE || (ino) == GITMOD_STATS_INODE || (ino) == GITMOD_TRACE_INODE)
+
 #define OPTION(t, p) \
 	{ t, offsetof(struct options, p), 1 }
 
@@ -38,150 +78,567 @@ static const struct fuse_opt option_spec[] = {
 	OPTION("--fix", fix),
 	OPTION("--debug", debug),
 	OPTION("--kim", keep_in_memory),
+	OPTION("--stream-threshold=%ld", stream_threshold),
+	OPTION("--kim-budget=%ld", kim_budget),
+	OPTION("--kim-preload=%d", kim_preload),
+	OPTION("--kim-preload-blobs", kim_preload_blobs),
+	OPTION("uid=%u", uid),
+	OPTION("gid=%u", gid),
+	OPTION("--blob-cache=%s", blob_cache),
+	OPTION("--blob-cache-min-size=%ld", blob_cache_min_size),
+	OPTION("--blob-cache-opens=%d", blob_cache_opens),
+	OPTION("--ready-fd=%d", ready_fd),
+	OPTION("--repo-handles=%d", repo_handles),
+	OPTION("--log-rate-limit=%d", log_rate_limit),
+	OPTION("--trace=%s", trace),
+	OPTION("--blob-cache-budget=%ld", blob_cache_budget),
 	OPTION("--help", show_help),
 	OPTION("-h", show_help),
 	FUSE_OPT_END
 };
 
-static void *gitmod_fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+static void gitmod_ll_init(void *userdata, struct fuse_conn_info *conn)
 {
-	(void)conn;
+	(void)userdata;
 	if (options.debug)
-		syslog(LOG_DEBUG, "Running gitmod_init(...)");
-	cfg->kernel_cache = options.fix;
-	gm_info->uid = cfg->set_uid;
-	gm_info->gid = cfg->set_gid;
-	return NULL;
+		gitmod_log(LOG_DEBUG, "Running gitmod_init(...)");
+	// entries come with their attributes on every call, not only when the kernel thinks it's worth it
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	if (!options.blob_cache)
+		return;
+	// reads of files in the blob cache are spliced from their file descriptors
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		// files of the blob cache are not on a stacked file system
+		conn->max_stack_depth = 1;
+		passthrough = 1;
+	}
+#endif
+	gitmod_log(LOG_INFO, "Files in the blob cache will be %s", passthrough ? "passed through" : "spliced");
 }
 
-static int gitmod_fs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+static void gitmod_ll_destroy(void *userdata)
 {
-	(void)fi;
-	int res = 0;
-
+	(void)userdata;
 	if (options.debug)
-		syslog(LOG_DEBUG, "Running gitmod_getattr(\"%s\", ...)", path);
+		gitmod_log(LOG_DEBUG, "Running gitmod_destroy()");
+	// what happened until the very end
+	if (options.trace && gitmod_trace_dump_file(options.trace) < 0)
+		gitmod_log(LOG_ERR, "Could not dump the trace into %s", options.trace);
+	gitmod_stop(&gm_info);
+	gitmod_shutdown();
+}
+
+static void gitmod_ll_invalidate(void *payload, uint64_t parent, const char *name)
+{
+	struct fuse_session *se = payload;
+	// the kernel might not know about it, that's fine
+	if (name)
+		fuse_lowlevel_notify_inval_entry(se, parent, name, strlen(name));
+	else
+		fuse_lowlevel_notify_inval_inode(se, parent, 0, 0);
+}
 
-	gitmod_object *object = gitmod_get_object(gm_info, path);
-	if (!object) {
-		syslog(LOG_ERR, "gitmod_getattr: Could not find an object for path %s", path);
-		return -ENOENT;
+static void gitmod_ll_ready(void *payload)
+{
+	(void)payload;
+	int fds[] = { options.ready_fd, daemon_fd };
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] < 0)
+			continue;
+		if (write(fds[i], "ready\n", 6) != 6)
+			gitmod_log(LOG_ERR, "Could not notify readiness on fd %d", fds[i]);
+		close(fds[i]);
 	}
+	options.ready_fd = daemon_fd = -1;
+}
+
+/**
+ * Inode of a report file of the root directory, 0 if it's not one. Only used when the root tree has no entry
+ * with that name
+ */
+static fuse_ino_t gitmod_ll_report_inode(const char *name)
+{
+	if (!strcmp(name, GITMOD_LL_STATUS_NAME))
+		return GITMOD_STATUS_INODE;
+	if (!strcmp(name, GITMOD_LL_STATS_NAME))
+		return GITMOD_STATS_INODE;
+	if (!strcmp(name, GITMOD_LL_TRACE_NAME))
+		return GITMOD_TRACE_INODE;
+	return 0;
+}
 
+static void gitmod_ll_fill_report_stat(fuse_ino_t ino, struct stat *stbuf)
+{
 	memset(stbuf, 0, sizeof(struct stat));
-	stbuf->st_atime = gm_info->root_tree->time;
-	stbuf->st_ctime = gm_info->root_tree->time;
-	stbuf->st_mtime = gm_info->root_tree->time;
+	stbuf->st_ino = ino;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
 	stbuf->st_uid = gm_info->uid;
 	stbuf->st_gid = gm_info->gid;
-	stbuf->st_nlink = gitmod_object_get_num_entries(object);
-	enum gitmod_object_type object_type = gitmod_object_get_type(object);
-	if (object_type == GITMOD_OBJECT_TREE) {	// this will depend on the type of object
+	// it's read with direct IO so its size doesn't need to be exact
+	stbuf->st_size = GITMOD_LL_STATUS_SIZE;
+}
+
+static void gitmod_ll_fill_stat(gitmod_inode *inode, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = inode->ino;
+	stbuf->st_atime = gitmod_inode_table_get_time(gm_info->inodes);
+	stbuf->st_ctime = stbuf->st_atime;
+	stbuf->st_mtime = stbuf->st_atime;
+	stbuf->st_uid = gm_info->uid;
+	stbuf->st_gid = gm_info->gid;
+	stbuf->st_nlink = gitmod_inode_get_num_entries(inode);
+	if (gitmod_inode_get_type(inode) == GITMOD_OBJECT_TREE) {
 		stbuf->st_mode = S_IFDIR | 0555;	// mode is always 0 for trees
 		stbuf->st_nlink += 2;
-	} else if (object_type == GITMOD_OBJECT_BLOB) {
-		stbuf->st_mode = S_IFREG | (gitmod_object_get_mode(object) & (options.allow_exec ? 0777 : 0666));
-		stbuf->st_size = gitmod_object_get_size(object);
-	} else
-		res = -ENOENT;
-	gitmod_dispose_object(&object);
-
-	return res;
+	} else {
+		stbuf->st_mode = S_IFREG | (gitmod_inode_get_mode(inode) & (options.allow_exec ? 0777 : 0666));
+		stbuf->st_size = gitmod_inode_get_size(inode);
+	}
+}
+
+static void gitmod_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	if (options.debug)
+		gitmod_log(LOG_DEBUG, "Running gitmod_lookup(%lu, \"%s\")", (unsigned long)parent, name);
+
+	struct fuse_entry_param entry;
+	memset(&entry, 0, sizeof(entry));
+	unsigned long root_tree_changes = gitmod_get_root_tree_changes(gm_info);
+	gitmod_inode *inode = gitmod_lookup(gm_info, parent, name);
+	entry.attr_timeout = GITMOD_LL_ATTR_TIMEOUT;
+	entry.entry_timeout = GITMOD_LL_TIMEOUT;
+	if (parent == GITMOD_ROOT_INODE && root_tree_changes != gitmod_get_root_tree_changes(gm_info))
+		// it could come from the previous root tree and the entries that changed could be invalidated already
+		entry.entry_timeout = 0;
+	if (!inode && parent == GITMOD_ROOT_INODE && (entry.ino = gitmod_ll_report_inode(name))) {
+		// entries of the tree with the same name come first. If one is added, the entry is invalidated
+		gitmod_ll_fill_report_stat(entry.ino, &entry.attr);
+		entry.attr_timeout = 0;
+		fuse_reply_entry(req, &entry);
+		return;
+	}
+	if (!inode) {
+		gitmod_inode *dir = gitmod_get_inode(gm_info, parent);
+		if (!(dir && gitmod_inode_get_type(dir) == GITMOD_OBJECT_TREE)) {
+			gitmod_log(LOG_ERR, "gitmod_lookup: Could not find directory inode %lu", (unsigned long)parent);
+			fuse_reply_err(req, dir ? ENOTDIR : ENOENT);
+			return;
+		}
+		if (options.debug)
+			gitmod_log(LOG_DEBUG, "gitmod_lookup: %s is not in inode %lu", name, (unsigned long)parent);
+		// a negative entry. The kernel won't ask again until it times out (or it's invalidated)
+		fuse_reply_entry(req, &entry);
+		return;
+	}
+
+	entry.ino = inode->ino;
+	gitmod_ll_fill_stat(inode, &entry.attr);
+	if (fuse_reply_entry(req, &entry))
+		// the kernel did not get it so it won't forget about it
+		gitmod_forget(gm_info, inode->ino, 1);
+}
+
+static void gitmod_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	gitmod_forget(gm_info, ino, nlookup);
+	fuse_reply_none(req);
 }
 
-static int
-gitmod_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		  off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+static void gitmod_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		gitmod_forget(gm_info, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void gitmod_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	(void)offset;
 	(void)fi;
-	(void)flags;
 
 	if (options.debug)
-		syslog(LOG_DEBUG, "Running gitmod_readdir(\"%s\", ...)", path);
-
-	gitmod_object *dir_node = gitmod_get_object(gm_info, path);
-	if (!dir_node || gitmod_object_get_type(dir_node) != GITMOD_OBJECT_TREE) {
-		syslog(LOG_ERR, "gitmod_readdir: Could not find an object for path %s (or it's not a tree)", path);
-		if (dir_node)
-			gitmod_dispose_object(&dir_node);
-		return -ENOENT;
+		gitmod_log(LOG_DEBUG, "Running gitmod_getattr(%lu, ...)", (unsigned long)ino);
+
+	struct stat stbuf;
+	if (GITMOD_LL_IS_REPORT(ino)) {
+		gitmod_ll_fill_report_stat(ino, &stbuf);
+		fuse_reply_attr(req, &stbuf, 0);
+		return;
 	}
+	gitmod_inode *inode = gitmod_get_inode(gm_info, ino);
+	if (!inode) {
+		gitmod_log(LOG_ERR, "gitmod_getattr: Could not find inode %lu", (unsigned long)ino);
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	gitmod_ll_fill_stat(inode, &stbuf);
+	fuse_reply_attr(req, &stbuf, GITMOD_LL_ATTR_TIMEOUT);
+}
 
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
-	int num_items = gitmod_object_get_num_entries(dir_node);
-	gitmod_object *entry;
-	for (int i = 0; i < num_items; i++) {
-		entry = gitmod_get_tree_entry(gm_info, dir_node, i);
-		if (entry) {
-			char *name = gitmod_object_get_name(entry);
-			if (name)
-				filler(buf, name, NULL, 0, 0);
-			gitmod_dispose_object(&entry);
-		}
+// "." and ".." take the first offsets, entries of the tree follow
+#define GITMOD_LL_DIR_OFFSET 2
+
+static void gitmod_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	gitmod_inode_dir *dir = gitmod_opendir(gm_info, ino);
+	if (!dir) {
+		gitmod_inode *inode = gitmod_get_inode(gm_info, ino);
+		gitmod_log(LOG_ERR, "gitmod_opendir: Could not open inode %lu (or it's not a tree)",
+			   (unsigned long)ino);
+		fuse_reply_err(req, inode && gitmod_inode_get_type(inode) != GITMOD_OBJECT_TREE ? ENOTDIR : ENOENT);
+		return;
+	}
+	fi->fh = (uint64_t) dir;
+	if (ino != GITMOD_ROOT_INODE) {
+		// entries of other directories never change (a tree with different entries gets a different inode)
+		fi->cache_readdir = 1;
+		fi->keep_cache = 1;
 	}
-	gitmod_dispose_object(&dir_node);
+	if (fuse_reply_open(req, fi))
+		// the kernel won't release it
+		gitmod_releasedir(gm_info, &dir);
+}
 
+static void gitmod_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	gitmod_inode_dir *dir = (gitmod_inode_dir *) fi->fh;
+	gitmod_releasedir(gm_info, &dir);
+	fuse_reply_err(req, 0);
+}
+
+typedef struct {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t capacity;	// the size requested by the kernel
+} gitmod_ll_dirbuf;
+
+static int gitmod_ll_dirbuf_add(gitmod_ll_dirbuf *dirbuf, const char *name, uint64_t ino,
+				enum gitmod_object_type type, off_t next_offset)
+{
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = type == GITMOD_OBJECT_TREE ? S_IFDIR : S_IFREG;
+	size_t len = fuse_add_direntry(dirbuf->req, dirbuf->buf + dirbuf->size, dirbuf->capacity - dirbuf->size, name,
+				       &stbuf, next_offset);
+	if (len > dirbuf->capacity - dirbuf->size)
+		// the buffer is full
+		return 1;
+	dirbuf->size += len;
 	return 0;
 }
 
-static int gitmod_fs_open(const char *path, struct fuse_file_info *fi)
+static int gitmod_ll_dirbuf_add_entry(void *payload, const char *name, uint64_t ino, enum gitmod_object_type type,
+				      int64_t next_offset)
 {
-	int ret = 0;
-	gitmod_object *object = gitmod_get_object(gm_info, path);
-	if (!object || gitmod_object_get_type(object) != GITMOD_OBJECT_BLOB) {
-		syslog(LOG_ERR, "gitmod_fs_open: Could not find an object for path %s (or it's not a blob)", path);
-		if (object)
-			gitmod_dispose_object(&object);
-		ret = -ENOENT;
-	} else
-		fi->fh = (uint64_t) object;
-	return ret;
+	return gitmod_ll_dirbuf_add(payload, name, ino, type, next_offset + GITMOD_LL_DIR_OFFSET);
 }
 
-static int gitmod_fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void
+gitmod_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	size_t len;
-	(void)fi;
-	gitmod_object *object = (gitmod_object *) fi->fh;
-
-	len = gitmod_object_get_size(object);
-	const char *contents = gitmod_object_get_content(object);
-	if (offset < len) {
-		if (offset + size > len)
-			size = len - offset;
-		memcpy(buf, contents + offset, size);
-	} else
-		size = 0;
-
-	return size;
+	if (options.debug)
+		gitmod_log(LOG_DEBUG, "Running gitmod_readdir(%lu, %ld, ...)", (unsigned long)ino, (long)offset);
+
+	gitmod_ll_dirbuf dirbuf = {.req = req,.capacity = size };
+	dirbuf.buf = malloc(size);
+	if (!dirbuf.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (offset < 1 && gitmod_ll_dirbuf_add(&dirbuf, ".", ino, GITMOD_OBJECT_TREE, 1))
+		goto reply;
+	if (offset < 2 && gitmod_ll_dirbuf_add(&dirbuf, "..", GITMOD_ROOT_INODE, GITMOD_OBJECT_TREE, 2))
+		goto reply;	// parents are not tracked
+	// only the entries that fit in the buffer are gone over
+	int ret = gitmod_readdir((gitmod_inode_dir *) fi->fh,
+				 offset > GITMOD_LL_DIR_OFFSET ? offset - GITMOD_LL_DIR_OFFSET : 0,
+				 gitmod_ll_dirbuf_add_entry, &dirbuf);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto end;
+	}
+ reply:
+	fuse_reply_buf(req, dirbuf.buf, dirbuf.size);
+ end:
+	free(dirbuf.buf);
+}
+
+typedef struct {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t capacity;	// the size requested by the kernel
+	gitmod_inode_dir *dir;
+	fuse_ino_t *inos;	// inodes that were added. The kernel won't know about them if the reply fails
+	size_t num_inos;
+} gitmod_ll_dirbuf_plus;
+
+static int gitmod_ll_dirbuf_plus_add(gitmod_ll_dirbuf_plus *dirbuf, const char *name, gitmod_inode *inode,
+				     off_t next_offset)
+{
+	struct fuse_entry_param entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.ino = inode->ino;
+	entry.attr_timeout = GITMOD_LL_ATTR_TIMEOUT;
+	entry.entry_timeout = GITMOD_LL_TIMEOUT;
+	if (dirbuf->dir->dir->ino == GITMOD_ROOT_INODE
+	    && dirbuf->dir->root_tree_changes != gitmod_get_root_tree_changes(gm_info))
+		// same as with lookups, entries come from a root tree that was replaced
+		entry.entry_timeout = 0;
+	gitmod_ll_fill_stat(inode, &entry.attr);
+	size_t len = fuse_add_direntry_plus(dirbuf->req, dirbuf->buf + dirbuf->size, dirbuf->capacity - dirbuf->size,
+					    name, &entry, next_offset);
+	if (len > dirbuf->capacity - dirbuf->size)
+		// the buffer is full
+		return 1;
+	dirbuf->size += len;
+	return 0;
 }
 
-static int gitmod_fs_release(const char *path, struct fuse_file_info *fi)
+static int gitmod_ll_dirbuf_plus_add_entry(void *payload, const char *name, gitmod_inode *inode, int64_t next_offset)
 {
-	gitmod_object *object = (gitmod_object *) fi->fh;
-	gitmod_dispose_object(&object);
+	gitmod_ll_dirbuf_plus *dirbuf = payload;
+	fuse_ino_t *inos = realloc(dirbuf->inos, (dirbuf->num_inos + 1) * sizeof(fuse_ino_t));
+	if (!inos)
+		return 1;
+	dirbuf->inos = inos;
+	if (gitmod_ll_dirbuf_plus_add(dirbuf, name, inode, next_offset + GITMOD_LL_DIR_OFFSET))
+		return 1;
+	dirbuf->inos[dirbuf->num_inos++] = inode->ino;
 	return 0;
 }
 
-static void gitmod_fs_destroy()
+static void
+gitmod_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	if (options.debug)
-		syslog(LOG_DEBUG, "Running gitmod_destroy()");
-	gitmod_stop(&gm_info);
-	gitmod_shutdown();
+		gitmod_log(LOG_DEBUG, "Running gitmod_readdirplus(%lu, %ld, ...)", (unsigned long)ino, (long)offset);
+
+	gitmod_ll_dirbuf_plus dirbuf = {.req = req,.capacity = size,.dir = (gitmod_inode_dir *) fi->fh };
+	dirbuf.buf = malloc(size);
+	if (!dirbuf.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	// the kernel does not count lookups of "." and ".."
+	if (offset < 1 && gitmod_ll_dirbuf_plus_add(&dirbuf, ".", dirbuf.dir->dir, 1))
+		goto reply;
+	if (offset < 2
+	    && gitmod_ll_dirbuf_plus_add(&dirbuf, "..", gitmod_get_inode(gm_info, GITMOD_ROOT_INODE), 2))
+		goto reply;	// parents are not tracked
+	int ret = gitmod_readdirplus(gm_info, dirbuf.dir,
+				     offset > GITMOD_LL_DIR_OFFSET ? offset - GITMOD_LL_DIR_OFFSET : 0,
+				     gitmod_ll_dirbuf_plus_add_entry, &dirbuf);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto end;
+	}
+ reply:
+	if (fuse_reply_buf(req, dirbuf.buf, dirbuf.size))
+		for (size_t i = 0; i < dirbuf.num_inos; i++)
+			gitmod_forget(gm_info, dirbuf.inos[i], 1);
+ end:
+	free(dirbuf.inos);
+	free(dirbuf.buf);
+}
+
+static void gitmod_ll_close_file(fuse_req_t req, gitmod_file **file)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	if ((*file)->backing_id)
+		fuse_passthrough_close(req, (*file)->backing_id);
+#endif
+	if ((*file)->inode)
+		__atomic_sub_fetch(&(*file)->inode->cached_opens, 1, __ATOMIC_RELEASE);
+	gitmod_release_file(file);
+}
+
+/**
+ * A snapshot of the trace events. Nothing is written into the file of --trace
+ */
+static GString *gitmod_ll_trace_report()
+{
+	if (!options.trace)
+		return g_string_new("Events are not traced. Start gitmod with --trace=<file>\n");
+	GString *report = g_string_new(NULL);
+	int ret = gitmod_trace_snapshot(report);
+	if (ret < 0) {
+		g_string_truncate(report, 0);
+		g_string_append_printf(report, "Could not take a snapshot of the trace: %s\n", strerror(-ret));
+	}
+	return report;
+}
+
+/**
+ * The status, stats and trace files are read from a report that is taken when they are opened
+ */
+static void gitmod_ll_open_report(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	GString *report;
+	if (ino == GITMOD_STATUS_INODE) {
+		char *status = calloc(1, GITMOD_LL_STATUS_SIZE);
+		if (!status) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		gitmod_get_status(gm_info, status, GITMOD_LL_STATUS_SIZE);
+		report = g_string_new(status);
+		free(status);
+	} else if (ino == GITMOD_TRACE_INODE)
+		report = gitmod_ll_trace_report();
+	else {
+		report = g_string_new(NULL);
+		gitmod_get_stats(gm_info, report);
+	}
+	fi->fh = (uint64_t) report;
+	fi->direct_io = 1;
+	if (fuse_reply_open(req, fi))
+		g_string_free(report, TRUE);
+}
+
+static void gitmod_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (GITMOD_LL_IS_REPORT(ino)) {
+		gitmod_ll_open_report(req, ino, fi);
+		return;
+	}
+	gitmod_inode *inode = gitmod_get_inode(gm_info, ino);
+	gitmod_file *file = gitmod_open_inode(gm_info, inode);
+	if (!file) {
+		gitmod_log(LOG_ERR, "gitmod_open: Could not find an object for inode %lu (or it's not a blob)",
+			   (unsigned long)ino);
+		fuse_reply_err(req, inode && gitmod_inode_get_type(inode) == GITMOD_OBJECT_TREE ? EISDIR : ENOENT);
+		return;
+	}
+	fi->fh = (uint64_t) file;
+	// inodes don't change their content (a blob with a different oid gets a different inode)
+	fi->keep_cache = 1;
+	// counted before deciding so that opens that race with this one are not passed through
+	int opens = __atomic_fetch_add(&inode->cached_opens, 1, __ATOMIC_ACQ_REL);
+	file->inode = inode;
+#ifdef FUSE_CAP_PASSTHROUGH
+	// the kernel won't pass through files of an inode that is also open without passthrough
+	if (passthrough && file->fd >= 0 && !opens) {
+		int backing_id = fuse_passthrough_open(req, file->fd);
+		if (backing_id > 0) {
+			file->backing_id = backing_id;
+			fi->backing_id = backing_id;
+			file->inode = NULL;
+			__atomic_sub_fetch(&inode->cached_opens, 1, __ATOMIC_RELEASE);
+		}
+	}
+#else
+	(void)opens;
+#endif
+	if (fuse_reply_open(req, fi))
+		// the kernel won't release it
+		gitmod_ll_close_file(req, &file);
+}
 
+static void gitmod_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	if (GITMOD_LL_IS_REPORT(ino)) {
+		// the trace is binary so its length is taken from the report
+		GString *report = (GString *) fi->fh;
+		size_t len = report->len;
+		if ((size_t) offset >= len)
+			fuse_reply_buf(req, NULL, 0);
+		else
+			fuse_reply_buf(req, report->str + offset, len - offset < size ? len - offset : size);
+		return;
+	}
+	gitmod_file *file = (gitmod_file *) fi->fh;
+	if (file->fd >= 0) {
+		// the blob is in the blob cache, its content is spliced from the file if the kernel can take it
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+		bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv.buf[0].fd = file->fd;
+		bufv.buf[0].pos = offset;
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+	char *buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int ret = gitmod_read_file(file, buf, size, offset);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
 }
 
-static const struct fuse_operations gitmod_oper = {
-	.init = gitmod_fs_init,
-	.getattr = gitmod_fs_getattr,
-	.readdir = gitmod_fs_readdir,
-	.open = gitmod_fs_open,
-	.read = gitmod_fs_read,
-	.release = gitmod_fs_release,
-	.destroy = gitmod_fs_destroy,
+static void gitmod_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (GITMOD_LL_IS_REPORT(ino)) {
+		g_string_free((GString *) fi->fh, TRUE);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	gitmod_file *file = (gitmod_file *) fi->fh;
+	gitmod_ll_close_file(req, &file);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Handlers are wrapped so that their latency is recorded (and traced) no matter how they reply
+ */
+#define GITMOD_LL_TIMED(handler, op, params, args) \
+	static void gitmod_ll_timed_##handler params \
+	{ \
+		uint64_t start = gitmod_stats_now(); \
+		gitmod_ll_##handler args; \
+		gitmod_stats_record(gm_info->stats, op, start); \
+		if (gitmod_trace_is_enabled()) \
+			gitmod_trace_write(GITMOD_TRACE_FUSE_OP, op, start, ino); \
+	}
+
+GITMOD_LL_TIMED(lookup, GITMOD_STATS_LOOKUP, (fuse_req_t req, fuse_ino_t ino, const char *name), (req, ino, name))
+GITMOD_LL_TIMED(getattr, GITMOD_STATS_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+GITMOD_LL_TIMED(opendir, GITMOD_STATS_OPENDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+GITMOD_LL_TIMED(readdir, GITMOD_STATS_READDIR,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+		(req, ino, size, offset, fi))
+GITMOD_LL_TIMED(readdirplus, GITMOD_STATS_READDIRPLUS,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+		(req, ino, size, offset, fi))
+GITMOD_LL_TIMED(open, GITMOD_STATS_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+GITMOD_LL_TIMED(read, GITMOD_STATS_READ,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+		(req, ino, size, offset, fi))
+GITMOD_LL_TIMED(release, GITMOD_STATS_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+
+static const struct fuse_lowlevel_ops gitmod_ll_oper = {
+	.init = gitmod_ll_init,
+	.destroy = gitmod_ll_destroy,
+	.lookup = gitmod_ll_timed_lookup,
+	.forget = gitmod_ll_forget,
+	.forget_multi = gitmod_ll_forget_multi,
+	.getattr = gitmod_ll_timed_getattr,
+	.opendir = gitmod_ll_timed_opendir,
+	.readdir = gitmod_ll_timed_readdir,
+	.readdirplus = gitmod_ll_timed_readdirplus,
+	.releasedir = gitmod_ll_releasedir,
+	.open = gitmod_ll_timed_open,
+	.read = gitmod_ll_timed_read,
+	.release = gitmod_ll_timed_release,
 };
 
 static void show_help(const char *progname)
@@ -198,9 +655,44 @@ static void show_help(const char *progname)
 	       "    --fix                  Do not track changes in references.\n"
 	       "                           Useful if using a tag\n"
 	       "    --refresh-delay=<d>    Milliseconds between checks for movement of reference\n"
+	       "                           When the reference is watched with inotify, it is only checked\n"
+	       "                           this often (but no less than 10 s) in case an event is missed\n"
 	       "                           (default: 100 milliseconds. 0 means it's a tight loop)\n"
 	       "    --debug                Show some debugging messages\n"
-	       "    --kim                  Keep (objects) in memory (careful with size of tree!!!)\n" "\n");
+	       "    --kim                  Keep (objects) in memory (careful with size of tree!!!)\n"
+	       "    --kim-budget=<n>       MBs of blobs that can be kept in memory when using --kim.\n"
+	       "                           Blobs that are not in use are released when going over it.\n"
+	       "                           (default: 0, no limit)\n"
+	       "    --kim-preload=<n>      Set up all paths with this many threads when using --kim\n"
+	       "                           instead of waiting for them to be accessed\n"
+	       "                           (default: 0, paths are set up when accessed)\n"
+	       "    --kim-preload-blobs    Load blobs as well when preloading\n"
+	       "    --stream-threshold=<n> Blobs of this size (in bytes) or bigger are streamed\n"
+	       "                           instead of being loaded in memory when read\n"
+	       "                           (default: 64 MBs. 0 means blobs are never streamed)\n"
+	       "                           Blobs that are deltified in a pack are loaded in memory\n"
+	       "    --blob-cache=<dir>     Write hot or big blobs into files of this directory (named by OID)\n"
+	       "                           and read them from there. Files of a previous run are used.\n"
+	       "                           (default: none)\n"
+	       "    --blob-cache-min-size=<n> Smaller blobs (in bytes) are never written to the blob cache\n"
+	       "                           (default: 64 KBs)\n"
+	       "    --blob-cache-opens=<n> Blobs are written to the blob cache after being opened this many times.\n"
+	       "                           Blobs that would be streamed are written on the first open\n"
+	       "                           (default: 2)\n"
+	       "    --blob-cache-budget=<n> MBs of files kept in the blob cache. Files that are not in use\n"
+	       "                           are removed when going over it (default: 1024 MBs)\n"
+	       "    --repo-handles=<n>     Repo handles used to read objects from different threads\n"
+	       "                           (default: number of processors. 1 means they share one handle)\n"
+	       "    --log-rate-limit=<n>   Messages per second that each place of the code can log. The rest\n"
+	       "                           are dropped and counted (default: 10. 0 means there is no limit)\n"
+	       "    --trace=<file>         Keep the last events of every thread (FUSE requests, cache lookups, blob\n"
+	       "                           loads, lock waits and root tree swaps) and dump them into this file\n"
+	       "                           on SIGUSR1 and when unmounting. .gitmod-trace holds a snapshot\n"
+	       "                           of them (default: none, events are not traced)\n"
+	       "    --ready-fd=<fd>        Write \"ready\" into this file descriptor (and close it) once the\n"
+	       "                           mount point is ready (warm-up included)\n"
+	       "    -o uid=<n>             Owner of the files (default: 0)\n"
+	       "    -o gid=<n>             Group of the files (default: 0)\n" "\n");
 }
 
 int main(int argc, char *argv[])
@@ -218,6 +710,11 @@ int main(int argc, char *argv[])
 		fargv[i] = argv[i];
 	}
 	if (!foreground) {
+		int ready_pipe[2];
+		if (pipe(ready_pipe)) {
+			fprintf(stderr, "Failure to create a pipe to wait for the background process\n");
+			return 1;
+		}
 		pid_t pid = fork();
 		if (pid < 0) {
 			fprintf(stderr,
@@ -225,53 +722,105 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 		if (pid != 0) {
-			printf("Check syslog for output from background process\n");
-			return 0;
+			// the child lets us know when the mount point is ready (or closes the pipe if it fails)
+			close(ready_pipe[1]);
+			char buf[8] = { 0 };
+			ssize_t len;
+			while ((len = read(ready_pipe[0], buf, sizeof(buf) - 1)) < 0 && errno == EINTR) ;
+			close(ready_pipe[0]);
+			if (len > 0 && !strncmp(buf, "ready", 5))
+				return 0;
+			fprintf(stderr,
+				"gitmod could not be mounted. Check syslog for output from background process\n");
+			return 1;
 		}
 		// child process.... this one is where we call fuse_main as it will continue running
+		close(ready_pipe[0]);
+		daemon_fd = ready_pipe[1];
 		fargc++;
 		fargv[argc] = "-f";	// force fuse to run in the foreground regardless
 	}
 	struct fuse_args args = FUSE_ARGS_INIT(fargc, fargv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
 
 	/* Set defaults -- we have to use strdup so that
 	   fuse_opt_parse can free the defaults if other
 	   values are specified */
 	options.treeish = strdup("HEAD");
 	options.root_tree_delay = ROOT_TREEE_MONITOR_DEFAULT_DELAY;
+	options.stream_threshold = GITMOD_STREAM_DEFAULT_THRESHOLD;
+	options.blob_cache_min_size = GITMOD_BLOB_CACHE_DEFAULT_MIN_SIZE;
+	options.blob_cache_opens = GITMOD_BLOB_CACHE_DEFAULT_OPENS;
+	options.blob_cache_budget = GITMOD_BLOB_CACHE_DEFAULT_BUDGET / (1024 * 1024);
+	options.ready_fd = -1;
+	options.repo_handles = sysconf(_SC_NPROCESSORS_ONLN);
+	options.log_rate_limit = GITMOD_LOG_DEFAULT_RATE_LIMIT;
 
 	/* Parse options */
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
 		return 1;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
 
-	/* When --help is specified, first print our own file-system
-	   specific help text, then signal fuse_main to show
-	   additional help (by adding `--help` to the options again)
-	   without usage: line (by setting argv[0] to the empty
-	   string) */
+	/* When --help is specified, print our own file-system
+	   specific help text and then the one from FUSE */
 	if (options.show_help) {
 		show_help(argv[0]);
-		assert(fuse_opt_add_arg(&args, "--help") == 0);
-		args.argv[0][0] = '\0';
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		goto end;
+	} else if (!opts.mountpoint) {
+		if (foreground)
+			fprintf(stderr, "No mount point provided.\n");
+		else
+			gitmod_log(LOG_ERR, "No mount point provided.");
+		ret = 1;
 	} else if (!options.repo_path) {
 		if (foreground)
 			fprintf(stderr, "No repo path provided. Provide it with --repo=<repo-path>.\n");
 		else
-			syslog(LOG_ERR, "No repo path provided. Provide it with --repo=<repo-path>.");
+			gitmod_log(LOG_ERR, "No repo path provided. Provide it with --repo=<repo-path>.");
 		ret = 1;
 	} else {
+		gitmod_log_set_rate_limit(options.log_rate_limit > 0 ? options.log_rate_limit : 0);
+		if (options.trace) {
+			gitmod_trace_set_enabled(1);
+			// before other threads are started so that they don't get the signal
+			if (gitmod_trace_dump_on_signal(SIGUSR1, options.trace))
+				gitmod_log(LOG_ERR, "Could not wait for SIGUSR1. Read %s to get the trace",
+					   GITMOD_LL_TRACE_NAME);
+		}
 		gitmod_init();
 		int gm_options = options.keep_in_memory ? GITMOD_OPTION_KEEP_IN_MEMORY : 0;
 		gm_options |= (options.fix ? GITMOD_OPTION_FIX : 0);
 		gm_info = gitmod_start(options.repo_path, options.treeish, gm_options, options.root_tree_delay);
+		gitmod_set_stream_threshold(gm_info, options.stream_threshold);
+		gitmod_set_cache_budget(gm_info, (size_t) options.kim_budget * 1024 * 1024);
 
 		if (!gm_info) {
 			if (foreground)
 				fprintf(stderr, "Could not setup gitmod\n");
 			else
-				syslog(LOG_ERR, "Could not setup gitmod.");
+				gitmod_log(LOG_ERR, "Could not setup gitmod.");
 			gitmod_shutdown();
 			ret = 1;
+		} else {
+			gm_info->uid = options.uid;
+			gm_info->gid = options.gid;
+			if (options.repo_handles > 1 && gitmod_set_repo_pool(gm_info, options.repo_handles))
+				gitmod_log(LOG_ERR, "Could not set up %d repo handles. Threads will share one",
+					   options.repo_handles);
+			if (options.blob_cache
+			    && gitmod_set_blob_cache(gm_info, options.blob_cache, options.blob_cache_min_size,
+						     options.blob_cache_opens,
+						     (size_t) options.blob_cache_budget * 1024 * 1024))
+				gitmod_log(LOG_ERR, "Could not set up the blob cache in %s. Blobs will be read from "
+					   "the repo", options.blob_cache);
+			if (options.keep_in_memory && options.kim_preload > 0
+			    && gitmod_set_preload(gm_info, options.kim_preload, options.kim_preload_blobs))
+				gitmod_log(LOG_ERR,
+					   "Could not preload the root tree. Paths will be set up when accessed");
 		}
 	}
 
@@ -279,12 +828,39 @@ int main(int argc, char *argv[])
 		if (foreground)
 			printf("Check for output in syslog\n");
 
-		fuse_main(args.argc, args.argv, &gitmod_oper, NULL);
+		ret = 1;
+		se = fuse_session_new(&args, &gitmod_ll_oper, sizeof(gitmod_ll_oper), NULL);
+		if (se) {
+			if (!fuse_set_signal_handlers(se)) {
+				if (!fuse_session_mount(se, opts.mountpoint)) {
+					gitmod_set_invalidate_func(gm_info, gitmod_ll_invalidate, se);
+					// requests are queued by the kernel until the loop starts
+					gitmod_set_ready_func(gm_info, gitmod_ll_ready, NULL);
+					if (opts.singlethread)
+						ret = fuse_session_loop(se);
+					else {
+						struct fuse_loop_config config = {
+							.clone_fd = opts.clone_fd,
+							.max_idle_threads = opts.max_idle_threads,
+						};
+						ret = fuse_session_loop_mt(se, &config);
+					}
+					gitmod_set_invalidate_func(gm_info, NULL, NULL);
+					fuse_session_unmount(se);
+				}
+				fuse_remove_signal_handlers(se);
+			}
+			// gitmod is stopped here if the session was started
+			fuse_session_destroy(se);
+		}
 	}
 
 	if (!foreground) {
-		syslog(LOG_INFO, "Exiting.");
+		gitmod_log(LOG_INFO, "Exiting.");
 	}
 
+ end:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
 	return ret;
 }
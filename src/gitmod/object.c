@@ -7,17 +7,62 @@
 #include <syslog.h>
 #include "gitmod.h"
 
+gitmod_object *gitmod_object_create()
+{
+	gitmod_object *object = calloc(1, sizeof(gitmod_object));
+	if (object) {
+		gitmod_locker_init(&object->lock);
+		gitmod_locker_set_class(&object->lock, GITMOD_LOCK_OBJECT);
+	}
+	return object;
+}
+
+gitmod_object *gitmod_object_create_in_arena(gitmod_arena *arena)
+{
+	gitmod_object *object = gitmod_arena_alloc(arena, sizeof(gitmod_object));
+	if (object) {
+		gitmod_locker_init(&object->lock);
+		gitmod_locker_set_class(&object->lock, GITMOD_LOCK_OBJECT);
+		object->in_arena = 1;
+	}
+	return object;
+}
+
+gitmod_object *gitmod_object_clone(gitmod_object *object, gitmod_arena *arena)
+{
+	if (!(object && object->store))
+		return NULL;
+	if (object->type == GITMOD_OBJECT_TREE && !object->content)
+		// the root tree belongs to its root_tree
+		return NULL;
+	gitmod_object *clone = arena ? gitmod_object_create_in_arena(arena) : gitmod_object_create();
+	if (!clone)
+		return NULL;
+	clone->type = object->type;
+	git_oid_cpy(&clone->oid, &object->oid);
+	clone->size = object->size;
+	clone->repo = object->repo;
+	clone->repos = object->repos;
+	clone->store = object->store;
+	clone->mode = object->mode;
+	clone->name = arena ? gitmod_arena_strdup(arena, object->name) : strdup(object->name);
+	clone->path = arena ? gitmod_arena_strdup(arena, object->path) : strdup(object->path);
+	gitmod_lock(&object->lock);
+	if (object->content) {
+		gitmod_content_store_ref(object->store, object->content);
+		clone->content = object->content;
+		clone->tree = object->tree;
+		clone->blob = object->blob;
+	}
+	gitmod_unlock(&object->lock);
+	return clone;
+}
+
 enum gitmod_object_type gitmod_object_get_type(gitmod_object *object)
 {
 	if (!object)
 		return GITMOD_OBJECT_UNKNOWN;
-	if (object->tree) {
-		return GITMOD_OBJECT_TREE;
-	}
-	if (object->blob) {
-		return GITMOD_OBJECT_BLOB;
-	}
-	return GITMOD_OBJECT_UNKNOWN;
+	return object->type;
 }
 
 int gitmod_object_get_num_entries(gitmod_object *object)
@@ -40,28 +85,122 @@ int gitmod_object_get_num_entries(gitmod_object *object)
 	return res;
 }
 
-int gitmod_object_get_size(gitmod_object *object)
+int64_t gitmod_object_get_size(gitmod_object *object)
 {
-	int res;
+	int64_t res;
 	if (!object)
 		return -ENOENT;
-	if (object->blob)
-		res = git_blob_rawsize(object->blob);
-	else if (object->tree)
+	switch (object->type) {
+	case GITMOD_OBJECT_BLOB:
+		res = object->size;	// no need to load the blob for this
+		break;
+	case GITMOD_OBJECT_TREE:
 		res = gitmod_object_get_num_entries(object);
-	else
+		break;
+	default:
 		res = -ENOENT;
+	}
 
 	return res;
 }
 
+static git_repository *gitmod_object_repo(gitmod_object *object)
+{
+	return object->repos ? gitmod_repo_pool_get(object->repos) : object->repo;
+}
+
+int gitmod_object_read_header(gitmod_object *object)
+{
+	git_odb *odb;
+	git_otype otype;
+	uint64_t start = gitmod_trace_begin();
+	int ret = git_repository_odb(&odb, gitmod_object_repo(object));
+	if (ret) {
+		gitmod_log(LOG_ERR, "Could not get the object database of the repo");
+		return ret;
+	}
+	ret = git_odb_read_header(&object->size, &otype, odb, &object->oid);
+	if (ret)
+		gitmod_log(LOG_ERR, "Could not read header of object %s", git_oid_tostr_s(&object->oid));
+	git_odb_free(odb);
+	gitmod_trace_end(GITMOD_TRACE_HEADER_READ, 0, start, object->size);
+	return ret;
+}
+
+/**
+ * Blobs are inflated the first time their content is asked for (or after they were evicted).
+ */
+static git_blob *gitmod_object_load_blob(gitmod_object *object)
+{
+	int loaded = 0;
+	gitmod_lock(&object->lock);
+	if (!object->blob) {
+		uint64_t start = gitmod_trace_begin();
+		if (object->store) {
+			// blobs with the same content are shared between paths and root trees
+			object->content = gitmod_content_store_get(object->store, gitmod_object_repo(object),
+								   &object->oid, GIT_OBJ_BLOB);
+			if (object->content)
+				object->blob = (git_blob *) object->content->object;
+		} else if (git_blob_lookup(&object->blob, gitmod_object_repo(object), &object->oid)) {
+			gitmod_log(LOG_ERR, "Could not load blob %s", git_oid_tostr_s(&object->oid));
+			object->blob = NULL;
+		}
+		loaded = object->blob != NULL;
+		gitmod_trace_end(GITMOD_TRACE_BLOB_LOAD, 0, start, object->size);
+	}
+	git_blob *blob = object->blob;
+	gitmod_unlock(&object->lock);
+	if (loaded && object->cached_item)
+		// this could evict other blobs
+		gitmod_cache_item_charge(object->cache, object->cached_item, object->size);
+	return blob;
+}
+
+int gitmod_object_release_blob(gitmod_object *object)
+{
+	int ret = 0;
+	gitmod_lock(&object->lock);
+	if (object->usage > 0)
+		ret = -EBUSY;
+	else if (object->blob) {
+		if (object->content)
+			gitmod_content_store_release(object->store, &object->content, 0);
+		else
+			git_blob_free(object->blob);
+		object->blob = NULL;
+	}
+	gitmod_unlock(&object->lock);
+	return ret;
+}
+
+void gitmod_object_increase_usage(gitmod_object *object)
+{
+	gitmod_lock(&object->lock);
+	object->usage++;
+	gitmod_unlock(&object->lock);
+}
+
+void gitmod_object_decrease_usage(gitmod_object *object)
+{
+	gitmod_lock(&object->lock);
+	int idle = !--object->usage;
+	gitmod_unlock(&object->lock);
+	// not holding the lock of the object, the cache takes it while evicting
+	if (idle && object->cached_item)
+		gitmod_cache_item_idle(object->cache, object->cached_item);
+}
+
 const char *gitmod_object_get_content(gitmod_object *object)
 {
 	if (!object)
 		return NULL;
-	if (!object->blob)
+	if (object->type != GITMOD_OBJECT_BLOB)
 		return NULL;
-	return git_blob_rawcontent(object->blob);
+	git_blob *blob = gitmod_object_load_blob(object);
+	if (!blob)
+		return NULL;
+	return git_blob_rawcontent(blob);
 }
 
 int gitmod_object_get_mode(gitmod_object *object)
@@ -78,8 +217,20 @@ void gitmod_object_dispose(gitmod_object **object)
 {
 	if (!object)
 		return;
-	if ((*object)->blob)
+	if ((*object)->content) {
+		// if the object belongs to a root tree that is being replaced, its content is kept
+		// for a while so that the new root tree can use it
+		int retain = (*object)->root_tree
+		    && __atomic_load_n(&(*object)->root_tree->marked_for_deletion, __ATOMIC_ACQUIRE);
+		gitmod_content_store_release((*object)->store, &(*object)->content, retain);
+	} else if ((*object)->blob)
 		git_blob_free((*object)->blob);
+	gitmod_locker_destroy(&(*object)->lock);
+	if ((*object)->in_arena) {
+		// the memory goes away with the arena
+		*object = NULL;
+		return;
+	}
 	if ((*object)->name)
 		free((*object)->name);
 	if ((*object)->path)
@@ -98,7 +249,7 @@ gitmod_object *gitmod_object_get_tree_entry(gitmod_info *info, gitmod_root_tree
 		return NULL;
 	git_tree_entry *git_entry = (git_tree_entry *) git_tree_entry_byindex(tree->tree, index);	// no need to dispose of manually
 	if (!git_entry) {
-		syslog(LOG_ERR, "No entry in tree for index %d", index);
+		gitmod_log(LOG_ERR, "No entry in tree for index %d", index);
 		return NULL;
 	}
 	const char *item_name = git_tree_entry_name(git_entry);
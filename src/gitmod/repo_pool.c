@@ -0,0 +1,60 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#include <syslog.h>
+#include "gitmod.h"
+
+gitmod_repo_pool *gitmod_repo_pool_create(const char *repo_path, int size)
+{
+	if (size < 1)
+		return NULL;
+	gitmod_repo_pool *pool = calloc(1, sizeof(gitmod_repo_pool));
+	if (!pool)
+		return NULL;
+	pool->repos = calloc(size, sizeof(git_repository *));
+	if (!pool->repos || pthread_key_create(&pool->key, NULL)) {
+		free(pool->repos);
+		free(pool);
+		return NULL;
+	}
+	for (; pool->size < size; pool->size++)
+		if (git_repository_open(&pool->repos[pool->size], repo_path)) {
+			gitmod_log(LOG_ERR, "Could not open repo handle %d of the pool", pool->size);
+			break;
+		}
+	if (!pool->size) {
+		gitmod_repo_pool_dispose(&pool);
+		return NULL;
+	}
+	return pool;
+}
+
+git_repository *gitmod_repo_pool_get(gitmod_repo_pool *pool)
+{
+	// index + 1 of the handle of the thread so that 0 means it has none yet
+	uintptr_t index = (uintptr_t) pthread_getspecific(pool->key);
+	if (!index) {
+		index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->size + 1;
+		pthread_setspecific(pool->key, (void *)index);
+	}
+	return pool->repos[index - 1];
+}
+
+int gitmod_repo_pool_size(gitmod_repo_pool *pool)
+{
+	return pool ? pool->size : 0;
+}
+
+void gitmod_repo_pool_dispose(gitmod_repo_pool **pool)
+{
+	if (!(pool && *pool))
+		return;
+	for (int i = 0; i < (*pool)->size; i++)
+		git_repository_free((*pool)->repos[i]);
+	pthread_key_delete((*pool)->key);
+	free((*pool)->repos);
+	free(*pool);
+	*pool = NULL;
+}
@@ -5,60 +5,80 @@
 
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
 #include "gitmod.h"
 
-static int gitmod_tree_walk(const char *root, const git_tree_entry *entry, void *payload)
-{
-	if (!payload)
-		return -1;	// stop the walk
-	gitmod_cache *cache = payload;
-	const char *entry_name = git_tree_entry_name(entry);
-	char *path = calloc(1, 1 + strlen(root) + strlen(entry_name) + 1);
-	strcat(path, "/");
-	strcat(path, root);
-	strcat(path, entry_name);
-	gitmod_cache_get(cache, path);	//map the path to an object
-	free(path);
-	return 0;
-}
+#define GITMOD_ROOT_TREE_ARENA_BLOCK (64 * 1024)
 
-static void destroy_cache_key(void *key)
+static int evict_cache_value(const void *value)
 {
-	if (key)
-		free(key);
+	return gitmod_object_release_blob((gitmod_object *) value);
 }
 
 static void destroy_cache_value(void *value)
 {
-	gitmod_object **object = value;
-	if (!*object)
-		// value hadn't been set yet for this path
+	gitmod_object *object = value;
+	gitmod_object_dispose(&object);
+}
+
+/**
+ * Nodes (and their names) belong to the arena of the root tree
+ */
+static gitmod_cache_node *gitmod_cache_node_create(gitmod_arena *arena, const char *name, const git_oid *oid,
+						   enum gitmod_object_type type, int mode)
+{
+	gitmod_cache_node *node = gitmod_arena_alloc(arena, sizeof(gitmod_cache_node));
+	if (!node)
+		return NULL;
+	node->name = gitmod_arena_strdup(arena, name);
+	if (!node->name)
+		return NULL;
+	git_oid_cpy(&node->oid, oid);
+	node->type = type;
+	node->mode = mode;
+	return node;
+}
+
+static void gitmod_cache_node_dispose(void *data)
+{
+	gitmod_cache_node *node = data;
+	if (!node)
 		return;
-	gitmod_object_dispose(object);
+	// items belong to the objects cache, the rest goes away with the arena
+	if (node->children)
+		g_hash_table_destroy(node->children);
 }
 
-gitmod_root_tree *gitmod_root_tree_create(git_tree *tree, time_t revision_time, int use_cache)
+/**
+ * Set up a root tree instance. If a cache is used, it will be empty
+ */
+static gitmod_root_tree *gitmod_root_tree_alloc(git_tree *tree, time_t revision_time, int use_cache)
 {
 	gitmod_root_tree *root_tree;
 	root_tree = calloc(1, sizeof(gitmod_root_tree));
 	if (root_tree) {
-		root_tree->lock = gitmod_locker_create();
-		if (root_tree->lock && use_cache) {
-			root_tree->objects_cache = gitmod_cache_create(destroy_cache_key, destroy_cache_value);
-			// do a walk so that we set all paths right now
-			git_tree_walk(tree, GIT_TREEWALK_PRE, gitmod_tree_walk, root_tree->objects_cache);
-			// make sure that the root path is associated cause it's not included in the tree walk
-			gitmod_cache_get(root_tree->objects_cache, "/");
-			gitmod_cache_set_fixed(root_tree->objects_cache, 1);
+		if (use_cache) {
+			root_tree->arena = gitmod_arena_create(GITMOD_ROOT_TREE_ARENA_BLOCK);
+			root_tree->objects_cache = gitmod_cache_create(NULL, destroy_cache_value);
+			gitmod_cache_set_evict_func(root_tree->objects_cache, evict_cache_value);
+			gitmod_cache_set_arena(root_tree->objects_cache, root_tree->arena);
+			root_tree->root_node = gitmod_cache_node_create(root_tree->arena, "/", git_tree_id(tree),
+									GITMOD_OBJECT_TREE, 0555);
+			root_tree->nodes_lock = gitmod_locker_create();
+			gitmod_locker_set_class(root_tree->nodes_lock, GITMOD_LOCK_ROOT_TREE);
 		}
-		if (root_tree->lock && (!use_cache || root_tree->objects_cache)) {
+		if (!use_cache || (root_tree->arena && root_tree->objects_cache && root_tree->root_node
+				   && root_tree->nodes_lock)) {
 			root_tree->tree = tree;
 			root_tree->time = revision_time;
+			root_tree->refs = 1;	// the one that publishes it
 		} else {
 			if (root_tree->objects_cache)
 				gitmod_cache_dispose(&root_tree->objects_cache);
-			if (root_tree->lock)
-				gitmod_locker_dispose(&root_tree->lock);
+			gitmod_cache_node_dispose(root_tree->root_node);
+			if (root_tree->nodes_lock)
+				gitmod_locker_dispose(&root_tree->nodes_lock);
+			gitmod_arena_dispose(&root_tree->arena);
 			free(root_tree);
 			root_tree = NULL;
 		}
@@ -66,76 +86,373 @@ gitmod_root_tree *gitmod_root_tree_create(git_tree *tree, time_t revision_time,
 	return root_tree;
 }
 
+gitmod_root_tree *gitmod_root_tree_create(git_tree *tree, time_t revision_time, int use_cache)
+{
+	// paths are set up as they are accessed
+	return gitmod_root_tree_alloc(tree, revision_time, use_cache);
+}
+
+/**
+ * Get a reference to the root tree this one was set up from, unless it was dropped already.
+ * Nodes of this root tree can only get to their previous nodes while it is held
+ */
+static gitmod_root_tree *gitmod_root_tree_get_previous(gitmod_root_tree *root_tree)
+{
+	if (!__atomic_load_n(&root_tree->previous, __ATOMIC_ACQUIRE))
+		return NULL;
+	gitmod_lock(root_tree->nodes_lock);
+	gitmod_root_tree *previous = root_tree->previous;
+	gitmod_root_tree_ref(previous);
+	gitmod_unlock(root_tree->nodes_lock);
+	return previous;
+}
+
+/**
+ * Set up the entries of a directory node if it was not done before. Objects are read with repo.
+ * Entries that are in the previous root tree are linked to their nodes there.
+ * Will return 0 on success
+ */
+static int gitmod_root_tree_populate(gitmod_info *info, git_repository *repo, gitmod_root_tree *root_tree,
+				     gitmod_cache_node *node)
+{
+	if (node->type != GITMOD_OBJECT_TREE)
+		return -ENOTDIR;
+	if (__atomic_load_n(&node->complete, __ATOMIC_ACQUIRE))
+		return 0;
+	uint64_t start = gitmod_trace_begin();
+	// entries are read without holding the lock so that different directories can be set up in parallel
+	git_tree *tree = NULL;
+	gitmod_content *content = NULL;
+	if (node == root_tree->root_node)
+		tree = root_tree->tree;
+	else if (info->content_store) {
+		content = gitmod_content_store_get(info->content_store, repo, &node->oid, GIT_OBJ_TREE);
+		if (content)
+			tree = (git_tree *) content->object;
+	} else if (git_tree_lookup(&tree, repo, &node->oid))
+		tree = NULL;
+	if (!tree) {
+		gitmod_log(LOG_ERR, "Could not load the tree of %s", node->name);
+		return -ENOENT;
+	}
+
+	GHashTable *children = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, gitmod_cache_node_dispose);
+	size_t num_entries = git_tree_entrycount(tree);
+	const git_tree_entry *entry;
+	gitmod_cache_node *child;
+	enum gitmod_object_type type;
+	gitmod_root_tree *previous_tree = gitmod_root_tree_get_previous(root_tree);
+	gitmod_cache_node *previous = previous_tree ? node->previous : NULL;
+	if (!(previous && __atomic_load_n(&previous->complete, __ATOMIC_ACQUIRE)))
+		// there's nothing to take from it
+		previous = NULL;
+	for (size_t i = 0; i < num_entries; i++) {
+		entry = git_tree_entry_byindex(tree, i);
+		switch (git_tree_entry_type(entry)) {
+		case GIT_OBJ_BLOB:
+			type = GITMOD_OBJECT_BLOB;
+			break;
+		case GIT_OBJ_TREE:
+			type = GITMOD_OBJECT_TREE;
+			break;
+		default:
+			// submodules can't be read
+			continue;
+		}
+		child = gitmod_cache_node_create(root_tree->arena, git_tree_entry_name(entry), git_tree_entry_id(entry),
+						 type, git_tree_entry_filemode(entry) & 0555);	// RO always
+		if (!child)
+			continue;
+		g_hash_table_insert(children, child->name, child);
+		if (previous) {
+			child->previous = g_hash_table_lookup(previous->children, child->name);
+			if (child->previous && child->previous->type != type)
+				child->previous = NULL;
+		}
+	}
+	gitmod_root_tree_unref(&previous_tree);
+	if (content)
+		gitmod_content_store_release(info->content_store, &content, 0);
+	else if (tree != root_tree->tree)
+		git_tree_free(tree);
+
+	// all entries are published at once
+	gitmod_lock(root_tree->nodes_lock);
+	if (node->complete) {
+		// another thread did it in the meantime
+		gitmod_unlock(root_tree->nodes_lock);
+		g_hash_table_destroy(children);
+		return 0;
+	}
+	node->children = children;
+	__atomic_add_fetch(&root_tree->populated_dirs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&node->complete, 1, __ATOMIC_RELEASE);
+	gitmod_unlock(root_tree->nodes_lock);
+	gitmod_trace_end(GITMOD_TRACE_DIR_SETUP, 0, start, num_entries);
+	return 0;
+}
+
+/**
+ * Get the node of a path, setting up the directories on the way.
+ * Will return NULL if the path is not in the tree
+ */
+static gitmod_cache_node *gitmod_root_tree_find_node(gitmod_info *info, gitmod_root_tree *root_tree, const char *path)
+{
+	gitmod_cache_node *node = root_tree->root_node;
+	char *components = strdup(path);
+	if (!components)
+		return NULL;
+	char *saveptr;
+	for (char *name = strtok_r(components, "/", &saveptr); name && node; name = strtok_r(NULL, "/", &saveptr)) {
+		if (gitmod_root_tree_populate(info, gitmod_get_repo(info), root_tree, node))
+			node = NULL;
+		else
+			// the directory is complete so a name that is not there does not exist
+			node = g_hash_table_lookup(node->children, name);
+	}
+	free(components);
+	return node;
+}
+
+static gitmod_cache_item *gitmod_root_tree_node_item(gitmod_root_tree *root_tree, gitmod_cache_node *node,
+						      const char *path)
+{
+	gitmod_cache_item *item = __atomic_load_n(&node->item, __ATOMIC_ACQUIRE);
+	if (item)
+		return item;
+	// if other threads race us they will get the same item
+	item = gitmod_cache_get(root_tree->objects_cache, path);
+	if (item)
+		__atomic_store_n(&node->item, item, __ATOMIC_RELEASE);
+	return item;
+}
+
+/**
+ * Take the object that was set up for the path of node in the previous root tree if it's the same object.
+ * Will return NULL if there's nothing to take (the object has to be loaded)
+ */
+static gitmod_object *gitmod_root_tree_carry_over(gitmod_root_tree *root_tree, gitmod_cache_node *node,
+						  gitmod_cache_item *item)
+{
+	gitmod_root_tree *previous_tree = gitmod_root_tree_get_previous(root_tree);
+	if (!previous_tree)
+		return NULL;
+	gitmod_object *object = NULL;
+	gitmod_cache_node *previous = node->previous;
+	gitmod_cache_item *previous_item = previous ? __atomic_load_n(&previous->item, __ATOMIC_ACQUIRE) : NULL;
+	gitmod_object *previous_object = (gitmod_object *) gitmod_cache_item_peek(previous_item);
+	if (previous_object && !git_oid_cmp(&previous->oid, &node->oid) && previous->mode == node->mode)
+		object = gitmod_object_clone(previous_object, root_tree->arena);
+	if (object) {
+		object->root_tree = root_tree;
+		object->cache = root_tree->objects_cache;
+		object->cached_item = item;
+	}
+	gitmod_root_tree_unref(&previous_tree);
+	return object;
+}
+
+/**
+ * Stop taking what was set up in the previous root tree and drop the reference to it
+ */
+static void gitmod_root_tree_drop_previous(gitmod_root_tree *root_tree)
+{
+	if (!root_tree->nodes_lock)
+		return;
+	gitmod_lock(root_tree->nodes_lock);
+	gitmod_root_tree *previous = root_tree->previous;
+	__atomic_store_n(&root_tree->previous, NULL, __ATOMIC_RELEASE);
+	gitmod_unlock(root_tree->nodes_lock);
+	gitmod_root_tree_unref(&previous);
+}
+
+gitmod_root_tree *gitmod_root_tree_create_from_previous(gitmod_info *info, gitmod_root_tree *previous, git_tree *tree,
+							time_t revision_time)
+{
+	(void)info;
+	if (!(previous && previous->objects_cache))
+		return gitmod_root_tree_create(tree, revision_time, 0);
+
+	uint64_t start = gitmod_trace_begin();
+	gitmod_root_tree *root_tree = gitmod_root_tree_alloc(tree, revision_time, 1);
+	if (!root_tree)
+		return NULL;
+	// nothing is walked: paths take what was set up for them in previous the first time they are accessed
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	root_tree->created = now.tv_sec;
+	gitmod_root_tree_ref(previous);
+	root_tree->previous = previous;
+	root_tree->root_node->previous = previous->root_node;
+	gitmod_trace_end(GITMOD_TRACE_ROOT_TREE_SETUP, 0, start,
+			 __atomic_load_n(&previous->populated_dirs, __ATOMIC_RELAXED));
+	return root_tree;
+}
+
+void gitmod_root_tree_expire_previous(gitmod_root_tree *root_tree, time_t max_age)
+{
+	if (!(root_tree && __atomic_load_n(&root_tree->previous, __ATOMIC_ACQUIRE)))
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - root_tree->created >= max_age) {
+		gitmod_log(LOG_INFO, "Releasing the previous root tree after %ld seconds", (long)max_age);
+		gitmod_root_tree_drop_previous(root_tree);
+	}
+}
+
 void gitmod_root_tree_dispose(gitmod_root_tree **root_tree)
 {
 	if (!(root_tree && *root_tree))
 		return;
-	syslog(LOG_INFO, "Disposing of root tree");
+	gitmod_log(LOG_INFO, "Disposing of root tree");
 	if ((*root_tree)->objects_cache) {
-#ifdef GITMOD_DEBUG
-		syslog(LOG_DEBUG, "Disposing of root tree's object's cache");
-#endif
+		gitmod_cache_stats stats;
+		gitmod_cache_get_stats((*root_tree)->objects_cache, &stats);
+		gitmod_log(LOG_INFO, "Object cache stats: %lu lookups ready, %lu not ready, %lu evictions, %zu bytes "
+			   "(budget: %zu)", stats.ready, stats.not_ready, stats.evictions, stats.bytes, stats.budget);
+		int size = gitmod_cache_size((*root_tree)->objects_cache);
+		size_t bytes = gitmod_arena_bytes((*root_tree)->arena);
+		gitmod_log(LOG_INFO, "Root tree metadata: %zu bytes (%zu used) for %d paths (%zu bytes per path)",
+			   bytes, gitmod_arena_used((*root_tree)->arena), size, size ? bytes / size : 0);
+		gitmod_log_debug("Disposing of root tree's object's cache");
 		gitmod_cache_dispose(&(*root_tree)->objects_cache);
+		gitmod_cache_node_dispose((*root_tree)->root_node);
+		gitmod_root_tree_unref(&(*root_tree)->previous);
+		gitmod_locker_dispose(&(*root_tree)->nodes_lock);
+		// nodes, items and objects all at once
+		gitmod_arena_dispose(&(*root_tree)->arena);
 	}
-	gitmod_locker_dispose(&(*root_tree)->lock);
 	git_tree_free((*root_tree)->tree);
 	free(*root_tree);
 	*root_tree = NULL;
 }
 
+void gitmod_root_tree_ref(gitmod_root_tree *root_tree)
+{
+	if (root_tree)
+		__atomic_add_fetch(&root_tree->refs, 1, __ATOMIC_RELAXED);
+}
+
+int gitmod_root_tree_unref(gitmod_root_tree **root_tree)
+{
+	if (!(root_tree && *root_tree))
+		return 0;
+	if (__atomic_sub_fetch(&(*root_tree)->refs, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	// nobody can get to it anymore
+	gitmod_root_tree_dispose(root_tree);
+	return 1;
+}
+
+gitmod_root_tree *gitmod_root_tree_acquire(gitmod_info *info)
+{
+	int token = gitmod_epoch_enter(&info->root_tree_epoch);
+	gitmod_root_tree *root_tree = __atomic_load_n(&info->root_tree, __ATOMIC_ACQUIRE);
+	// the monitor waits for us to leave the epoch before dropping its reference
+	gitmod_root_tree_ref(root_tree);
+	gitmod_epoch_exit(&info->root_tree_epoch, token);
+	return root_tree;
+}
+
+int gitmod_root_tree_retire(gitmod_root_tree *root_tree)
+{
+	if (!root_tree)
+		return 0;
+	// what was not taken from the previous root tree by now won't be
+	gitmod_root_tree_drop_previous(root_tree);
+	__atomic_store_n(&root_tree->marked_for_deletion, 1, __ATOMIC_RELEASE);
+	return gitmod_root_tree_unref(&root_tree);
+}
+
 void gitmod_root_tree_increase_usage(gitmod_root_tree *root_tree)
 {
 	if (!root_tree)
 		return;
-	gitmod_lock(root_tree->lock);
-	root_tree->usage_counter++;
+	gitmod_root_tree_ref(root_tree);
 #ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "Increasing root tree usage, count is now %d", root_tree->usage_counter);
+	int usage = __atomic_add_fetch(&root_tree->usage_counter, 1, __ATOMIC_RELAXED);
+	gitmod_log_debug("Increasing root tree usage, count is now %d", usage);
+#else
+	__atomic_add_fetch(&root_tree->usage_counter, 1, __ATOMIC_RELAXED);
 #endif
-	gitmod_unlock(root_tree->lock);
 }
 
 void gitmod_root_tree_decrease_usage(gitmod_root_tree **root_tree)
 {
 	if (!(root_tree && *root_tree))
 		return;
-	int delete_root_tree;
-	gitmod_lock((*root_tree)->lock);
-	(*root_tree)->usage_counter--;
 #ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "Decreasing root tree usage, count is now %d", (*root_tree)->usage_counter);
+	int usage = __atomic_sub_fetch(&(*root_tree)->usage_counter, 1, __ATOMIC_RELAXED);
+	gitmod_log_debug("Decreasing root tree usage, count is now %d", usage);
+#else
+	__atomic_sub_fetch(&(*root_tree)->usage_counter, 1, __ATOMIC_RELAXED);
 #endif
-	delete_root_tree = (*root_tree)->marked_for_deletion && (*root_tree)->usage_counter <= 0;
-	gitmod_unlock((*root_tree)->lock);
-	if (delete_root_tree) {
-		gitmod_root_tree_dispose(root_tree);
-	}
+	gitmod_root_tree_unref(root_tree);
 }
 
-static gitmod_object *gitmod_root_tree_get_object_from_git_tree_entry(gitmod_info *info, git_tree_entry *git_entry)
+/**
+ * Metadata is read with repo. Trees are loaded right away.
+ * If arena is set, the object is allocated from it and name has to belong to it already (like the name of a node)
+ */
+static gitmod_object *gitmod_root_tree_object_create(gitmod_info *info, git_repository *repo, gitmod_arena *arena,
+						     const char *name, const git_oid *oid, enum gitmod_object_type type,
+						     int mode)
 {
-	gitmod_object *object = calloc(1, sizeof(gitmod_object));
+	gitmod_object *object = arena ? gitmod_object_create_in_arena(arena) : gitmod_object_create();
 	if (!object)
 		return NULL;
-	object->mode = git_tree_entry_filemode(git_entry) & 0555;	// RO always
-	object->name = strdup(git_tree_entry_name(git_entry));
-	git_otype otype = git_tree_entry_type(git_entry);
+	object->mode = mode & 0555;	// RO always
+	object->name = arena ? (char *)name : strdup(name);
+	object->repo = repo;
+	object->store = info->content_store;
+	object->type = type;
+	git_oid_cpy(&object->oid, oid);
 	int ret;
-	switch (otype) {
-	case GIT_OBJ_BLOB:
-		ret = git_tree_entry_to_object((git_object **) & object->blob, info->repo, git_entry);
+	switch (type) {
+	case GITMOD_OBJECT_BLOB:
+		// only metadata for the time being, the blob is loaded when its content is requested
+		ret = gitmod_object_read_header(object);
 		break;
-	case GIT_OBJ_TREE:
-		ret = git_tree_entry_to_object((git_object **) & object->tree, info->repo, git_entry);
+	case GITMOD_OBJECT_TREE:
+		if (object->store) {
+			object->content = gitmod_content_store_get(object->store, repo, &object->oid, GIT_OBJ_TREE);
+			ret = object->content ? 0 : -ENOENT;
+			if (object->content)
+				object->tree = (git_tree *) object->content->object;
+		} else
+			ret = git_tree_lookup(&object->tree, repo, &object->oid);
 		break;
 	default:
 		ret = -ENOENT;
 	}
 	if (ret)
 		gitmod_object_dispose(&object);
+	else {
+		// blobs are loaded with the repo (handles) of gitmod
+		object->repo = info->repo;
+		object->repos = __atomic_load_n(&info->repos, __ATOMIC_ACQUIRE);
+	}
 	return object;
 }
 
+static gitmod_object *gitmod_root_tree_get_object_from_git_tree_entry(gitmod_info *info, git_tree_entry *git_entry)
+{
+	enum gitmod_object_type type;
+	switch (git_tree_entry_type(git_entry)) {
+	case GIT_OBJ_BLOB:
+		type = GITMOD_OBJECT_BLOB;
+		break;
+	case GIT_OBJ_TREE:
+		type = GITMOD_OBJECT_TREE;
+		break;
+	default:
+		return NULL;
+	}
+	return gitmod_root_tree_object_create(info, gitmod_get_repo(info), NULL, git_tree_entry_name(git_entry),
+					      git_tree_entry_id(git_entry), type, git_tree_entry_filemode(git_entry));
+}
+
 gitmod_object *gitmod_root_tree_get_object(gitmod_info *info, gitmod_root_tree *root_tree, const char *orig_path)
 {
 	int ret = 0;
@@ -152,35 +469,50 @@ gitmod_object *gitmod_root_tree_get_object(gitmod_info *info, gitmod_root_tree *
 		strcpy(path, "/");
 		strcat(path, orig_path);
 	}
-#ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "Getting object for path %s", path);
-#endif
+	gitmod_log_debug("Getting object for path %s", path);
 	// is the object in memory already?
 	gitmod_cache_item *cached_item = NULL;
+	gitmod_cache_node *node = NULL;
+	int claimed = 0, carried_over = 0;
 	if (root_tree->objects_cache) {
-		cached_item = gitmod_cache_get(root_tree->objects_cache, path);
+		node = gitmod_root_tree_find_node(info, root_tree, path);
+		if (!node)
+			// this path is not in the tree
+			goto end;
+		cached_item = gitmod_root_tree_node_item(root_tree, node, path);
 		if (!cached_item)
-			// this path is not associated
 			goto end;
-		if (cached_item->content) {
+		// only one thread sets up the object, the others wait for it
+		while (!(object = (gitmod_object *) gitmod_cache_item_get(cached_item)))
+			if ((claimed = gitmod_cache_item_claim(cached_item)))
+				break;
+		if (object)
 			// the object was already in memory
-			object = (gitmod_object *) gitmod_cache_item_get(cached_item);
 			goto end;
-		}
 	}
 	if (!(strlen(path) && strcmp(path, "/"))) {
 		// root tree
-		object = calloc(1, sizeof(gitmod_object));
-		object->path = strdup("/");
-		object->name = strdup("/");
+		object = node ? gitmod_object_create_in_arena(root_tree->arena) : gitmod_object_create();
+		if (!object)
+			goto end;
+		object->name = node ? node->name : strdup("/");
 		object->tree = root_tree->tree;
+		object->type = GITMOD_OBJECT_TREE;
+		object->repo = info->repo;
+		object->repos = __atomic_load_n(&info->repos, __ATOMIC_ACQUIRE);
+		git_oid_cpy(&object->oid, git_tree_id(root_tree->tree));
 		object->mode = 0555;	// TODO can we get more info about what the perms are for the mount point?
-	} else {
+	} else if (node) {
+		object = claimed ? gitmod_root_tree_carry_over(root_tree, node, cached_item) : NULL;
+		carried_over = object != NULL;
+		if (!object)
+			object = gitmod_root_tree_object_create(info, gitmod_get_repo(info), root_tree->arena,
+								node->name, &node->oid, node->type, node->mode);
+	}
+	else {
 		ret = git_tree_entry_bypath(&tree_entry, root_tree->tree, path + (path[0] == '/' ? 1 : 0));
 		if (ret) {
-#ifdef GITMOD_DEBUG
-			syslog(LOG_DEBUG, "Could not find the object for the path %s", path);
-#endif
+			gitmod_log_debug("Could not find the object for the path %s", path);
 			tree_entry = NULL;
 			goto end;
 		}
@@ -188,13 +520,27 @@ gitmod_object *gitmod_root_tree_get_object(gitmod_info *info, gitmod_root_tree *
 		object = gitmod_root_tree_get_object_from_git_tree_entry(info, tree_entry);
 	}
  end:
+	if (claimed && !object)
+		// let another thread try
+		gitmod_cache_item_abandon(cached_item);
+	if (object && !cached_item)
+		// objects that are not cached keep the root tree alive as well
+		gitmod_root_tree_ref(root_tree);
 	if (cached_item && object) {
 		gitmod_root_tree_increase_usage(root_tree);	// one more item using this root_tree
+		if (!object->cached_item) {
+			object->cache = root_tree->objects_cache;
+			object->cached_item = cached_item;
+		}
+		gitmod_object_increase_usage(object);	// its blob can't be evicted while we use it
 		gitmod_cache_item_set(cached_item, object);	// so that the item can be used
+		if (carried_over && object->blob)
+			gitmod_cache_item_charge(root_tree->objects_cache, cached_item, object->size);
 	}
 	if (object) {
 		if (!object->path)
-			object->path = strdup(path);
+			// the id of the item lives as long as the object
+			object->path = object->in_arena ? cached_item->id : strdup(path);
 		if (!object->root_tree)
 			object->root_tree = root_tree;
 	}
@@ -211,17 +557,16 @@ int gitmod_root_tree_dispose_object(gitmod_object **object)
 		// nothing to do
 		return 0;
 
-#ifdef GITMOD_DEBUG
-	syslog(LOG_DEBUG, "Disposing of object for path %s", (*object)->path);
-#endif
+	gitmod_log_debug("Disposing of object for path %s", (*object)->path);
 	gitmod_root_tree *root_tree = (*object)->root_tree;
 	// if the object is not cached, we can dispose of it direcly
-	if (!root_tree->objects_cache) {
+	if (!(*object)->cache) {
 		// objects are not cached
 		gitmod_object_dispose(object);
-		return 0;
+		return gitmod_root_tree_unref(&root_tree);
 	}
 	// there's some caching involved
+	gitmod_object_decrease_usage(*object);
 
 	gitmod_root_tree_decrease_usage(&root_tree);	// this might get rid of EVERYTHING
 	if (!root_tree)
@@ -229,3 +574,282 @@ int gitmod_root_tree_dispose_object(gitmod_object **object)
 		*object = NULL;
 	return (!root_tree);
 }
+
+typedef struct {
+	gitmod_cache_node *node;
+	const char *path;	// in the string chunk of the worker that queued it
+} gitmod_preload_task;
+
+typedef struct gitmod_preload_worker {
+	struct gitmod_preload *preload;
+	git_repository *repo;
+	GQueue tasks;		// directories to set up. The worker takes them from the tail, others from the head
+	gitmod_locker lock;
+	GStringChunk *paths;	// paths of the directories that were queued. Freed when the preload is over
+	GString *path;		// path of the entry that is being set up
+	GStringChunk *entries;	// paths of the entries of the directory that is being set up
+	GPtrArray *ids;		// of the entries of the directory, to add their items to the cache in one go
+	GPtrArray *items;
+	pthread_t thread;
+	gitmod_preload_stats stats;
+} gitmod_preload_worker;
+
+typedef struct gitmod_preload {
+	gitmod_info *info;
+	gitmod_root_tree *root_tree;
+	int blobs;
+	int pending;		// directories that were queued and are not set up yet (atomic)
+	int queued;		// directories in the queues of the workers (atomic)
+	int idle;		// workers waiting for directories to be queued (atomic)
+	int over;		// all directories were set up or it was cancelled (atomic)
+	gitmod_locker idle_lock;
+	pthread_cond_t work;	// signaled when a directory is queued or when it's over
+	const int *cancel;	// workers stop when it's set (atomic)
+	guint num_workers;
+	gitmod_preload_worker *workers;
+} gitmod_preload;
+
+/**
+ * Wake up one worker that is waiting for directories (or all of them). The lock is only taken if somebody
+ * is waiting: idle goes up before waiters check what they wait for
+ */
+static void gitmod_preload_wake(gitmod_preload *preload, int all)
+{
+	if (!__atomic_load_n(&preload->idle, __ATOMIC_SEQ_CST))
+		return;
+	gitmod_lock(&preload->idle_lock);
+	if (all)
+		pthread_cond_broadcast(&preload->work);
+	else
+		pthread_cond_signal(&preload->work);
+	gitmod_unlock(&preload->idle_lock);
+}
+
+/**
+ * Wait until a directory is queued or the preload is over
+ */
+static void gitmod_preload_wait(gitmod_preload *preload)
+{
+	gitmod_lock(&preload->idle_lock);
+	__atomic_add_fetch(&preload->idle, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&preload->queued, __ATOMIC_SEQ_CST)
+	       && !__atomic_load_n(&preload->over, __ATOMIC_SEQ_CST))
+		gitmod_locker_wait(&preload->idle_lock, &preload->work);
+	__atomic_sub_fetch(&preload->idle, 1, __ATOMIC_SEQ_CST);
+	gitmod_unlock(&preload->idle_lock);
+}
+
+static void gitmod_preload_push(gitmod_preload_worker *worker, gitmod_cache_node *node, const char *path)
+{
+	gitmod_preload_task *task = malloc(sizeof(gitmod_preload_task));
+	if (!task)
+		return;
+	task->node = node;
+	task->path = g_string_chunk_insert(worker->paths, path);
+	__atomic_add_fetch(&worker->preload->pending, 1, __ATOMIC_ACQ_REL);
+	gitmod_lock(&worker->lock);
+	g_queue_push_tail(&worker->tasks, task);
+	gitmod_unlock(&worker->lock);
+	__atomic_add_fetch(&worker->preload->queued, 1, __ATOMIC_SEQ_CST);
+	gitmod_preload_wake(worker->preload, 0);
+}
+
+/**
+ * Take the last directory queued by the worker or steal the oldest one from another worker
+ */
+static gitmod_preload_task *gitmod_preload_take(gitmod_preload_worker *worker)
+{
+	gitmod_lock(&worker->lock);
+	gitmod_preload_task *task = g_queue_pop_tail(&worker->tasks);
+	gitmod_unlock(&worker->lock);
+	gitmod_preload *preload = worker->preload;
+	guint index = worker - preload->workers;
+	for (guint i = 1; !task && i < preload->num_workers; i++) {
+		gitmod_preload_worker *victim = &preload->workers[(index + i) % preload->num_workers];
+		gitmod_lock(&victim->lock);
+		task = g_queue_pop_head(&victim->tasks);
+		gitmod_unlock(&victim->lock);
+	}
+	if (task)
+		__atomic_sub_fetch(&preload->queued, 1, __ATOMIC_SEQ_CST);
+	return task;
+}
+
+/**
+ * Set up the object of an entry in the cache (unless it's there already)
+ */
+static void gitmod_preload_object(gitmod_preload_worker *worker, gitmod_cache_node *node, const char *path)
+{
+	gitmod_preload *preload = worker->preload;
+	gitmod_info *info = preload->info;
+	gitmod_cache *cache = preload->root_tree->objects_cache;
+	gitmod_cache_item *item = gitmod_root_tree_node_item(preload->root_tree, node, path);
+	if (!(item && gitmod_cache_item_claim(item)))
+		// it's being used already
+		return;
+	gitmod_object *object = gitmod_root_tree_carry_over(preload->root_tree, node, item);
+	if (!object)
+		object = gitmod_root_tree_object_create(info, worker->repo, preload->root_tree->arena, node->name,
+							&node->oid, node->type, node->mode);
+	if (!object) {
+		gitmod_cache_item_abandon(item);
+		return;
+	}
+	object->path = item->id;
+	object->root_tree = preload->root_tree;
+	object->cache = cache;
+	object->cached_item = item;
+	if (preload->blobs && object->type == GITMOD_OBJECT_BLOB && object->store && !object->blob
+	    && !(info->stream_threshold && object->size >= info->stream_threshold)) {
+		object->content = gitmod_content_store_get(object->store, worker->repo, &object->oid, GIT_OBJ_BLOB);
+		if (object->content) {
+			object->blob = (git_blob *) object->content->object;
+			worker->stats.blobs++;
+			worker->stats.bytes += object->size;
+		}
+	}
+	gitmod_cache_item_set(item, object);
+	if (object->blob)
+		gitmod_cache_item_charge(cache, item, object->size);
+	worker->stats.objects++;
+}
+
+static void gitmod_preload_dir(gitmod_preload_worker *worker, gitmod_preload_task *task)
+{
+	gitmod_preload *preload = worker->preload;
+	gitmod_cache_node *node = task->node;
+	if (gitmod_root_tree_populate(preload->info, worker->repo, preload->root_tree, node))
+		return;
+	worker->stats.dirs++;
+	g_string_assign(worker->path, task->path);
+	size_t len = worker->path->len;
+	g_string_chunk_clear(worker->entries);
+	g_ptr_array_set_size(worker->ids, 0);
+	GPtrArray *children = g_ptr_array_sized_new(g_hash_table_size(node->children));
+	GHashTableIter iter;
+	gpointer name, value;
+	g_hash_table_iter_init(&iter, node->children);
+	while (g_hash_table_iter_next(&iter, &name, &value)) {
+		if (len > 1)
+			g_string_append_c(worker->path, '/');
+		g_string_append(worker->path, name);
+		g_ptr_array_add(children, value);
+		g_ptr_array_add(worker->ids, g_string_chunk_insert(worker->entries, worker->path->str));
+		g_string_truncate(worker->path, len);
+	}
+	// the items of all entries are added to the cache taking the lock of each shard once
+	g_ptr_array_set_size(worker->items, worker->ids->len);
+	gitmod_cache_get_batch(preload->root_tree->objects_cache, (const char **)worker->ids->pdata, worker->ids->len,
+			       (gitmod_cache_item **) worker->items->pdata);
+	for (guint i = 0; i < children->len; i++) {
+		gitmod_cache_node *child = g_ptr_array_index(children, i);
+		const char *path = g_ptr_array_index(worker->ids, i);
+		gitmod_cache_item *item = g_ptr_array_index(worker->items, i);
+		if (item)
+			// threads that race us get the same item
+			__atomic_store_n(&child->item, item, __ATOMIC_RELEASE);
+		gitmod_preload_object(worker, child, path);
+		if (child->type == GITMOD_OBJECT_TREE)
+			gitmod_preload_push(worker, child, path);
+	}
+	g_ptr_array_free(children, TRUE);
+}
+
+static void *gitmod_preload_run(void *params)
+{
+	gitmod_preload_worker *worker = params;
+	gitmod_preload *preload = worker->preload;
+	gitmod_preload_task *task;
+	const int *cancel = preload->cancel;
+	while (__atomic_load_n(&preload->pending, __ATOMIC_ACQUIRE)
+	       && !__atomic_load_n(&preload->over, __ATOMIC_ACQUIRE)
+	       && !(cancel && __atomic_load_n(cancel, __ATOMIC_ACQUIRE))) {
+		if (!(task = gitmod_preload_take(worker))) {
+			// the directories that are left are being set up by other workers
+			gitmod_preload_wait(preload);
+			continue;
+		}
+		gitmod_preload_dir(worker, task);
+		free(task);
+		__atomic_sub_fetch(&preload->pending, 1, __ATOMIC_ACQ_REL);
+	}
+	// workers that are waiting have to leave as well
+	__atomic_store_n(&preload->over, 1, __ATOMIC_SEQ_CST);
+	gitmod_preload_wake(preload, 1);
+	return NULL;
+}
+
+int gitmod_root_tree_preload(gitmod_info *info, gitmod_root_tree *root_tree, GPtrArray *repos, int blobs,
+			     const int *cancel, gitmod_preload_stats *stats)
+{
+	if (!(info && root_tree && root_tree->objects_cache && repos && repos->len))
+		return -EINVAL;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	gitmod_preload preload = {
+		.info = info,
+		.root_tree = root_tree,
+		.blobs = blobs,
+		.cancel = cancel,
+		.num_workers = repos->len,
+		.workers = calloc(repos->len, sizeof(gitmod_preload_worker)),
+	};
+	if (!preload.workers)
+		return -ENOMEM;
+	gitmod_locker_init(&preload.idle_lock);
+	pthread_cond_init(&preload.work, NULL);
+	for (guint i = 0; i < preload.num_workers; i++) {
+		gitmod_preload_worker *worker = &preload.workers[i];
+		worker->preload = &preload;
+		worker->repo = g_ptr_array_index(repos, i);
+		g_queue_init(&worker->tasks);
+		gitmod_locker_init(&worker->lock);
+		worker->paths = g_string_chunk_new(4096);
+		worker->path = g_string_new(NULL);
+		worker->entries = g_string_chunk_new(4096);
+		worker->ids = g_ptr_array_new();
+		worker->items = g_ptr_array_new();
+	}
+	gitmod_preload_push(&preload.workers[0], root_tree->root_node, "/");
+	// the first worker is the calling thread
+	guint started = 1;
+	for (; started < preload.num_workers; started++)
+		if (pthread_create(&preload.workers[started].thread, NULL, gitmod_preload_run,
+				   &preload.workers[started])) {
+			gitmod_log(LOG_ERR, "Could not start all preload workers, will go on with %u", started);
+			break;
+		}
+	gitmod_preload_run(&preload.workers[0]);
+
+	gitmod_preload_stats total = { 0 };
+	for (guint i = 0; i < repos->len; i++) {
+		gitmod_preload_worker *worker = &preload.workers[i];
+		if (i && i < started)
+			pthread_join(worker->thread, NULL);
+		total.dirs += worker->stats.dirs;
+		total.objects += worker->stats.objects;
+		total.blobs += worker->stats.blobs;
+		total.bytes += worker->stats.bytes;
+		// directories left behind if it was cancelled
+		while (!g_queue_is_empty(&worker->tasks))
+			free(g_queue_pop_head(&worker->tasks));
+		g_string_chunk_free(worker->paths);
+		g_string_free(worker->path, TRUE);
+		g_string_chunk_free(worker->entries);
+		g_ptr_array_free(worker->ids, TRUE);
+		g_ptr_array_free(worker->items, TRUE);
+		gitmod_locker_destroy(&worker->lock);
+	}
+	free(preload.workers);
+	pthread_cond_destroy(&preload.work);
+	gitmod_locker_destroy(&preload.idle_lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	total.millis = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	gitmod_log(LOG_INFO, "Root tree preloaded with %u workers in %ld ms: %d dirs, %d objects (%.0f objects/s), "
+		   "%d blobs (%zu bytes)", started, total.millis, total.dirs, total.objects,
+		   total.millis ? total.objects * 1000.0 / total.millis : (double)total.objects, total.blobs,
+		   total.bytes);
+	if (stats)
+		*stats = total;
+	return 0;
+}
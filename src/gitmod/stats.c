@@ -0,0 +1,258 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Every thread gets a slot the first time it records something. Only that thread writes into the slot
+ * (relaxed loads and stores, no read-modify-write) so recording does not bounce cache lines between threads.
+ * When a thread goes away its slot is kept (with everything it recorded) and taken by the next thread
+ * that needs one.
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#include "gitmod.h"
+
+static const char *gitmod_stats_op_names[GITMOD_STATS_OPS] = {
+	"lookup", "getattr", "opendir", "readdir", "readdirplus", "open", "read", "release"
+};
+
+static const char *gitmod_stats_counter_names[GITMOD_STATS_COUNTERS] = {
+	"gitmod_cache_items_ready_total", "gitmod_cache_items_not_ready_total", "gitmod_blob_loads_total",
+	"gitmod_blob_bytes_total", "gitmod_streamed_bytes_total"
+};
+
+static const double gitmod_stats_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void gitmod_stats_slot_release(void *slot)
+{
+	// the thread is gone
+	__atomic_store_n(&((gitmod_stats_slot *) slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+gitmod_stats *gitmod_stats_create()
+{
+	gitmod_stats *stats = calloc(1, sizeof(gitmod_stats));
+	if (!stats)
+		return NULL;
+	if (pthread_key_create(&stats->key, gitmod_stats_slot_release)) {
+		gitmod_log(LOG_ERR, "Could not set up thread slots for stats");
+		free(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+const char *gitmod_stats_op_name(enum gitmod_stats_op op)
+{
+	return op < GITMOD_STATS_OPS ? gitmod_stats_op_names[op] : "unknown";
+}
+
+uint64_t gitmod_stats_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static gitmod_stats_slot *gitmod_stats_get_slot(gitmod_stats *stats)
+{
+	gitmod_stats_slot *slot = pthread_getspecific(stats->key);
+	if (slot)
+		return slot;
+	// a slot left behind by a thread that is gone
+	int expected;
+	for (slot = __atomic_load_n(&stats->slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&slot->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!slot) {
+		slot = calloc(1, sizeof(gitmod_stats_slot));
+		if (!slot)
+			return NULL;
+		slot->in_use = 1;
+		slot->next = __atomic_load_n(&stats->slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&stats->slots, &slot->next, slot, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) ;
+	}
+	pthread_setspecific(stats->key, slot);
+	return slot;
+}
+
+/**
+ * Only the owner of the slot writes into it
+ */
+static void gitmod_stats_slot_add(uint64_t *value, uint64_t delta)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+int gitmod_stats_bucket(uint64_t latency)
+{
+	if (latency < GITMOD_STATS_SUB_BUCKETS)
+		return latency;
+	int exponent = 63 - __builtin_clzll(latency);
+	if (exponent > GITMOD_STATS_MAX_EXPONENT)
+		return GITMOD_STATS_BUCKETS - 1;
+	return (exponent - GITMOD_STATS_SUB_BUCKET_BITS + 1) * GITMOD_STATS_SUB_BUCKETS
+	    + ((latency >> (exponent - GITMOD_STATS_SUB_BUCKET_BITS)) & (GITMOD_STATS_SUB_BUCKETS - 1));
+}
+
+uint64_t gitmod_stats_bucket_limit(int bucket)
+{
+	if (bucket < GITMOD_STATS_SUB_BUCKETS)
+		return bucket;
+	int shift = bucket / GITMOD_STATS_SUB_BUCKETS - 1;
+	uint64_t lower = (uint64_t) (GITMOD_STATS_SUB_BUCKETS + bucket % GITMOD_STATS_SUB_BUCKETS) << shift;
+	return lower + (1UL << shift) - 1;
+}
+
+void gitmod_stats_record_latency(gitmod_stats *stats, enum gitmod_stats_op op, uint64_t latency)
+{
+	if (!stats)
+		return;
+	gitmod_stats_slot *slot = gitmod_stats_get_slot(stats);
+	if (!slot)
+		return;
+	gitmod_stats_slot_add(&slot->latencies[op][gitmod_stats_bucket(latency)], 1);
+	gitmod_stats_slot_add(&slot->latency_sums[op], latency);
+}
+
+void gitmod_stats_record(gitmod_stats *stats, enum gitmod_stats_op op, uint64_t start)
+{
+	if (stats)
+		gitmod_stats_record_latency(stats, op, gitmod_stats_now() - start);
+}
+
+void gitmod_stats_add(gitmod_stats *stats, enum gitmod_stats_counter counter, uint64_t value)
+{
+	if (!stats)
+		return;
+	gitmod_stats_slot *slot = gitmod_stats_get_slot(stats);
+	if (slot)
+		gitmod_stats_slot_add(&slot->counters[counter], value);
+}
+
+uint64_t gitmod_stats_get_counter(gitmod_stats *stats, enum gitmod_stats_counter counter)
+{
+	if (!stats)
+		return 0;
+	uint64_t value = 0;
+	for (gitmod_stats_slot *slot = __atomic_load_n(&stats->slots, __ATOMIC_ACQUIRE); slot; slot = slot->next)
+		value += __atomic_load_n(&slot->counters[counter], __ATOMIC_RELAXED);
+	return value;
+}
+
+/**
+ * Add up the histogram of op from all slots into latencies. Will return the number of operations
+ */
+static uint64_t gitmod_stats_merge(gitmod_stats *stats, enum gitmod_stats_op op, uint64_t *latencies, uint64_t *sum)
+{
+	uint64_t count = 0;
+	memset(latencies, 0, GITMOD_STATS_BUCKETS * sizeof(uint64_t));
+	if (sum)
+		*sum = 0;
+	for (gitmod_stats_slot *slot = __atomic_load_n(&stats->slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		for (int i = 0; i < GITMOD_STATS_BUCKETS; i++) {
+			uint64_t value = __atomic_load_n(&slot->latencies[op][i], __ATOMIC_RELAXED);
+			latencies[i] += value;
+			count += value;
+		}
+		if (sum)
+			*sum += __atomic_load_n(&slot->latency_sums[op], __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+uint64_t gitmod_stats_quantile(uint64_t *latencies, uint64_t count, double quantile)
+{
+	if (!count)
+		return 0;
+	uint64_t rank = quantile * count;
+	if (rank < quantile * count || rank < 1)
+		rank++;
+	uint64_t seen = 0;
+	for (int i = 0; i < GITMOD_STATS_BUCKETS; i++) {
+		seen += latencies[i];
+		if (seen >= rank)
+			return gitmod_stats_bucket_limit(i);
+	}
+	return gitmod_stats_bucket_limit(GITMOD_STATS_BUCKETS - 1);
+}
+
+uint64_t gitmod_stats_get_count(gitmod_stats *stats, enum gitmod_stats_op op)
+{
+	if (!stats)
+		return 0;
+	uint64_t latencies[GITMOD_STATS_BUCKETS];
+	return gitmod_stats_merge(stats, op, latencies, NULL);
+}
+
+uint64_t gitmod_stats_get_quantile(gitmod_stats *stats, enum gitmod_stats_op op, double quantile)
+{
+	if (!stats)
+		return 0;
+	uint64_t latencies[GITMOD_STATS_BUCKETS];
+	uint64_t count = gitmod_stats_merge(stats, op, latencies, NULL);
+	return gitmod_stats_quantile(latencies, count, quantile);
+}
+
+void gitmod_stats_write_histogram(GString *out, const char *metric, const char *label, const char *value,
+				  uint64_t *latencies, uint64_t count, uint64_t sum)
+{
+	uint64_t seen = 0;
+	// empty buckets are left out
+	for (int i = 0; i < GITMOD_STATS_BUCKETS; i++) {
+		if (!latencies[i])
+			continue;
+		seen += latencies[i];
+		g_string_append_printf(out, "%s_bucket{%s=\"%s\",le=\"%lu\"} %lu\n", metric, label, value,
+				       (unsigned long)gitmod_stats_bucket_limit(i), (unsigned long)seen);
+	}
+	g_string_append_printf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", metric, label, value,
+			       (unsigned long)count);
+	g_string_append_printf(out, "%s_sum{%s=\"%s\"} %lu\n", metric, label, value, (unsigned long)sum);
+	g_string_append_printf(out, "%s_count{%s=\"%s\"} %lu\n", metric, label, value, (unsigned long)count);
+}
+
+void gitmod_stats_write(gitmod_stats *stats, GString *out)
+{
+	if (!(stats && out))
+		return;
+	uint64_t latencies[GITMOD_STATS_OPS][GITMOD_STATS_BUCKETS];
+	uint64_t counts[GITMOD_STATS_OPS], sums[GITMOD_STATS_OPS];
+	for (int op = 0; op < GITMOD_STATS_OPS; op++)
+		counts[op] = gitmod_stats_merge(stats, op, latencies[op], &sums[op]);
+
+	g_string_append(out, "# TYPE gitmod_op_latency_ns histogram\n");
+	for (int op = 0; op < GITMOD_STATS_OPS; op++)
+		gitmod_stats_write_histogram(out, "gitmod_op_latency_ns", "op", gitmod_stats_op_names[op],
+					     latencies[op], counts[op], sums[op]);
+	g_string_append(out, "# TYPE gitmod_op_latency_quantile_ns gauge\n");
+	for (int op = 0; op < GITMOD_STATS_OPS; op++)
+		for (size_t q = 0; q < sizeof(gitmod_stats_quantiles) / sizeof(double); q++)
+			g_string_append_printf(out, "gitmod_op_latency_quantile_ns{op=\"%s\",quantile=\"%g\"} %lu\n",
+					       gitmod_stats_op_names[op], gitmod_stats_quantiles[q],
+					       (unsigned long)gitmod_stats_quantile(latencies[op], counts[op],
+										    gitmod_stats_quantiles[q]));
+	for (int counter = 0; counter < GITMOD_STATS_COUNTERS; counter++)
+		g_string_append_printf(out, "# TYPE %s counter\n%s %lu\n", gitmod_stats_counter_names[counter],
+				       gitmod_stats_counter_names[counter],
+				       (unsigned long)gitmod_stats_get_counter(stats, counter));
+}
+
+void gitmod_stats_dispose(gitmod_stats **stats)
+{
+	if (!(stats && *stats))
+		return;
+	// threads that are still around won't release their slots anymore
+	pthread_key_delete((*stats)->key);
+	gitmod_stats_slot *slot, *next;
+	for (slot = (*stats)->slots; slot; slot = next) {
+		next = slot->next;
+		free(slot);
+	}
+	free(*stats);
+	*stats = NULL;
+}
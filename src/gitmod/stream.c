@@ -0,0 +1,417 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+#define GITMOD_STREAM_INPUT_SIZE (64 * 1024)
+#define GITMOD_STREAM_MAX_HEADER 64
+#define GITMOD_STREAM_PACK_BLOB 3	// type of the entries of blobs that are not deltified
+#define GITMOD_STREAM_INDEX_HEADER (8 + 256 * 4)	// magic, version and fan-out table of pack indexes (v2)
+
+static int gitmod_stream_fill_input(gitmod_stream *stream)
+{
+	if (stream->zs.avail_in)
+		return 0;
+	ssize_t len = pread(stream->fd, stream->input, GITMOD_STREAM_INPUT_SIZE, stream->file_offset);
+	if (len <= 0)
+		// the file can't end before the compressed stream does
+		return -EIO;
+	stream->file_offset += len;
+	stream->zs.next_in = stream->input;
+	stream->zs.avail_in = len;
+	return 0;
+}
+
+/**
+ * Will return the number of bytes that were inflated or a negative errno value
+ */
+static int gitmod_stream_inflate(gitmod_stream *stream, unsigned char *out, size_t len)
+{
+	int ret;
+	stream->zs.next_out = out;
+	stream->zs.avail_out = len;
+	while (stream->zs.avail_out) {
+		if (gitmod_stream_fill_input(stream))
+			return -EIO;
+		ret = inflate(&stream->zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			break;
+		if (ret != Z_OK) {
+			gitmod_log(LOG_ERR, "Error inflating stream: %d", ret);
+			return -EIO;
+		}
+	}
+	return len - stream->zs.avail_out;
+}
+
+/**
+ * Save the state of the inflater at the current position so that we can come back to it later on.
+ * If we run out of checkpoints, every other checkpoint is dropped and the interval is doubled so that
+ * memory stays bounded regardless of the size of the blob.
+ */
+static void gitmod_stream_add_checkpoint(gitmod_stream *stream)
+{
+	gitmod_stream_checkpoint *last;
+	if (stream->num_checkpoints) {
+		last = stream->checkpoints[stream->num_checkpoints - 1];
+		if (stream->position < last->offset + stream->checkpoint_interval)
+			return;
+	}
+	if (stream->num_checkpoints == GITMOD_STREAM_MAX_CHECKPOINTS) {
+		int kept = 0;
+		for (int i = 0; i < stream->num_checkpoints; i++) {
+			if (i % 2) {
+				inflateEnd(&stream->checkpoints[i]->state);
+				free(stream->checkpoints[i]);
+				continue;
+			}
+			stream->checkpoints[kept++] = stream->checkpoints[i];
+		}
+		stream->num_checkpoints = kept;
+		stream->checkpoint_interval *= 2;
+		last = stream->checkpoints[stream->num_checkpoints - 1];
+		if (stream->position < last->offset + stream->checkpoint_interval)
+			return;
+	}
+	gitmod_stream_checkpoint *checkpoint = calloc(1, sizeof(gitmod_stream_checkpoint));
+	if (!checkpoint)
+		return;
+	if (inflateCopy(&checkpoint->state, &stream->zs) != Z_OK) {
+		// no big deal, we will just have to inflate more when seeking
+		free(checkpoint);
+		return;
+	}
+	checkpoint->offset = stream->position;
+	checkpoint->file_offset = stream->file_offset - stream->zs.avail_in;
+	stream->checkpoints[stream->num_checkpoints++] = checkpoint;
+}
+
+static int gitmod_stream_restore_checkpoint(gitmod_stream *stream, gitmod_stream_checkpoint *checkpoint)
+{
+	inflateEnd(&stream->zs);
+	if (inflateCopy(&stream->zs, &checkpoint->state) != Z_OK) {
+		gitmod_log(LOG_ERR, "Could not restore stream checkpoint");
+		return -ENOMEM;
+	}
+	// input will be read again from the file
+	stream->zs.next_in = stream->input;
+	stream->zs.avail_in = 0;
+	stream->file_offset = checkpoint->file_offset;
+	stream->position = checkpoint->offset;
+	stream->window_offset = checkpoint->offset;
+	stream->window_len = 0;
+	return 0;
+}
+
+/**
+ * Make sure that the byte at offset is in the window
+ */
+static int gitmod_stream_seek(gitmod_stream *stream, int64_t offset)
+{
+	if (offset >= stream->window_offset && offset < stream->window_offset + (int64_t) stream->window_len)
+		return 0;
+	int ret;
+	if (offset < stream->position || offset - stream->position > stream->checkpoint_interval) {
+		// going backwards or far ahead, let's find the closest checkpoint before the offset
+		gitmod_stream_checkpoint *checkpoint = NULL;
+		for (int i = stream->num_checkpoints - 1; i >= 0; i--) {
+			if (stream->checkpoints[i]->offset <= offset) {
+				checkpoint = stream->checkpoints[i];
+				break;
+			}
+		}
+		if (checkpoint && (offset < stream->position || checkpoint->offset > stream->position)) {
+			ret = gitmod_stream_restore_checkpoint(stream, checkpoint);
+			if (ret)
+				return ret;
+		}
+	}
+	while (1) {
+		gitmod_stream_add_checkpoint(stream);
+		stream->window_offset = stream->position;
+		ret = gitmod_stream_inflate(stream, stream->window, stream->window_size);
+		if (ret <= 0) {
+			stream->window_len = 0;
+			return ret ? ret : -EIO;
+		}
+		stream->window_len = ret;
+		stream->position += ret;
+		if (offset < stream->position)
+			return 0;
+	}
+}
+
+int gitmod_stream_read(gitmod_stream *stream, char *buf, size_t size, int64_t offset)
+{
+	if (!stream)
+		return -EINVAL;
+	if (offset >= stream->size)
+		return 0;
+	if (offset + (int64_t) size > stream->size)
+		size = stream->size - offset;
+	int ret = 0;
+	size_t copied = 0;
+	gitmod_lock(stream->lock);
+	while (copied < size) {
+		ret = gitmod_stream_seek(stream, offset + copied);
+		if (ret)
+			break;
+		size_t from = offset + copied - stream->window_offset;
+		size_t len = stream->window_len - from;
+		if (len > size - copied)
+			len = size - copied;
+		memcpy(buf + copied, stream->window + from, len);
+		copied += len;
+	}
+	gitmod_unlock(stream->lock);
+	return copied ? (int)copied : ret;
+}
+
+/**
+ * Loose objects start with "blob <size>\0"
+ */
+static int gitmod_stream_skip_header(gitmod_stream *stream)
+{
+	char header[GITMOD_STREAM_MAX_HEADER];
+	int i;
+	for (i = 0; i < GITMOD_STREAM_MAX_HEADER; i++) {
+		if (gitmod_stream_inflate(stream, (unsigned char *)header + i, 1) != 1)
+			return -EIO;
+		if (!header[i])
+			break;
+	}
+	if (i == GITMOD_STREAM_MAX_HEADER || strncmp(header, "blob ", 5)) {
+		gitmod_log(LOG_ERR, "Unexpected header on loose object");
+		return -EIO;
+	}
+	if (strtoll(header + 5, NULL, 10) != stream->size) {
+		gitmod_log(LOG_ERR, "Size of the loose object does not match the expected size");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Path of name inside of the objects directory of the repo
+ */
+static char *gitmod_stream_objects_path(git_repository *repo, const char *name)
+{
+	const char *commondir = git_repository_commondir(repo);
+	int needs_slash = strlen(commondir) && commondir[strlen(commondir) - 1] != '/';
+	char *path = calloc(1, strlen(commondir) + 1 + strlen("objects/") + strlen(name) + 1);
+	if (!path)
+		return NULL;
+	strcpy(path, commondir);
+	if (needs_slash)
+		strcat(path, "/");
+	strcat(path, "objects/");
+	strcat(path, name);
+	return path;
+}
+
+static uint32_t gitmod_stream_be32(const unsigned char *buf)
+{
+	return (uint32_t) buf[0] << 24 | (uint32_t) buf[1] << 16 | (uint32_t) buf[2] << 8 | buf[3];
+}
+
+/**
+ * Look up the offset of oid in the pack of an index (version 2) with a binary search over its names.
+ * Will return 0 if it's found
+ */
+static int gitmod_stream_index_lookup(int fd, const git_oid *oid, uint64_t *offset)
+{
+	unsigned char header[GITMOD_STREAM_INDEX_HEADER];
+	if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, "\377tOc\0\0\0\2", 8))
+		return -ENOENT;
+	const unsigned char *fanout = header + 8;
+	uint32_t first = oid->id[0] ? gitmod_stream_be32(fanout + (oid->id[0] - 1) * 4) : 0;
+	uint32_t last = gitmod_stream_be32(fanout + oid->id[0] * 4);
+	uint32_t total = gitmod_stream_be32(fanout + 255 * 4);
+	unsigned char buf[GIT_OID_RAWSZ];
+	while (first < last) {
+		uint32_t middle = first + (last - first) / 2;
+		if (pread(fd, buf, GIT_OID_RAWSZ, sizeof(header) + (off_t) middle * GIT_OID_RAWSZ) != GIT_OID_RAWSZ)
+			return -EIO;
+		int cmp = memcmp(oid->id, buf, GIT_OID_RAWSZ);
+		if (cmp < 0) {
+			last = middle;
+			continue;
+		}
+		if (cmp > 0) {
+			first = middle + 1;
+			continue;
+		}
+		// names are followed by their CRCs and then by their offsets
+		off_t offsets = sizeof(header) + (off_t) total * (GIT_OID_RAWSZ + 4);
+		if (pread(fd, buf, 4, offsets + (off_t) middle * 4) != 4)
+			return -EIO;
+		uint32_t value = gitmod_stream_be32(buf);
+		if (!(value & 0x80000000)) {
+			*offset = value;
+			return 0;
+		}
+		// packs over 2 GBs have a table of 64-bit offsets
+		if (pread(fd, buf, 8, offsets + (off_t) total * 4 + (off_t) (value & 0x7fffffff) * 8) != 8)
+			return -EIO;
+		*offset = (uint64_t) gitmod_stream_be32(buf) << 32 | gitmod_stream_be32(buf + 4);
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/**
+ * Check the header of the entry at offset of a pack. Only blobs that are not deltified can be streamed.
+ * Will return the offset where its compressed content starts or -1
+ */
+static off_t gitmod_stream_pack_entry(int fd, uint64_t offset, int64_t size)
+{
+	unsigned char header[16];
+	ssize_t len = pread(fd, header, sizeof(header), offset);
+	if (len <= 0)
+		return -1;
+	int type = (header[0] >> 4) & 7;
+	uint64_t entry_size = header[0] & 15;
+	int shift = 4;
+	ssize_t i = 0;
+	while (header[i] & 0x80) {
+		if (++i >= len || shift > 57)
+			return -1;
+		entry_size |= (uint64_t) (header[i] & 0x7f) << shift;
+		shift += 7;
+	}
+	if (type != GITMOD_STREAM_PACK_BLOB || entry_size != (uint64_t) size)
+		return -1;
+	return offset + i + 1;
+}
+
+/**
+ * Find a pack of the repo that holds the blob without deltas.
+ * Will return the file descriptor of the pack (and the offset of the compressed content) or -1
+ */
+static int gitmod_stream_open_packed(git_repository *repo, const git_oid *oid, int64_t size, off_t *offset)
+{
+	char *dir_path = gitmod_stream_objects_path(repo, "pack");
+	DIR *dir = dir_path ? opendir(dir_path) : NULL;
+	int fd = -1;
+	if (!dir)
+		goto end;
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		size_t len = strlen(dirent->d_name);
+		if (len < 5 || strcmp(dirent->d_name + len - 4, ".idx"))
+			continue;
+		char *path = malloc(strlen(dir_path) + 1 + len + 2);
+		if (!path)
+			break;
+		sprintf(path, "%s/%s", dir_path, dirent->d_name);
+		int index_fd = open(path, O_RDONLY);
+		uint64_t pack_offset;
+		int found = index_fd >= 0 && !gitmod_stream_index_lookup(index_fd, oid, &pack_offset);
+		if (index_fd >= 0)
+			close(index_fd);
+		if (found) {
+			strcpy(path + strlen(path) - 4, ".pack");
+			fd = open(path, O_RDONLY);
+			if (fd >= 0 && (*offset = gitmod_stream_pack_entry(fd, pack_offset, size)) < 0) {
+				// deltified, it has to be loaded as usual
+				close(fd);
+				fd = -1;
+			}
+		}
+		free(path);
+		if (found)
+			break;
+	}
+	closedir(dir);
+ end:
+	free(dir_path);
+	return fd;
+}
+
+gitmod_stream *gitmod_stream_open(git_repository *repo, const git_oid *oid, int64_t size, size_t window_size)
+{
+	char oid_path[GIT_OID_HEXSZ + 2];
+	git_oid_pathfmt(oid_path, oid);
+	oid_path[GIT_OID_HEXSZ + 1] = '\0';
+	char *path = gitmod_stream_objects_path(repo, oid_path);
+	if (!path)
+		return NULL;
+	int fd = open(path, O_RDONLY);
+	free(path);
+	off_t offset = 0;
+	int loose = fd >= 0;
+	if (!loose)
+		fd = gitmod_stream_open_packed(repo, oid, size, &offset);
+	if (fd < 0) {
+#ifdef GITMOD_DEBUG
+		gitmod_log(LOG_DEBUG, "%s is not a loose object or a packed blob without deltas, it can't be streamed",
+			   oid_path);
+#endif
+		return NULL;
+	}
+
+	gitmod_stream *stream = calloc(1, sizeof(gitmod_stream));
+	if (!stream) {
+		close(fd);
+		return NULL;
+	}
+	stream->fd = fd;
+	stream->size = size;
+	stream->file_offset = offset;
+	stream->window_size = window_size;
+	stream->checkpoint_interval = (int64_t) window_size * GITMOD_STREAM_CHECKPOINT_CHUNKS;
+	stream->input = malloc(GITMOD_STREAM_INPUT_SIZE);
+	stream->window = malloc(window_size);
+	stream->checkpoints = calloc(GITMOD_STREAM_MAX_CHECKPOINTS, sizeof(gitmod_stream_checkpoint *));
+	stream->lock = gitmod_locker_create();
+	gitmod_locker_set_class(stream->lock, GITMOD_LOCK_STREAM);
+	if (!(stream->input && stream->window && stream->checkpoints && stream->lock)) {
+		gitmod_log(LOG_ERR, "Could not allocate stream for blob %s", git_oid_tostr_s(oid));
+		goto fail;
+	}
+	if (inflateInit(&stream->zs) != Z_OK) {
+		gitmod_log(LOG_ERR, "Could not initialize inflater for blob %s", git_oid_tostr_s(oid));
+		goto fail;
+	}
+	// entries of packs hold the content only
+	if (loose && gitmod_stream_skip_header(stream)) {
+		inflateEnd(&stream->zs);
+		goto fail;
+	}
+	// first checkpoint is right at the beginning of the content
+	gitmod_stream_add_checkpoint(stream);
+	return stream;
+ fail:
+	free(stream->input);
+	free(stream->window);
+	free(stream->checkpoints);
+	gitmod_locker_dispose(&stream->lock);
+	close(fd);
+	free(stream);
+	return NULL;
+}
+
+void gitmod_stream_close(gitmod_stream **stream)
+{
+	if (!(stream && *stream))
+		return;
+	inflateEnd(&(*stream)->zs);
+	for (int i = 0; i < (*stream)->num_checkpoints; i++) {
+		inflateEnd(&(*stream)->checkpoints[i]->state);
+		free((*stream)->checkpoints[i]);
+	}
+	free((*stream)->checkpoints);
+	free((*stream)->input);
+	free((*stream)->window);
+	gitmod_locker_dispose(&(*stream)->lock);
+	close((*stream)->fd);
+	free(*stream);
+	*stream = NULL;
+}
@@ -3,21 +3,69 @@
  * Released under the terms of GPLv2
  */
 
+#include <poll.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include "gitmod.h"
 
+static long now_millis()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Wait for delay ms or until the thread is woken up.
+ * Will return non-zero if the watch reported changes
+ */
+static int thread_wait(gitmod_thread *thread, int delay)
+{
+	struct pollfd fds[2] = {
+		{.fd = thread->wake_fd,.events = POLLIN },
+		{.fd = thread->watch ? thread->watch->fd : -1,.events = POLLIN }
+	};
+	if (poll(fds, 2, delay) <= 0 || !(fds[1].revents & POLLIN))
+		return 0;
+	if (!gitmod_watch_read_events(thread->watch))
+		return 0;
+	// git writes a few files when moving a reference (lock file, rename, reflog...). Let's wait for it to calm down
+	long start = now_millis();
+	while (__atomic_load_n(&thread->run_thread, __ATOMIC_ACQUIRE)
+	       && now_millis() - start < GITMOD_WATCH_MAX_COALESCE) {
+		fds[0].revents = fds[1].revents = 0;
+		if (poll(fds, 2, GITMOD_WATCH_QUIET_TIME) <= 0 || fds[0].revents)
+			break;
+		gitmod_watch_read_events(thread->watch);
+	}
+	// references might have been created or point somewhere else now
+	gitmod_watch_refresh(thread->watch);
+	return 1;
+}
+
 static void *thread_task(void *params)
 {
 	gitmod_thread *thread = params;
-	while (thread->run_thread) {
+	while (__atomic_load_n(&thread->run_thread, __ATOMIC_ACQUIRE)) {
 		thread->task(thread);
-		usleep(thread->delay * 1000);	// sleep for a millisecond (or 10) and loop over so that it doesn't _hang_ (like when closing the application)
+		if (thread->wake_fd < 0) {
+			// sleep for a millisecond (or 10) and loop over so that it doesn't _hang_ (like when closing the
+			// application)
+			usleep(thread->delay * 1000);
+			continue;
+		}
+		if (thread->watch)
+			// run the task when the watch reports changes. The fallback delay covers missed events
+			thread_wait(thread, MAX(thread->delay, GITMOD_WATCH_FALLBACK_DELAY));
+		else
+			thread_wait(thread, thread->delay);
 	}
 	return NULL;
 }
 
-gitmod_thread *gitmod_thread_create(gitmod_info *info, void (*task)(gitmod_thread *), int delay)
+gitmod_thread *gitmod_thread_create(gitmod_info *info, void (*task)(gitmod_thread *), int delay, gitmod_watch *watch)
 {
 	if (!info)
 		return NULL;
@@ -27,9 +75,15 @@ gitmod_thread *gitmod_thread_create(gitmod_info *info, void (*task)(gitmod_threa
 		thread->task = task;
 		thread->run_thread = 1;
 		thread->payload = info;
+		thread->watch = watch;
+		thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (thread->wake_fd < 0)
+			gitmod_log(LOG_ERR, "Could not create eventfd for thread. Will use sleeps between cycles");
 		int res = pthread_create(&thread->thread, NULL, thread_task, thread);
 		if (res) {
-			syslog(LOG_ERR, "There was a failure in pthread_create. Res: %d", res);
+			gitmod_log(LOG_ERR, "There was a failure in pthread_create. Res: %d", res);
+			if (thread->wake_fd >= 0)
+				close(thread->wake_fd);
 			free(thread);
 			thread = NULL;
 		}
@@ -45,8 +99,16 @@ void gitmod_thread_set_delay(gitmod_thread *thread, int delay)
 void gitmod_thread_release(gitmod_thread **thread)
 {
 	if (*thread) {
-		(*thread)->run_thread = 0;
+		__atomic_store_n(&(*thread)->run_thread, 0, __ATOMIC_RELEASE);
+		if ((*thread)->wake_fd >= 0) {
+			// no need to wait for the delay to finish
+			uint64_t value = 1;
+			if (write((*thread)->wake_fd, &value, sizeof(value)) < 0)
+				gitmod_log(LOG_ERR, "Could not wake up thread");
+		}
 		pthread_join((*thread)->thread, NULL);
+		if ((*thread)->wake_fd >= 0)
+			close((*thread)->wake_fd);
 		free(*thread);
 		*thread = NULL;
 	}
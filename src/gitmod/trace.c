@@ -0,0 +1,221 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Each thread writes its events into a ring of its own (the last GITMOD_TRACE_RING_SIZE are kept) so tracing
+ * doesn't make threads wait on each other. Dumps copy the rings while they are being written and leave out
+ * the records that could have been overwritten in the meantime.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+int gitmod_trace_enabled;	// (atomic)
+
+static gitmod_trace_ring *gitmod_trace_rings;	// (atomic) rings are added at the head and never removed
+static pthread_key_t gitmod_trace_key;	// ring of each thread
+static pthread_once_t gitmod_trace_key_once = PTHREAD_ONCE_INIT;
+
+static const char *gitmod_trace_event_names[GITMOD_TRACE_EVENTS] = {
+	"fuse", "item_ready", "item_not_ready", "blob_load", "header_read", "dir_setup", "root_tree_setup",
+	"root_tree_swap", "lock_wait"
+};
+
+static void gitmod_trace_ring_release(void *ring)
+{
+	// its records can still be dumped
+	__atomic_store_n(&((gitmod_trace_ring *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void gitmod_trace_create_key()
+{
+	pthread_key_create(&gitmod_trace_key, gitmod_trace_ring_release);
+}
+
+static gitmod_trace_ring *gitmod_trace_get_ring()
+{
+	pthread_once(&gitmod_trace_key_once, gitmod_trace_create_key);
+	gitmod_trace_ring *ring = pthread_getspecific(gitmod_trace_key);
+	if (ring)
+		return ring;
+	int expected;
+	for (ring = __atomic_load_n(&gitmod_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!ring) {
+		ring = calloc(1, sizeof(gitmod_trace_ring));
+		if (!ring)
+			return NULL;
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&gitmod_trace_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&gitmod_trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) ;
+	}
+	__atomic_store_n(&ring->tid, (uint32_t) syscall(SYS_gettid), __ATOMIC_RELAXED);
+	pthread_setspecific(gitmod_trace_key, ring);
+	return ring;
+}
+
+void gitmod_trace_write(enum gitmod_trace_event event, uint16_t detail, uint64_t start, uint64_t arg)
+{
+	gitmod_trace_ring *ring = gitmod_trace_get_ring();
+	if (!ring)
+		return;
+	uint64_t now = gitmod_stats_now();
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	gitmod_trace_record *record = &ring->records[head & (GITMOD_TRACE_RING_SIZE - 1)];
+	record->start = start ? start : now;
+	record->duration = start ? now - start : 0;
+	record->arg = arg;
+	record->tid = ring->tid;
+	record->event = event;
+	record->detail = detail;
+	// only this thread writes into it
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void gitmod_trace_set_enabled(int enabled)
+{
+	__atomic_store_n(&gitmod_trace_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+static int gitmod_trace_write_all(void *payload, const void *buf, size_t size)
+{
+	int fd = *(int *)payload;
+	const char *data = buf;
+	ssize_t written;
+	while (size) {
+		written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += written;
+		size -= written;
+	}
+	return 0;
+}
+
+static int gitmod_trace_append(void *payload, const void *buf, size_t size)
+{
+	g_string_append_len((GString *) payload, buf, size);
+	return 0;
+}
+
+/**
+ * Copy the header and the records of the rings through write. Rings are only read
+ */
+static int gitmod_trace_copy(int (*write_func)(void *payload, const void *buf, size_t size), void *payload)
+{
+	gitmod_trace_header header = {.magic = GITMOD_TRACE_MAGIC,.version = GITMOD_TRACE_VERSION,
+		.record_size = sizeof(gitmod_trace_record)
+	};
+	int ret = write_func(payload, &header, sizeof(header));
+	if (ret)
+		return ret;
+	gitmod_trace_record *records = malloc(GITMOD_TRACE_RING_SIZE * sizeof(gitmod_trace_record));
+	if (!records)
+		return -ENOMEM;
+	int total = 0;
+	uint64_t head, first, last, valid;
+	for (gitmod_trace_ring *ring = __atomic_load_n(&gitmod_trace_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = head > GITMOD_TRACE_RING_SIZE ? head - GITMOD_TRACE_RING_SIZE : 0;
+		for (uint64_t i = first; i < head; i++)
+			records[i - first] = ring->records[i & (GITMOD_TRACE_RING_SIZE - 1)];
+		// records that were overwritten while copying them are left out, as well as the one that could be
+		// being written (index last reuses the slot of index last - GITMOD_TRACE_RING_SIZE)
+		last = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		valid = last + 1 > GITMOD_TRACE_RING_SIZE && last + 1 - GITMOD_TRACE_RING_SIZE > first ?
+		    last + 1 - GITMOD_TRACE_RING_SIZE : first;
+		if (valid >= head)
+			continue;
+		ret = write_func(payload, records + (valid - first), (head - valid) * sizeof(gitmod_trace_record));
+		if (ret)
+			break;
+		total += head - valid;
+	}
+	free(records);
+	return ret ? ret : total;
+}
+
+int gitmod_trace_dump(int fd)
+{
+	return gitmod_trace_copy(gitmod_trace_write_all, &fd);
+}
+
+int gitmod_trace_snapshot(GString *out)
+{
+	return gitmod_trace_copy(gitmod_trace_append, out);
+}
+
+int gitmod_trace_dump_file(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	int ret = gitmod_trace_dump(fd);
+	if (close(fd) && ret >= 0)
+		ret = -errno;
+	return ret;
+}
+
+typedef struct {
+	int signo;
+	char *path;
+} gitmod_trace_signal;
+
+static void *gitmod_trace_wait_signal(void *params)
+{
+	gitmod_trace_signal *waiter = params;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, waiter->signo);
+	int signo, ret;
+	while (!sigwait(&set, &signo)) {
+		ret = gitmod_trace_dump_file(waiter->path);
+		if (ret < 0)
+			gitmod_log(LOG_ERR, "Could not dump the trace into %s: %s", waiter->path, strerror(-ret));
+		else
+			gitmod_log(LOG_INFO, "%d trace events dumped into %s", ret, waiter->path);
+	}
+	return NULL;
+}
+
+int gitmod_trace_dump_on_signal(int signo, const char *path)
+{
+	gitmod_trace_signal *waiter = calloc(1, sizeof(gitmod_trace_signal));
+	if (!waiter)
+		return -ENOMEM;
+	waiter->signo = signo;
+	waiter->path = strdup(path);
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	// threads created from now on inherit it so only the waiting thread gets the signal
+	int ret = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_t thread;
+	if (!(ret || (ret = pthread_create(&thread, NULL, gitmod_trace_wait_signal, waiter)))) {
+		pthread_detach(thread);
+		return 0;
+	}
+	free(waiter->path);
+	free(waiter);
+	return -ret;
+}
+
+const char *gitmod_trace_event_name(uint16_t event, uint16_t detail)
+{
+	if (event == GITMOD_TRACE_FUSE_OP)
+		return gitmod_stats_op_name(detail);
+	return event < GITMOD_TRACE_EVENTS ? gitmod_trace_event_names[event] : "unknown";
+}
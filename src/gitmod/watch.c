@@ -0,0 +1,170 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#include <errno.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+#define GITMOD_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_DELETE | IN_ONLYDIR)
+#define GITMOD_WATCH_MAX_SYMREF_DEPTH 5
+
+static void destroy_watch_item(void *value)
+{
+	gitmod_watch_item *item = value;
+	free(item->name);
+	free(item);
+}
+
+/**
+ * path is relative to base_dir, like refs/heads/main
+ */
+static int gitmod_watch_add(gitmod_watch *watch, const char *base_dir, const char *path)
+{
+	char *full_path = calloc(1, strlen(base_dir) + 1 + strlen(path) + 1);
+	if (!full_path)
+		return -ENOMEM;
+	strcpy(full_path, base_dir);
+	if (strlen(base_dir) && base_dir[strlen(base_dir) - 1] != '/')
+		strcat(full_path, "/");
+	strcat(full_path, path);
+	// we watch the directory because git replaces files by renaming them
+	char *slash = strrchr(full_path, '/');
+	*slash = '\0';
+	int wd = inotify_add_watch(watch->fd, full_path, GITMOD_WATCH_MASK);
+	int ret = 0;
+	if (wd < 0) {
+		// the directory might not exist (yet), the reference could be packed
+#ifdef GITMOD_DEBUG
+		gitmod_log(LOG_DEBUG, "Could not watch %s for changes on %s", full_path, slash + 1);
+#endif
+		ret = -errno;
+	} else {
+		gitmod_watch_item *item = calloc(1, sizeof(gitmod_watch_item));
+		if (item) {
+			item->wd = wd;
+			item->name = strdup(slash + 1);
+			g_ptr_array_add(watch->items, item);
+		}
+	}
+	free(full_path);
+	return ret;
+}
+
+static void gitmod_watch_add_reference(gitmod_watch *watch, const char *name)
+{
+	if (!strcmp(name, "HEAD"))
+		// HEAD belongs to the worktree
+		gitmod_watch_add(watch, git_repository_path(watch->repo), name);
+	else
+		gitmod_watch_add(watch, git_repository_commondir(watch->repo), name);
+}
+
+static int gitmod_watch_add_all(gitmod_watch *watch)
+{
+	git_reference *ref;
+	if (git_reference_dwim(&ref, watch->repo, watch->treeish))
+		// not a reference
+		return -ENOENT;
+	gitmod_watch_add_reference(watch, git_reference_name(ref));
+	// follow symbolic references (like HEAD)
+	for (int depth = 0; depth < GITMOD_WATCH_MAX_SYMREF_DEPTH && git_reference_symbolic_target(ref); depth++) {
+		git_reference *target;
+		gitmod_watch_add_reference(watch, git_reference_symbolic_target(ref));
+		int ret = git_reference_lookup(&target, watch->repo, git_reference_symbolic_target(ref));
+		git_reference_free(ref);
+		if (ret)
+			// target does not exist yet (like HEAD on an unborn branch)
+			return 0;
+		ref = target;
+	}
+	git_reference_free(ref);
+	gitmod_watch_add(watch, git_repository_commondir(watch->repo), "packed-refs");
+	return 0;
+}
+
+static int gitmod_watch_is_live(gitmod_watch *watch, int wd)
+{
+	for (guint i = 0; i < watch->items->len; i++)
+		if (((gitmod_watch_item *) g_ptr_array_index(watch->items, i))->wd == wd)
+			return 1;
+	return 0;
+}
+
+int gitmod_watch_refresh(gitmod_watch *watch)
+{
+	__atomic_add_fetch(&watch->refreshes, 1, __ATOMIC_RELAXED);
+	// directories that are still watched get the same wd back (and no IN_IGNORED event)
+	GPtrArray *previous = watch->items;
+	watch->items = g_ptr_array_new_with_free_func(destroy_watch_item);
+	int ret = gitmod_watch_add_all(watch);
+	// the IN_IGNORED events of the ones that are removed are not relevant, their wds are not live anymore
+	for (guint i = 0; i < previous->len; i++) {
+		int wd = ((gitmod_watch_item *) g_ptr_array_index(previous, i))->wd;
+		if (!gitmod_watch_is_live(watch, wd))
+			inotify_rm_watch(watch->fd, wd);
+	}
+	g_ptr_array_free(previous, TRUE);
+	return ret;
+}
+
+gitmod_watch *gitmod_watch_create(git_repository *repo, const char *treeish)
+{
+	gitmod_watch *watch = calloc(1, sizeof(gitmod_watch));
+	if (!watch)
+		return NULL;
+	watch->repo = repo;
+	watch->treeish = treeish;
+	watch->items = g_ptr_array_new_with_free_func(destroy_watch_item);
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		gitmod_log(LOG_ERR, "Could not set up inotify, references will be polled");
+		gitmod_watch_dispose(&watch);
+		return NULL;
+	}
+	if (gitmod_watch_refresh(watch)) {
+		gitmod_log(LOG_INFO, "%s is not a reference, it will be polled", treeish);
+		gitmod_watch_dispose(&watch);
+	}
+	return watch;
+}
+
+int gitmod_watch_read_events(gitmod_watch *watch)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int relevant = 0;
+	ssize_t len;
+	while ((len = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+		for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			if (event->mask & IN_Q_OVERFLOW
+			    || (event->mask & IN_IGNORED && gitmod_watch_is_live(watch, event->wd))) {
+				// we lost events or a directory we are watching went away
+				relevant = 1;
+				continue;
+			}
+			if (!event->len)
+				continue;
+			for (guint i = 0; i < watch->items->len && !relevant; i++) {
+				gitmod_watch_item *item = g_ptr_array_index(watch->items, i);
+				relevant = item->wd == event->wd && !strcmp(item->name, event->name);
+			}
+		}
+	}
+	return relevant;
+}
+
+void gitmod_watch_dispose(gitmod_watch **watch)
+{
+	if (!(watch && *watch))
+		return;
+	if ((*watch)->fd >= 0)
+		close((*watch)->fd);
+	g_ptr_array_free((*watch)->items, TRUE);
+	free(*watch);
+	*watch = NULL;
+}
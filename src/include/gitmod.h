@@ -13,6 +13,17 @@
 #include "gitmod/root_tree.h"
 #include "gitmod/thread.h"
 #include "gitmod/cache.h"
+#include "gitmod/stream.h"
+#include "gitmod/content.h"
+#include "gitmod/watch.h"
+#include "gitmod/epoch.h"
+#include "gitmod/inode.h"
+#include "gitmod/blob_cache.h"
+#include "gitmod/repo_pool.h"
+#include "gitmod/arena.h"
+#include "gitmod/stats.h"
+#include "gitmod/log.h"
+#include "gitmod/trace.h"
 
 #define GITMOD_OPTION_FIX 1
 #define GITMOD_OPTION_KEEP_IN_MEMORY 1<<1
@@ -43,7 +54,8 @@ void gitmod_stop(gitmod_info ** info);
  * Do all things needed when root tree changes.
  * 
  * It is assumed that gitmod_info.lock is _locked_.
- * It will be unlocked as soon as the new_tree is set up
+ * It will be unlocked as soon as the new_tree is published and readers that could be using the old tree
+ * hold a reference to it. Readers never wait on this.
  * 
  * This method is published so that we can test what happens when the root tree moves
  * 
@@ -58,6 +70,135 @@ gitmod_object *gitmod_get_object(gitmod_info * info, const char *path);
 
 gitmod_object *gitmod_get_tree_entry(gitmod_info * info, gitmod_object * tree, int index);
 
+/**
+ * Look up an entry of the directory with inode number parent.
+ * The kernel has to forget about it (gitmod_forget) for it to be released.
+ */
+gitmod_inode *gitmod_lookup(gitmod_info * info, uint64_t parent, const char *name);
+
+/**
+ * Get an inode that was looked up (or the root inode)
+ */
+gitmod_inode *gitmod_get_inode(gitmod_info * info, uint64_t ino);
+
+void gitmod_forget(gitmod_info * info, uint64_t ino, uint64_t nlookup);
+
+/**
+ * Open the directory with inode number ino. Its entries are served from the tree it had when it was opened
+ * until it's released with gitmod_releasedir.
+ * Will return NULL if there is no such directory
+ */
+gitmod_inode_dir *gitmod_opendir(gitmod_info * info, uint64_t ino);
+
+/**
+ * Call filler for the entries of an open directory starting at entry index offset. Work is bounded by the
+ * entries that filler takes.
+ * Will return 0 on success or a negative errno value
+ */
+int gitmod_readdir(gitmod_inode_dir * dir, int64_t offset, gitmod_inode_dir_filler filler, void *payload);
+
+/**
+ * Same as gitmod_readdir, along with the inodes of the entries.
+ * Every inode that is taken has to be forgotten by the kernel (gitmod_forget).
+ */
+int gitmod_readdirplus(gitmod_info * info, gitmod_inode_dir * dir, int64_t offset,
+		       gitmod_inode_dir_plus_filler filler, void *payload);
+
+void gitmod_releasedir(gitmod_info * info, gitmod_inode_dir ** dir);
+
+/**
+ * Set the function that is called with what the kernel has to forget about when the root tree moves
+ */
+void gitmod_set_invalidate_func(gitmod_info * info, gitmod_invalidate_func invalidate, void *payload);
+
+/**
+ * How many times the root tree was replaced
+ */
+unsigned long gitmod_get_root_tree_changes(gitmod_info * info);
+
+/**
+ * Open the blob of an inode for reading. Same as gitmod_open_file
+ */
+gitmod_file *gitmod_open_inode(gitmod_info * info, gitmod_inode * inode);
+
+/**
+ * Open the blob associated with this path for reading.
+ * Blobs of stream_threshold bytes or bigger are streamed instead of being inflated in memory.
+ */
+gitmod_file *gitmod_open_file(gitmod_info * info, const char *path);
+
+/**
+ * Will return the number of bytes copied into buf or a negative errno value
+ */
+int gitmod_read_file(gitmod_file * file, char *buf, size_t size, int64_t offset);
+
+void gitmod_release_file(gitmod_file ** file);
+
+/**
+ * Blobs of this size (in bytes) or bigger will be streamed when read. 0 means blobs are never streamed.
+ * Only loose objects can be streamed, packed blobs are loaded in memory no matter their size
+ */
+void gitmod_set_stream_threshold(gitmod_info * info, int64_t threshold);
+
+/**
+ * How many bytes of blobs can be kept in memory by each root tree when using GITMOD_OPTION_KEEP_IN_MEMORY.
+ * When going over budget, blobs that are not in use are released (paths are kept).
+ * 0 means there is no limit
+ */
+void gitmod_set_cache_budget(gitmod_info * info, size_t budget);
+
+/**
+ * Write hot blobs (opened admit_opens times) and blobs that would be streamed into files of dir (named by OID)
+ * and read them from there. Blobs smaller than min_size are never written. Files that are not in use are
+ * removed when going over budget bytes.
+ * Has to be set up before files are opened. Will return 0 on success
+ */
+int gitmod_set_blob_cache(gitmod_info * info, const char *dir, int64_t min_size, int admit_opens, size_t budget);
+
+/**
+ * Set up all paths of the root tree (and of every root tree that replaces it) instead of waiting
+ * for them to be accessed, using threads workers. If blobs is set, blobs are loaded as well.
+ * The current root tree is warmed up in the background: gitmod is not ready until it's over
+ * but requests are served in the meantime. Root trees that replace it are published right away and
+ * preloaded in the background as well (stopping the preload of the previous one if it's still going on).
+ * Only for GITMOD_OPTION_KEEP_IN_MEMORY. Will return 0 on success
+ */
+int gitmod_set_preload(gitmod_info * info, int threads, int blobs);
+
+/**
+ * Will return non-zero if there is no warm-up going on
+ */
+int gitmod_is_ready(gitmod_info * info);
+
+/**
+ * ready will be called (once) when gitmod is ready. If it is ready already, it's called right away
+ */
+void gitmod_set_ready_func(gitmod_info * info, gitmod_ready_func ready, void *payload);
+
+/**
+ * Write a report of readiness, warm-up progress and the current root tree into buf (as text).
+ * Will return the length of the report (like snprintf) or a negative errno value
+ */
+int gitmod_get_status(gitmod_info * info, char *buf, size_t size);
+
+/**
+ * Append latency histograms of the FUSE operations and counters of caches and loads to out
+ * (in Prometheus text format)
+ */
+void gitmod_get_stats(gitmod_info * info, GString * out);
+
+/**
+ * Read objects with a pool of size repo handles instead of sharing the handle of gitmod between threads.
+ * Objects that were set up before keep on reading with the handle of gitmod. It can be set up while the
+ * monitor is running (but only once). Will return 0 on success
+ */
+int gitmod_set_repo_pool(gitmod_info * info, int size);
+
+/**
+ * Handle to read objects with in the calling thread
+ */
+git_repository *gitmod_get_repo(gitmod_info * info);
+
 /**
  * Will return if the tree associated to the object was deleted
  */
@@ -73,7 +214,7 @@ int gitmod_get_num_entries(gitmod_object * object);
  * Return the size of the object. If it is a tree,
  * will return the number of items.
  */
-int gitmod_get_size(gitmod_object * object);
+int64_t gitmod_get_size(gitmod_object * object);
 
 char *gitmod_get_name(gitmod_object * object);
 
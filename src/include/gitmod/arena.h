@@ -0,0 +1,38 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_ARENA_H
+#define GITMOD_ARENA_H
+
+#include "types.h"
+
+/**
+ * Memory for lots of small things that live as long as the arena does (like the metadata of a root tree).
+ * Allocations are taken from blocks of block_size bytes and are never freed one by one: they are all
+ * released when the arena is disposed of. Threads can allocate at the same time.
+ * Will return NULL if there is an error
+ */
+gitmod_arena *gitmod_arena_create(size_t block_size);
+
+/**
+ * size bytes set to 0, aligned to 16 bytes. Will return NULL if there is an error
+ */
+void *gitmod_arena_alloc(gitmod_arena * arena, size_t size);
+
+char *gitmod_arena_strdup(gitmod_arena * arena, const char *str);
+
+/**
+ * Bytes taken from the system
+ */
+size_t gitmod_arena_bytes(gitmod_arena * arena);
+
+/**
+ * Bytes handed out
+ */
+size_t gitmod_arena_used(gitmod_arena * arena);
+
+void gitmod_arena_dispose(gitmod_arena ** arena);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_BLOB_CACHE_H
+#define GITMOD_BLOB_CACHE_H
+
+#include "types.h"
+
+#define GITMOD_BLOB_CACHE_DEFAULT_MIN_SIZE (64 * 1024)
+#define GITMOD_BLOB_CACHE_DEFAULT_OPENS 2
+#define GITMOD_BLOB_CACHE_DEFAULT_BUDGET (1024L * 1024 * 1024)
+
+/**
+ * Hot (or big) blobs are written once into files of a local directory, named by their OID, so that they can be
+ * read from there (or by the kernel straight from the file). Files are written by a thread of the cache.
+ * Files left in the directory by a previous run are used as well, once their content is checked.
+ *
+ * min_size: smaller blobs are never written
+ * admit_opens: blobs are written after being opened this many times
+ * admit_size: blobs of this size or bigger are written on the first open. 0 means there is no such size
+ * budget: bytes of files kept in the directory. Files that are not in use are removed (least recently used first)
+ *
+ * Will return NULL if there is an error
+ */
+gitmod_blob_cache *gitmod_blob_cache_create(const char *dir, int64_t min_size, int admit_opens, int64_t admit_size,
+					    size_t budget);
+
+/**
+ * A blob is being opened. If its file is ready, a file descriptor to read it from is returned. It has to be
+ * released with gitmod_blob_cache_release.
+ * If the blob is admitted to the cache with this open, its file is written in the background (a handle of its own
+ * is opened from the path of repo). The same goes for checking a file left by a previous run.
+ *
+ * Will return -1 if the file of the blob is not ready: the blob has to be read from the repo
+ */
+int gitmod_blob_cache_open(gitmod_blob_cache * cache, git_repository * repo, const git_oid * oid, int64_t size);
+
+/**
+ * Wait until the files that were queued to be written (or checked) are done
+ */
+void gitmod_blob_cache_flush(gitmod_blob_cache * cache);
+
+void gitmod_blob_cache_release(gitmod_blob_cache * cache, const git_oid * oid);
+
+int gitmod_blob_cache_size(gitmod_blob_cache * cache);
+
+void gitmod_blob_cache_dispose(gitmod_blob_cache ** cache);
+
+#endif
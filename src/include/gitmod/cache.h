@@ -11,26 +11,95 @@
 gitmod_cache *gitmod_cache_create(GDestroyNotify key_destroy_notify, GDestroyNotify value_destroy_notify);
 
 /**
- * Try to find the object for this id.
- * If the object does not exist, a new LOCKED instance of container will be provided,
- * the caller will have to set the content and then unlock it so that the content can be read from other threads.
- * The caller can know if the object has to be filled with content by checking empty (this will be set to true when setting the content)
+ * Try to find the item for this id.
+ * If the item does not exist, a new empty item will be provided.
+ * Its content can be set up by the thread that claims it with gitmod_cache_item_claim.
  * 
  * Will return NULL if there is an error
  */
 gitmod_cache_item *gitmod_cache_get(gitmod_cache * cache, const char *id);
 
+/**
+ * Same as gitmod_cache_get for count ids, taking the lock of each shard once. Meant to set up the items of
+ * a directory before they are asked for so ready/not ready lookups are not counted.
+ * items[i] will be NULL if there is an error
+ */
+void gitmod_cache_get_batch(gitmod_cache * cache, const char **ids, guint count, gitmod_cache_item ** items);
+
 int gitmod_cache_size(gitmod_cache * cache);
 
-void gitmod_cache_set_fixed(gitmod_cache * cache, int fixed);
+/**
+ * Set how many bytes can be charged to the items of the cache before they are evicted.
+ * 0 means there is no limit
+ */
+void gitmod_cache_set_budget(gitmod_cache * cache, size_t budget);
+
+/**
+ * Set the function used to release the content of items when going over budget.
+ * Items are not removed from the cache when evicted, only the heavy part of their content is released.
+ */
+void gitmod_cache_set_evict_func(gitmod_cache * cache, gitmod_cache_evict_func evict);
+
+/**
+ * Allocate items (and their ids) from arena instead of one by one. They are not freed when the cache
+ * is disposed of (key_destroy_func is not called): they go away with the arena.
+ * Has to be set before items are added
+ */
+void gitmod_cache_set_arena(gitmod_cache * cache, gitmod_arena * arena);
+
+/**
+ * Record lookups that found items ready (or not) into recorder. They say whether the content of the item
+ * was set up, not whether its blob is in memory (blob loads are counted by the content store).
+ * Lookups are not counted for caches without a recorder
+ */
+void gitmod_cache_set_recorder(gitmod_cache * cache, gitmod_stats * recorder);
+
+/**
+ * Let the cache know that the content of the item is holding this many bytes.
+ * Items might be evicted if the cache goes over budget.
+ */
+void gitmod_cache_item_charge(gitmod_cache * cache, gitmod_cache_item * item, size_t bytes);
+
+/**
+ * Let the cache know that the content of the item is not in use anymore. Items that were in use when the cache
+ * tried to evict them are not looked at again until then
+ */
+void gitmod_cache_item_idle(gitmod_cache * cache, gitmod_cache_item * item);
 
+/**
+ * Ready and not ready lookups are the ones the recorder got since it was set for this cache. Caches
+ * sharing the recorder (like a root tree that is being replaced) are counted as well
+ */
+void gitmod_cache_get_stats(gitmod_cache * cache, gitmod_cache_stats * stats);
+
+/**
+ * Get the content of the item. If another thread claimed it, we will wait for the content to be set.
+ * Will return NULL if the content has not been set up (the item can be claimed)
+ */
 const void *gitmod_cache_item_get(gitmod_cache_item * item);
 
 /**
- * The object used here _won't_ be duplicate. The caller is in charge of deleting it (TODO: ....after it has been removed from the cache, which is not supported at the time)
+ * Get the content of the item if it's set up. Does not wait for other threads that are setting it up
+ */
+const void *gitmod_cache_item_peek(gitmod_cache_item * item);
+
+/**
+ * Claim an empty item to set up its content. Only one thread gets it (returns non-zero),
+ * others will wait in gitmod_cache_item_get until it sets the content or abandons the item.
+ */
+int gitmod_cache_item_claim(gitmod_cache_item * item);
+
+/**
+ * The object used here _won't_ be duplicate. The cache will dispose of it with value_destroy_notify.
+ * Only the first call on an item sets the content.
  */
 void gitmod_cache_item_set(gitmod_cache_item * item, const void *content);
 
+/**
+ * The content of a claimed item could not be set up. It's empty again
+ */
+void gitmod_cache_item_abandon(gitmod_cache_item * item);
+
 void gitmod_cache_dispose(gitmod_cache ** cache);
 
 #endif
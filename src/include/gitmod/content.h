@@ -0,0 +1,59 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_CONTENT_H
+#define GITMOD_CONTENT_H
+
+#include "types.h"
+
+/**
+ * Trees and blobs held in memory by OID so that they are shared between paths and root trees.
+ * Content is spread over shards by OID, each one with its own lock. References are taken and dropped
+ * without locks unless it's the last one
+ */
+gitmod_content_store *gitmod_content_store_create();
+
+/**
+ * Record blob loads (and their bytes) into recorder
+ */
+void gitmod_content_store_set_recorder(gitmod_content_store * store, gitmod_stats * recorder);
+
+/**
+ * Retained content is freed when it's over budget bytes or older than age seconds (0 means no limit), even if
+ * the root tree does not change. Defaults: GITMOD_CONTENT_RETAIN_BUDGET and GITMOD_CONTENT_RETAIN_AGE
+ */
+void gitmod_content_store_set_retention(gitmod_content_store * store, size_t budget, time_t age);
+
+/**
+ * Get the content for this OID, loading it from the repo if it's not in memory already.
+ * The content is referenced until it's released with gitmod_content_store_release.
+ *
+ * Will return NULL if there is an error
+ */
+gitmod_content *gitmod_content_store_get(gitmod_content_store * store, git_repository * repo, const git_oid * oid,
+					 git_otype type);
+
+/**
+ * Take one more reference to content that is being used already
+ */
+void gitmod_content_store_ref(gitmod_content_store * store, gitmod_content * content);
+
+/**
+ * Drop a reference to the content. When it's not referenced anymore it is freed
+ * unless retain is set. Retained content is kept until the next call to gitmod_content_store_expire
+ * so that a new root tree can pick it up (or until it goes over the retention budget or age).
+ */
+void gitmod_content_store_release(gitmod_content_store * store, gitmod_content ** content, int retain);
+
+/**
+ * Free all retained content that is not referenced at the moment. Used when the root tree changes.
+ */
+void gitmod_content_store_expire(gitmod_content_store * store);
+
+int gitmod_content_store_size(gitmod_content_store * store);
+
+void gitmod_content_store_dispose(gitmod_content_store ** store);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_EPOCH_H
+#define GITMOD_EPOCH_H
+
+#include "types.h"
+
+/**
+ * Epochs allow readers to load a pointer that is published by a writer without taking locks.
+ *
+ * Readers wrap the load (and whatever they need to do to keep the object alive, like getting a reference)
+ * with gitmod_epoch_enter/gitmod_epoch_exit. These sections have to be short and can't block.
+ *
+ * After publishing a new pointer, the writer calls gitmod_epoch_synchronize to wait for the readers
+ * that could have loaded the previous pointer to leave. After that, nobody else can get to it.
+ * A zero-filled gitmod_epoch is ready to be used.
+ */
+
+/**
+ * Returns the token that has to be provided to gitmod_epoch_exit
+ */
+int gitmod_epoch_enter(gitmod_epoch * epoch);
+
+void gitmod_epoch_exit(gitmod_epoch * epoch, int token);
+
+/**
+ * Wait for readers that entered before the call to exit. Writers have to be serialized by the caller.
+ */
+void gitmod_epoch_synchronize(gitmod_epoch * epoch);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_INODE_H
+#define GITMOD_INODE_H
+
+#include "types.h"
+
+#define GITMOD_ROOT_INODE 1
+#define GITMOD_STATUS_INODE 2	// the status file
+#define GITMOD_STATS_INODE 3	// the stats file
+#define GITMOD_TRACE_INODE 4	// the trace control file
+#define GITMOD_RESERVED_INODES 4	// objects get inode numbers above it
+
+/**
+ * Inodes are looked up relative to their parent so paths don't need to be parsed from the root.
+ * Inode numbers are derived from the path, the oid and the mode of the object so a path that does not change
+ * keeps its inode number when the root tree moves.
+ */
+gitmod_inode_table *gitmod_inode_table_create(gitmod_content_store * store);
+
+/**
+ * Set up the root inode from the root tree that is published
+ */
+void gitmod_inode_table_set_root(gitmod_inode_table * table, gitmod_root_tree * root_tree);
+
+/**
+ * The root tree moved from previous to root_tree. Entries of the root inode that were added, removed or
+ * changed are passed to invalidate (and the root inode itself, with name NULL).
+ * The entries of other inodes never change (their numbers depend on the object) so there's nothing to invalidate
+ * about them. Their time follows the root tree: the kernel only keeps attributes for a short while.
+ */
+void gitmod_inode_table_invalidate(gitmod_root_tree * previous, gitmod_root_tree * root_tree,
+				   gitmod_invalidate_func invalidate, void *payload);
+
+/**
+ * Get an inode that is known by the kernel. Will return NULL if there is no such inode
+ */
+gitmod_inode *gitmod_inode_table_get(gitmod_inode_table * table, uint64_t ino);
+
+/**
+ * Look up an entry of a directory. The lookup count of the inode is increased.
+ * Entries of the root inode come from the current root tree of info.
+ * Names that were not found are not remembered: the kernel keeps them as negative entries.
+ *
+ * Will return NULL if there is no such entry
+ */
+gitmod_inode *gitmod_inode_table_lookup(gitmod_info * info, uint64_t parent, const char *name);
+
+/**
+ * The kernel forgot about nlookup lookups of the inode. It is released when there are no lookups left
+ */
+void gitmod_inode_table_forget(gitmod_inode_table * table, uint64_t ino, uint64_t nlookup);
+
+/**
+ * Open a directory. Its entries are served from the tree it has when it's opened (even if the root tree moves)
+ * until it's closed with gitmod_inode_table_closedir.
+ * Will return NULL if there is an error
+ */
+gitmod_inode_dir *gitmod_inode_table_opendir(gitmod_info * info, gitmod_inode * dir);
+
+/**
+ * next_offset is the offset to continue from after this entry.
+ * Will return non-zero to stop going over the entries
+ */
+typedef int (*gitmod_inode_dir_filler)(void *payload, const char *name, uint64_t ino, enum gitmod_object_type type,
+				       int64_t next_offset);
+
+/**
+ * Call filler for the entries of a directory starting at the entry with index offset.
+ * Will return 0 on success or a negative errno value
+ */
+int gitmod_inode_table_readdir(gitmod_inode_dir * handle, int64_t offset, gitmod_inode_dir_filler filler,
+			       void *payload);
+
+/**
+ * Same as gitmod_inode_dir_filler. If it returns non-zero, the lookup of the inode is undone
+ */
+typedef int (*gitmod_inode_dir_plus_filler)(void *payload, const char *name, gitmod_inode * inode,
+					    int64_t next_offset);
+
+/**
+ * Call filler for the entries of a directory starting at the entry with index offset, along with their inodes.
+ * Attributes of the entries are filled in a single pass over the tree (no objects are set up for them).
+ * The lookup count of every inode that is taken by filler is increased.
+ * Will return 0 on success or a negative errno value
+ */
+int gitmod_inode_table_readdirplus(gitmod_info * info, gitmod_inode_dir * handle, int64_t offset,
+				   gitmod_inode_dir_plus_filler filler, void *payload);
+
+void gitmod_inode_table_closedir(gitmod_info * info, gitmod_inode_dir ** handle);
+
+/**
+ * Get an object for the blob of an inode. If the root tree keeps objects in memory and the path
+ * has not changed, the cached object is used.
+ * It has to be disposed of with gitmod_dispose_object
+ */
+gitmod_object *gitmod_inode_get_object(gitmod_info * info, gitmod_inode * inode);
+
+enum gitmod_object_type gitmod_inode_get_type(gitmod_inode * inode);
+
+int gitmod_inode_get_mode(gitmod_inode * inode);
+
+int64_t gitmod_inode_get_size(gitmod_inode * inode);
+
+int gitmod_inode_get_num_entries(gitmod_inode * inode);
+
+/**
+ * Revision time of the current root tree. Every inode reports it so the ones that survive a move of the
+ * treeish follow the new revision
+ */
+time_t gitmod_inode_table_get_time(gitmod_inode_table * table);
+
+int gitmod_inode_table_size(gitmod_inode_table * table);
+
+void gitmod_inode_table_dispose(gitmod_inode_table ** table);
+
+#endif
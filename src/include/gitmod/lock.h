@@ -6,14 +6,79 @@
 #ifndef GITMOD_LOCK_H
 #define GITMOD_LOCK_H
 
+#include <glib.h>
 #include "types.h"
 
 gitmod_locker *gitmod_locker_create();
 
+/**
+ * For lockers that are embedded in other structures
+ */
+void gitmod_locker_init(gitmod_locker * locker);
+
+/**
+ * Acquisitions of the locker are counted as lock_class (GITMOD_LOCK_OTHER unless set).
+ * Does nothing unless building with GITMOD_LOCK_STATS
+ */
+void gitmod_locker_set_class(gitmod_locker * locker, enum gitmod_lock_class lock_class);
+
+void gitmod_locker_destroy(gitmod_locker * locker);
+
 void gitmod_lock(gitmod_locker * locker);
 
 void gitmod_unlock(gitmod_locker * locker);
 
+/**
+ * Wait on cond while holding the locker (pthread_cond_wait). The time spent waiting is not counted as held
+ */
+void gitmod_locker_wait(gitmod_locker * locker, pthread_cond_t * cond);
+
+/**
+ * Same as gitmod_locker_wait, giving up at until (pthread_cond_timedwait). Returns what pthread_cond_timedwait did
+ */
+int gitmod_locker_timedwait(gitmod_locker * locker, pthread_cond_t * cond, const struct timespec *until);
+
 void gitmod_locker_dispose(gitmod_locker ** locker);
 
+/**
+ * Readers/writer lockers (for lockers that are embedded in other structures). Acquisitions are counted the same
+ * way as those of lockers. Hold times are only counted for writers
+ */
+void gitmod_rwlocker_init(gitmod_rwlocker * locker);
+
+void gitmod_rwlocker_set_class(gitmod_rwlocker * locker, enum gitmod_lock_class lock_class);
+
+void gitmod_rwlocker_destroy(gitmod_rwlocker * locker);
+
+void gitmod_read_lock(gitmod_rwlocker * locker);
+
+void gitmod_read_unlock(gitmod_rwlocker * locker);
+
+void gitmod_write_lock(gitmod_rwlocker * locker);
+
+void gitmod_write_unlock(gitmod_rwlocker * locker);
+
+/**
+ * For waits that don't take a lock (like writers waiting for the readers of an epoch): the time passed since
+ * gitmod_lock_wait_begin is counted as an acquisition of lock_class that was contended if it waited.
+ * Does nothing unless building with GITMOD_LOCK_STATS
+ */
+uint64_t gitmod_lock_wait_begin();
+
+void gitmod_lock_wait_end(enum gitmod_lock_class lock_class, uint64_t start, int waited);
+
+const char *gitmod_lock_class_name(enum gitmod_lock_class lock_class);
+
+/**
+ * What was recorded for the lockers of a class by all threads.
+ * Will return 0 on success or -ENOTSUP when not building with GITMOD_LOCK_STATS (stats are all 0)
+ */
+int gitmod_lock_get_stats(enum gitmod_lock_class lock_class, gitmod_lock_stats * stats);
+
+/**
+ * Append acquisitions, contended acquisitions, wait histograms and maximum hold times of every class to out
+ * in Prometheus text format. Nothing is appended unless building with GITMOD_LOCK_STATS
+ */
+void gitmod_lock_stats_write(GString * out);
+
 #endif
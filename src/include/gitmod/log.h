@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_LOG_H
+#define GITMOD_LOG_H
+
+#include <syslog.h>
+#include "types.h"
+
+#define GITMOD_LOG_DEFAULT_RATE_LIMIT 10	// messages per second of each site
+
+/**
+ * Log a message (syslog style) without waiting for syslog: it's copied into a buffer of the calling thread
+ * and written by the logging thread. Messages of the same site go over the rate limit are dropped and
+ * reported with a summary once the next second starts.
+ * Before gitmod_log_start (or after gitmod_log_stop) messages are written into syslog right away.
+ */
+#define gitmod_log(level, ...) \
+	do { \
+		static gitmod_log_site gitmod_log_site_ = { __FILE__, __LINE__ }; \
+		gitmod_log_write(&gitmod_log_site_, level, __VA_ARGS__); \
+	} while (0)
+
+/**
+ * Debug messages are only compiled in debug builds
+ */
+#ifdef GITMOD_DEBUG
+#define gitmod_log_debug(...) gitmod_log(LOG_DEBUG, __VA_ARGS__)
+#else
+#define gitmod_log_debug(...) do { } while (0)
+#endif
+
+void gitmod_log_write(gitmod_log_site * site, int level, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Start the logging thread. Does nothing if it's running already. Will return 0 on success
+ */
+int gitmod_log_start();
+
+/**
+ * Messages of a site over this number in a second are dropped. 0 means there is no limit
+ */
+void gitmod_log_set_rate_limit(unsigned int per_second);
+
+/**
+ * Write everything that is waiting into syslog right away
+ */
+void gitmod_log_flush();
+
+/**
+ * Write what is left and stop the logging thread
+ */
+void gitmod_log_stop();
+
+#endif
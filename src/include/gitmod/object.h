@@ -9,14 +9,52 @@
 #include <git2.h>
 #include "types.h"
 
+gitmod_object *gitmod_object_create();
+
+/**
+ * Create an object that belongs to arena. Its name and path have to live as long as the arena does
+ * (they are not freed when the object is disposed of)
+ */
+gitmod_object *gitmod_object_create_in_arena(gitmod_arena * arena);
+
+/**
+ * Create a new object with the same metadata and sharing the same content as object.
+ * The clone is not associated to any root tree. If arena is set, the clone (along with its name and path)
+ * is allocated from it.
+ * Will return NULL if the content can't be shared (the object does not come from a content store).
+ */
+gitmod_object *gitmod_object_clone(gitmod_object * object, gitmod_arena * arena);
+
 enum gitmod_object_type gitmod_object_get_type(gitmod_object * object);
 
 int gitmod_object_get_num_entries(gitmod_object * object);
 
-int gitmod_object_get_size(gitmod_object * object);
+int64_t gitmod_object_get_size(gitmod_object * object);
+
+/**
+ * Fill in the size of a blob from the ODB header without inflating it.
+ * object->repo and object->oid need to be set already.
+ */
+int gitmod_object_read_header(gitmod_object * object);
 
+/**
+ * The blob is loaded on the first call
+ */
 const char *gitmod_object_get_content(gitmod_object * object);
 
+/**
+ * Release the blob of a cached object if nobody is using it.
+ * Will return 0 if the blob was released (or wasn't loaded), -EBUSY if the object is in use
+ */
+int gitmod_object_release_blob(gitmod_object * object);
+
+/**
+ * Keep track of the holders of a cached object
+ */
+void gitmod_object_increase_usage(gitmod_object * object);
+
+void gitmod_object_decrease_usage(gitmod_object * object);
+
 int gitmod_object_get_mode(gitmod_object * object);
 
 char *gitmod_object_get_name(gitmod_object * object);
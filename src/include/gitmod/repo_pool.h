@@ -0,0 +1,30 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_REPO_POOL_H
+#define GITMOD_REPO_POOL_H
+
+#include "types.h"
+
+/**
+ * Handles of the same repo so that threads reading objects don't contend on the locks of a single handle.
+ * Each thread keeps on using the handle it got the first time (handles are assigned round robin).
+ * Pack files are mapped read-only by every handle so their pages are shared.
+ *
+ * Objects loaded with a handle have to be released before the pool is disposed of.
+ * Will return NULL if there is an error
+ */
+gitmod_repo_pool *gitmod_repo_pool_create(const char *repo_path, int size);
+
+/**
+ * Get the handle of the calling thread
+ */
+git_repository *gitmod_repo_pool_get(gitmod_repo_pool * pool);
+
+int gitmod_repo_pool_size(gitmod_repo_pool * pool);
+
+void gitmod_repo_pool_dispose(gitmod_repo_pool ** pool);
+
+#endif
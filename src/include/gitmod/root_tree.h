@@ -9,27 +9,80 @@
 #include "types.h"
 
 #define ROOT_TREEE_MONITOR_DEFAULT_DELAY 100
+// seconds a root tree holds the one it was set up from, same as the content store retains content
+#define GITMOD_ROOT_TREE_PREVIOUS_AGE GITMOD_CONTENT_RETAIN_AGE
 
+/**
+ * If use_cache is set, paths are kept in a tree of nodes where a directory gets all of its entries
+ * the first time it's accessed. Nothing is walked up front.
+ */
 gitmod_root_tree *gitmod_root_tree_create(git_tree * tree, time_t revision_time, int use_cache);
 
+/**
+ * Create the root tree that replaces previous. Nothing is walked so it takes the same time whatever changed.
+ * If previous keeps objects in memory, the new root tree holds a reference to it and paths take the objects
+ * that were set up in previous (if they are the same object) the first time they are accessed.
+ * The reference is dropped when the new root tree is replaced or by gitmod_root_tree_expire_previous.
+ */
+gitmod_root_tree *gitmod_root_tree_create_from_previous(gitmod_info * info, gitmod_root_tree * previous,
+							git_tree * tree, time_t revision_time);
+
+/**
+ * Drop the previous root tree if root_tree was set up from it max_age seconds ago or more
+ */
+void gitmod_root_tree_expire_previous(gitmod_root_tree * root_tree, time_t max_age);
+
 /*
  * If a call is being made to destroy root tree, it is because we are disposing of the root tree and all of its objects
  */
 void gitmod_root_tree_dispose(gitmod_root_tree ** root_tree);
 
+void gitmod_root_tree_ref(gitmod_root_tree * root_tree);
+
+/**
+ * Drop a reference. Will return non-zero if it was the last one (the root tree is disposed of)
+ */
+int gitmod_root_tree_unref(gitmod_root_tree ** root_tree);
+
+/**
+ * Get a reference to the current root tree of info without taking locks.
+ * It has to be dropped with gitmod_root_tree_unref
+ */
+gitmod_root_tree *gitmod_root_tree_acquire(gitmod_info * info);
+
+/**
+ * The root tree was replaced (or it is not going to be published). Drops the reference of the publisher.
+ * Will return non-zero if it was disposed of (nobody was using it)
+ */
+int gitmod_root_tree_retire(gitmod_root_tree * root_tree);
+
+/**
+ * A cached object from the root tree is being used
+ */
 void gitmod_root_tree_increase_usage(gitmod_root_tree * root_tree);
 
 /**
- * Decrease usage. Will get a lock to do the decrease.
- * If the root_tree has been set for deletion _and_ the counter reached 0 on this call, we will free it
+ * Decrease usage.
+ * If the root_tree has been set for deletion _and_ this was the last reference, we will free it
  */
 void gitmod_root_tree_decrease_usage(gitmod_root_tree ** root_tree);
 
 /**
- * When we call this method, it is assumed the its usage counter has already been increased
+ * The caller has to hold a reference to the root tree while calling it.
+ * The object gets a reference of its own that is dropped when disposing of it
  */
 gitmod_object *gitmod_root_tree_get_object(gitmod_info * info, gitmod_root_tree * tree, const char *path);
 
+/**
+ * Set up all paths of a root tree that keeps objects in memory instead of waiting for them to be accessed.
+ * Directories are spread among one worker per repo handle of repos (the calling thread is the first one).
+ * If blobs is set, blobs that would not be streamed are loaded as well.
+ * Workers stop as soon as cancel (optional) is set.
+ * Will return 0 on success
+ */
+int gitmod_root_tree_preload(gitmod_info * info, gitmod_root_tree * root_tree, GPtrArray * repos, int blobs,
+			     const int *cancel, gitmod_preload_stats * stats);
+
 /**
  * Pass in the _current_ root tree.
  * The object's root tree will be asked to decrease its usage
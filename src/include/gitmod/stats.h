@@ -0,0 +1,82 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_STATS_H
+#define GITMOD_STATS_H
+
+#include <glib.h>
+#include "types.h"
+
+/**
+ * Latency histograms of operations and counters. Each thread records into a slot of its own without
+ * taking locks so recording is cheap. Slots are only added up when the stats are read.
+ * Will return NULL if there is an error
+ */
+gitmod_stats *gitmod_stats_create();
+
+/**
+ * Name of the operation as used in the report
+ */
+const char *gitmod_stats_op_name(enum gitmod_stats_op op);
+
+/**
+ * Monotonic time in ns, to be used as start of gitmod_stats_record
+ */
+uint64_t gitmod_stats_now();
+
+/**
+ * Record the latency of an operation that started at start (gitmod_stats_now)
+ */
+void gitmod_stats_record(gitmod_stats * stats, enum gitmod_stats_op op, uint64_t start);
+
+/**
+ * Record a latency (in ns)
+ */
+void gitmod_stats_record_latency(gitmod_stats * stats, enum gitmod_stats_op op, uint64_t latency);
+
+void gitmod_stats_add(gitmod_stats * stats, enum gitmod_stats_counter counter, uint64_t value);
+
+uint64_t gitmod_stats_get_counter(gitmod_stats * stats, enum gitmod_stats_counter counter);
+
+/**
+ * Operations recorded so far
+ */
+uint64_t gitmod_stats_get_count(gitmod_stats * stats, enum gitmod_stats_op op);
+
+/**
+ * Latency (in ns) under which quantile (0 to 1) of the operations took. It's the upper bound of its bucket.
+ * 0 if nothing was recorded
+ */
+uint64_t gitmod_stats_get_quantile(gitmod_stats * stats, enum gitmod_stats_op op, double quantile);
+
+/**
+ * Bucket of the histograms a latency (in ns) is counted in
+ */
+int gitmod_stats_bucket(uint64_t latency);
+
+/**
+ * Highest latency that is counted in a bucket
+ */
+uint64_t gitmod_stats_bucket_limit(int bucket);
+
+/**
+ * Same as gitmod_stats_get_quantile, for a histogram of GITMOD_STATS_BUCKETS buckets with count latencies
+ */
+uint64_t gitmod_stats_quantile(uint64_t * latencies, uint64_t count, double quantile);
+
+/**
+ * Append a histogram of GITMOD_STATS_BUCKETS buckets as metric{label="value"} in Prometheus text format
+ */
+void gitmod_stats_write_histogram(GString * out, const char *metric, const char *label, const char *value,
+				  uint64_t * latencies, uint64_t count, uint64_t sum);
+
+/**
+ * Append the histograms and counters to out in Prometheus text format
+ */
+void gitmod_stats_write(gitmod_stats * stats, GString * out);
+
+void gitmod_stats_dispose(gitmod_stats ** stats);
+
+#endif
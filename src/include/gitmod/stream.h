@@ -0,0 +1,34 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_STREAM_H
+#define GITMOD_STREAM_H
+
+#include "types.h"
+
+#define GITMOD_STREAM_DEFAULT_THRESHOLD (64 * 1024 * 1024)
+#define GITMOD_STREAM_DEFAULT_WINDOW (1024 * 1024)
+#define GITMOD_STREAM_CHECKPOINT_CHUNKS 16	// chunks inflated between checkpoints (to begin with)
+#define GITMOD_STREAM_MAX_CHECKPOINTS 64
+
+/**
+ * Open a stream to read the content of a blob incrementally.
+ * Only window_size bytes of inflated content are kept in memory.
+ *
+ * Streams can be used on loose objects and on blobs that are in a pack without deltas (their entry is inflated
+ * from its offset in the pack). Will return NULL otherwise (or if there is an error, or if size does not match)
+ * and then the blob has to be loaded as usual.
+ */
+gitmod_stream *gitmod_stream_open(git_repository * repo, const git_oid * oid, int64_t size, size_t window_size);
+
+/**
+ * Read up to size bytes from offset.
+ * Will return the number of bytes copied into buf or a negative errno value
+ */
+int gitmod_stream_read(gitmod_stream * stream, char *buf, size_t size, int64_t offset);
+
+void gitmod_stream_close(gitmod_stream ** stream);
+
+#endif
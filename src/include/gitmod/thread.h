@@ -11,8 +11,10 @@
 /**
  * Crete and start the thread.
  * delay is used in milliseconds. 0 means it's a tight loop
+ * If watch is provided, the task is run when the watch reports changes instead of every delay ms
  */
-gitmod_thread *gitmod_thread_create(gitmod_info * info, void (*task)(gitmod_thread *), int delay);
+gitmod_thread *gitmod_thread_create(gitmod_info * info, void (*task)(gitmod_thread *), int delay,
+				    gitmod_watch * watch);
 
 void gitmod_thread_set_delay(gitmod_thread * thread, int delay);
 
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_TRACE_H
+#define GITMOD_TRACE_H
+
+#include "types.h"
+
+// set with gitmod_trace_set_enabled. Only read through the macros
+extern int gitmod_trace_enabled;
+
+#define gitmod_trace_is_enabled() __atomic_load_n(&gitmod_trace_enabled, __ATOMIC_RELAXED)
+
+/**
+ * Start of a span (gitmod_stats_now) or 0 if tracing is off
+ */
+#define gitmod_trace_begin() (gitmod_trace_is_enabled() ? gitmod_stats_now() : 0)
+
+/**
+ * Record a span that started at start (gitmod_trace_begin). Nothing is done if tracing was off when it started
+ */
+#define gitmod_trace_end(event, detail, start, arg) \
+	do { \
+		if (start) \
+			gitmod_trace_write(event, detail, start, arg); \
+	} while (0)
+
+/**
+ * Record an event that has no duration
+ */
+#define gitmod_trace_instant(event, detail, arg) \
+	do { \
+		if (gitmod_trace_is_enabled()) \
+			gitmod_trace_write(event, detail, 0, arg); \
+	} while (0)
+
+/**
+ * Events are written into a ring of the calling thread without taking locks. start 0 means it's instant
+ */
+void gitmod_trace_write(enum gitmod_trace_event event, uint16_t detail, uint64_t start, uint64_t arg);
+
+void gitmod_trace_set_enabled(int enabled);
+
+/**
+ * Write the events that are in the rings of all threads into fd (a header followed by records, oldest first
+ * for each thread). Events being written while dumping are left out.
+ * Will return the number of records written or a negative errno value
+ */
+int gitmod_trace_dump(int fd);
+
+/**
+ * Same as gitmod_trace_dump, appending to out. Events are not consumed by dumps so it can be taken any time
+ */
+int gitmod_trace_snapshot(GString * out);
+
+/**
+ * Same as gitmod_trace_dump, into the file at path (replacing it)
+ */
+int gitmod_trace_dump_file(const char *path);
+
+/**
+ * Dump into the file at path every time signo is received. signo is blocked in the calling thread and a
+ * thread waits for it so this has to be called before other threads are created.
+ * Will return 0 on success
+ */
+int gitmod_trace_dump_on_signal(int signo, const char *path);
+
+/**
+ * Name of an event (and its detail) as shown in the converted trace
+ */
+const char *gitmod_trace_event_name(uint16_t event, uint16_t detail);
+
+#endif
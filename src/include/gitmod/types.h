@@ -9,6 +9,7 @@
 #include <git2.h>
 #include <pthread.h>
 #include <glib.h>
+#include <zlib.h>
 
 enum gitmod_object_type {
 	GITMOD_OBJECT_UNKNOWN,
@@ -16,47 +17,525 @@ enum gitmod_object_type {
 	GITMOD_OBJECT_BLOB
 };
 
+typedef struct {
+	int wd;			// inotify watch descriptor of the directory
+	char *name;		// file we care about inside of the directory
+} gitmod_watch_item;
+
+typedef struct {
+	int fd;			// inotify instance
+	git_repository *repo;
+	const char *treeish;
+	GPtrArray *items;	// gitmod_watch_item
+	unsigned long refreshes;	// (atomic) times the watches were set up
+} gitmod_watch;
+
 typedef struct {
 	void (*task)();		// task that will be called during refresh cycle
 	pthread_t thread;	// pthread instance
 	int run_thread;
 	int delay;		// delay in milliseconds (0 means it's a tight loop). Default will be set to 100
 	void *payload;
+	int wake_fd;		// eventfd used to wake up the thread right away (like when releasing it)
+	gitmod_watch *watch;	// if set, the task is run when the watch reports changes instead of every delay ms
 } gitmod_thread;
 
+/**
+ * Lockers are counted by class when building with GITMOD_LOCK_STATS
+ */
+enum gitmod_lock_class {
+	GITMOD_LOCK_OTHER,
+	GITMOD_LOCK_INFO,	// held while the root tree is replaced
+	GITMOD_LOCK_ROOT_TREE,	// held while publishing the entries of a directory
+	GITMOD_LOCK_CACHE,	// charges and evictions of the objects cache
+	GITMOD_LOCK_OBJECT,	// blob and usage of an object
+	GITMOD_LOCK_CONTENT,	// content store
+	GITMOD_LOCK_INODES,	// inode table
+	GITMOD_LOCK_BLOB_CACHE,
+	GITMOD_LOCK_STREAM,
+	GITMOD_LOCK_CACHE_SHARD,	// items of a shard of a cache (rwlock)
+	GITMOD_LOCK_CACHE_WAIT,	// waits for items of a cache being loaded by other threads
+	GITMOD_LOCK_LOG,	// starting/stopping and draining the logging rings
+	GITMOD_LOCK_EPOCH,	// writers waiting for the readers of an epoch (no lock is taken)
+	GITMOD_LOCK_CLASSES
+};
+
 typedef struct {
 	pthread_mutex_t lock;
+#ifdef GITMOD_LOCK_STATS
+	int lock_class;
+	uint64_t acquired_at;	// ns (gitmod_stats_now). Only used by the thread that holds it
+#endif
 } gitmod_locker;
 
+/**
+ * For lockers that are static
+ */
+#ifdef GITMOD_LOCK_STATS
+#define GITMOD_LOCKER_INITIALIZER(lock_class) { PTHREAD_MUTEX_INITIALIZER, lock_class, 0 }
+#else
+#define GITMOD_LOCKER_INITIALIZER(lock_class) { PTHREAD_MUTEX_INITIALIZER }
+#endif
+
 typedef struct {
-	GHashTable *items;
-	gitmod_locker *locker;
-	int fixed;		// no more items will be added. If asking for a key and it doesn't exist, will return NULL
-} gitmod_cache;
+	pthread_rwlock_t lock;
+#ifdef GITMOD_LOCK_STATS
+	int lock_class;
+	uint64_t acquired_at;	// ns (gitmod_stats_now). Only used by the writer that holds it
+#endif
+} gitmod_rwlocker;
+
+typedef struct {
+	uint64_t acquisitions;
+	uint64_t contended;	// acquisitions that had to wait
+	uint64_t wait;		// ns waited, in total
+	uint64_t wait_p99;	// ns waited by 99% of the contended acquisitions (or less)
+	uint64_t max_hold;	// ns
+} gitmod_lock_stats;
+
+/**
+ * A place in the code that logs. Messages of a site are rate limited together
+ */
+typedef struct gitmod_log_site {
+	const char *file;
+	int line;
+	long window;		// second the messages are being counted for (atomic)
+	unsigned int count;	// messages in the window (atomic)
+	unsigned long suppressed;	// messages that were dropped by the rate limit (atomic)
+	int listed;		// it's in the list of sites that had messages suppressed (atomic)
+	struct gitmod_log_site *next;	// in that list
+	long reported;		// second suppressed messages were last reported (only used by the logging thread)
+} gitmod_log_site;
+
+#define GITMOD_LOG_MESSAGE_SIZE 256
+#define GITMOD_LOG_RING_SIZE 128	// power of 2
+
+typedef struct {
+	int level;
+	char message[GITMOD_LOG_MESSAGE_SIZE];
+} gitmod_log_entry;
+
+/**
+ * Messages of a thread waiting to be written into syslog. Only the thread that owns it writes into it,
+ * only the logging thread reads from it
+ */
+typedef struct gitmod_log_ring {
+	struct gitmod_log_ring *next;
+	int in_use;		// owned by a thread (atomic). Rings of threads that are gone are taken by new threads
+	unsigned int head;	// next entry to be written (atomic)
+	unsigned int tail;	// next entry to be read (atomic)
+	unsigned long dropped;	// messages that did not fit (atomic)
+	unsigned long reported;	// dropped messages that were reported already (only used by the logging thread)
+	gitmod_log_entry entries[GITMOD_LOG_RING_SIZE];
+} gitmod_log_ring;
+
+enum gitmod_stats_op {
+	GITMOD_STATS_LOOKUP,
+	GITMOD_STATS_GETATTR,
+	GITMOD_STATS_OPENDIR,
+	GITMOD_STATS_READDIR,
+	GITMOD_STATS_READDIRPLUS,
+	GITMOD_STATS_OPEN,
+	GITMOD_STATS_READ,
+	GITMOD_STATS_RELEASE,
+	GITMOD_STATS_OPS
+};
+
+enum gitmod_stats_counter {
+	GITMOD_STATS_ITEMS_READY,	// lookups of paths whose object was set up already (not blob residency)
+	GITMOD_STATS_ITEMS_NOT_READY,	// lookups of paths whose object had to be set up (or waited for)
+	GITMOD_STATS_BLOB_LOADS,
+	GITMOD_STATS_BLOB_BYTES,	// inflated to be kept in memory
+	GITMOD_STATS_STREAMED_BYTES,	// inflated while streaming
+	GITMOD_STATS_COUNTERS
+};
+
+// latencies (in ns) are counted in buckets of 8 per power of 2 (HDR style, ~12% precision)
+#define GITMOD_STATS_SUB_BUCKET_BITS 3
+#define GITMOD_STATS_SUB_BUCKETS (1 << GITMOD_STATS_SUB_BUCKET_BITS)
+#define GITMOD_STATS_MAX_EXPONENT 40	// ~18 minutes. Anything longer is counted in the last bucket
+#define GITMOD_STATS_BUCKETS ((GITMOD_STATS_MAX_EXPONENT - GITMOD_STATS_SUB_BUCKET_BITS + 2) * GITMOD_STATS_SUB_BUCKETS)
+
+/**
+ * Everything recorded by a thread. Only the thread that owns it writes into it, readers add up all slots
+ */
+typedef struct gitmod_stats_slot {
+	struct gitmod_stats_slot *next;
+	int in_use;		// owned by a thread (atomic). Slots of threads that are gone are taken by new threads
+	uint64_t latencies[GITMOD_STATS_OPS][GITMOD_STATS_BUCKETS];
+	uint64_t latency_sums[GITMOD_STATS_OPS];
+	uint64_t counters[GITMOD_STATS_COUNTERS];
+} gitmod_stats_slot;
+
+typedef struct {
+	gitmod_stats_slot *slots;	// (atomic) slots are added at the head and never removed
+	pthread_key_t key;	// slot of each thread
+} gitmod_stats;
+
+/**
+ * What a thread recorded about the lockers it took. Same as gitmod_stats_slot
+ */
+typedef struct gitmod_lock_stats_slot {
+	struct gitmod_lock_stats_slot *next;
+	int in_use;		// owned by a thread (atomic)
+	uint64_t acquisitions[GITMOD_LOCK_CLASSES];
+	uint64_t contended[GITMOD_LOCK_CLASSES];
+	uint64_t waits[GITMOD_LOCK_CLASSES][GITMOD_STATS_BUCKETS];	// of contended acquisitions
+	uint64_t wait_sums[GITMOD_LOCK_CLASSES];
+	uint64_t max_hold[GITMOD_LOCK_CLASSES];
+} gitmod_lock_stats_slot;
+
+enum gitmod_trace_event {
+	GITMOD_TRACE_FUSE_OP,	// detail is the operation (gitmod_stats_op), arg is the inode
+	GITMOD_TRACE_ITEM_READY,	// arg is the hash of the path
+	GITMOD_TRACE_ITEM_NOT_READY,
+	GITMOD_TRACE_BLOB_LOAD,	// arg is the size of the blob
+	GITMOD_TRACE_HEADER_READ,
+	GITMOD_TRACE_DIR_SETUP,	// arg is the number of entries
+	GITMOD_TRACE_ROOT_TREE_SETUP,	// arg is the number of directories that can be carried over
+	GITMOD_TRACE_ROOT_TREE_SWAP,	// arg is the number of changes so far
+	GITMOD_TRACE_LOCK_WAIT,	// arg is the address of the lock
+	GITMOD_TRACE_EVENTS
+};
+
+/**
+ * A timestamped event, as it's kept in memory and written in dumps
+ */
+typedef struct {
+	uint64_t start;		// ns (CLOCK_MONOTONIC)
+	uint64_t duration;	// ns. 0 for instant events
+	uint64_t arg;
+	uint32_t tid;
+	uint16_t event;
+	uint16_t detail;
+} gitmod_trace_record;
 
+#define GITMOD_TRACE_RING_SIZE 8192	// records of each thread (power of 2). Older ones are overwritten
+
+/**
+ * Last events of a thread. Only the thread that owns it writes into it
+ */
+typedef struct gitmod_trace_ring {
+	struct gitmod_trace_ring *next;
+	int in_use;		// owned by a thread (atomic). Rings of threads that are gone are taken by new threads
+	uint32_t tid;
+	uint64_t head;		// records written so far (atomic)
+	gitmod_trace_record records[GITMOD_TRACE_RING_SIZE];
+} gitmod_trace_ring;
+
+#define GITMOD_TRACE_MAGIC "gmtrace"
+#define GITMOD_TRACE_VERSION 1
+
+/**
+ * Dumps start with it, records follow
+ */
 typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} gitmod_trace_header;
+
+typedef struct gitmod_arena_block {
+	struct gitmod_arena_block *next;
+	size_t size;		// bytes of data
+	size_t used;		// bytes of data handed out (atomic). Can go over size when the block is full
+	char data[] __attribute__((aligned(16)));
+} gitmod_arena_block;
+
+typedef struct {
+	gitmod_arena_block *block;	// block allocations are taken from (atomic)
+	gitmod_arena_block *full;	// blocks that were filled up and big allocations
+	gitmod_locker lock;	// held while adding blocks
+	size_t block_size;
+	size_t bytes;		// bytes taken from the system (atomic)
+	size_t used;		// bytes handed out (atomic)
+} gitmod_arena;
+
+/**
+ * Called to release the heavy part of the content of an item when the cache goes over its budget.
+ * Has to return 0 if it was released, non-zero if it can't be released at the moment (it's in use)
+ */
+typedef int (*gitmod_cache_evict_func)(const void *content);
+
+enum gitmod_cache_item_state {
+	GITMOD_CACHE_ITEM_EMPTY,
+	GITMOD_CACHE_ITEM_LOADING,	// a thread claimed it and is setting up its content
+	GITMOD_CACHE_ITEM_WAITING,	// loading and other threads are waiting for the content
+	GITMOD_CACHE_ITEM_READY
+};
+
+typedef struct gitmod_cache_item {
 	const void *content;	// DO NOT ACCESS THIS DIRECTLY. use gitmod_cache_item_get, gitmod_cache_item_set
-	gitmod_locker *locker;
+	char *id;
+	guint hash;		// hash of id, computed once
+	int state;		// gitmod_cache_item_state (atomic)
+	struct gitmod_cache_item *next;	// next item in the same bucket
+	size_t charge;		// bytes charged to this item
+	int referenced;		// used since the CLOCK hand went over it
+	int busy;		// (atomic) in use when the CLOCK hand went over it, kept out of charged
+	guint slot;		// position in charged (or busy)
 } gitmod_cache_item;
 
+#define GITMOD_CACHE_SHARDS 64	// power of 2
+#define GITMOD_CACHE_SHARD_MIN_BUCKETS 8	// power of 2
+
+typedef struct {
+	gitmod_rwlocker lock;
+	gitmod_cache_item **buckets;
+	guint num_buckets;	// power of 2
+	guint size;
+} __attribute__((aligned(64))) gitmod_cache_shard;
+
+typedef struct {
+	gitmod_cache_shard shards[GITMOD_CACHE_SHARDS];	// items are spread over shards by hash
+	int size;		// atomic
+	GDestroyNotify key_destroy_func;
+	GDestroyNotify value_destroy_func;
+	gitmod_locker *locker;	// protects charges/eviction
+	size_t budget;		// in bytes. 0 means there is no limit
+	size_t bytes;		// bytes charged to items at the moment
+	GPtrArray *charged;	// items that were charged and can be evicted, in CLOCK order
+	GPtrArray *busy;	// charged items that were in use. Back to charged when they are idle again
+	guint hand;		// position of the CLOCK hand in charged
+	gitmod_cache_evict_func evict;
+	gitmod_arena *arena;	// if set, items and their ids are allocated from it
+	gitmod_stats *recorder;	// ready/not ready lookups are recorded into it, if set
+	uint64_t ready_base;	// ready lookups of the recorder when it was set
+	uint64_t not_ready_base;
+	unsigned long evictions;
+} gitmod_cache;
+
+typedef struct {
+	unsigned long ready;	// lookups that found the content of the item set up (whatever it holds)
+	unsigned long not_ready;	// lookups that had to set it up or wait for it
+	unsigned long evictions;
+	size_t bytes;
+	size_t budget;
+} gitmod_cache_stats;
+
+typedef struct {
+	int64_t offset;		// offset in the content of the blob
+	off_t file_offset;	// offset in the object file where compressed input has to be read from
+	z_stream state;
+} gitmod_stream_checkpoint;
+
+typedef struct {
+	int fd;			// loose object file
+	z_stream zs;
+	int64_t size;		// size of the content of the blob
+	int64_t position;	// offset in the content of the next byte that will be inflated
+	off_t file_offset;	// offset in the object file of the next compressed byte to read
+	unsigned char *input;
+	unsigned char *window;	// last chunk that was inflated
+	size_t window_size;
+	size_t window_len;
+	int64_t window_offset;
+	gitmod_stream_checkpoint **checkpoints;	// sorted by offset. zlib states can't be moved around in memory
+	int num_checkpoints;
+	int64_t checkpoint_interval;
+	gitmod_locker *lock;
+} gitmod_stream;
+
+typedef struct gitmod_content {
+	git_oid oid;
+	git_object *object;	// blob or tree. NULL while loading (or if it could not be loaded)
+	size_t size;		// bytes held by blobs
+	int refcount;		// users (or threads waiting for it to load). Only gets to 0 with the lock (atomic)
+	int loading;		// a thread is loading it, others wait for it instead of loading it again
+	int retained;		// not referenced but kept for a new root tree
+	time_t released;	// when it was retained
+	struct gitmod_content *prev;	// retained list of its shard
+	struct gitmod_content *next;
+} gitmod_content;
+
+#define GITMOD_CONTENT_RETAIN_AGE 300	// seconds retained content is kept, at most
+#define GITMOD_CONTENT_RETAIN_BUDGET (256 * 1024 * 1024)	// bytes of retained blobs, at most
+#define GITMOD_CONTENT_SHARDS 64	// power of 2
+
+typedef struct {
+	GHashTable *items;	// gitmod_content by OID
+	gitmod_locker lock;
+	pthread_cond_t loaded;	// signaled when content of the shard is done loading
+	gitmod_content *retained;	// oldest retained content first
+	gitmod_content *retained_last;
+} __attribute__((aligned(64))) gitmod_content_shard;
+
 typedef struct {
+	gitmod_content_shard shards[GITMOD_CONTENT_SHARDS];	// content is spread over shards by OID
+	size_t bytes;		// (atomic)
+	size_t retained_bytes;	// of all shards (atomic)
+	size_t retain_budget;	// 0 means there is no limit (atomic)
+	time_t retain_age;	// 0 means there is no limit (atomic)
+	unsigned long hits;	// requests served with content that was in memory already (atomic)
+	unsigned long loads;	// (atomic)
+	unsigned long coalesced;	// requests that waited for content another thread was loading (atomic)
+	unsigned long expired;	// retained content that was freed before the root tree changed (atomic)
+	gitmod_stats *recorder;	// blob loads are recorded into it, if set
+} gitmod_content_store;
+
+typedef struct {
+	git_repository **repos;
+	int size;
+	pthread_key_t key;	// handle used by each thread
+	unsigned int next;	// next handle to be assigned to a thread (atomic)
+} gitmod_repo_pool;
+
+enum gitmod_blob_cache_state {
+	GITMOD_BLOB_CACHE_NOT_ADMITTED,
+	GITMOD_BLOB_CACHE_WRITING,	// waiting for the writer or being written by it
+	GITMOD_BLOB_CACHE_UNVERIFIED,	// a file left by a previous run. Its content is checked on its first open
+	GITMOD_BLOB_CACHE_VERIFYING,	// waiting for the writer or being checked by it
+	GITMOD_BLOB_CACHE_READY
+};
+
+typedef struct gitmod_blob_cache_entry {
+	git_oid oid;
+	int state;		// gitmod_blob_cache_state
+	int opens;		// times it was opened, used for admission
+	int refs;		// open files reading from it. Its file can't be removed while in use
+	int fd;			// only open while in use
+	size_t size;
+	struct gitmod_blob_cache_entry *lru_prev;	// in the list of files that are not in use
+	struct gitmod_blob_cache_entry *lru_next;
+	struct gitmod_blob_cache_entry *queue_next;	// in the queue of the writer
+} gitmod_blob_cache_entry;
+
+typedef struct {
+	char *dir;		// files are named by the OID of the blob
+	GHashTable *entries;	// gitmod_blob_cache_entry by OID. Entries are never removed
+	gitmod_locker *lock;
+	int64_t min_size;	// smaller blobs are not written to the cache
+	int admit_opens;	// blobs are written to the cache after being opened this many times
+	int64_t admit_size;	// blobs of this size or bigger are written on the first open
+	size_t budget;		// bytes of files kept in the cache. Unused files are removed when going over it
+	size_t bytes;
+	gitmod_blob_cache_entry *lru_first;	// files that are not in use, least recently used first
+	gitmod_blob_cache_entry *lru_last;
+	gitmod_blob_cache_entry *queue_first;	// files to be written or checked by the writer
+	gitmod_blob_cache_entry *queue_last;
+	gitmod_blob_cache_entry *busy;	// the one the writer is working on
+	pthread_cond_t work;	// signaled when an entry is queued or when stopping
+	pthread_cond_t idle;	// signaled when the writer is done with an entry
+	pthread_t writer;	// writes (and checks) files so that opens don't wait for them
+	int writer_started;
+	int stopping;
+	char *repo_path;	// the writer reads blobs with a repo handle of its own
+	unsigned long hits;
+	unsigned long writes;
+	unsigned long removals;
+	unsigned long rejected;	// files left by a previous run that did not hold their blob
+} gitmod_blob_cache;
+
+#define GITMOD_EPOCH_STRIPES 64
+
+typedef struct {
+	int count;
+} __attribute__((aligned(64))) gitmod_epoch_readers;
+
+typedef struct {
+	unsigned int current;	// readers register on the counters of its parity
+	gitmod_epoch_readers readers[2][GITMOD_EPOCH_STRIPES];
+} gitmod_epoch;
+
+typedef struct gitmod_cache_node {
+	char *name;
+	git_oid oid;
+	enum gitmod_object_type type;
+	int mode;
+	GHashTable *children;	// gitmod_cache_node by name. Trees only, set up with all of its entries on first access
+	int complete;		// children holds every entry of the tree (atomic). Names that are not there don't exist
+	gitmod_cache_item *item;	// item of this path in the objects cache. Set up on first access (atomic)
+	struct gitmod_cache_node *previous;	// same path in the previous root tree. Only used while it's held
+} gitmod_cache_node;
+
+typedef struct gitmod_root_tree {
 	git_tree *tree;
 	time_t time;
-	gitmod_locker *lock;
-	int usage_counter;
-	int marked_for_deletion;
+	int usage_counter;	// cached objects that are being used (atomic)
+	int refs;		// objects using it + 1 while it is published. Disposed of when it reaches 0 (atomic)
+	int marked_for_deletion;	// it was replaced (atomic)
 	gitmod_cache *objects_cache;	// gitmod_objects will be held by PATH
+	gitmod_cache_node *root_node;	// paths of the objects cache. Directories are set up when they are accessed
+	gitmod_locker *nodes_lock;	// held while publishing the entries of a directory
+	int populated_dirs;	// (atomic)
+	gitmod_arena *arena;	// nodes, items and objects of the cache. Released all at once with the root tree
+	struct gitmod_root_tree *previous;	// paths take what was set up in it when accessed (nodes_lock, atomic)
+	time_t created;		// monotonic seconds. previous is dropped when it gets old
 } gitmod_root_tree;
 
 typedef struct {
 	git_tree *tree;
-	git_blob *blob;
+	git_blob *blob;		// only loaded when content is requested. use gitmod_object_get_content
+	gitmod_locker lock;	// protects blob and usage
+	gitmod_content *content;	// shared content the tree/blob comes from, if a content store is used
+	gitmod_content_store *store;
+	git_oid oid;
+	enum gitmod_object_type type;
+	size_t size;		// taken from the ODB header so that the blob does not need to be inflated
+	git_repository *repo;	// used to load the blob on demand
+	gitmod_repo_pool *repos;	// if set, the handle of the calling thread is used instead of repo
 	char *name;		// local name, _not_ fullpath
 	char *path;		// full path
 	int mode;
 	gitmod_root_tree *root_tree;	// tree that was used to associate this object
+	int usage;		// holders of a cached object. Its blob can't be evicted while in use
+	gitmod_cache *cache;	// cache (and item) the object is kept in, if any
+	gitmod_cache_item *cached_item;
+	int in_arena;		// the object, its name and its path belong to the arena of its root tree
 } gitmod_object;
 
+typedef struct {
+	uint64_t ino;
+	guint64 identity;	// hash of path, oid and mode. The inode number is derived from it
+	char *path;		// full path
+	char *name;
+	git_oid oid;
+	enum gitmod_object_type type;
+	int mode;
+	int64_t size;		// blobs only
+	int num_entries;	// trees only (atomic, the root inode is updated when the root tree moves)
+	gitmod_content *content;	// tree used to look up entries. Not set on the root inode (uses the root tree)
+	uint64_t nlookup;	// lookups the kernel remembers. Released when it gets to 0
+	int cached_opens;	// open files that are not passed through to the blob cache (atomic)
+} gitmod_inode;
+
+typedef struct {
+	GHashTable *inodes;	// gitmod_inode by inode number
+	GHashTable *identities;	// gitmod_inode by identity (path, oid, mode)
+	gitmod_inode *root;
+	time_t time;		// revision time of the root tree, reported for every inode (atomic)
+	gitmod_content_store *store;
+	gitmod_locker *lock;
+} gitmod_inode_table;
+
+typedef struct {
+	gitmod_inode *dir;
+	git_tree *tree;		// entries are served from it until the directory is released
+	gitmod_root_tree *root_tree;	// only held for the root inode
+	gitmod_content *content;	// only held for other directories
+	git_odb *odb;
+	unsigned long root_tree_changes;	// times the root tree was replaced before it was opened
+} gitmod_inode_dir;
+
+typedef struct {
+	int dirs;
+	int objects;
+	int blobs;
+	size_t bytes;		// of blobs
+	long millis;
+} gitmod_preload_stats;
+
+/**
+ * Called when the kernel can't keep using what it knows about an entry of a directory (or about the directory itself
+ * if name is NULL)
+ */
+typedef void (*gitmod_invalidate_func)(void *payload, uint64_t parent, const char *name);
+
+/**
+ * Called once gitmod is ready
+ */
+typedef void (*gitmod_ready_func)(void *payload);
+
 typedef struct {
 	git_repository *repo;
 	const char *treeish;	// treeish that is asked to track
@@ -65,7 +544,39 @@ typedef struct {
 	int gid;		// provided by fuse
 	int uid;		// provided by fuse
 	gitmod_locker *lock;
+	gitmod_epoch root_tree_epoch;	// root_tree is read by FUSE ops without taking locks
 	gitmod_thread *root_tree_monitor;
+	gitmod_watch *root_tree_watch;
+	int64_t stream_threshold;	// blobs of this size or bigger are streamed when read. 0 means never
+	size_t cache_budget;	// bytes of blobs kept in memory per root tree. 0 means there is no limit (atomic)
+	gitmod_content_store *content_store;	// trees/blobs shared by all root trees
+	gitmod_repo_pool *repos;	// (atomic) handles used to read objects. Optional, repo is used otherwise
+	gitmod_inode_table *inodes;	// inodes the kernel knows about (low-level FUSE frontend)
+	gitmod_invalidate_func invalidate;	// (atomic)
+	void *invalidate_payload;
+	unsigned long root_tree_changes;	// times the root tree was replaced (atomic)
+	gitmod_blob_cache *blob_cache;	// hot/large blobs written to local files. Optional
+	GPtrArray *preload_repos;	// one repo handle per preload worker. Root trees are preloaded if set
+	int preload_blobs;	// blobs are loaded as well when preloading
+	pthread_t preload_thread;	// preloads the current root tree in the background
+	int preload_started;	// preload_thread has to be joined
+	int preload_cancel;	// (atomic) the preload going on has to stop (the root tree moved or gitmod is stopping)
+	gitmod_locker preload_lock;	// held while starting/joining preload_thread
+	int warming_up;		// (atomic) the first root tree is being preloaded
+	int stopping;		// background work has to be dropped (atomic)
+	gitmod_ready_func ready;	// (atomic) cleared once it is called
+	void *ready_payload;
+	gitmod_stats *stats;	// latencies of FUSE operations and counters of what goes on inside
 } gitmod_info;
 
+typedef struct {
+	gitmod_object *object;
+	gitmod_stream *stream;	// only set up for blobs that are streamed
+	gitmod_blob_cache *blob_cache;
+	int fd;			// file of the blob in the blob cache. -1 if it's not used
+	gitmod_inode *inode;	// set up by the frontend
+	int backing_id;		// set up by the frontend if the kernel reads from fd directly
+	gitmod_stats *recorder;	// streamed bytes are recorded into it
+} gitmod_file;
+
 #endif
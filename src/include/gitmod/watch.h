@@ -0,0 +1,38 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ */
+
+#ifndef GITMOD_WATCH_H
+#define GITMOD_WATCH_H
+
+#include "types.h"
+
+// minimum milliseconds between checks when watching, in case an event is missed. The refresh delay is used if longer
+#define GITMOD_WATCH_FALLBACK_DELAY 10000
+#define GITMOD_WATCH_QUIET_TIME 10	// milliseconds without events before considering a burst of updates done
+#define GITMOD_WATCH_MAX_COALESCE 100	// maximum milliseconds a burst of updates can be coalesced
+
+/**
+ * Watch (with inotify) the files that can make a treeish move:
+ * the reference itself (and the targets of symbolic references), packed-refs and HEAD.
+ *
+ * Will return NULL if the treeish is not a reference (or inotify can't be used).
+ * In that case, the treeish has to be polled.
+ */
+gitmod_watch *gitmod_watch_create(git_repository * repo, const char *treeish);
+
+/**
+ * Drain the events of the watch. Will return non-zero if any of them is about the files we care about.
+ */
+int gitmod_watch_read_events(gitmod_watch * watch);
+
+/**
+ * Set up the watches again (references could have been created/deleted or could point somewhere else now).
+ * Directories that are still needed keep their watches
+ */
+int gitmod_watch_refresh(gitmod_watch * watch);
+
+void gitmod_watch_dispose(gitmod_watch ** watch);
+
+#endif
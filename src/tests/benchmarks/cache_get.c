@@ -0,0 +1,97 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * cache get benchmark
+ *  Threads look up random paths of a cache (like FUSE ops do on a --kim root tree)
+ *  and we report how many lookups can be done per second for 1 to 64 threads.
+ *
+ *    ./tests/bench_cache_get [--paths=<n>] [--seconds=<n>]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+static gitmod_cache *cache;
+static char **paths;
+static int num_paths = 100000;
+static int run;
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *lookup_paths(void *params)
+{
+	unsigned int seed = (unsigned long)params;
+	long ops = 0;
+	while (__atomic_load_n(&run, __ATOMIC_RELAXED)) {
+		// check the clock once in a while only
+		for (int i = 0; i < 1024; i++)
+			gitmod_cache_get(cache, paths[rand_r(&seed) % num_paths]);
+		ops += 1024;
+	}
+	return (void *)ops;
+}
+
+int main(int argc, char *argv[])
+{
+	int seconds = 2;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--paths=", 8))
+			num_paths = atoi(argv[i] + 8);
+		else if (!strncmp(argv[i], "--seconds=", 10))
+			seconds = atoi(argv[i] + 10);
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	cache = gitmod_cache_create(NULL, NULL);
+	paths = calloc(num_paths, sizeof(char *));
+	if (!(cache && paths)) {
+		fprintf(stderr, "Could not set up the cache\n");
+		return 1;
+	}
+	char path[64];
+	for (int i = 0; i < num_paths; i++) {
+		sprintf(path, "/dir-%d/some-file-%d.txt", i % 100, i);
+		paths[i] = strdup(path);
+		gitmod_cache_get(cache, path);
+	}
+
+	printf("paths: %d\n", num_paths);
+	pthread_t threads[64];
+	struct timespec start, end;
+	for (int num_threads = 1; num_threads <= 64; num_threads *= 2) {
+		run = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < num_threads; i++)
+			pthread_create(&threads[i], NULL, lookup_paths, (void *)(i + 1));
+		sleep(seconds);
+		__atomic_store_n(&run, 0, __ATOMIC_RELAXED);
+		long ops = 0;
+		void *thread_ops;
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], &thread_ops);
+			ops += (long)thread_ops;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double elapsed = elapsed_seconds(&start, &end);
+		printf("threads: %2d lookups: %ld elapsed: %.3f s throughput: %.0f lookups/s\n", num_threads, ops,
+		       elapsed, ops / elapsed);
+	}
+
+	for (int i = 0; i < num_paths; i++)
+		free(paths[i]);
+	free(paths);
+	gitmod_cache_dispose(&cache);
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * getattr benchmark
+ *  Does the same work that gitmod_fs_getattr does for every blob of a tree
+ *  and reports how many of them can be done per second.
+ *
+ *  Create a repo with large blobs with tests/create_bench_repo.sh and then run:
+ *    ./tests/bench_getattr [--kim] [--load-content] [--iterations=<n>] [--repo=<path>] [--treeish=<treeish>]
+ *
+ *  --load-content also requests the content of each blob, which is what getattr used to pay
+ *  for when the blob was inflated to get its size.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "gitmod.h"
+
+static void collect_paths(gitmod_info *info, gitmod_object *tree, GPtrArray *paths)
+{
+	int num_items = gitmod_object_get_num_entries(tree);
+	gitmod_object *entry;
+	for (int i = 0; i < num_items; i++) {
+		entry = gitmod_get_tree_entry(info, tree, i);
+		if (!entry)
+			continue;
+		if (gitmod_object_get_type(entry) == GITMOD_OBJECT_TREE)
+			collect_paths(info, entry, paths);
+		else
+			g_ptr_array_add(paths, strdup(entry->path));
+		gitmod_dispose_object(&entry);
+	}
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *repo_path = "tests/bench_repo";
+	const char *treeish = "bench-main";
+	int options = GITMOD_OPTION_FIX;
+	int load_content = 0;
+	int iterations = 10;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--kim"))
+			options |= GITMOD_OPTION_KEEP_IN_MEMORY;
+		else if (!strcmp(argv[i], "--load-content"))
+			load_content = 1;
+		else if (!strncmp(argv[i], "--iterations=", 13))
+			iterations = atoi(argv[i] + 13);
+		else if (!strncmp(argv[i], "--repo=", 7))
+			repo_path = argv[i] + 7;
+		else if (!strncmp(argv[i], "--treeish=", 10))
+			treeish = argv[i] + 10;
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	gitmod_init();
+	gitmod_info *info = gitmod_start(repo_path, treeish, options, 0);
+	if (!info) {
+		fprintf(stderr, "Could not start gitmod on %s. Did you run tests/create_bench_repo.sh?\n", repo_path);
+		return 1;
+	}
+
+	GPtrArray *paths = g_ptr_array_new_with_free_func(free);
+	gitmod_object *root = gitmod_get_object(info, "/");
+	collect_paths(info, root, paths);
+	gitmod_dispose_object(&root);
+
+	struct timespec start, end;
+	long long total_size = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		for (guint i = 0; i < paths->len; i++) {
+			gitmod_object *object = gitmod_get_object(info, g_ptr_array_index(paths, i));
+			if (!object)
+				continue;
+			gitmod_object_get_num_entries(object);
+			gitmod_object_get_mode(object);
+			if (gitmod_object_get_type(object) == GITMOD_OBJECT_BLOB)
+				total_size += gitmod_object_get_size(object);
+			if (load_content)
+				gitmod_object_get_content(object);
+			gitmod_dispose_object(&object);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = elapsed_seconds(&start, &end);
+	long ops = (long)paths->len * iterations;
+	printf("files: %u iterations: %d kim: %s load-content: %s\n", paths->len, iterations,
+	       options & GITMOD_OPTION_KEEP_IN_MEMORY ? "yes" : "no", load_content ? "yes" : "no");
+	printf("getattr ops: %ld elapsed: %.3f s throughput: %.0f ops/s (%lld bytes reported)\n", ops, seconds,
+	       seconds > 0 ? ops / seconds : 0, total_size);
+
+	g_ptr_array_free(paths, TRUE);
+	gitmod_stop(&info);
+	gitmod_shutdown();
+	return 0;
+}
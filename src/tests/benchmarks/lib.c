@@ -0,0 +1,362 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * library benchmark
+ *  Drives gitmod directly (no FUSE involved) with 1 or more threads, with and without
+ *  GITMOD_OPTION_KEEP_IN_MEMORY, to be able to compare builds:
+ *    get_object    lookups of the paths of the tree (files and directories)
+ *    tree_entries  gitmod_get_tree_entry on each entry of the directories
+ *    read          gitmod_read_file of READ_SIZE bytes, going through the files
+ *    swap          root tree swaps (between --treeish and --next) while the other threads look up paths.
+ *                  Only the swaps are reported
+ *
+ *  Each run starts on a new instance of gitmod. A line of JSON is printed for each run with ops/sec and
+ *  p50/p99/p999 latencies in ns (upper bounds of the buckets of the histograms of gitmod_stats).
+ *
+ *  Create a repo with large blobs with tests/create_bench_repo.sh and then run:
+ *    ./tests/bench_lib [--threads=<n>[,<n>...]] [--seconds=<n>] [--only=<benchmark>] [--label=<label>]
+ *        [--repo=<path>] [--treeish=<treeish>] [--next=<treeish>]
+ *
+ *  --threads defaults to 1,4,16. --label is added to every line to tell builds apart.
+ *  --next is the treeish swapped with --treeish (default: bench-next). If it can't be found, the same
+ *  tree is set up over and over.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+#define READ_SIZE (128 * 1024)
+#define MAX_RUNS 16
+
+enum bench {
+	BENCH_GET_OBJECT,
+	BENCH_TREE_ENTRIES,
+	BENCH_READ,
+	BENCH_SWAP,
+	BENCHES
+};
+
+static const char *bench_names[BENCHES] = { "get_object", "tree_entries", "read", "swap" };
+
+typedef struct {
+	enum bench bench;
+	guint index;		// where the thread starts going through the paths
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t latencies[GITMOD_STATS_BUCKETS];
+} bench_thread;
+
+static const char *repo_path = "tests/bench_repo";
+static const char *treeish = "bench-main";
+static const char *next_treeish = "bench-next";
+static const char *label = "";
+
+static gitmod_info *info;
+static GPtrArray *paths;	// files and directories
+static GPtrArray *files;
+static GPtrArray *dirs;
+static git_oid tree_ids[2];	// trees swapped in BENCH_SWAP
+static int run;
+
+static void collect_paths(gitmod_object *tree)
+{
+	int num_items = gitmod_object_get_num_entries(tree);
+	gitmod_object *entry;
+	for (int i = 0; i < num_items; i++) {
+		entry = gitmod_get_tree_entry(info, tree, i);
+		if (!entry)
+			continue;
+		g_ptr_array_add(paths, strdup(entry->path));
+		if (gitmod_object_get_type(entry) == GITMOD_OBJECT_TREE) {
+			g_ptr_array_add(dirs, strdup(entry->path));
+			collect_paths(entry);
+		} else
+			g_ptr_array_add(files, strdup(entry->path));
+		gitmod_dispose_object(&entry);
+	}
+}
+
+static int running()
+{
+	return __atomic_load_n(&run, __ATOMIC_RELAXED);
+}
+
+static void record(bench_thread *thread, uint64_t start)
+{
+	thread->latencies[gitmod_stats_bucket(gitmod_stats_now() - start)]++;
+	thread->ops++;
+}
+
+static void get_objects(bench_thread *thread)
+{
+	guint index = thread->index;
+	gitmod_object *object;
+	uint64_t start;
+	while (running()) {
+		start = gitmod_stats_now();
+		object = gitmod_get_object(info, g_ptr_array_index(paths, index++ % paths->len));
+		gitmod_dispose_object(&object);
+		record(thread, start);
+	}
+}
+
+static void get_tree_entries(bench_thread *thread)
+{
+	guint index = thread->index;
+	gitmod_object *tree, *entry;
+	uint64_t start;
+	while (running()) {
+		tree = gitmod_get_object(info, g_ptr_array_index(dirs, index++ % dirs->len));
+		if (!tree)
+			continue;
+		int num_items = gitmod_object_get_num_entries(tree);
+		for (int i = 0; i < num_items && running(); i++) {
+			start = gitmod_stats_now();
+			entry = gitmod_get_tree_entry(info, tree, i);
+			gitmod_dispose_object(&entry);
+			record(thread, start);
+		}
+		gitmod_dispose_object(&tree);
+	}
+}
+
+static void read_files(bench_thread *thread)
+{
+	guint index = thread->index;
+	char *buf = malloc(READ_SIZE);
+	gitmod_file *file;
+	uint64_t start;
+	int ret;
+	while (buf && running()) {
+		file = gitmod_open_file(info, g_ptr_array_index(files, index++ % files->len));
+		if (!file)
+			continue;
+		for (int64_t offset = 0; running(); offset += ret) {
+			start = gitmod_stats_now();
+			ret = gitmod_read_file(file, buf, READ_SIZE, offset);
+			if (ret <= 0)
+				break;
+			record(thread, start);
+			thread->bytes += ret;
+		}
+		gitmod_release_file(&file);
+	}
+	free(buf);
+}
+
+static void swap_root_trees(bench_thread *thread)
+{
+	int next = 1;
+	git_tree *tree;
+	gitmod_root_tree *root_tree;
+	uint64_t start;
+	while (running()) {
+		if (git_tree_lookup(&tree, info->repo, &tree_ids[next])) {
+			fprintf(stderr, "Could not look up the tree to swap\n");
+			break;
+		}
+		start = gitmod_stats_now();
+		// same as the monitor of the root tree does
+		gitmod_lock(info->lock);
+		root_tree = gitmod_root_tree_create_from_previous(info, info->root_tree, tree, time(NULL));
+		if (root_tree) {
+			gitmod_cache_set_budget(root_tree->objects_cache, info->cache_budget);
+			gitmod_cache_set_recorder(root_tree->objects_cache, info->stats);
+		}
+		// takes care of unlocking
+		gitmod_root_tree_changed(info, root_tree);
+		record(thread, start);
+		next = !next;
+	}
+}
+
+static void *run_thread(void *params)
+{
+	bench_thread *thread = params;
+	switch (thread->bench) {
+	case BENCH_GET_OBJECT:
+		get_objects(thread);
+		break;
+	case BENCH_TREE_ENTRIES:
+		get_tree_entries(thread);
+		break;
+	case BENCH_READ:
+		read_files(thread);
+		break;
+	case BENCH_SWAP:
+		// the first thread swaps, the others keep on looking up paths
+		if (thread->index)
+			get_objects(thread);
+		else
+			swap_root_trees(thread);
+		break;
+	default:
+		break;
+	}
+	return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int start(int options)
+{
+	info = gitmod_start(repo_path, treeish, options, 0);
+	if (!info) {
+		fprintf(stderr, "Could not start gitmod on %s. Did you run tests/create_bench_repo.sh?\n", repo_path);
+		return 1;
+	}
+	return 0;
+}
+
+static int run_bench(enum bench bench, int options, int num_threads, int seconds)
+{
+	if (start(options))
+		return 1;
+	pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+	bench_thread **params = calloc(num_threads, sizeof(bench_thread *));
+	struct timespec start_time, end_time;
+	run = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	for (int i = 0; i < num_threads; i++) {
+		params[i] = calloc(1, sizeof(bench_thread));
+		params[i]->bench = bench;
+		// every thread starts on a different path
+		params[i]->index = i * 7;
+		pthread_create(&threads[i], NULL, run_thread, params[i]);
+	}
+	sleep(seconds);
+	__atomic_store_n(&run, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	double elapsed = elapsed_seconds(&start_time, &end_time);
+
+	uint64_t ops = 0, bytes = 0;
+	uint64_t latencies[GITMOD_STATS_BUCKETS] = { 0 };
+	for (int i = 0; i < num_threads; i++) {
+		if (bench == BENCH_SWAP && i)
+			// readers were only there to make swaps wait for them
+			break;
+		ops += params[i]->ops;
+		bytes += params[i]->bytes;
+		for (int j = 0; j < GITMOD_STATS_BUCKETS; j++)
+			latencies[j] += params[i]->latencies[j];
+	}
+	printf("{\"label\":\"%s\",\"benchmark\":\"%s\",\"kim\":%d,\"threads\":%d,\"seconds\":%.3f,\"ops\":%lu,"
+	       "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu}\n",
+	       label, bench_names[bench], options & GITMOD_OPTION_KEEP_IN_MEMORY ? 1 : 0, num_threads, elapsed,
+	       (unsigned long)ops, ops / elapsed, bytes / elapsed,
+	       (unsigned long)gitmod_stats_quantile(latencies, ops, 0.5),
+	       (unsigned long)gitmod_stats_quantile(latencies, ops, 0.99),
+	       (unsigned long)gitmod_stats_quantile(latencies, ops, 0.999));
+	fflush(stdout);
+
+	for (int i = 0; i < num_threads; i++)
+		free(params[i]);
+	free(params);
+	free(threads);
+	gitmod_stop(&info);
+	return 0;
+}
+
+/**
+ * Find out what is going to be used by the benchmarks with an instance of its own
+ */
+static int prepare()
+{
+	if (start(GITMOD_OPTION_FIX))
+		return 1;
+	paths = g_ptr_array_new_with_free_func(free);
+	files = g_ptr_array_new_with_free_func(free);
+	dirs = g_ptr_array_new_with_free_func(free);
+	g_ptr_array_add(paths, strdup("/"));
+	g_ptr_array_add(dirs, strdup("/"));
+	gitmod_object *root = gitmod_get_object(info, "/");
+	collect_paths(root);
+	gitmod_dispose_object(&root);
+
+	git_oid_cpy(&tree_ids[0], git_tree_id(info->root_tree->tree));
+	git_oid_cpy(&tree_ids[1], &tree_ids[0]);
+	git_object *next;
+	char *spec = g_strdup_printf("%s^{tree}", next_treeish);
+	if (!git_revparse_single(&next, info->repo, spec)) {
+		git_oid_cpy(&tree_ids[1], git_object_id(next));
+		git_object_free(next);
+	} else
+		fprintf(stderr, "Could not find %s, the same tree will be swapped\n", next_treeish);
+	g_free(spec);
+	gitmod_stop(&info);
+
+	if (!files->len) {
+		fprintf(stderr, "There are no files to read\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int thread_counts[MAX_RUNS] = { 1, 4, 16 };
+	int num_runs = 3;
+	int seconds = 2;
+	const char *only = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--threads=", 10)) {
+			num_runs = 0;
+			for (char *count = strtok(argv[i] + 10, ","); count && num_runs < MAX_RUNS;
+			     count = strtok(NULL, ","))
+				if ((thread_counts[num_runs++] = atoi(count)) < 1) {
+					fprintf(stderr, "Invalid number of threads: %s\n", count);
+					return 1;
+				}
+			if (!num_runs) {
+				fprintf(stderr, "No number of threads in %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!strncmp(argv[i], "--seconds=", 10))
+			seconds = atoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--only=", 7))
+			only = argv[i] + 7;
+		else if (!strncmp(argv[i], "--label=", 8))
+			label = argv[i] + 8;
+		else if (!strncmp(argv[i], "--repo=", 7))
+			repo_path = argv[i] + 7;
+		else if (!strncmp(argv[i], "--treeish=", 10))
+			treeish = argv[i] + 10;
+		else if (!strncmp(argv[i], "--next=", 7))
+			next_treeish = argv[i] + 7;
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	gitmod_init();
+	if (prepare())
+		return 1;
+	fprintf(stderr, "paths: %u files: %u directories: %u\n", paths->len, files->len, dirs->len);
+	int options[] = { GITMOD_OPTION_FIX, GITMOD_OPTION_FIX | GITMOD_OPTION_KEEP_IN_MEMORY };
+	for (int bench = 0; bench < BENCHES; bench++) {
+		if (only && strcmp(only, bench_names[bench]))
+			continue;
+		for (int o = 0; o < 2; o++)
+			for (int i = 0; i < num_runs; i++)
+				if (run_bench(bench, options[o], thread_counts[i], seconds))
+					return 1;
+	}
+
+	g_ptr_array_free(paths, TRUE);
+	g_ptr_array_free(files, TRUE);
+	g_ptr_array_free(dirs, TRUE);
+	gitmod_shutdown();
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * read benchmark
+ *  Threads open and read different files of a tree (like FUSE workers serving different clients do)
+ *  and we report how many bytes can be read per second for 1, 4, 16 and 64 threads,
+ *  first with all threads sharing the repo handle of gitmod and then with a pool of handles.
+ *
+ *  Create a repo with large blobs with tests/create_bench_repo.sh and then run:
+ *    ./tests/bench_read [--handles=<n>] [--seconds=<n>] [--repo=<path>] [--treeish=<treeish>]
+ *
+ *  --handles is the size of the pool (default: number of processors)
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gitmod.h"
+
+#define READ_SIZE (128 * 1024)
+
+static gitmod_info *info;
+static GPtrArray *paths;
+static int run;
+
+static void collect_paths(gitmod_object *tree)
+{
+	int num_items = gitmod_object_get_num_entries(tree);
+	gitmod_object *entry;
+	for (int i = 0; i < num_items; i++) {
+		entry = gitmod_get_tree_entry(info, tree, i);
+		if (!entry)
+			continue;
+		if (gitmod_object_get_type(entry) == GITMOD_OBJECT_TREE)
+			collect_paths(entry);
+		else
+			g_ptr_array_add(paths, strdup(entry->path));
+		gitmod_dispose_object(&entry);
+	}
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *read_files(void *params)
+{
+	// every thread starts on a different file
+	guint index = (unsigned long)params;
+	char *buf = malloc(READ_SIZE);
+	long bytes = 0;
+	while (buf && __atomic_load_n(&run, __ATOMIC_RELAXED)) {
+		gitmod_file *file = gitmod_open_file(info, g_ptr_array_index(paths, index++ % paths->len));
+		if (!file)
+			continue;
+		int ret;
+		for (int64_t offset = 0; (ret = gitmod_read_file(file, buf, READ_SIZE, offset)) > 0; offset += ret)
+			bytes += ret;
+		gitmod_release_file(&file);
+	}
+	free(buf);
+	return (void *)bytes;
+}
+
+static void run_readers(const char *label)
+{
+	pthread_t threads[64];
+	struct timespec start, end;
+	for (int num_threads = 1; num_threads <= 64; num_threads *= 4) {
+		run = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < num_threads; i++)
+			pthread_create(&threads[i], NULL, read_files, (void *)(i * 7));
+		sleep(2);
+		__atomic_store_n(&run, 0, __ATOMIC_RELAXED);
+		long bytes = 0;
+		void *thread_bytes;
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], &thread_bytes);
+			bytes += (long)thread_bytes;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double elapsed = elapsed_seconds(&start, &end);
+		printf("%s threads: %2d read: %ld bytes elapsed: %.3f s throughput: %.1f MB/s\n", label, num_threads,
+		       bytes, elapsed, bytes / elapsed / (1024 * 1024));
+	}
+}
+
+static int start(const char *repo_path, const char *treeish, int handles)
+{
+	info = gitmod_start(repo_path, treeish, GITMOD_OPTION_FIX, 0);
+	if (!info) {
+		fprintf(stderr, "Could not start gitmod on %s. Did you run tests/create_bench_repo.sh?\n", repo_path);
+		return 1;
+	}
+	// blobs are loaded in memory, not streamed
+	gitmod_set_stream_threshold(info, 0);
+	if (handles && gitmod_set_repo_pool(info, handles)) {
+		fprintf(stderr, "Could not set up a pool of %d repo handles\n", handles);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *repo_path = "tests/bench_repo";
+	const char *treeish = "bench-main";
+	int handles = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--handles=", 10))
+			handles = atoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--repo=", 7))
+			repo_path = argv[i] + 7;
+		else if (!strncmp(argv[i], "--treeish=", 10))
+			treeish = argv[i] + 10;
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	gitmod_init();
+	if (start(repo_path, treeish, 0))
+		return 1;
+	paths = g_ptr_array_new_with_free_func(free);
+	gitmod_object *root = gitmod_get_object(info, "/");
+	collect_paths(root);
+	gitmod_dispose_object(&root);
+	if (!paths->len) {
+		fprintf(stderr, "There are no files to read\n");
+		return 1;
+	}
+	printf("files: %u handles in the pool: %d\n", paths->len, handles);
+	run_readers("shared");
+	gitmod_stop(&info);
+
+	if (start(repo_path, treeish, handles))
+		return 1;
+	run_readers("pool  ");
+	gitmod_stop(&info);
+
+	g_ptr_array_free(paths, TRUE);
+	gitmod_shutdown();
+	return 0;
+}
@@ -9,7 +9,9 @@
 
 int main()
 {
-	CU_pSuite pSuite1 = NULL, pSuite2 = NULL, pSuiteKim = NULL, pSuiteKim2 = NULL;
+	CU_pSuite pSuite1 = NULL, pSuite2 = NULL, pSuiteKim = NULL, pSuiteKim2 = NULL, pSuiteStream = NULL,
+	    pSuiteCache = NULL, pSuiteInode = NULL, pSuiteBlobCache = NULL, pSuiteRepoPool = NULL, pSuiteArena = NULL,
+	    pSuiteStats = NULL, pSuiteLog = NULL, pSuiteTrace = NULL, pSuiteWatch = NULL;
 
 	/* initialize the CUnit test registry */
 	if (CUE_SUCCESS != CU_initialize_registry())
@@ -20,7 +22,19 @@ int main()
 	pSuite2 = suite2_setup();
 	pSuiteKim = suitekim_setup();
 	pSuiteKim2 = suitekim2_setup();
-	if (!(pSuite1 && pSuite2 && pSuiteKim && pSuiteKim2)) {
+	pSuiteStream = suitestream_setup();
+	pSuiteCache = suitecache_setup();
+	pSuiteInode = suiteinode_setup();
+	pSuiteBlobCache = suiteblobcache_setup();
+	pSuiteRepoPool = suiterepopool_setup();
+	pSuiteArena = suitearena_setup();
+	pSuiteStats = suitestats_setup();
+	pSuiteLog = suitelog_setup();
+	pSuiteTrace = suitetrace_setup();
+	pSuiteWatch = suitewatch_setup();
+	if (!(pSuite1 && pSuite2 && pSuiteKim && pSuiteKim2 && pSuiteStream && pSuiteCache && pSuiteInode
+	      && pSuiteBlobCache && pSuiteRepoPool && pSuiteArena
+	      && pSuiteStats && pSuiteLog && pSuiteTrace && pSuiteWatch)) {
 		CU_cleanup_registry();
 		return CU_get_error();
 	}
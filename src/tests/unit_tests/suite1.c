@@ -6,6 +6,7 @@
  */
 
 #include "gitmod.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <CUnit/Basic.h>
@@ -135,8 +136,10 @@ static void suite1_testGetObjectByPathBlob()
 		CU_ASSERT(gitmod_object_get_num_entries(object) == 1);
 		long size = gitmod_object_get_size(object);
 		CU_ASSERT(size == 184);
+		CU_ASSERT(object->blob == NULL);	// getting the size does not load the blob
 		const char *content = gitmod_object_get_content(object);
 		CU_ASSERT(content != NULL);
+		CU_ASSERT(object->blob != NULL);
 		if (content) {
 			char *dest = calloc(1, 27);
 			strncpy(dest, content, 26);
@@ -187,6 +190,78 @@ static void suite1_testGetObjectByPathTree()
 	}
 }
 
+static void suite1_testSharedContent()
+{
+	int store_size = gitmod_content_store_size(gm_info->content_store);
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	gitmod_object *object2 = gitmod_get_object(gm_info, "cowsay.txt");
+	CU_ASSERT(object != NULL);
+	CU_ASSERT(object2 != NULL);
+	if (object && object2) {
+		CU_ASSERT(object != object2);
+		CU_ASSERT(gitmod_object_get_content(object) != NULL);
+		CU_ASSERT(gitmod_object_get_content(object2) == gitmod_object_get_content(object));
+		CU_ASSERT(object->content == object2->content);
+		CU_ASSERT(object->content->refcount == 2);
+		CU_ASSERT(gitmod_content_store_size(gm_info->content_store) == store_size + 1);
+	}
+	gitmod_dispose_object(&object);
+	gitmod_dispose_object(&object2);
+	// nobody is using it, it's gone
+	CU_ASSERT(gitmod_content_store_size(gm_info->content_store) == store_size);
+}
+
+#define SUITE1_THREADS 16
+
+static pthread_barrier_t tux_barrier;
+
+static void *get_tux(void *params)
+{
+	// all threads ask for the content at the same time
+	pthread_barrier_wait(&tux_barrier);
+	return (void *)gitmod_object_get_content(params);
+}
+
+static void suite1_testConcurrentContent()
+{
+	int store_size = gitmod_content_store_size(gm_info->content_store);
+	pthread_t threads[SUITE1_THREADS];
+	gitmod_object *objects[SUITE1_THREADS];
+	// getting the objects reads trees from the store too. Only what the threads do is counted
+	for (int i = 0; i < SUITE1_THREADS; i++)
+		objects[i] = gitmod_get_object(gm_info, "/tux.txt");
+	int loaded_size = gitmod_content_store_size(gm_info->content_store);
+	unsigned long loads = gm_info->content_store->loads;
+	unsigned long waits = gm_info->content_store->coalesced + gm_info->content_store->hits;
+	pthread_barrier_init(&tux_barrier, NULL, SUITE1_THREADS);
+	for (int i = 0; i < SUITE1_THREADS; i++)
+		pthread_create(&threads[i], NULL, get_tux, objects[i]);
+	void *content;
+	for (int i = 0; i < SUITE1_THREADS; i++) {
+		pthread_join(threads[i], &content);
+		CU_ASSERT(content != NULL);
+	}
+	pthread_barrier_destroy(&tux_barrier);
+	// the blob was loaded once, no matter how many threads were asking for it at the same time.
+	// The others waited for it (or got it right after it was loaded)
+	CU_ASSERT(gm_info->content_store->loads == loads + 1);
+	CU_ASSERT(gm_info->content_store->coalesced + gm_info->content_store->hits == waits + SUITE1_THREADS - 1);
+	CU_ASSERT(gitmod_content_store_size(gm_info->content_store) == loaded_size + 1);
+	for (int i = 0; i < SUITE1_THREADS; i++) {
+		CU_ASSERT(objects[i] != NULL);
+		if (objects[i] && objects[0]) {
+			CU_ASSERT(objects[i]->content != NULL);
+			CU_ASSERT(objects[i]->content == objects[0]->content);
+		}
+	}
+	if (objects[0] && objects[0]->content)
+		CU_ASSERT(objects[0]->content->refcount == SUITE1_THREADS);
+	for (int i = 0; i < SUITE1_THREADS; i++)
+		gitmod_dispose_object(&objects[i]);
+	// released with the last object using it
+	CU_ASSERT(gitmod_content_store_size(gm_info->content_store) == store_size);
+}
+
 static void suite1_testGetNonExistingObjectByPath()
 {
 	gitmod_object *object = gitmod_get_object(gm_info, "blahblah");
@@ -205,6 +280,8 @@ CU_pSuite suite1_setup()
 		      CU_add_test(pSuite, "Suite1: getObjectByPathBlob", suite1_testGetObjectByPathBlob) &&
 		      CU_add_test(pSuite, "Suite1: getExecObjectByPathBlob", suite1_testGetExecObjectByPathBlob) &&
 		      CU_add_test(pSuite, "Suite1: getObjectByPathTree", suite1_testGetObjectByPathTree) &&
+		      CU_add_test(pSuite, "Suite1: sharedContent", suite1_testSharedContent) &&
+		      CU_add_test(pSuite, "Suite1: concurrentContent", suite1_testConcurrentContent) &&
 		      CU_add_test(pSuite, "Suite1: getNonExisingObjectByPath", suite1_testGetNonExistingObjectByPath)))
 		{
 			return NULL;
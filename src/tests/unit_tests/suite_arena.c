@@ -0,0 +1,104 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite arena
+ *  Threads take memory from the same arena and it's all released at once
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define NUM_THREADS 8
+#define NUM_ALLOCS 1000
+
+static int suitearena_init()
+{
+	return 0;
+}
+
+static int suitearena_shutdown()
+{
+	return 0;
+}
+
+static void suitearena_alloc()
+{
+	gitmod_arena *arena = gitmod_arena_create(1024);
+	CU_ASSERT(arena != NULL);
+	if (!arena)
+		return;
+	char *first = gitmod_arena_alloc(arena, 3);
+	char *second = gitmod_arena_alloc(arena, 3);
+	CU_ASSERT(first != NULL && second != NULL);
+	// aligned and set to 0
+	CU_ASSERT(((uintptr_t) first) % 16 == 0);
+	CU_ASSERT(second == first + 16);
+	CU_ASSERT(!first[0] && !first[2]);
+	CU_ASSERT(gitmod_arena_used(arena) == 32);
+	char *copy = gitmod_arena_strdup(arena, "some-dir/sample-file.txt");
+	CU_ASSERT(copy != NULL && !strcmp(copy, "some-dir/sample-file.txt"));
+	size_t bytes = gitmod_arena_bytes(arena);
+	// a block of its own
+	char *big = gitmod_arena_alloc(arena, 4096);
+	CU_ASSERT(big != NULL);
+	CU_ASSERT(gitmod_arena_bytes(arena) > bytes + 4096);
+	// going over the size of the block
+	for (int i = 0; i < 100; i++)
+		CU_ASSERT(gitmod_arena_alloc(arena, 100) != NULL);
+	CU_ASSERT(gitmod_arena_used(arena) >= 4096 + 100 * 112);
+	gitmod_arena_dispose(&arena);
+	CU_ASSERT(arena == NULL);
+}
+
+static void *alloc_ids(void *params)
+{
+	gitmod_arena *arena = params;
+	long **ids = malloc(NUM_ALLOCS * sizeof(long *));
+	for (long i = 0; ids && i < NUM_ALLOCS; i++) {
+		ids[i] = gitmod_arena_alloc(arena, sizeof(long));
+		if (ids[i])
+			*ids[i] = i;
+	}
+	return ids;
+}
+
+static void suitearena_concurrent()
+{
+	gitmod_arena *arena = gitmod_arena_create(4096);
+	CU_ASSERT(arena != NULL);
+	if (!arena)
+		return;
+	pthread_t threads[NUM_THREADS];
+	long **ids[NUM_THREADS];
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, alloc_ids, arena);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], (void **)&ids[i]);
+	// nobody wrote over what other threads got
+	for (int i = 0; i < NUM_THREADS; i++) {
+		CU_ASSERT(ids[i] != NULL);
+		if (!ids[i])
+			continue;
+		for (long j = 0; j < NUM_ALLOCS; j++)
+			CU_ASSERT(ids[i][j] != NULL && *ids[i][j] == j);
+		free(ids[i]);
+	}
+	CU_ASSERT(gitmod_arena_used(arena) == NUM_THREADS * NUM_ALLOCS * 16);
+	gitmod_arena_dispose(&arena);
+}
+
+CU_pSuite suitearena_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteArena", suitearena_init, suitearena_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteArena: alloc", suitearena_alloc) &&
+		      CU_add_test(pSuite, "SuiteArena: concurrent", suitearena_concurrent))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
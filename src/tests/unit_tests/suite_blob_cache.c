@@ -0,0 +1,303 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite blob cache
+ *  Hot blobs written into a directory (named by OID) in the background and read from there
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+static gitmod_info *gm_info;
+static char *REPO_PATH = "tests/test_repo";
+static char blob_cache_dir[] = "/tmp/gitmod-blob-cache-XXXXXX";
+
+static int suiteblobcache_init()
+{
+	gitmod_init();
+	if (!mkdtemp(blob_cache_dir))
+		return 1;
+	gm_info = gitmod_start(REPO_PATH, "test-main", GITMOD_OPTION_FIX, 100);
+	if (!gm_info)
+		return 1;
+	return gitmod_set_blob_cache(gm_info, blob_cache_dir, 0, 2, GITMOD_BLOB_CACHE_DEFAULT_BUDGET);
+}
+
+static int suiteblobcache_shutdown()
+{
+	gitmod_stop(&gm_info);
+	gitmod_shutdown();
+	DIR *dir = opendir(blob_cache_dir);
+	if (dir) {
+		struct dirent *dirent;
+		while ((dirent = readdir(dir)))
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+		closedir(dir);
+	}
+	rmdir(blob_cache_dir);
+	return 0;
+}
+
+static int blob_file_exists(const git_oid *oid)
+{
+	char path[sizeof(blob_cache_dir) + GIT_OID_HEXSZ + 1];
+	snprintf(path, sizeof(path), "%s/%s", blob_cache_dir, git_oid_tostr_s(oid));
+	return !access(path, F_OK);
+}
+
+static void suiteblobcache_admission()
+{
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(object != NULL);
+	if (!object)
+		return;
+	// first open, it's not hot yet
+	gitmod_file *file = gitmod_open_file(gm_info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->fd == -1);
+		gitmod_release_file(&file);
+	}
+	CU_ASSERT(!blob_file_exists(&object->oid));
+
+	// admitted, it's read from the repo while it's written
+	file = gitmod_open_file(gm_info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->fd == -1);
+		char buf[200];
+		CU_ASSERT(gitmod_read_file(file, buf, sizeof(buf), 0) == 184);
+		gitmod_release_file(&file);
+	}
+	gitmod_blob_cache_flush(gm_info->blob_cache);
+	CU_ASSERT(blob_file_exists(&object->oid));
+	CU_ASSERT(gitmod_blob_cache_size(gm_info->blob_cache) == 1);
+	CU_ASSERT(gm_info->blob_cache->writes == 1);
+
+	// it's read from the file from now on
+	file = gitmod_open_file(gm_info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->fd >= 0);
+		char buf[200];
+		CU_ASSERT(gitmod_read_file(file, buf, sizeof(buf), 0) == 184);
+		CU_ASSERT(!memcmp(buf, gitmod_object_get_content(object), 184));
+		CU_ASSERT(gitmod_read_file(file, buf, 10, 180) == 4);
+		CU_ASSERT(gitmod_read_file(file, buf, 10, 184) == 0);
+		gitmod_release_file(&file);
+	}
+	file = gitmod_open_file(gm_info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->fd >= 0);
+		gitmod_release_file(&file);
+	}
+	CU_ASSERT(gm_info->blob_cache->hits == 2);
+	CU_ASSERT(gm_info->blob_cache->writes == 1);
+	gitmod_dispose_object(&object);
+}
+
+static void suiteblobcache_minSize()
+{
+	gitmod_blob_cache *cache =
+	    gitmod_blob_cache_create(blob_cache_dir, 1000, 1, 0, GITMOD_BLOB_CACHE_DEFAULT_BUDGET);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	// files of the previous test are picked up
+	CU_ASSERT(gitmod_blob_cache_size(cache) == 1);
+	gitmod_object *object = gitmod_get_object(gm_info, "/hello-world.sh");
+	CU_ASSERT(object != NULL);
+	if (object) {
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) ==
+			  -1);
+		CU_ASSERT(!blob_file_exists(&object->oid));
+		gitmod_dispose_object(&object);
+	}
+	gitmod_blob_cache_dispose(&cache);
+	CU_ASSERT(cache == NULL);
+}
+
+static void suiteblobcache_budget()
+{
+	// nothing can stay in the directory once it's not in use
+	gitmod_blob_cache *cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0, 0);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	// the file of the first test was removed right away
+	CU_ASSERT(gitmod_blob_cache_size(cache) == 0);
+	gitmod_object *object = gitmod_get_object(gm_info, "/hello-world.sh");
+	CU_ASSERT(object != NULL);
+	if (object) {
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) ==
+			  -1);
+		// it's removed as soon as it's written, it's not in use
+		gitmod_blob_cache_flush(cache);
+		CU_ASSERT(cache->writes == 1);
+		CU_ASSERT(!blob_file_exists(&object->oid));
+		CU_ASSERT(cache->removals == 2);
+		gitmod_dispose_object(&object);
+	}
+	gitmod_blob_cache_dispose(&cache);
+}
+
+static void suiteblobcache_truncated()
+{
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(object != NULL);
+	if (!object)
+		return;
+	// a file left by a previous run that was not completed
+	char path[sizeof(blob_cache_dir) + GIT_OID_HEXSZ + 1];
+	snprintf(path, sizeof(path), "%s/%s", blob_cache_dir, git_oid_tostr_s(&object->oid));
+	FILE *f = fopen(path, "w");
+	CU_ASSERT(f != NULL);
+	if (f) {
+		fwrite(gitmod_object_get_content(object), 1, 10, f);
+		fclose(f);
+	}
+	gitmod_blob_cache *cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0, GITMOD_BLOB_CACHE_DEFAULT_BUDGET);
+	CU_ASSERT(cache != NULL);
+	if (cache) {
+		CU_ASSERT(gitmod_blob_cache_size(cache) == 1);
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) ==
+			  -1);
+		gitmod_blob_cache_flush(cache);
+		// it was written again
+		CU_ASSERT(cache->removals == 1);
+		CU_ASSERT(cache->writes == 1);
+		int fd = gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object));
+		CU_ASSERT(fd >= 0);
+		CU_ASSERT(cache->hits == 1);
+		char buf[200];
+		CU_ASSERT(pread(fd, buf, sizeof(buf), 0) == 184);
+		CU_ASSERT(!memcmp(buf, gitmod_object_get_content(object), 184));
+		gitmod_blob_cache_release(cache, &object->oid);
+		gitmod_blob_cache_dispose(&cache);
+	}
+	gitmod_dispose_object(&object);
+}
+
+static void suiteblobcache_tampered()
+{
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(object != NULL);
+	if (!object)
+		return;
+	// a file of the right size that does not hold the blob
+	char path[sizeof(blob_cache_dir) + GIT_OID_HEXSZ + 1];
+	snprintf(path, sizeof(path), "%s/%s", blob_cache_dir, git_oid_tostr_s(&object->oid));
+	FILE *f = fopen(path, "w");
+	CU_ASSERT(f != NULL);
+	if (f) {
+		for (int i = 0; i < gitmod_object_get_size(object); i++)
+			fputc('x', f);
+		fclose(f);
+	}
+	gitmod_blob_cache *cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0, GITMOD_BLOB_CACHE_DEFAULT_BUDGET);
+	CU_ASSERT(cache != NULL);
+	if (cache) {
+		CU_ASSERT(gitmod_blob_cache_size(cache) == 1);
+		// it's checked before it's used
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) ==
+			  -1);
+		gitmod_blob_cache_flush(cache);
+		CU_ASSERT(cache->rejected == 1);
+		CU_ASSERT(cache->writes == 1);
+		int fd = gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object));
+		CU_ASSERT(fd >= 0);
+		char buf[200];
+		CU_ASSERT(pread(fd, buf, sizeof(buf), 0) == 184);
+		CU_ASSERT(!memcmp(buf, gitmod_object_get_content(object), 184));
+		gitmod_blob_cache_release(cache, &object->oid);
+		gitmod_blob_cache_dispose(&cache);
+	}
+	// now it holds the blob so it's used as it is
+	cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0, GITMOD_BLOB_CACHE_DEFAULT_BUDGET);
+	CU_ASSERT(cache != NULL);
+	if (cache) {
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) ==
+			  -1);
+		gitmod_blob_cache_flush(cache);
+		CU_ASSERT(cache->rejected == 0);
+		CU_ASSERT(cache->writes == 0);
+		CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) >=
+			  0);
+		gitmod_blob_cache_release(cache, &object->oid);
+		gitmod_blob_cache_dispose(&cache);
+	}
+	gitmod_dispose_object(&object);
+}
+
+/**
+ * Open a blob with the cache and wait for its file to be written
+ */
+static void open_written(gitmod_blob_cache *cache, gitmod_object *object)
+{
+	CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &object->oid, gitmod_object_get_size(object)) == -1);
+	gitmod_blob_cache_flush(cache);
+}
+
+static void suiteblobcache_lru()
+{
+	// empty the directory
+	gitmod_blob_cache *cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0, 0);
+	gitmod_blob_cache_dispose(&cache);
+	gitmod_object *hello = gitmod_get_object(gm_info, "/hello-world.sh");
+	gitmod_object *cowsay = gitmod_get_object(gm_info, "/cowsay.txt");
+	gitmod_object *readme = gitmod_get_object(gm_info, "/readme.txt");
+	CU_ASSERT(hello && cowsay && readme);
+	if (!(hello && cowsay && readme))
+		goto end;
+	// readme can only get in if one of the other two goes away
+	cache = gitmod_blob_cache_create(blob_cache_dir, 0, 1, 0,
+					 gitmod_object_get_size(cowsay) + gitmod_object_get_size(readme));
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		goto end;
+	open_written(cache, hello);
+	open_written(cache, cowsay);
+	CU_ASSERT(gitmod_blob_cache_size(cache) == 2);
+	// hello was used first but it's in use
+	CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &hello->oid, gitmod_object_get_size(hello)) >= 0);
+	open_written(cache, readme);
+	CU_ASSERT(cache->removals == 1);
+	CU_ASSERT(blob_file_exists(&hello->oid));
+	CU_ASSERT(!blob_file_exists(&cowsay->oid));
+	CU_ASSERT(blob_file_exists(&readme->oid));
+	gitmod_blob_cache_release(cache, &hello->oid);
+	// used more recently than readme now
+	CU_ASSERT(gitmod_blob_cache_open(cache, gm_info->repo, &readme->oid, gitmod_object_get_size(readme)) >= 0);
+	gitmod_blob_cache_release(cache, &readme->oid);
+	open_written(cache, cowsay);
+	CU_ASSERT(!blob_file_exists(&hello->oid));
+	CU_ASSERT(blob_file_exists(&readme->oid));
+	CU_ASSERT(blob_file_exists(&cowsay->oid));
+	gitmod_blob_cache_dispose(&cache);
+ end:
+	gitmod_dispose_object(&hello);
+	gitmod_dispose_object(&cowsay);
+	gitmod_dispose_object(&readme);
+}
+
+CU_pSuite suiteblobcache_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteBlobCache", suiteblobcache_init, suiteblobcache_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteBlobCache: admission", suiteblobcache_admission) &&
+		      CU_add_test(pSuite, "SuiteBlobCache: minSize", suiteblobcache_minSize) &&
+		      CU_add_test(pSuite, "SuiteBlobCache: budget", suiteblobcache_budget) &&
+		      CU_add_test(pSuite, "SuiteBlobCache: truncated", suiteblobcache_truncated) &&
+		      CU_add_test(pSuite, "SuiteBlobCache: tampered", suiteblobcache_tampered) &&
+		      CU_add_test(pSuite, "SuiteBlobCache: lru", suiteblobcache_lru))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite cache
+ *  Items of the cache are shared by threads that look for the same ids
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define NUM_THREADS 8
+#define NUM_IDS 1000
+
+static gitmod_cache *cache;
+static int claims;
+
+static int suitecache_init()
+{
+	return 0;
+}
+
+static int suitecache_shutdown()
+{
+	return 0;
+}
+
+static void suitecache_get()
+{
+	cache = gitmod_cache_create(NULL, NULL);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	gitmod_cache_item *item = gitmod_cache_get(cache, "/a");
+	CU_ASSERT(item != NULL);
+	CU_ASSERT(gitmod_cache_get(cache, "/a") == item);
+	CU_ASSERT(gitmod_cache_get(cache, "/b") != item);
+	CU_ASSERT(gitmod_cache_size(cache) == 2);
+	CU_ASSERT(gitmod_cache_item_get(item) == NULL);	// nothing has been set
+	gitmod_cache_dispose(&cache);
+	CU_ASSERT(cache == NULL);
+}
+
+static void *get_ids(void *params)
+{
+	gitmod_cache_item **items = params;
+	char id[32];
+	for (int i = 0; i < NUM_IDS; i++) {
+		sprintf(id, "/dir/file-%d", i);
+		items[i] = gitmod_cache_get(cache, id);
+	}
+	return NULL;
+}
+
+static void suitecache_concurrentGets()
+{
+	cache = gitmod_cache_create(NULL, NULL);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	pthread_t threads[NUM_THREADS];
+	gitmod_cache_item **items = calloc(NUM_THREADS * NUM_IDS, sizeof(gitmod_cache_item *));
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, get_ids, items + i * NUM_IDS);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	// every thread got the same item for each id
+	CU_ASSERT(gitmod_cache_size(cache) == NUM_IDS);
+	int mismatches = 0;
+	for (int i = 0; i < NUM_THREADS; i++)
+		for (int j = 0; j < NUM_IDS; j++)
+			mismatches += items[j] == NULL || items[i * NUM_IDS + j] != items[j];
+	CU_ASSERT(mismatches == 0);
+	free(items);
+	gitmod_cache_dispose(&cache);
+}
+
+static void *load_item(void *params)
+{
+	gitmod_cache_item *item = gitmod_cache_get(cache, "/shared");
+	const void *content;
+	while (!(content = gitmod_cache_item_get(item)))
+		if (gitmod_cache_item_claim(item)) {
+			__atomic_add_fetch(&claims, 1, __ATOMIC_RELAXED);
+			usleep(10000);	// let the others wait for it
+			content = "content";
+			gitmod_cache_item_set(item, content);
+			break;
+		}
+	return (void *)content;
+}
+
+static void suitecache_claimOnce()
+{
+	cache = gitmod_cache_create(NULL, NULL);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	claims = 0;
+	pthread_t threads[NUM_THREADS];
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, load_item, NULL);
+	void *content;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], &content);
+		CU_ASSERT(content != NULL && !strcmp(content, "content"));
+	}
+	CU_ASSERT(claims == 1);
+	// an abandoned item can be claimed again
+	gitmod_cache_item *item = gitmod_cache_get(cache, "/other");
+	CU_ASSERT(gitmod_cache_item_claim(item));
+	CU_ASSERT(!gitmod_cache_item_claim(item));
+	gitmod_cache_item_abandon(item);
+	CU_ASSERT(gitmod_cache_item_get(item) == NULL);
+	CU_ASSERT(gitmod_cache_item_claim(item));
+	gitmod_cache_item_abandon(item);
+	gitmod_cache_dispose(&cache);
+}
+
+static int evict_calls;
+
+/**
+ * Contents are flags that say whether they are in use
+ */
+static int evict_flag(const void *content)
+{
+	evict_calls++;
+	return *(const int *)content;
+}
+
+static void suitecache_busyItemsAreSkipped()
+{
+	cache = gitmod_cache_create(NULL, NULL);
+	CU_ASSERT(cache != NULL);
+	if (!cache)
+		return;
+	gitmod_cache_set_evict_func(cache, evict_flag);
+	gitmod_cache_set_budget(cache, 100);
+	evict_calls = 0;
+	int *in_use = calloc(NUM_IDS, sizeof(int));
+	gitmod_cache_item **items = calloc(NUM_IDS, sizeof(gitmod_cache_item *));
+	char id[32];
+	for (int i = 0; i < NUM_IDS; i++) {
+		sprintf(id, "/dir/file-%d", i);
+		items[i] = gitmod_cache_get(cache, id);
+		in_use[i] = 1;
+		CU_ASSERT(gitmod_cache_item_claim(items[i]));
+		gitmod_cache_item_set(items[i], &in_use[i]);
+		gitmod_cache_item_charge(cache, items[i], 10);
+	}
+	gitmod_cache_stats stats;
+	gitmod_cache_get_stats(cache, &stats);
+	CU_ASSERT(stats.evictions == 0);
+	CU_ASSERT(stats.bytes == NUM_IDS * 10);
+	// items in use are not looked at again on every charge
+	CU_ASSERT(evict_calls <= NUM_IDS);
+	CU_ASSERT(cache->charged->len + cache->busy->len == NUM_IDS);
+
+	// once it's not used anymore it can be evicted
+	in_use[5] = 0;
+	gitmod_cache_item_idle(cache, items[5]);
+	gitmod_cache_get_stats(cache, &stats);
+	CU_ASSERT(stats.evictions == 1);
+	CU_ASSERT(stats.bytes == (NUM_IDS - 1) * 10);
+	CU_ASSERT(items[5]->charge == 0);
+	// nothing to do for items that were not found in use
+	gitmod_cache_item_idle(cache, items[5]);
+	CU_ASSERT(cache->charged->len + cache->busy->len == NUM_IDS - 1);
+	gitmod_cache_dispose(&cache);
+	free(items);
+	free(in_use);
+}
+
+CU_pSuite suitecache_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteCache", suitecache_init, suitecache_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteCache: get", suitecache_get) &&
+		      CU_add_test(pSuite, "SuiteCache: concurrentGets", suitecache_concurrentGets) &&
+		      CU_add_test(pSuite, "SuiteCache: claimOnce", suitecache_claimOnce) &&
+		      CU_add_test(pSuite, "SuiteCache: busyItemsAreSkipped", suitecache_busyItemsAreSkipped))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite inode
+ *  Lookups relative to the parent inode and inode numbers that survive root tree moves
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+static gitmod_info *gm_info;
+static char *REPO_PATH = "tests/test_repo";
+
+static int suiteinode_init()
+{
+	gitmod_init();
+	gm_info = gitmod_start(REPO_PATH, "intermediate", GITMOD_OPTION_FIX, 100);
+	return gm_info == NULL;
+}
+
+static int suiteinode_shutdown()
+{
+	gitmod_stop(&gm_info);
+	gitmod_shutdown();
+	return 0;
+}
+
+static void suiteinode_lookup()
+{
+	gitmod_inode *root = gitmod_get_inode(gm_info, GITMOD_ROOT_INODE);
+	CU_ASSERT(root != NULL);
+	CU_ASSERT(gitmod_inode_get_type(root) == GITMOD_OBJECT_TREE);
+	CU_ASSERT(gitmod_inode_get_num_entries(root) == 4);
+
+	gitmod_inode *dir = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "some-dir");
+	CU_ASSERT(dir != NULL);
+	if (dir) {
+		CU_ASSERT(dir->ino > GITMOD_ROOT_INODE);
+		CU_ASSERT(gitmod_inode_get_type(dir) == GITMOD_OBJECT_TREE);
+		CU_ASSERT(gitmod_inode_get_num_entries(dir) == 1);
+		CU_ASSERT(gitmod_get_inode(gm_info, dir->ino) == dir);
+		gitmod_inode *file = gitmod_lookup(gm_info, dir->ino, "sample-file.txt");
+		CU_ASSERT(file != NULL);
+		if (file) {
+			CU_ASSERT(gitmod_inode_get_type(file) == GITMOD_OBJECT_BLOB);
+			CU_ASSERT(!strcmp(file->path, "/some-dir/sample-file.txt"));
+			gitmod_forget(gm_info, file->ino, 1);
+		}
+		CU_ASSERT(gitmod_lookup(gm_info, dir->ino, "blahblah") == NULL);
+		gitmod_forget(gm_info, dir->ino, 1);
+	}
+	// only the root inode is left
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 1);
+}
+
+static void suiteinode_forget()
+{
+	gitmod_inode *inode = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+	CU_ASSERT(inode != NULL);
+	if (inode) {
+		uint64_t ino = inode->ino;
+		CU_ASSERT(gitmod_inode_get_size(inode) == 184);
+		// same object, same inode
+		CU_ASSERT(gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt") == inode);
+		CU_ASSERT(inode->nlookup == 2);
+		gitmod_forget(gm_info, ino, 1);
+		CU_ASSERT(gitmod_get_inode(gm_info, ino) == inode);
+		gitmod_forget(gm_info, ino, 1);
+		CU_ASSERT(gitmod_get_inode(gm_info, ino) == NULL);
+		// it gets the same number if it's looked up again
+		inode = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+		CU_ASSERT(inode != NULL);
+		if (inode) {
+			CU_ASSERT(inode->ino == ino);
+			gitmod_forget(gm_info, ino, 1);
+		}
+	}
+	// the root inode is never forgotten
+	gitmod_forget(gm_info, GITMOD_ROOT_INODE, 10);
+	CU_ASSERT(gitmod_get_inode(gm_info, GITMOD_ROOT_INODE) != NULL);
+}
+
+static void suiteinode_negativeLookups()
+{
+	int size = gitmod_inode_table_size(gm_info->inodes);
+	CU_ASSERT(gitmod_lookup(gm_info, GITMOD_ROOT_INODE, ".htaccess") == NULL);
+	CU_ASSERT(gitmod_lookup(gm_info, GITMOD_ROOT_INODE, ".htaccess") == NULL);
+	// nothing is set up for names that are not there
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == size);
+
+	// names that are there are not affected
+	gitmod_inode *inode = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+	CU_ASSERT(inode != NULL);
+	if (inode)
+		gitmod_forget(gm_info, inode->ino, 1);
+}
+
+typedef struct {
+	int entries;
+	int limit;		// entries that are taken
+	int64_t next_offset;
+} counted_entries;
+
+static int count_entries(void *payload, const char *name, uint64_t ino, enum gitmod_object_type type,
+			 int64_t next_offset)
+{
+	counted_entries *counted = payload;
+	if (counted->entries == counted->limit)
+		return 1;
+	counted->entries++;
+	counted->next_offset = next_offset;
+	return 0;
+}
+
+static void suiteinode_readdirAndRead()
+{
+	gitmod_inode_dir *dir = gitmod_opendir(gm_info, GITMOD_ROOT_INODE);
+	CU_ASSERT(dir != NULL);
+	if (dir) {
+		counted_entries counted = {.limit = 10 };
+		CU_ASSERT(gitmod_readdir(dir, 0, count_entries, &counted) == 0);
+		CU_ASSERT(counted.entries == 4);
+		CU_ASSERT(counted.next_offset == 4);
+
+		// it goes on from where it stopped
+		counted_entries first = {.limit = 2 };
+		CU_ASSERT(gitmod_readdir(dir, 0, count_entries, &first) == 0);
+		CU_ASSERT(first.entries == 2);
+		CU_ASSERT(first.next_offset == 2);
+		counted_entries rest = {.limit = 10 };
+		CU_ASSERT(gitmod_readdir(dir, first.next_offset, count_entries, &rest) == 0);
+		CU_ASSERT(rest.entries == 2);
+		CU_ASSERT(rest.next_offset == 4);
+		counted_entries past = {.limit = 10 };
+		CU_ASSERT(gitmod_readdir(dir, 4, count_entries, &past) == 0);
+		CU_ASSERT(past.entries == 0);
+		gitmod_releasedir(gm_info, &dir);
+		CU_ASSERT(dir == NULL);
+	}
+
+	gitmod_inode *inode = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "hello-world.sh");
+	CU_ASSERT(inode != NULL);
+	if (inode) {
+		CU_ASSERT(gitmod_opendir(gm_info, inode->ino) == NULL);
+		gitmod_file *file = gitmod_open_inode(gm_info, inode);
+		CU_ASSERT(file != NULL);
+		if (file) {
+			char buf[10];
+			memset(buf, 0, sizeof(buf));
+			CU_ASSERT(gitmod_read_file(file, buf, 9, 0) == 9);
+			CU_ASSERT(strcmp(buf, "#!/bin/ba") == 0);
+			gitmod_release_file(&file);
+		}
+		gitmod_forget(gm_info, inode->ino, 1);
+	}
+}
+
+typedef struct {
+	int entries;
+	int limit;
+	int64_t next_offset;
+	uint64_t inos[10];
+} plus_entries;
+
+static int take_entries(void *payload, const char *name, gitmod_inode *inode, int64_t next_offset)
+{
+	plus_entries *taken = payload;
+	if (taken->entries == taken->limit)
+		return 1;
+	CU_ASSERT(!strcmp(name, inode->name));
+	CU_ASSERT(gitmod_get_inode(gm_info, inode->ino) == inode);
+	taken->inos[taken->entries++] = inode->ino;
+	taken->next_offset = next_offset;
+	return 0;
+}
+
+static void suiteinode_readdirplus()
+{
+	gitmod_inode_dir *root = gitmod_opendir(gm_info, GITMOD_ROOT_INODE);
+	CU_ASSERT(root != NULL);
+	if (!root)
+		return;
+	plus_entries taken = {.limit = 10 };
+	CU_ASSERT(gitmod_readdirplus(gm_info, root, 0, take_entries, &taken) == 0);
+	CU_ASSERT(taken.entries == 4);
+	CU_ASSERT(taken.next_offset == 4);
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 5);
+	gitmod_inode *dir = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "some-dir");
+	CU_ASSERT(dir != NULL);
+	if (dir) {
+		// the same inode, with attributes filled in
+		CU_ASSERT(dir->nlookup == 2);
+		CU_ASSERT(gitmod_inode_get_num_entries(dir) == 1);
+		gitmod_forget(gm_info, dir->ino, 1);
+	}
+	gitmod_inode *cowsay = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+	CU_ASSERT(cowsay != NULL);
+	if (cowsay) {
+		CU_ASSERT(gitmod_inode_get_size(cowsay) == 184);
+		gitmod_forget(gm_info, cowsay->ino, 1);
+	}
+	for (int i = 0; i < taken.entries; i++)
+		gitmod_forget(gm_info, taken.inos[i], 1);
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 1);
+
+	// the buffer gets full after one entry, the one that did not fit is not looked up
+	plus_entries partial = {.limit = 1 };
+	CU_ASSERT(gitmod_readdirplus(gm_info, root, 2, take_entries, &partial) == 0);
+	CU_ASSERT(partial.entries == 1);
+	CU_ASSERT(partial.next_offset == 3);
+	CU_ASSERT(partial.inos[0] == taken.inos[2]);
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 2);
+	gitmod_forget(gm_info, partial.inos[0], 1);
+	gitmod_releasedir(gm_info, &root);
+
+	// it was forgotten
+	CU_ASSERT(gitmod_opendir(gm_info, taken.inos[0]) == NULL);
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 1);
+}
+
+static int invalidated_entries;
+static int invalidated_root;
+
+static void count_invalidations(void *payload, uint64_t parent, const char *name)
+{
+	CU_ASSERT(parent == GITMOD_ROOT_INODE);
+	if (!name)
+		invalidated_root++;
+	else if (!strcmp(name, "tux.txt"))
+		invalidated_entries++;
+	else
+		// nothing else changed
+		invalidated_entries += 100;
+}
+
+static void suiteinode_rootTreeMoves()
+{
+	gitmod_inode *cowsay = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+	gitmod_inode *dir = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "some-dir");
+	CU_ASSERT(cowsay != NULL);
+	CU_ASSERT(dir != NULL);
+	CU_ASSERT(gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "tux.txt") == NULL);
+	if (!(cowsay && dir))
+		return;
+	uint64_t cowsay_ino = cowsay->ino;
+	uint64_t dir_ino = dir->ino;
+	gitmod_forget(gm_info, cowsay_ino, 1);	// the kernel can forget about it while the tree moves
+	gitmod_inode_dir *listing = gitmod_opendir(gm_info, GITMOD_ROOT_INODE);
+	CU_ASSERT(listing != NULL);
+
+	git_object *treeish;
+	int ret = git_revparse_single(&treeish, gm_info->repo, "test-main^{tree}");
+	CU_ASSERT(!ret);
+	if (!ret) {
+		gitmod_root_tree *root_tree = gitmod_root_tree_create((git_tree *) treeish, 2000000000, 0);
+		CU_ASSERT(root_tree != NULL);
+		unsigned long changes = gitmod_get_root_tree_changes(gm_info);
+		gitmod_set_invalidate_func(gm_info, count_invalidations, NULL);
+		gitmod_lock(gm_info->lock);
+		gitmod_root_tree_changed(gm_info, root_tree);
+		gitmod_set_invalidate_func(gm_info, NULL, NULL);
+		CU_ASSERT(gitmod_get_root_tree_changes(gm_info) == changes + 1);
+		CU_ASSERT(invalidated_entries == 1);
+		CU_ASSERT(invalidated_root == 1);
+
+		if (listing) {
+			// a directory that was open keeps on listing the tree it had
+			counted_entries counted = {.limit = 10 };
+			CU_ASSERT(gitmod_readdir(listing, 0, count_entries, &counted) == 0);
+			CU_ASSERT(counted.entries == 4);
+			gitmod_releasedir(gm_info, &listing);
+		}
+		listing = gitmod_opendir(gm_info, GITMOD_ROOT_INODE);
+		CU_ASSERT(listing != NULL);
+		if (listing) {
+			counted_entries counted = {.limit = 10 };
+			CU_ASSERT(gitmod_readdir(listing, 0, count_entries, &counted) == 0);
+			CU_ASSERT(counted.entries == 5);
+		}
+
+		gitmod_inode *root = gitmod_get_inode(gm_info, GITMOD_ROOT_INODE);
+		CU_ASSERT(gitmod_inode_get_num_entries(root) == 5);
+		CU_ASSERT(gitmod_inode_table_get_time(gm_info->inodes) == 2000000000);
+		// paths that did not change keep their inode numbers
+		cowsay = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "cowsay.txt");
+		CU_ASSERT(cowsay != NULL);
+		if (cowsay) {
+			CU_ASSERT(cowsay->ino == cowsay_ino);
+			gitmod_forget(gm_info, cowsay->ino, 1);
+		}
+		CU_ASSERT(gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "some-dir") == dir);
+		CU_ASSERT(dir->ino == dir_ino);
+		CU_ASSERT(dir->nlookup == 2);
+		gitmod_forget(gm_info, dir_ino, 2);
+
+		gitmod_inode *tux = gitmod_lookup(gm_info, GITMOD_ROOT_INODE, "tux.txt");
+		CU_ASSERT(tux != NULL);
+		if (tux)
+			gitmod_forget(gm_info, tux->ino, 1);
+	}
+	gitmod_releasedir(gm_info, &listing);
+	CU_ASSERT(gitmod_inode_table_size(gm_info->inodes) == 1);
+}
+
+CU_pSuite suiteinode_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteInode", suiteinode_init, suiteinode_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteInode: lookup", suiteinode_lookup) &&
+		      CU_add_test(pSuite, "SuiteInode: forget", suiteinode_forget) &&
+		      CU_add_test(pSuite, "SuiteInode: negativeLookups", suiteinode_negativeLookups) &&
+		      CU_add_test(pSuite, "SuiteInode: readdirAndRead", suiteinode_readdirAndRead) &&
+		      CU_add_test(pSuite, "SuiteInode: readdirplus", suiteinode_readdirplus) &&
+		      CU_add_test(pSuite, "SuiteInode: rootTreeMoves", suiteinode_rootTreeMoves))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <CUnit/Basic.h>
 #include "gitmod.h"
 
@@ -33,7 +34,9 @@ static void suitekim_testRevisionInfo()
 	CU_ASSERT(gm_info->root_tree->time == 2000000000);
 	CU_ASSERT(gm_info->treeish_type == GIT_OBJ_COMMIT);
 	CU_ASSERT(gm_info->root_tree->objects_cache != NULL);
-	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);	// all paths are set
+	// paths are set up when they are accessed
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 0);
+	CU_ASSERT(gm_info->root_tree->populated_dirs == 0);
 }
 
 static void suitekim_testGetRootTree()
@@ -123,7 +126,8 @@ static void suitekim_testGetRootTree()
 		gitmod_dispose_object(&root_tree);
 		CU_ASSERT(root_tree != NULL);
 	}
-	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);
+	// the root tree and its entries
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 6);
 }
 
 static void suitekim_testGetObjectByPathBlob()
@@ -147,7 +151,7 @@ static void suitekim_testGetObjectByPathBlob()
 		gitmod_dispose_object(&object);
 		CU_ASSERT(object != NULL);
 	}
-	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 6);
 }
 
 static void suitekim_testGetExecObjectByPathBlob()
@@ -171,7 +175,7 @@ static void suitekim_testGetExecObjectByPathBlob()
 		gitmod_dispose_object(&object);
 		CU_ASSERT(object != NULL);
 	}
-	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 6);
 }
 
 static void suitekim_testGetObjectByPathTree()
@@ -187,14 +191,100 @@ static void suitekim_testGetObjectByPathTree()
 		gitmod_dispose_object(&object);
 		CU_ASSERT(object != NULL);
 	}
-	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 6);
 }
 
 static void suitekim_testGetNonExistingObjectByPath()
 {
 	gitmod_object *object = gitmod_get_object(gm_info, "blahblah");
 	CU_ASSERT(object == NULL);
+	object = gitmod_get_object(gm_info, "/some-dir/blahblah");
+	CU_ASSERT(object == NULL);
+	object = gitmod_get_object(gm_info, "/tux.txt/blahblah");
+	CU_ASSERT(object == NULL);
+	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 6);
+	// only directories that were walked through
+	CU_ASSERT(gm_info->root_tree->populated_dirs == 2);
+}
+
+static void suitekim_testBudgetEviction()
+{
+	gitmod_cache_stats stats;
+	gitmod_cache *cache = gm_info->root_tree->objects_cache;
+	// tux.txt and hello-world.sh were loaded already (196 bytes)
+	gitmod_set_cache_budget(gm_info, 200);
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(object != NULL);
+	if (object) {
+		CU_ASSERT(gitmod_object_get_content(object) != NULL);
+		gitmod_cache_get_stats(cache, &stats);
+		CU_ASSERT(stats.budget == 200);
+		CU_ASSERT(stats.bytes <= 200);
+		CU_ASSERT(stats.evictions == 2);
+		CU_ASSERT(object->blob != NULL);	// in use, it can't be evicted
+		gitmod_dispose_object(&object);
+	}
+	// paths are kept, evicted blobs are loaded again when needed
+	CU_ASSERT(gitmod_cache_size(cache) == 6);
+	object = gitmod_get_object(gm_info, "/tux.txt");
+	CU_ASSERT(object != NULL);
+	if (object) {
+		CU_ASSERT(object->blob == NULL);
+		CU_ASSERT(gitmod_object_get_content(object) != NULL);
+		gitmod_dispose_object(&object);
+	}
+	gitmod_cache_get_stats(cache, &stats);
+	CU_ASSERT(stats.ready > 0);
+	CU_ASSERT(stats.not_ready > 0);
+	CU_ASSERT(stats.evictions == 3);
+	gitmod_set_cache_budget(gm_info, 0);
+}
+
+static void count_ready(void *payload)
+{
+	__atomic_add_fetch((int *)payload, 1, __ATOMIC_RELEASE);
+}
+
+static void suitekim_testReady()
+{
+	// nothing to warm up
+	CU_ASSERT(gitmod_is_ready(gm_info));
+	int ready = 0;
+	gitmod_set_ready_func(gm_info, count_ready, &ready);
+	CU_ASSERT(ready == 1);
+	char status[1024];
+	CU_ASSERT(gitmod_get_status(gm_info, status, sizeof(status)) > 0);
+	CU_ASSERT(strstr(status, "ready: yes\n") != NULL);
+	CU_ASSERT(strstr(status, "warm-up: off\n") != NULL);
+}
+
+static void suitekim_testWarmUp()
+{
+	int ready = 0;
+	CU_ASSERT(!gitmod_set_preload(gm_info, 2, 0));
+	gitmod_set_ready_func(gm_info, count_ready, &ready);
+	// objects can be used while warming up
+	gitmod_object *object = gitmod_get_object(gm_info, "/some-dir/sample-file.txt");
+	CU_ASSERT(object != NULL);
+	gitmod_dispose_object(&object);
+	for (int i = 0; i < 1000 && !__atomic_load_n(&ready, __ATOMIC_ACQUIRE); i++)
+		usleep(10000);
+	CU_ASSERT(ready == 1);
+	CU_ASSERT(gitmod_is_ready(gm_info));
+	// all paths are set up
 	CU_ASSERT(gitmod_cache_size(gm_info->root_tree->objects_cache) == 7);
+	CU_ASSERT(gm_info->root_tree->populated_dirs == 2);
+	// metadata of the paths comes from the arena of the root tree
+	gitmod_object *file = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(file != NULL && file->in_arena);
+	if (file)
+		CU_ASSERT(file->path == file->cached_item->id);
+	gitmod_dispose_object(&file);
+	CU_ASSERT(gitmod_arena_used(gm_info->root_tree->arena) > 0);
+	char status[1024];
+	gitmod_get_status(gm_info, status, sizeof(status));
+	CU_ASSERT(strstr(status, "warm-up: done\n") != NULL);
+	CU_ASSERT(strstr(status, "paths set up: 7\n") != NULL);
 }
 
 CU_pSuite suitekim_setup()
@@ -209,7 +299,10 @@ CU_pSuite suitekim_setup()
 		      CU_add_test(pSuite, "Suitekim: getExecObjectByPathBlob", suitekim_testGetExecObjectByPathBlob) &&
 		      CU_add_test(pSuite, "Suitekim: getObjectByPathTree", suitekim_testGetObjectByPathTree) &&
 		      CU_add_test(pSuite, "Suitekim: getNonExisingObjectByPath",
-				  suitekim_testGetNonExistingObjectByPath))) {
+				  suitekim_testGetNonExistingObjectByPath) &&
+		      CU_add_test(pSuite, "Suitekim: budgetEviction", suitekim_testBudgetEviction) &&
+		      CU_add_test(pSuite, "Suitekim: ready", suitekim_testReady) &&
+		      CU_add_test(pSuite, "Suitekim: warmUp", suitekim_testWarmUp))) {
 			return NULL;
 		}
 	}
@@ -5,6 +5,7 @@
  * Suite keep in memory
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <CUnit/Basic.h>
@@ -49,7 +50,7 @@ static void suitekim2_testPullTwoDifferentObjectsMarkForDeletionDisposeOfThem()
 				CU_ASSERT(object2 != NULL);
 				CU_ASSERT(root_tree->usage_counter = 2);
 				// we mark it to be disposed
-				root_tree->marked_for_deletion = 1;
+				CU_ASSERT(!gitmod_root_tree_retire(root_tree));	// objects are still in use
 				if (object != NULL) {
 					ret = gitmod_root_tree_dispose_object(&object);
 					CU_ASSERT(!ret);
@@ -92,7 +93,7 @@ static void suitekim2_testPullTwiceSameObjectMarkForDeletionDisposeOfThem()
 				CU_ASSERT(object2 != NULL);
 				CU_ASSERT(root_tree->usage_counter = 2);
 				// we mark it to be disposed
-				root_tree->marked_for_deletion = 1;
+				CU_ASSERT(!gitmod_root_tree_retire(root_tree));	// objects are still in use
 				if (object != NULL) {
 					ret = gitmod_root_tree_dispose_object(&object);
 					CU_ASSERT(!ret);
@@ -305,6 +306,227 @@ static void suitekim2_treeMoves2ObjectsInUse()
 	}
 }
 
+static void suitekim2_treeMovesCarryOver()
+{
+	int ret = git_repository_open(&gm_info->repo, REPO_PATH);
+	CU_ASSERT(!ret);
+	if (!ret) {
+		gm_info->content_store = gitmod_content_store_create();
+		git_object *treeish;
+		ret = git_revparse_single(&treeish, gm_info->repo, "intermediate^{tree}");
+		CU_ASSERT(!ret);
+		if (!ret) {
+			gitmod_root_tree *root_tree = gitmod_root_tree_create((git_tree *) treeish, 0, 1);
+			CU_ASSERT(root_tree != NULL);
+			if (root_tree) {
+				CU_ASSERT(gitmod_cache_size(root_tree->objects_cache) == 0);
+				// load a blob in the original tree
+				gitmod_object *object = gitmod_root_tree_get_object(gm_info, root_tree, "/cowsay.txt");
+				CU_ASSERT(object != NULL);
+				const char *content = gitmod_object_get_content(object);
+				CU_ASSERT(content != NULL);
+				gitmod_root_tree_dispose_object(&object);
+
+				ret = git_revparse_single(&treeish, gm_info->repo, "test-main^{tree}");
+				CU_ASSERT(!ret);
+				if (!ret) {
+					gitmod_root_tree *root_tree2 =
+					    gitmod_root_tree_create_from_previous(gm_info, root_tree,
+										  (git_tree *) treeish, 0);
+					CU_ASSERT(root_tree2 != NULL);
+					if (root_tree2) {
+						// nothing is set up until it's accessed
+						CU_ASSERT(gitmod_cache_size(root_tree2->objects_cache) == 0);
+						CU_ASSERT(root_tree2->populated_dirs == 0);
+						CU_ASSERT(root_tree2->previous == root_tree);
+						// cowsay.txt did not change, it takes what was loaded in the original tree
+						object =
+						    gitmod_root_tree_get_object(gm_info, root_tree2, "/cowsay.txt");
+						CU_ASSERT(object != NULL);
+						if (object) {
+							CU_ASSERT(object->root_tree == root_tree2);
+							CU_ASSERT(object->blob != NULL);
+							CU_ASSERT(gitmod_object_get_content(object) == content);
+							gitmod_root_tree_dispose_object(&object);
+						}
+						object = gitmod_root_tree_get_object(gm_info, root_tree2, "/tux.txt");
+						CU_ASSERT(object != NULL);
+						if (object)
+							gitmod_root_tree_dispose_object(&object);
+						object = gitmod_root_tree_get_object(gm_info, root_tree2, "/");
+						CU_ASSERT(object != NULL);
+						if (object) {
+							CU_ASSERT(gitmod_object_get_num_entries(object) == 5);
+							gitmod_root_tree_dispose_object(&object);
+						}
+						gitmod_root_tree_dispose(&root_tree2);
+					}
+				}
+				gitmod_root_tree_dispose(&root_tree);
+			}
+		}
+		gitmod_content_store_dispose(&gm_info->content_store);
+		git_repository_free(gm_info->repo);
+	}
+}
+
+static void suitekim2_preload()
+{
+	int ret = git_repository_open(&gm_info->repo, REPO_PATH);
+	CU_ASSERT(!ret);
+	if (!ret) {
+		gm_info->content_store = gitmod_content_store_create();
+		GPtrArray *repos = g_ptr_array_new();
+		git_repository *repo;
+		for (int i = 0; i < 3; i++)
+			if (!git_repository_open(&repo, REPO_PATH))
+				g_ptr_array_add(repos, repo);
+		CU_ASSERT(repos->len == 3);
+		git_object *treeish;
+		ret = git_revparse_single(&treeish, gm_info->repo, "test-main^{tree}");
+		CU_ASSERT(!ret);
+		if (!ret) {
+			gitmod_root_tree *root_tree = gitmod_root_tree_create((git_tree *) treeish, 0, 1);
+			CU_ASSERT(root_tree != NULL);
+			if (root_tree) {
+				gitmod_preload_stats stats;
+				CU_ASSERT(!gitmod_root_tree_preload(gm_info, root_tree, repos, 1, NULL, &stats));
+				// the root directory and some-dir
+				CU_ASSERT(stats.dirs == 2);
+				CU_ASSERT(root_tree->populated_dirs == 2);
+				CU_ASSERT(stats.objects == 6);
+				CU_ASSERT(stats.blobs == 5);
+				CU_ASSERT(gitmod_cache_size(root_tree->objects_cache) == 6);
+				gitmod_object *object =
+				    gitmod_root_tree_get_object(gm_info, root_tree, "/some-dir/sample-file.txt");
+				CU_ASSERT(object != NULL);
+				if (object) {
+					// it was loaded already
+					CU_ASSERT(object->blob != NULL);
+					CU_ASSERT(object->repo == gm_info->repo);
+					gitmod_root_tree_dispose_object(&object);
+				}
+				// nothing else is set up
+				CU_ASSERT(!gitmod_root_tree_preload(gm_info, root_tree, repos, 0, NULL, &stats));
+				CU_ASSERT(stats.objects == 0);
+				gitmod_root_tree_dispose(&root_tree);
+			}
+		}
+		gitmod_content_store_dispose(&gm_info->content_store);
+		for (guint i = 0; i < repos->len; i++)
+			git_repository_free(g_ptr_array_index(repos, i));
+		g_ptr_array_free(repos, TRUE);
+		git_repository_free(gm_info->repo);
+	}
+}
+
+static int concurrent_readers_run;
+static int concurrent_readers_failures;
+
+static void *concurrent_reader(void *params)
+{
+	while (__atomic_load_n(&concurrent_readers_run, __ATOMIC_ACQUIRE)) {
+		gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+		if (!(object && gitmod_object_get_content(object)))
+			__atomic_add_fetch(&concurrent_readers_failures, 1, __ATOMIC_RELAXED);
+		gitmod_dispose_object(&object);
+	}
+	return NULL;
+}
+
+static void suitekim2_concurrentReadersDuringSwaps()
+{
+	int ret = git_repository_open(&gm_info->repo, REPO_PATH);
+	CU_ASSERT(!ret);
+	if (!ret) {
+		gm_info->content_store = gitmod_content_store_create();
+		git_oid oids[2];
+		const char *treeishes[] = { "intermediate^{tree}", "test-main^{tree}" };
+		git_object *treeish;
+		for (int i = 0; i < 2; i++) {
+			ret = git_revparse_single(&treeish, gm_info->repo, treeishes[i]);
+			CU_ASSERT(!ret);
+			if (!ret) {
+				git_oid_cpy(&oids[i], git_object_id(treeish));
+				git_object_free(treeish);
+			}
+		}
+		git_tree *tree;
+		git_tree_lookup(&tree, gm_info->repo, &oids[0]);
+		gm_info->root_tree = gitmod_root_tree_create(tree, 0, 1);
+		CU_ASSERT(gm_info->root_tree != NULL);
+		if (gm_info->root_tree) {
+			pthread_t readers[4];
+			concurrent_readers_run = 1;
+			concurrent_readers_failures = 0;
+			for (int i = 0; i < 4; i++)
+				pthread_create(&readers[i], NULL, concurrent_reader, NULL);
+			// readers never see a root tree that was disposed of
+			for (int i = 1; i <= 200; i++) {
+				git_tree_lookup(&tree, gm_info->repo, &oids[i % 2]);
+				gitmod_root_tree *root_tree =
+				    gitmod_root_tree_create_from_previous(gm_info, gm_info->root_tree, tree, 0);
+				CU_ASSERT(root_tree != NULL);
+				gitmod_lock(gm_info->lock);
+				gitmod_root_tree_changed(gm_info, root_tree);
+			}
+			__atomic_store_n(&concurrent_readers_run, 0, __ATOMIC_RELEASE);
+			for (int i = 0; i < 4; i++)
+				pthread_join(readers[i], NULL);
+			CU_ASSERT(concurrent_readers_failures == 0);
+			CU_ASSERT(gm_info->root_tree->usage_counter == 0);
+			// nobody is using it
+			CU_ASSERT(gitmod_root_tree_retire(gm_info->root_tree));
+			gm_info->root_tree = NULL;
+		}
+		gitmod_content_store_dispose(&gm_info->content_store);
+		git_repository_free(gm_info->repo);
+	}
+}
+
+static void suitekim2_retainedContentExpires()
+{
+	int ret = git_repository_open(&gm_info->repo, REPO_PATH);
+	CU_ASSERT(!ret);
+	if (ret)
+		return;
+	gitmod_content_store *store = gitmod_content_store_create();
+	CU_ASSERT(store != NULL);
+	git_object *blob;
+	ret = git_revparse_single(&blob, gm_info->repo, "test-main:cowsay.txt");
+	CU_ASSERT(!ret);
+	if (store && !ret) {
+		// the tree does not move again, retained content is released once it goes over budget
+		gitmod_content_store_set_retention(store, 100, 0);
+		gitmod_content *content =
+		    gitmod_content_store_get(store, gm_info->repo, git_object_id(blob), GIT_OBJ_BLOB);
+		CU_ASSERT(content != NULL);
+		gitmod_content_store_release(store, &content, 1);
+		CU_ASSERT(gitmod_content_store_size(store) == 0);
+		CU_ASSERT(store->expired == 1);
+		CU_ASSERT(store->bytes == 0);
+
+		// within budget, it is kept for a new root tree to pick it up
+		gitmod_content_store_set_retention(store, 1000, 0);
+		content = gitmod_content_store_get(store, gm_info->repo, git_object_id(blob), GIT_OBJ_BLOB);
+		CU_ASSERT(content != NULL);
+		gitmod_content_store_release(store, &content, 1);
+		CU_ASSERT(gitmod_content_store_size(store) == 1);
+		CU_ASSERT(store->retained_bytes == 184);
+		content = gitmod_content_store_get(store, gm_info->repo, git_object_id(blob), GIT_OBJ_BLOB);
+		CU_ASSERT(content != NULL);
+		CU_ASSERT(store->hits == 1);
+		CU_ASSERT(store->retained_bytes == 0);
+		gitmod_content_store_release(store, &content, 0);
+		CU_ASSERT(gitmod_content_store_size(store) == 0);
+		CU_ASSERT(store->expired == 1);
+	}
+	if (!ret)
+		git_object_free(blob);
+	gitmod_content_store_dispose(&store);
+	git_repository_free(gm_info->repo);
+}
+
 CU_pSuite suitekim2_setup()
 {
 	CU_pSuite pSuite = CU_add_suite("Suitekim2", suitekim2_init, suitekim2_shutdown);
@@ -320,7 +542,12 @@ CU_pSuite suitekim2_setup()
 		     && CU_add_test(pSuite, "Suitekim2, treeMoves1ObjectInUse", suitekim2_treeMoves1ObjectInUse)
 		     && CU_add_test(pSuite, "Suitekim2, treeMoves1ObjectInUseTwice",
 				    suitekim2_treeMoves1ObjectInUseTwice)
-		     && CU_add_test(pSuite, "Suitekim2, treeMoves2ObjectsInUse", suitekim2_treeMoves2ObjectsInUse))) {
+		     && CU_add_test(pSuite, "Suitekim2, treeMoves2ObjectsInUse", suitekim2_treeMoves2ObjectsInUse)
+		     && CU_add_test(pSuite, "Suitekim2, treeMovesCarryOver", suitekim2_treeMovesCarryOver)
+		     && CU_add_test(pSuite, "Suitekim2, preload", suitekim2_preload)
+		     && CU_add_test(pSuite, "Suitekim2, concurrentReadersDuringSwaps",
+				    suitekim2_concurrentReadersDuringSwaps)
+		     && CU_add_test(pSuite, "Suitekim2, retainedContentExpires", suitekim2_retainedContentExpires))) {
 			return NULL;
 		}
 	}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite log
+ *  Messages of a site that go over the rate limit are suppressed and counted until they are reported
+ */
+
+#include <time.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define NUM_MESSAGES 10
+#define RATE_LIMIT 3
+
+static int suitelog_init()
+{
+	gitmod_init();
+	return 0;
+}
+
+static int suitelog_shutdown()
+{
+	gitmod_log_set_rate_limit(GITMOD_LOG_DEFAULT_RATE_LIMIT);
+	gitmod_shutdown();
+	return 0;
+}
+
+static void suitelog_rate_limit()
+{
+	gitmod_log_site site = { __FILE__, __LINE__ };
+	struct timespec before, after;
+	gitmod_log_set_rate_limit(RATE_LIMIT);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &before);
+	for (int i = 0; i < NUM_MESSAGES; i++)
+		gitmod_log_write(&site, LOG_DEBUG, "SuiteLog: message %d", i);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &after);
+	// unless the second changed while writing them
+	if (before.tv_sec == after.tv_sec)
+		CU_ASSERT(site.suppressed == NUM_MESSAGES - RATE_LIMIT);
+	CU_ASSERT(site.suppressed > 0);
+	CU_ASSERT(site.listed == 1);
+	gitmod_log_flush();
+	// they were reported
+	CU_ASSERT(site.suppressed == 0);
+	CU_ASSERT(site.reported != 0);
+	// a site is listed only once
+	gitmod_log_write(&site, LOG_DEBUG, "SuiteLog: one more message");
+	CU_ASSERT(site.listed == 1);
+	gitmod_log_flush();
+}
+
+static void suitelog_no_limit()
+{
+	gitmod_log_site site = { __FILE__, __LINE__ };
+	gitmod_log_set_rate_limit(0);
+	for (int i = 0; i < GITMOD_LOG_RING_SIZE / 2; i++)
+		gitmod_log_write(&site, LOG_DEBUG, "SuiteLog: message %d", i);
+	CU_ASSERT(site.suppressed == 0);
+	CU_ASSERT(site.listed == 0);
+	gitmod_log_flush();
+	gitmod_log_set_rate_limit(GITMOD_LOG_DEFAULT_RATE_LIMIT);
+}
+
+CU_pSuite suitelog_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteLog", suitelog_init, suitelog_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteLog: rate limit", suitelog_rate_limit) &&
+		      CU_add_test(pSuite, "SuiteLog: no limit", suitelog_no_limit))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
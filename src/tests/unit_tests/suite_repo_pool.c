@@ -0,0 +1,101 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite repo pool
+ *  Threads read objects with handles of their own
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+static char *REPO_PATH = "tests/test_repo";
+
+static int suiterepopool_init()
+{
+	gitmod_init();
+	return 0;
+}
+
+static int suiterepopool_shutdown()
+{
+	gitmod_shutdown();
+	return 0;
+}
+
+static void *get_repo(void *params)
+{
+	return gitmod_repo_pool_get(params);
+}
+
+static void suiterepopool_handles()
+{
+	gitmod_repo_pool *pool = gitmod_repo_pool_create(REPO_PATH, 2);
+	CU_ASSERT(pool != NULL);
+	if (!pool)
+		return;
+	CU_ASSERT(gitmod_repo_pool_size(pool) == 2);
+	git_repository *repo = gitmod_repo_pool_get(pool);
+	CU_ASSERT(repo != NULL);
+	// a thread keeps its handle
+	CU_ASSERT(gitmod_repo_pool_get(pool) == repo);
+	pthread_t thread;
+	void *other;
+	pthread_create(&thread, NULL, get_repo, pool);
+	pthread_join(thread, &other);
+	CU_ASSERT(other != NULL);
+	CU_ASSERT(other != repo);
+	// handles are assigned round robin
+	pthread_create(&thread, NULL, get_repo, pool);
+	pthread_join(thread, &other);
+	CU_ASSERT(other == repo);
+	gitmod_repo_pool_dispose(&pool);
+	CU_ASSERT(pool == NULL);
+	CU_ASSERT(gitmod_repo_pool_create(REPO_PATH, 0) == NULL);
+}
+
+static void *read_cowsay(void *params)
+{
+	gitmod_file *file = gitmod_open_file(params, "/cowsay.txt");
+	if (!file)
+		return NULL;
+	char buf[200];
+	long ret = gitmod_read_file(file, buf, sizeof(buf), 0);
+	gitmod_release_file(&file);
+	return (void *)ret;
+}
+
+static void suiterepopool_read()
+{
+	gitmod_info *info = gitmod_start(REPO_PATH, "test-main", GITMOD_OPTION_FIX, 100);
+	CU_ASSERT(info != NULL);
+	if (!info)
+		return;
+	CU_ASSERT(!gitmod_set_repo_pool(info, 4));
+	CU_ASSERT(gitmod_set_repo_pool(info, 4) == -EBUSY);
+	CU_ASSERT(gitmod_get_repo(info) != info->repo);
+	pthread_t threads[8];
+	void *ret;
+	for (int i = 0; i < 8; i++)
+		pthread_create(&threads[i], NULL, read_cowsay, info);
+	for (int i = 0; i < 8; i++) {
+		pthread_join(threads[i], &ret);
+		CU_ASSERT((long)ret == 184);
+	}
+	gitmod_stop(&info);
+}
+
+CU_pSuite suiterepopool_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteRepoPool", suiterepopool_init, suiterepopool_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteRepoPool: handles", suiterepopool_handles) &&
+		      CU_add_test(pSuite, "SuiteRepoPool: read", suiterepopool_read))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
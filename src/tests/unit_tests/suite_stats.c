@@ -0,0 +1,191 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite stats
+ *  Latencies and counters recorded by different threads are added up when they are read
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define NUM_THREADS 4
+#define NUM_RECORDS 1000
+
+static char *REPO_PATH = "tests/test_repo";
+
+static int suitestats_init()
+{
+	gitmod_init();
+	return 0;
+}
+
+static int suitestats_shutdown()
+{
+	gitmod_shutdown();
+	return 0;
+}
+
+static void suitestats_quantiles()
+{
+	gitmod_stats *stats = gitmod_stats_create();
+	CU_ASSERT(stats != NULL);
+	if (!stats)
+		return;
+	CU_ASSERT(gitmod_stats_get_quantile(stats, GITMOD_STATS_READ, 0.5) == 0);
+	// 1 us to 1 ms
+	for (uint64_t latency = 1000; latency <= 1000000; latency += 1000)
+		gitmod_stats_record_latency(stats, GITMOD_STATS_READ, latency);
+	CU_ASSERT(gitmod_stats_get_count(stats, GITMOD_STATS_READ) == 1000);
+	CU_ASSERT(gitmod_stats_get_count(stats, GITMOD_STATS_OPEN) == 0);
+	// within the precision of the buckets
+	uint64_t median = gitmod_stats_get_quantile(stats, GITMOD_STATS_READ, 0.5);
+	CU_ASSERT(median >= 500000 && median < 500000 * 1.13);
+	uint64_t p99 = gitmod_stats_get_quantile(stats, GITMOD_STATS_READ, 0.99);
+	CU_ASSERT(p99 >= 990000 && p99 < 990000 * 1.13);
+	// small and huge latencies have buckets too
+	gitmod_stats_record_latency(stats, GITMOD_STATS_OPEN, 3);
+	CU_ASSERT(gitmod_stats_get_quantile(stats, GITMOD_STATS_OPEN, 1) == 3);
+	gitmod_stats_record_latency(stats, GITMOD_STATS_LOOKUP, UINT64_MAX);
+	CU_ASSERT(gitmod_stats_get_quantile(stats, GITMOD_STATS_LOOKUP, 1) > 1000000000000UL);
+	uint64_t start = gitmod_stats_now();
+	gitmod_stats_record(stats, GITMOD_STATS_GETATTR, start);
+	CU_ASSERT(gitmod_stats_get_count(stats, GITMOD_STATS_GETATTR) == 1);
+	gitmod_stats_dispose(&stats);
+	CU_ASSERT(stats == NULL);
+}
+
+static void *record(void *params)
+{
+	for (int i = 0; i < NUM_RECORDS; i++) {
+		gitmod_stats_record_latency(params, GITMOD_STATS_GETATTR, i);
+		gitmod_stats_add(params, GITMOD_STATS_ITEMS_READY, 2);
+	}
+	return NULL;
+}
+
+static void suitestats_threads()
+{
+	gitmod_stats *stats = gitmod_stats_create();
+	CU_ASSERT(stats != NULL);
+	if (!stats)
+		return;
+	pthread_t threads[NUM_THREADS];
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < NUM_THREADS; i++)
+			pthread_create(&threads[i], NULL, record, stats);
+		for (int i = 0; i < NUM_THREADS; i++)
+			pthread_join(threads[i], NULL);
+	}
+	CU_ASSERT(gitmod_stats_get_count(stats, GITMOD_STATS_GETATTR) == 2 * NUM_THREADS * NUM_RECORDS);
+	CU_ASSERT(gitmod_stats_get_counter(stats, GITMOD_STATS_ITEMS_READY) == 4 * NUM_THREADS * NUM_RECORDS);
+	// threads of the second round took the slots of the first one
+	int slots = 0;
+	for (gitmod_stats_slot *slot = stats->slots; slot; slot = slot->next)
+		slots++;
+	CU_ASSERT(slots <= NUM_THREADS);
+	gitmod_stats_dispose(&stats);
+}
+
+static void suitestats_report()
+{
+	gitmod_info *info = gitmod_start(REPO_PATH, "test-main", GITMOD_OPTION_FIX, 100);
+	CU_ASSERT(info != NULL);
+	if (!info)
+		return;
+	gitmod_file *file = gitmod_open_file(info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	char buf[200];
+	CU_ASSERT(gitmod_read_file(file, buf, sizeof(buf), 0) == 184);
+	gitmod_release_file(&file);
+	CU_ASSERT(gitmod_stats_get_counter(info->stats, GITMOD_STATS_BLOB_LOADS) == 1);
+	CU_ASSERT(gitmod_stats_get_counter(info->stats, GITMOD_STATS_BLOB_BYTES) == 184);
+	gitmod_stats_record_latency(info->stats, GITMOD_STATS_READ, 1000);
+	GString *report = g_string_new(NULL);
+	gitmod_get_stats(info, report);
+	CU_ASSERT(strstr(report->str, "gitmod_op_latency_ns_bucket{op=\"read\",le=\"1023\"} 1\n") != NULL);
+	CU_ASSERT(strstr(report->str, "gitmod_op_latency_ns_count{op=\"read\"} 1\n") != NULL);
+	CU_ASSERT(strstr(report->str, "gitmod_op_latency_ns_count{op=\"lookup\"} 0\n") != NULL);
+	CU_ASSERT(strstr(report->str, "gitmod_op_latency_quantile_ns{op=\"read\",quantile=\"0.99\"} 1023\n") != NULL);
+	CU_ASSERT(strstr(report->str, "gitmod_blob_loads_total 1\n") != NULL);
+	CU_ASSERT(strstr(report->str, "gitmod_root_tree_changes_total 0\n") != NULL);
+	g_string_free(report, TRUE);
+	gitmod_stop(&info);
+}
+
+static void suitestats_locks()
+{
+	gitmod_lock_stats before, after;
+	int ret = gitmod_lock_get_stats(GITMOD_LOCK_STREAM, &before);
+	gitmod_locker *locker = gitmod_locker_create();
+	gitmod_locker_set_class(locker, GITMOD_LOCK_STREAM);
+	for (int i = 0; i < NUM_RECORDS; i++) {
+		gitmod_lock(locker);
+		gitmod_unlock(locker);
+	}
+	gitmod_locker_dispose(&locker);
+	CU_ASSERT(gitmod_lock_get_stats(GITMOD_LOCK_STREAM, &after) == ret);
+	GString *report = g_string_new(NULL);
+	gitmod_lock_stats_write(report);
+	if (ret == -ENOTSUP) {
+		// not building with GITMOD_LOCK_STATS
+		CU_ASSERT(after.acquisitions == 0);
+		CU_ASSERT(report->len == 0);
+	} else {
+		CU_ASSERT(ret == 0);
+		CU_ASSERT(after.acquisitions - before.acquisitions == NUM_RECORDS);
+		// nobody else was using it
+		CU_ASSERT(after.contended == before.contended);
+		CU_ASSERT(strstr(report->str, "gitmod_lock_acquisitions_total{lock=\"stream\"}") != NULL);
+		CU_ASSERT(strstr(report->str, "gitmod_lock_max_hold_ns{lock=\"stream\"}") != NULL);
+	}
+	g_string_free(report, TRUE);
+}
+
+static void suitestats_rwlocks()
+{
+	gitmod_lock_stats before, after;
+	int ret = gitmod_lock_get_stats(GITMOD_LOCK_CACHE_SHARD, &before);
+	gitmod_rwlocker locker;
+	gitmod_rwlocker_init(&locker);
+	gitmod_rwlocker_set_class(&locker, GITMOD_LOCK_CACHE_SHARD);
+	for (int i = 0; i < NUM_RECORDS; i++) {
+		gitmod_read_lock(&locker);
+		gitmod_read_lock(&locker);
+		gitmod_read_unlock(&locker);
+		gitmod_read_unlock(&locker);
+		gitmod_write_lock(&locker);
+		gitmod_write_unlock(&locker);
+	}
+	gitmod_rwlocker_destroy(&locker);
+	CU_ASSERT(gitmod_lock_get_stats(GITMOD_LOCK_CACHE_SHARD, &after) == ret);
+	GString *report = g_string_new(NULL);
+	gitmod_lock_stats_write(report);
+	if (ret == -ENOTSUP) {
+		CU_ASSERT(after.acquisitions == 0);
+	} else {
+		CU_ASSERT(after.acquisitions - before.acquisitions >= 3 * NUM_RECORDS);
+		CU_ASSERT(strstr(report->str, "gitmod_lock_acquisitions_total{lock=\"cache_shard\"}") != NULL);
+		CU_ASSERT(strstr(report->str, "gitmod_lock_acquisitions_total{lock=\"epoch\"}") != NULL);
+		CU_ASSERT(strstr(report->str, "gitmod_lock_acquisitions_total{lock=\"log\"}") != NULL);
+	}
+	g_string_free(report, TRUE);
+}
+
+CU_pSuite suitestats_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteStats", suitestats_init, suitestats_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteStats: quantiles", suitestats_quantiles) &&
+		      CU_add_test(pSuite, "SuiteStats: threads", suitestats_threads) &&
+		      CU_add_test(pSuite, "SuiteStats: report", suitestats_report) &&
+		      CU_add_test(pSuite, "SuiteStats: locks", suitestats_locks) &&
+		      CU_add_test(pSuite, "SuiteStats: rwlocks", suitestats_rwlocks))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
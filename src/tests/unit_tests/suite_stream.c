@@ -0,0 +1,131 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite stream
+ *  Blobs read incrementally through a small window
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+static gitmod_info *gm_info;
+static char *REPO_PATH = "tests/test_repo";
+static char *PACKED_REPO_PATH = "tests/test_repo_packed";	// same objects, all of them in a pack without deltas
+
+static int suitestream_init()
+{
+	gitmod_init();
+	gm_info = gitmod_start(REPO_PATH, "test-main", GITMOD_OPTION_FIX, 100);
+	return gm_info == NULL;
+}
+
+static int suitestream_shutdown()
+{
+	gitmod_stop(&gm_info);
+	gitmod_shutdown();
+	return 0;
+}
+
+static void suitestream_randomOffsets()
+{
+	gitmod_object *object = gitmod_get_object(gm_info, "/cowsay.txt");
+	CU_ASSERT(object != NULL);
+	if (object) {
+		const char *content = gitmod_object_get_content(object);
+		int64_t size = gitmod_object_get_size(object);
+		// a tiny window so that we have to move around the blob
+		gitmod_stream *stream = gitmod_stream_open(gm_info->repo, &object->oid, size, 16);
+		CU_ASSERT(stream != NULL);
+		if (stream) {
+			char buf[64];
+			int64_t offsets[] = { 0, 100, 10, 170, 5, 150, 60 };
+			for (int i = 0; i < sizeof(offsets) / sizeof(int64_t); i++) {
+				int expected = size - offsets[i] < 40 ? size - offsets[i] : 40;
+				int ret = gitmod_stream_read(stream, buf, 40, offsets[i]);
+				CU_ASSERT(ret == expected);
+				CU_ASSERT(!memcmp(buf, content + offsets[i], expected));
+			}
+			// past the end of the blob
+			CU_ASSERT(gitmod_stream_read(stream, buf, 40, size) == 0);
+			CU_ASSERT(stream->num_checkpoints > 1);
+			gitmod_stream_close(&stream);
+			CU_ASSERT(stream == NULL);
+		}
+		gitmod_dispose_object(&object);
+	}
+}
+
+static void suitestream_openFileOverThreshold()
+{
+	gitmod_set_stream_threshold(gm_info, 1);
+	gitmod_file *file = gitmod_open_file(gm_info, "/tux.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->stream != NULL);
+		char buf[200];
+		int ret = gitmod_read_file(file, buf, sizeof(buf), 0);
+		CU_ASSERT(ret == 166);
+		CU_ASSERT(!strncmp(buf, " _____________\n< Linux rules >", 30));
+		CU_ASSERT(file->object->blob == NULL);	// the blob was never loaded in memory
+		gitmod_release_file(&file);
+		CU_ASSERT(file == NULL);
+	}
+	gitmod_set_stream_threshold(gm_info, GITMOD_STREAM_DEFAULT_THRESHOLD);
+	file = gitmod_open_file(gm_info, "/tux.txt");
+	CU_ASSERT(file != NULL);
+	if (file) {
+		CU_ASSERT(file->stream == NULL);
+		gitmod_release_file(&file);
+	}
+	// not a blob
+	CU_ASSERT(gitmod_open_file(gm_info, "/some-dir") == NULL);
+}
+
+static void suitestream_packedBlob()
+{
+	git_repository *repo;
+	int ret = git_repository_open(&repo, PACKED_REPO_PATH);
+	CU_ASSERT(!ret);
+	if (ret)
+		return;
+	git_object *blob;
+	ret = git_revparse_single(&blob, repo, "test-main:tux.txt");
+	CU_ASSERT(!ret);
+	if (!ret) {
+		const char *content = git_blob_rawcontent((git_blob *) blob);
+		// entries of packs don't have a header before the content like loose objects
+		gitmod_stream *stream = gitmod_stream_open(repo, git_object_id(blob), 166, 16);
+		CU_ASSERT(stream != NULL);
+		if (stream) {
+			char buf[200];
+			CU_ASSERT(gitmod_stream_read(stream, buf, 30, 100) == 30);
+			CU_ASSERT(!memcmp(buf, content + 100, 30));
+			CU_ASSERT(gitmod_stream_read(stream, buf, sizeof(buf), 0) == 166);
+			CU_ASSERT(!memcmp(buf, content, 166));
+			gitmod_stream_close(&stream);
+		}
+		// the size has to match the one of the entry
+		stream = gitmod_stream_open(repo, git_object_id(blob), 165, 16);
+		CU_ASSERT(stream == NULL);
+		gitmod_stream_close(&stream);
+		git_object_free(blob);
+	}
+	git_repository_free(repo);
+}
+
+CU_pSuite suitestream_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteStream", suitestream_init, suitestream_shutdown);
+	if (pSuite != NULL) {
+		// did work
+		if (!(CU_add_test(pSuite, "SuiteStream: randomOffsets", suitestream_randomOffsets) &&
+		      CU_add_test(pSuite, "SuiteStream: openFileOverThreshold", suitestream_openFileOverThreshold) &&
+		      CU_add_test(pSuite, "SuiteStream: packedBlob", suitestream_packedBlob))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
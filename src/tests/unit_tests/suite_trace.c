@@ -0,0 +1,210 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite trace
+ *  Events written by different threads are dumped with their timings, keeping the last ones of each thread
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define NUM_THREADS 4
+#define NUM_EVENTS 10
+#define MARK 1000000000UL	// args of the events written by the tests start here
+
+static char *REPO_PATH = "tests/test_repo";
+static char *TRACE_PATH = "tests/trace.bin";
+
+static int suitetrace_init()
+{
+	gitmod_init();
+	return 0;
+}
+
+static int suitetrace_shutdown()
+{
+	gitmod_trace_set_enabled(0);
+	remove(TRACE_PATH);
+	gitmod_shutdown();
+	return 0;
+}
+
+/**
+ * Dump the trace and read back the records with args from min to max.
+ * Will return how many there are
+ */
+static int read_trace(gitmod_trace_record *records, int size, uint64_t min, uint64_t max)
+{
+	int dumped = gitmod_trace_dump_file(TRACE_PATH);
+	CU_ASSERT(dumped >= 0);
+	FILE *in = fopen(TRACE_PATH, "r");
+	CU_ASSERT(in != NULL);
+	if (!in)
+		return 0;
+	gitmod_trace_header header;
+	CU_ASSERT(fread(&header, sizeof(header), 1, in) == 1);
+	CU_ASSERT(!strcmp(header.magic, GITMOD_TRACE_MAGIC));
+	CU_ASSERT(header.record_size == sizeof(gitmod_trace_record));
+	gitmod_trace_record record;
+	int found = 0, total = 0;
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		total++;
+		if (record.arg >= min && record.arg <= max && found < size)
+			records[found++] = record;
+	}
+	fclose(in);
+	CU_ASSERT(total == dumped);
+	return found;
+}
+
+static void suitetrace_disabled()
+{
+	gitmod_trace_set_enabled(0);
+	CU_ASSERT(gitmod_trace_begin() == 0);
+	gitmod_trace_instant(GITMOD_TRACE_ITEM_READY, 0, MARK);
+	gitmod_trace_end(GITMOD_TRACE_BLOB_LOAD, 0, gitmod_trace_begin(), MARK);
+	gitmod_trace_record records[1];
+	CU_ASSERT(read_trace(records, 1, MARK, MARK) == 0);
+}
+
+static void suitetrace_events()
+{
+	gitmod_trace_set_enabled(1);
+	uint64_t start = gitmod_trace_begin();
+	CU_ASSERT(start != 0);
+	gitmod_trace_instant(GITMOD_TRACE_ITEM_NOT_READY, 0, MARK + 1);
+	gitmod_trace_end(GITMOD_TRACE_FUSE_OP, GITMOD_STATS_READ, start, MARK + 2);
+	gitmod_trace_record records[2];
+	CU_ASSERT(read_trace(records, 2, MARK + 1, MARK + 2) == 2);
+	CU_ASSERT(records[0].event == GITMOD_TRACE_ITEM_NOT_READY);
+	CU_ASSERT(records[0].duration == 0);
+	CU_ASSERT(records[1].event == GITMOD_TRACE_FUSE_OP);
+	CU_ASSERT(records[1].start == start);
+	CU_ASSERT(records[1].duration > 0);
+	CU_ASSERT(records[0].tid == records[1].tid);
+	CU_ASSERT(!strcmp(gitmod_trace_event_name(records[1].event, records[1].detail), "read"));
+	CU_ASSERT(!strcmp(gitmod_trace_event_name(GITMOD_TRACE_LOCK_WAIT, 0), "lock_wait"));
+}
+
+static void *write_events(void *params)
+{
+	uint64_t first = (unsigned long)params;
+	for (int i = 0; i < NUM_EVENTS; i++)
+		gitmod_trace_end(GITMOD_TRACE_DIR_SETUP, 0, gitmod_trace_begin(), first + i);
+	return NULL;
+}
+
+static void suitetrace_threads()
+{
+	gitmod_trace_set_enabled(1);
+	pthread_t threads[NUM_THREADS];
+	for (unsigned long i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, write_events, (void *)(MARK + 100 + i * NUM_EVENTS));
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	gitmod_trace_record records[NUM_THREADS * NUM_EVENTS];
+	CU_ASSERT(read_trace(records, NUM_THREADS * NUM_EVENTS, MARK + 100, MARK + 100 + NUM_THREADS * NUM_EVENTS - 1)
+		  == NUM_THREADS * NUM_EVENTS);
+	// events of each thread are dumped together, oldest first
+	for (int i = 0; i < NUM_THREADS * NUM_EVENTS; i++) {
+		CU_ASSERT(records[i].tid == records[i - i % NUM_EVENTS].tid);
+		if (i % NUM_EVENTS)
+			CU_ASSERT(records[i].arg == records[i - 1].arg + 1);
+	}
+}
+
+static void suitetrace_overwritten()
+{
+	gitmod_trace_set_enabled(1);
+	for (int i = 0; i < GITMOD_TRACE_RING_SIZE + 100; i++)
+		gitmod_trace_instant(GITMOD_TRACE_ITEM_READY, 0, MARK + 10000 + i);
+	gitmod_trace_record *records = calloc(GITMOD_TRACE_RING_SIZE + 100, sizeof(gitmod_trace_record));
+	// the oldest one could be being overwritten, it's left out
+	CU_ASSERT(read_trace(records, GITMOD_TRACE_RING_SIZE + 100, MARK + 10000,
+			     MARK + 10000 + GITMOD_TRACE_RING_SIZE + 99) == GITMOD_TRACE_RING_SIZE - 1);
+	// only the last ones are kept
+	CU_ASSERT(records[0].arg == MARK + 10101);
+	free(records);
+}
+
+static void suitetrace_blob_load()
+{
+	gitmod_trace_set_enabled(1);
+	gitmod_info *info = gitmod_start(REPO_PATH, "test-main", GITMOD_OPTION_FIX, 100);
+	CU_ASSERT(info != NULL);
+	if (!info)
+		return;
+	gitmod_file *file = gitmod_open_file(info, "/cowsay.txt");
+	CU_ASSERT(file != NULL);
+	char buf[200];
+	CU_ASSERT(gitmod_read_file(file, buf, sizeof(buf), 0) == 184);
+	gitmod_release_file(&file);
+	gitmod_stop(&info);
+	gitmod_trace_set_enabled(0);
+	// the size of the blob is the arg of its load
+	gitmod_trace_record records[NUM_EVENTS];
+	int found = read_trace(records, NUM_EVENTS, 184, 184);
+	int loads = 0;
+	for (int i = 0; i < found; i++)
+		loads += records[i].event == GITMOD_TRACE_BLOB_LOAD;
+	CU_ASSERT(loads == 1);
+}
+
+/**
+ * Count the records of a snapshot with arg
+ */
+static int count_snapshot(GString *snapshot, uint64_t arg)
+{
+	gitmod_trace_header header;
+	CU_ASSERT(snapshot->len >= sizeof(header));
+	if (snapshot->len < sizeof(header))
+		return 0;
+	memcpy(&header, snapshot->str, sizeof(header));
+	CU_ASSERT(!strcmp(header.magic, GITMOD_TRACE_MAGIC));
+	CU_ASSERT((snapshot->len - sizeof(header)) % sizeof(gitmod_trace_record) == 0);
+	gitmod_trace_record record;
+	int found = 0;
+	for (size_t offset = sizeof(header); offset + sizeof(record) <= snapshot->len; offset += sizeof(record)) {
+		memcpy(&record, snapshot->str + offset, sizeof(record));
+		found += record.arg == arg;
+	}
+	return found;
+}
+
+static void suitetrace_snapshot()
+{
+	gitmod_trace_set_enabled(1);
+	gitmod_trace_instant(GITMOD_TRACE_ITEM_READY, 0, MARK + 50000);
+	GString *snapshot = g_string_new(NULL);
+	int taken = gitmod_trace_snapshot(snapshot);
+	CU_ASSERT(taken > 0);
+	CU_ASSERT(snapshot->len == sizeof(gitmod_trace_header) + taken * sizeof(gitmod_trace_record));
+	CU_ASSERT(count_snapshot(snapshot, MARK + 50000) == 1);
+	// events are not consumed
+	g_string_truncate(snapshot, 0);
+	CU_ASSERT(gitmod_trace_snapshot(snapshot) >= taken);
+	CU_ASSERT(count_snapshot(snapshot, MARK + 50000) == 1);
+	g_string_free(snapshot, TRUE);
+	gitmod_trace_record records[1];
+	CU_ASSERT(read_trace(records, 1, MARK + 50000, MARK + 50000) == 1);
+}
+
+CU_pSuite suitetrace_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteTrace", suitetrace_init, suitetrace_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteTrace: disabled", suitetrace_disabled) &&
+		      CU_add_test(pSuite, "SuiteTrace: events", suitetrace_events) &&
+		      CU_add_test(pSuite, "SuiteTrace: threads", suitetrace_threads) &&
+		      CU_add_test(pSuite, "SuiteTrace: overwritten", suitetrace_overwritten) &&
+		      CU_add_test(pSuite, "SuiteTrace: blob load", suitetrace_blob_load) &&
+		      CU_add_test(pSuite, "SuiteTrace: snapshot", suitetrace_snapshot))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
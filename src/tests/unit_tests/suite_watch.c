@@ -0,0 +1,91 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Suite watch
+ *  Moving a watched reference makes the root tree change once and the monitor goes quiet afterwards
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <CUnit/Basic.h>
+#include "gitmod.h"
+
+#define WATCH_REF "refs/heads/watch-test"
+
+static char *REPO_PATH = "tests/test_repo";
+static git_repository *repo;
+
+static int suitewatch_init()
+{
+	gitmod_init();
+	return git_repository_open(&repo, REPO_PATH);
+}
+
+static int suitewatch_shutdown()
+{
+	git_reference *ref;
+	if (!git_reference_lookup(&ref, repo, WATCH_REF)) {
+		git_reference_delete(ref);
+		git_reference_free(ref);
+	}
+	git_repository_free(repo);
+	gitmod_shutdown();
+	return 0;
+}
+
+/**
+ * Point WATCH_REF to the commit of treeish
+ */
+static int set_ref(const char *treeish)
+{
+	git_object *commit;
+	int ret = git_revparse_single(&commit, repo, treeish);
+	if (ret)
+		return ret;
+	git_reference *ref;
+	ret = git_reference_create(&ref, repo, WATCH_REF, git_object_id(commit), 1, "watch test");
+	if (!ret)
+		git_reference_free(ref);
+	git_object_free(commit);
+	return ret;
+}
+
+static void suitewatch_move()
+{
+	CU_ASSERT(!set_ref("intermediate"));
+	gitmod_info *info = gitmod_start(REPO_PATH, "watch-test", 0, 100);
+	CU_ASSERT(info != NULL);
+	if (!info)
+		return;
+	CU_ASSERT(info->root_tree_watch != NULL);
+	if (!info->root_tree_watch) {
+		gitmod_stop(&info);
+		return;
+	}
+	unsigned long refreshes = __atomic_load_n(&info->root_tree_watch->refreshes, __ATOMIC_RELAXED);
+
+	CU_ASSERT(!set_ref("test-main"));
+	for (int i = 0; i < 200 && !gitmod_get_root_tree_changes(info); i++)
+		usleep(10000);
+	CU_ASSERT(gitmod_get_root_tree_changes(info) == 1);
+	CU_ASSERT(__atomic_load_n(&info->root_tree_watch->refreshes, __ATOMIC_RELAXED) == refreshes + 1);
+
+	// removing the watches that were not needed anymore must not wake it up again
+	usleep(30 * GITMOD_WATCH_QUIET_TIME * 1000);
+	CU_ASSERT(__atomic_load_n(&info->root_tree_watch->refreshes, __ATOMIC_RELAXED) == refreshes + 1);
+	CU_ASSERT(gitmod_get_root_tree_changes(info) == 1);
+	gitmod_stop(&info);
+}
+
+CU_pSuite suitewatch_setup()
+{
+	CU_pSuite pSuite = CU_add_suite("SuiteWatch", suitewatch_init, suitewatch_shutdown);
+	if (pSuite != NULL) {
+		if (!(CU_add_test(pSuite, "SuiteWatch: move", suitewatch_move))) {
+			return NULL;
+		}
+	}
+	return pSuite;
+}
@@ -9,3 +9,13 @@ CU_pSuite suite1_setup();
 CU_pSuite suite2_setup();
 CU_pSuite suitekim_setup();
 CU_pSuite suitekim2_setup();
+CU_pSuite suitestream_setup();
+CU_pSuite suitecache_setup();
+CU_pSuite suiteinode_setup();
+CU_pSuite suiteblobcache_setup();
+CU_pSuite suiterepopool_setup();
+CU_pSuite suitearena_setup();
+CU_pSuite suitestats_setup();
+CU_pSuite suitelog_setup();
+CU_pSuite suitetrace_setup();
+CU_pSuite suitewatch_setup();
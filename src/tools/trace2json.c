@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 Edmundo Carmona Antoranz
+ * Released under the terms of GPLv2
+ *
+ * Convert a trace dumped by gitmod (--trace=<file>) into Chrome trace JSON, which can be opened with
+ * https://ui.perfetto.dev or chrome://tracing
+ *
+ *    ./bin/gitmod-trace2json <trace-file> > trace.json
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "gitmod.h"
+
+// name of the argument of each event
+static const char *arg_names[GITMOD_TRACE_EVENTS] = {
+	"ino", "hash", "hash", "size", "size", "entries", "dirs", "changes", "lock"
+};
+
+static const char *category(uint16_t event)
+{
+	switch (event) {
+	case GITMOD_TRACE_FUSE_OP:
+		return "fuse";
+	case GITMOD_TRACE_ITEM_READY:
+	case GITMOD_TRACE_ITEM_NOT_READY:
+		return "cache";
+	case GITMOD_TRACE_BLOB_LOAD:
+	case GITMOD_TRACE_HEADER_READ:
+		return "object";
+	case GITMOD_TRACE_LOCK_WAIT:
+		return "lock";
+	default:
+		return "root_tree";
+	}
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	const gitmod_trace_record *ra = a, *rb = b;
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace-file>\n", argv[0]);
+		return 1;
+	}
+	FILE *in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "Could not open %s\n", argv[1]);
+		return 1;
+	}
+	gitmod_trace_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1
+	    || strncmp(header.magic, GITMOD_TRACE_MAGIC, sizeof(header.magic)) || header.version != GITMOD_TRACE_VERSION
+	    || header.record_size != sizeof(gitmod_trace_record)) {
+		fprintf(stderr, "%s is not a trace dumped by this version of gitmod\n", argv[1]);
+		fclose(in);
+		return 1;
+	}
+	GArray *records = g_array_new(FALSE, FALSE, sizeof(gitmod_trace_record));
+	gitmod_trace_record record;
+	while (fread(&record, sizeof(record), 1, in) == 1)
+		g_array_append_val(records, record);
+	fclose(in);
+	// threads are dumped one after the other
+	g_array_sort(records, compare_records);
+
+	uint64_t origin = records->len ? g_array_index(records, gitmod_trace_record, 0).start : 0;
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (guint i = 0; i < records->len; i++) {
+		gitmod_trace_record *r = &g_array_index(records, gitmod_trace_record, i);
+		printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,", i ? "," : "",
+		       gitmod_trace_event_name(r->event, r->detail), category(r->event), r->tid,
+		       (r->start - origin) / 1000.0);
+		if (r->duration)
+			printf("\"ph\":\"X\",\"dur\":%.3f,", r->duration / 1000.0);
+		else
+			printf("\"ph\":\"i\",\"s\":\"t\",");
+		if (r->event == GITMOD_TRACE_LOCK_WAIT)
+			printf("\"args\":{\"lock\":\"0x%lx\"}}", (unsigned long)r->arg);
+		else
+			printf("\"args\":{\"%s\":%lu}}", r->event < GITMOD_TRACE_EVENTS ? arg_names[r->event] : "arg",
+			       (unsigned long)r->arg);
+	}
+	printf("\n]}\n");
+	fprintf(stderr, "%u events\n", records->len);
+	g_array_free(records, TRUE);
+	return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Copyright 2024 Edmundo Carmona Antoranz
+# Released under the terms of GPLv2
+
+# Creates a repo with a number of (large) blobs to run benchmarks on.
+# Usage: tests/create_bench_repo.sh [number-of-files] [size-of-each-file-in-kb]
+
+set -e
+
+ROOT_DIR=$( git rev-parse --show-toplevel )
+if [ "$PWD" != "$ROOT_DIR" ]; then
+  cd "$ROOT_DIR"
+fi
+
+BENCH_REPO_DIR=tests/bench_repo
+NUM_FILES=${1:-200}
+FILE_SIZE_KB=${2:-4096}
+FILES_PER_DIR=50
+
+if [ -d $BENCH_REPO_DIR ]; then
+  echo Removing preexiting bench_repo
+  rm -fR $BENCH_REPO_DIR
+fi
+echo Creating bench repo with $NUM_FILES files of $FILE_SIZE_KB KB
+git init --quiet -b bench-main $BENCH_REPO_DIR
+cd $BENCH_REPO_DIR
+
+export GIT_AUTHOR_NAME="Bench Mark"
+export GIT_AUTHOR_EMAIL=bench@mark.com
+export GIT_AUTHOR_DATE="1500000000 -0100"
+export GIT_COMMITTER_NAME="Bench Mark"
+export GIT_COMMITTER_EMAIL=bench@mark.com
+export GIT_COMMITTER_DATE="1500000000 -0100"
+
+for i in $( seq 1 $NUM_FILES ); do
+  DIR=dir-$(( i / FILES_PER_DIR ))
+  mkdir -p $DIR
+  head -c $(( FILE_SIZE_KB * 1024 )) /dev/urandom > $DIR/file-$i.bin
+done
+git add .
+git commit -q -m "Bench content"
+# a tree to swap with, where one of the files is different
+git checkout -q -b bench-next
+head -c $(( FILE_SIZE_KB * 1024 )) /dev/urandom > dir-0/file-1.bin
+git commit -q -a -m "Bench changes"
+git checkout -q bench-main
+echo Bench repo is ready in $BENCH_REPO_DIR
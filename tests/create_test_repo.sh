@@ -11,6 +11,7 @@ if [ "$PWD" != "$ROOT_DIR" ]; then
 fi
 
 TEST_REPO_DIR=tests/test_repo
+TEST_PACKED_REPO_DIR=tests/test_repo_packed
 
 if [ -d $TEST_REPO_DIR ]; then
   echo Removing preexiting test_repo
@@ -106,3 +107,9 @@ EOF
 
 git add tux.txt
 git commit -q -m "Third commit: tux saying that linux rules (What a shock!!!)"
+
+# a copy with all objects in a pack (without deltas) to read packed blobs
+cd "$ROOT_DIR"
+rm -fR $TEST_PACKED_REPO_DIR
+git clone --quiet --bare --no-local $TEST_REPO_DIR $TEST_PACKED_REPO_DIR
+git -C $TEST_PACKED_REPO_DIR repack -a -d -f -q --window=0
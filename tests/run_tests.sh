@@ -39,8 +39,13 @@ cd - > /dev/null
 # First test
 echo First test
 ./bin/gitmod --treeish=moving --repo=tests/test_repo tests/mount-point
-echo Waiting for gitmod to get setup
-sleep 2 # give it some time to get itself setup
+# gitmod returns once the mount point is ready
+if ! grep -q "^ready: yes" tests/mount-point/.gitmod-status; then
+  echo Mount point is not ready
+  cat tests/mount-point/.gitmod-status
+  umount tests/mount-point
+  exit 1
+fi
 MD5=$( tar c tests/mount-point | md5sum - | awk '{print $1;}' )
 if [ "$MD5" != "$MD5_3RD_COMMIT" ]; then
   echo Was expecting a different MD5 value. Got $MD5
@@ -50,6 +55,13 @@ if [ "$MD5" != "$MD5_3RD_COMMIT" ]; then
   umount tests/mount-point
   exit 1
 fi
+# files were read so their latencies were recorded
+if grep -q '^gitmod_op_latency_ns_count{op="read"} 0$' tests/mount-point/.gitmod-stats; then
+  echo Reads were not recorded
+  cat tests/mount-point/.gitmod-stats
+  umount tests/mount-point
+  exit 1
+fi
 umount tests/mount-point
 echo Success
 echo
@@ -61,8 +73,6 @@ git branch -f moving test-main~2 # taking it back to the first commit
 cd - > /dev/null
 
 ./bin/gitmod --treeish=moving --repo=tests/test_repo tests/mount-point
-echo Waiting for gitmod to get setup
-sleep 2 # give it some time to get itself setup
 MD5=$( tar c tests/mount-point | md5sum - | awk '{print $1;}' )
 if [ "$MD5" != "$MD5_1ST_COMMIT" ]; then
   echo Was expecting a different MD5 value. Got $MD5
@@ -108,8 +118,6 @@ echo
 # fourth test, can use a fixed commit id as treeish
 echo Fourth test
 ./bin/gitmod --treeish=test-main~ --repo=tests/test_repo tests/mount-point
-echo Waiting for gitmod to get setup
-sleep 2 # give it some time to get itself setup
 MD5=$( tar c tests/mount-point | md5sum - | awk '{print $1;}' )
 if [ "$MD5" != "$MD5_2ND_COMMIT" ]; then
   echo Was expecting a different MD5 value. Got $MD5
@@ -126,8 +134,6 @@ echo
 # fifth test, if fixed, the treeish can move and the result won't change
 echo Fifth test
 ./bin/gitmod --treeish=moving --repo=tests/test_repo --fix tests/mount-point
-echo Waiting for gitmod to get setup
-sleep 2 # give it some time to get itself setup
 MD5=$( tar c tests/mount-point | md5sum - | awk '{print $1;}' )
 if [ "$MD5" != "$MD5_3RD_COMMIT" ]; then
   echo Was expecting a different MD5 value. Got $MD5